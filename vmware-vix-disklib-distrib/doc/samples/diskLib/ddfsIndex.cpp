@@ -0,0 +1,475 @@
+/*
+ * ddfsIndex.cpp --
+ *
+ *      Offline, read-only access to the index of a ddumbfs filesystem.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#include "ddfsIndex.h"
+
+using std::string;
+
+#if defined(__GNUC__)
+#define DDFS_PREFETCH(p) __builtin_prefetch(p)
+#else
+#define DDFS_PREFETCH(p) ((void)(p))
+#endif
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * DdfsReadConfig --
+ *
+ *      Parses a ddfs.cfg file: "key: value" lines, as written by
+ *      mkddumbfs. Unknown keys are ignored.
+ *
+ * Results:
+ *      true on success, false with a message in error if the file cannot
+ *      be read or does not describe a usable SHA1 filesystem.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+bool
+DdfsReadConfig(const char *path,       // IN
+               DdfsConfig &cfg,        // OUT
+               string &error)          // OUT
+{
+   char line[256];
+   FILE *file;
+
+   cfg = DdfsConfig();   // value-initialized: all numbers 0
+   cfg.indexFilename = "ddfsidx";
+
+   file = fopen(path, "r");
+   if (file == NULL) {
+      error = string("Cannot read ") + path + ": " + strerror(errno);
+      return false;
+   }
+   while (fgets(line, sizeof line, file) != NULL) {
+      char *value = strchr(line, ':');
+      char *end;
+      uint64_t num;
+
+      if (value == NULL) {
+         continue;
+      }
+      *value++ = '\0';
+      value += strspn(value, " \t");
+      end = value + strcspn(value, " \t\r\n");
+      *end = '\0';
+      num = strtoull(value, NULL, 0);
+
+      if (!strcmp(line, "hash")) {
+         cfg.hash = value;
+      } else if (!strcmp(line, "file_header_size")) {
+         cfg.fileHeaderSize = (uint32_t)num;
+      } else if (!strcmp(line, "hash_size")) {
+         cfg.hashSize = (uint32_t)num;
+      } else if (!strcmp(line, "block_size")) {
+         cfg.blockSize = (uint32_t)num;
+      } else if (!strcmp(line, "index_block_size")) {
+         cfg.indexBlockSize = (uint32_t)num;
+      } else if (!strcmp(line, "node_overflow")) {
+         cfg.nodeOverflow = (uint32_t)num;
+      } else if (!strcmp(line, "partition_size")) {
+         cfg.partitionSize = num;
+      } else if (!strcmp(line, "block_count")) {
+         cfg.blockCount = num;
+      } else if (!strcmp(line, "addr_bits")) {
+         cfg.addrBits = (uint32_t)num;
+      } else if (!strcmp(line, "addr_size")) {
+         cfg.addrSize = (uint32_t)num;
+      } else if (!strcmp(line, "node_size")) {
+         cfg.nodeSize = (uint32_t)num;
+      } else if (!strcmp(line, "node_count")) {
+         cfg.nodeCount = num;
+      } else if (!strcmp(line, "node_block_count")) {
+         cfg.nodeBlockCount = num;
+      } else if (!strcmp(line, "freeblock_offset")) {
+         cfg.freeblockOffset = num;
+      } else if (!strcmp(line, "freeblock_size")) {
+         cfg.freeblockSize = num;
+      } else if (!strcmp(line, "node_offset")) {
+         cfg.nodeOffset = num;
+      } else if (!strcmp(line, "index_size")) {
+         cfg.indexSize = num;
+      } else if (!strcmp(line, "index_block_count")) {
+         cfg.indexBlockCount = num;
+      } else if (!strcmp(line, "root_directory")) {
+         cfg.rootDirectory = value;
+      } else if (!strcmp(line, "block_filename")) {
+         cfg.blockFilename = value;
+      } else if (!strcmp(line, "index_filename")) {
+         cfg.indexFilename = value;
+      }
+   }
+   fclose(file);
+
+   if (cfg.hash != "SHA1" || cfg.hashSize != 20) {
+      error = string(path) + ": only SHA1 ddumbfs filesystems are supported";
+      return false;
+   }
+   if (cfg.blockSize == 0 || cfg.blockSize % 512 != 0 ||
+       cfg.addrSize == 0 || cfg.addrSize > 8 ||
+       cfg.nodeSize != cfg.hashSize + cfg.addrSize || cfg.nodeCount == 0) {
+      error = string(path) + ": incomplete or unsupported geometry";
+      return false;
+   }
+   if (cfg.freeblockSize * 8 < cfg.blockCount) {
+      // Older files may lack the bitmap fields; do without them.
+      cfg.freeblockOffset = cfg.freeblockSize = 0;
+   }
+   return true;
+}
+
+
+DdfsIndex::DdfsIndex()
+   : _cfg(),
+     _map(NULL),
+     _mapSize(0),
+     _locked(false),
+     _bitmap(NULL),
+     _nodes(NULL)
+{
+}
+
+
+DdfsIndex::~DdfsIndex()
+{
+   Close();
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * DdfsIndex::Open --
+ *
+ *      Reads parentDir/ddfs.cfg and maps the index file it names,
+ *      relative to parentDir unless absolute.
+ *
+ * Results:
+ *      true on success, false with a message in error otherwise.
+ *
+ * Side effects:
+ *      Closes the index previously open, if any.
+ *
+ *----------------------------------------------------------------------
+ */
+
+bool
+DdfsIndex::Open(const char *parentDir,   // IN
+                string &error)           // OUT
+{
+   Close();
+#ifdef _WIN32
+   error = "ddumbfs indexes are not supported on Windows";
+   return false;
+#else
+   string cfgPath = string(parentDir) + "/ddfs.cfg";
+   string indexName;
+   struct stat st;
+   void *map;
+   int fd;
+
+   if (!DdfsReadConfig(cfgPath.c_str(), _cfg, error)) {
+      return false;
+   }
+   indexName = _cfg.indexFilename;
+   if (indexName[0] != '/') {
+      indexName = string(parentDir) + "/" + indexName;
+   }
+   fd = open(indexName.c_str(), O_RDONLY);
+   if (fd < 0 || fstat(fd, &st) != 0) {
+      error = "Cannot open " + indexName + ": " + strerror(errno);
+      if (fd >= 0) {
+         close(fd);
+      }
+      return false;
+   }
+   if ((uint64_t)st.st_size < _cfg.nodeOffset +
+                              _cfg.nodeCount * _cfg.nodeSize ||
+       (uint64_t)st.st_size < _cfg.freeblockOffset + _cfg.freeblockSize) {
+      error = indexName + " is shorter than its ddfs.cfg says";
+      close(fd);
+      return false;
+   }
+   map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+   close(fd);
+   if (map == MAP_FAILED) {
+      error = "Cannot map " + indexName + ": " + strerror(errno);
+      return false;
+   }
+   _map = (uint8_t *)map;
+   _mapSize = st.st_size;
+   _nodes = _map + _cfg.nodeOffset;
+   _bitmap = _cfg.freeblockSize != 0 ? _map + _cfg.freeblockOffset : NULL;
+   return true;
+#endif
+}
+
+
+void
+DdfsIndex::Close(void)
+{
+#ifndef _WIN32
+   if (_map != NULL) {
+      if (_locked) {
+         munlock(_map, _mapSize);
+      }
+      munmap(_map, _mapSize);
+   }
+#endif
+   _map = NULL;
+   _mapSize = 0;
+   _locked = false;
+   _bitmap = NULL;
+   _nodes = NULL;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * DdfsIndex::Lock --
+ *
+ *      Faults the whole index in and pins it, as ddumbfs does with its
+ *      lock_index option, so lookups never wait for the disk.
+ *
+ * Results:
+ *      true on success, false with a message in error (usually
+ *      RLIMIT_MEMLOCK being too low).
+ *
+ * Side effects:
+ *      The index stays resident until Close().
+ *
+ *----------------------------------------------------------------------
+ */
+
+bool
+DdfsIndex::Lock(string &error)   // OUT
+{
+#ifdef _WIN32
+   error = "ddumbfs indexes are not supported on Windows";
+   return false;
+#else
+   if (_map == NULL) {
+      error = "no index is open";
+      return false;
+   }
+   if (!_locked && mlock(_map, _mapSize) != 0) {
+      error = string("Cannot lock the index: ") + strerror(errno);
+      return false;
+   }
+   _locked = true;
+   return true;
+#endif
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * DdfsIndex::HomeNode --
+ *
+ *      The node the first 32 bits of hash map to in a uniformly filled
+ *      table. Used nodes sit at or shortly after it, so a lookup starts
+ *      there; relying only on the sorted order keeps this independent of
+ *      the exact rounding of ddumbfs' own hash2idx().
+ *
+ * Results:
+ *      A node number below nodeCount.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+uint64_t
+DdfsIndex::HomeNode(const uint8_t *hash) const   // IN
+{
+   uint32_t prefix = (uint32_t)hash[0] << 24 | (uint32_t)hash[1] << 16 |
+                     (uint32_t)hash[2] << 8 | hash[3];
+
+   return (uint64_t)prefix * _cfg.nodeCount >> 32;
+}
+
+
+uint64_t
+DdfsIndex::NodeAddr(uint64_t node) const   // IN
+{
+   const uint8_t *addr = NodeHash(node) + _cfg.hashSize;
+   uint64_t value = 0;
+   int i;
+
+   for (i = _cfg.addrSize - 1; i >= 0; i--) {
+      value = value << 8 | addr[i];
+   }
+   return value;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * DdfsIndex::Search --
+ *
+ *      Looks hash up from its home node: steps back to a used node not
+ *      above the hash, then forward until a used node is not below it.
+ *
+ * Results:
+ *      The block address, or DDFS_NO_ADDR.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+uint64_t
+DdfsIndex::Search(uint64_t node,               // IN
+                  const uint8_t *hash) const   // IN
+{
+   uint64_t addr;
+
+   while (node > 0 && ((addr = NodeAddr(node)) == 0 ||
+                       memcmp(NodeHash(node), hash, _cfg.hashSize) > 0)) {
+      node--;
+   }
+   for (; node < _cfg.nodeCount; node++) {
+      addr = NodeAddr(node);
+      if (addr != 0) {
+         int cmp = memcmp(NodeHash(node), hash, _cfg.hashSize);
+
+         if (cmp >= 0) {
+            return cmp == 0 ? addr : DDFS_NO_ADDR;
+         }
+      }
+   }
+   return DDFS_NO_ADDR;
+}
+
+
+uint64_t
+DdfsIndex::Lookup(const uint8_t *hash) const   // IN
+{
+   return Search(HomeNode(hash), hash);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * DdfsIndex::LookupBatch --
+ *
+ *      Looks up count hashes. The home nodes of DDFS_LOOKUP_BATCH hashes
+ *      are computed and prefetched before any of them is searched, so
+ *      the cache (or page) misses of a batch overlap instead of each
+ *      lookup stalling on its own.
+ *
+ * Results:
+ *      addrs[i] is the block address of hash i, or DDFS_NO_ADDR.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+DdfsIndex::LookupBatch(const uint8_t *hashes,   // IN
+                       size_t count,            // IN
+                       uint64_t *addrs) const   // OUT
+{
+   uint64_t home[DDFS_LOOKUP_BATCH];
+   size_t done;
+
+   for (done = 0; done < count; done += DDFS_LOOKUP_BATCH) {
+      size_t n = count - done < DDFS_LOOKUP_BATCH ? count - done
+                                                  : DDFS_LOOKUP_BATCH;
+      size_t i;
+
+      for (i = 0; i < n; i++) {
+         const uint8_t *node;
+
+         home[i] = HomeNode(hashes + (done + i) * _cfg.hashSize);
+         node = NodeHash(home[i]);
+         DDFS_PREFETCH(node);
+         DDFS_PREFETCH(node + _cfg.nodeSize);
+      }
+      for (i = 0; i < n; i++) {
+         addrs[done + i] = Search(home[i],
+                                  hashes + (done + i) * _cfg.hashSize);
+      }
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * DdfsIndex::BlockInUse --
+ *
+ *      Tests the bit of block in the free block bitmap (bit 0 of the
+ *      first byte is block 0).
+ *
+ * Results:
+ *      true if the block is allocated. Without a bitmap every block
+ *      below blockCount is reported as used.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+bool
+DdfsIndex::BlockInUse(uint64_t block) const   // IN
+{
+   if (block >= _cfg.blockCount) {
+      return false;
+   }
+   if (_bitmap == NULL) {
+      return true;
+   }
+   return (_bitmap[block / 8] >> (block % 8) & 1) != 0;
+}
+
+
+uint64_t
+DdfsIndex::BlocksInUse(void) const
+{
+   uint64_t used = 0;
+   uint64_t i;
+
+   if (_bitmap == NULL) {
+      return _cfg.blockCount;
+   }
+   for (i = 0; i < _cfg.blockCount / 8; i++) {
+      uint8_t bits;
+
+      for (bits = _bitmap[i]; bits != 0; bits &= bits - 1) {
+         used++;
+      }
+   }
+   for (i = _cfg.blockCount / 8 * 8; i < _cfg.blockCount; i++) {
+      used += BlockInUse(i);
+   }
+   return used;
+}
@@ -0,0 +1,105 @@
+/*
+ * ddfsIndex.h --
+ *
+ *      Offline, read-only access to the index of a ddumbfs filesystem:
+ *      the geometry in ddfs.cfg, the free block bitmap and the node
+ *      array of ddfsidx.
+ */
+
+#ifndef DDFS_INDEX_H
+#define DDFS_INDEX_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+
+// Address returned by lookups of hashes that are not in the index.
+#define DDFS_NO_ADDR ((uint64_t)-1)
+
+// Number of hashes whose home nodes DdfsIndex::LookupBatch prefetches
+// before it starts searching.
+#define DDFS_LOOKUP_BATCH 16
+
+// Geometry of a ddumbfs filesystem, as written to ddfs.cfg by mkddumbfs
+// (see doc/ddumbfs-1.1/MISC). Fields missing from the file are 0/empty.
+struct DdfsConfig {
+   std::string hash;            // SHA1, TIGER128, TIGER160 or TIGER
+   uint32_t fileHeaderSize;
+   uint32_t hashSize;
+   uint32_t blockSize;
+   uint32_t indexBlockSize;
+   uint32_t nodeOverflow;
+   uint64_t partitionSize;
+   uint64_t blockCount;
+   uint32_t addrBits;
+   uint32_t addrSize;
+   uint32_t nodeSize;           // hashSize + addrSize
+   uint64_t nodeCount;
+   uint64_t nodeBlockCount;
+   uint64_t freeblockOffset;    // of the free block bitmap in ddfsidx
+   uint64_t freeblockSize;
+   uint64_t nodeOffset;         // of the node array in ddfsidx
+   uint64_t indexSize;
+   uint64_t indexBlockCount;
+   std::string rootDirectory;
+   std::string blockFilename;
+   std::string indexFilename;
+};
+
+bool DdfsReadConfig(const char *path, DdfsConfig &cfg, std::string &error);
+
+
+// The ddfsidx file of a filesystem, mmap()ed read-only. The free block
+// bitmap has a bit set for each used block. Each node is a hash followed
+// by the address of its block in addrSize little endian bytes, 0 meaning
+// an empty node; ddumbfs keeps the used nodes sorted by hash, starting
+// near the node the hash prefix maps to.
+
+class DdfsIndex
+{
+public:
+    DdfsIndex();
+    ~DdfsIndex();
+
+    // Reads parentDir/ddfs.cfg and maps the index it names.
+    bool Open(const char *parentDir, std::string &error);
+    void Close(void);
+    // Pins the index in RAM, like ddumbfs' lock_index option.
+    bool Lock(std::string &error);
+
+    const DdfsConfig &Config() const { return _cfg; }
+    bool IsOpen() const { return _map != NULL; }
+
+    // Block address of hash, or DDFS_NO_ADDR.
+    uint64_t Lookup(const uint8_t *hash) const;
+    bool Contains(const uint8_t *hash) const
+    {
+       return Lookup(hash) != DDFS_NO_ADDR;
+    }
+    // Looks up count hashes of hashSize bytes each, prefetching the
+    // nodes of DDFS_LOOKUP_BATCH of them at a time.
+    void LookupBatch(const uint8_t *hashes, size_t count,
+                     uint64_t *addrs) const;
+
+    uint64_t HomeNode(const uint8_t *hash) const;
+    uint64_t NodeAddr(uint64_t node) const;
+    const uint8_t *NodeHash(uint64_t node) const
+    {
+       return _nodes + node * _cfg.nodeSize;
+    }
+
+    bool BlockInUse(uint64_t block) const;
+    uint64_t BlocksInUse(void) const;
+
+private:
+    uint64_t Search(uint64_t node, const uint8_t *hash) const;
+
+    DdfsConfig _cfg;
+    uint8_t *_map;
+    size_t _mapSize;
+    bool _locked;
+    const uint8_t *_bitmap;
+    const uint8_t *_nodes;
+};
+
+#endif // DDFS_INDEX_H
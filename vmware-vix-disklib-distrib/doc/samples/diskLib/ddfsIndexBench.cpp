@@ -0,0 +1,469 @@
+/*
+ * ddfsIndexBench.cpp --
+ *
+ *      Lookup microbenchmark for DdfsIndex. Builds a synthetic ddumbfs
+ *      index (ddfs.cfg + ddfsidx) of the requested size and measures
+ *      single and batched lookups per second with the index cold (dropped
+ *      from the page cache), warm, and locked in RAM as with ddumbfs'
+ *      lock_index option, together with the page faults and, where
+ *      perf_event_open is allowed, the cache misses of each run.
+ *
+ *      Linux only.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include "ddfsIndex.h"
+
+using std::string;
+using std::vector;
+
+#define HASH_SIZE   20
+#define ADDR_SIZE   3
+#define NODE_SIZE   (HASH_SIZE + ADDR_SIZE)
+#define BLOCK_SIZE  (128 * 1024)
+#define PAGE        4096
+
+static struct {
+   uint64_t nodes;      // node_count of the synthetic index
+   int fillPct;         // used nodes, percent of node_count
+   uint64_t lookups;
+   int hitPct;          // lookups of hashes present in the index
+   const char *dir;
+   bool keep;
+   bool lockOnly;
+} opts;
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Rand64 --
+ *
+ *      xorshift64*; fast enough not to show up in the measurements.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static uint64_t
+Rand64(uint64_t &state)   // IN/OUT
+{
+   state ^= state >> 12;
+   state ^= state << 25;
+   state ^= state >> 27;
+   return state * 2685821657736338717ULL;
+}
+
+
+static void
+RandomHash(uint64_t &state,   // IN/OUT
+           uint8_t *hash)     // OUT
+{
+   uint64_t words[3];
+
+   words[0] = Rand64(state);
+   words[1] = Rand64(state);
+   words[2] = Rand64(state);
+   memcpy(hash, words, HASH_SIZE);
+}
+
+
+static bool
+HashLess(const string &a,   // IN
+         const string &b)   // IN
+{
+   return memcmp(a.data(), b.data(), HASH_SIZE) < 0;
+}
+
+
+static uint64_t
+NowNsec(void)
+{
+   return std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * BuildIndex --
+ *
+ *      Writes dir/ddfs.cfg and dir/ddfsidx with the layout of MISC: a
+ *      header block, the free block bitmap at 4096, then the node array.
+ *      The used nodes get random hashes in sorted order, each placed at
+ *      its home node or the first free node after the previous one, the
+ *      way ddumbfs fills its index. Also draws the hashes to look up,
+ *      -hit percent of them from the index, and whether each is there.
+ *
+ * Results:
+ *      true on success.
+ *
+ * Side effects:
+ *      Creates the two files.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static bool
+BuildIndex(vector<uint8_t> &lookups,   // OUT
+           vector<bool> &expected)      // OUT
+{
+   uint64_t nodeCount = opts.nodes;
+   uint64_t used = nodeCount * opts.fillPct / 100;
+   uint64_t blockCount = used + used / 8;
+   uint64_t freeblockOffset = PAGE;
+   uint64_t freeblockSize = ((blockCount + 7) / 8 + PAGE - 1) / PAGE * PAGE;
+   uint64_t nodeOffset = freeblockOffset + freeblockSize;
+   uint64_t indexSize = (nodeOffset + nodeCount * NODE_SIZE + PAGE - 1) /
+                        PAGE * PAGE;
+   uint64_t state = 0x9E3779B97F4A7C15ULL;
+   vector<string> hashes(used);
+   vector<uint8_t> index(indexSize, 0);
+   string cfgPath = string(opts.dir) + "/ddfs.cfg";
+   string idxPath = string(opts.dir) + "/ddfsidx";
+   uint64_t next = 0;
+   int addrBits = 1;
+   uint64_t i;
+   FILE *cfg;
+   int fd;
+
+   if (blockCount >= 1ULL << ADDR_SIZE * 8) {
+      fprintf(stderr, "Too many blocks for %d byte addresses.\n", ADDR_SIZE);
+      return false;
+   }
+   while (1ULL << addrBits <= blockCount) {
+      addrBits++;
+   }
+
+   printf("Building %llu nodes, %llu used (%llu MB index)...\n",
+          (unsigned long long)nodeCount, (unsigned long long)used,
+          (unsigned long long)(indexSize >> 20));
+   for (i = 0; i < used; i++) {
+      uint8_t hash[HASH_SIZE];
+
+      RandomHash(state, hash);
+      hashes[i].assign((const char *)hash, HASH_SIZE);
+   }
+   std::sort(hashes.begin(), hashes.end(), HashLess);
+
+   for (i = 0; i < used; i++) {
+      const uint8_t *hash = (const uint8_t *)hashes[i].data();
+      uint32_t prefix = (uint32_t)hash[0] << 24 | (uint32_t)hash[1] << 16 |
+                        (uint32_t)hash[2] << 8 | hash[3];
+      uint64_t node = std::max(next, (uint64_t)prefix * nodeCount >> 32);
+      uint64_t addr = i + 1;
+      uint8_t *p;
+
+      if (node >= nodeCount) {
+         fprintf(stderr, "Index overflow; use a lower -fill.\n");
+         return false;
+      }
+      p = &index[nodeOffset + node * NODE_SIZE];
+      memcpy(p, hash, HASH_SIZE);
+      p[HASH_SIZE] = addr & 0xff;
+      p[HASH_SIZE + 1] = addr >> 8 & 0xff;
+      p[HASH_SIZE + 2] = addr >> 16 & 0xff;
+      index[freeblockOffset + addr / 8] |= 1 << addr % 8;
+      next = node + 1;
+   }
+
+   lookups.resize(opts.lookups * HASH_SIZE);
+   expected.resize(opts.lookups);
+   for (i = 0; i < opts.lookups; i++) {
+      expected[i] = (int)(Rand64(state) % 100) < opts.hitPct;
+      if (expected[i]) {
+         memcpy(&lookups[i * HASH_SIZE], hashes[Rand64(state) % used].data(),
+                HASH_SIZE);
+      } else {
+         RandomHash(state, &lookups[i * HASH_SIZE]);
+      }
+   }
+
+   cfg = fopen(cfgPath.c_str(), "w");
+   if (cfg == NULL) {
+      fprintf(stderr, "Cannot create %s: %s\n", cfgPath.c_str(),
+              strerror(errno));
+      return false;
+   }
+   fprintf(cfg, "hash: SHA1\n"
+                "file_header_size: 8\n"
+                "hash_size: %d\n"
+                "block_size: %d\n"
+                "index_block_size: %d\n"
+                "node_overflow: %llu\n"
+                "partition_size: %llu\n"
+                "block_count: %llu\n"
+                "addr_bits: %d\n"
+                "addr_size: %d\n"
+                "node_size: %d\n"
+                "node_count: %llu\n"
+                "node_block_count: %llu\n"
+                "freeblock_offset: %llu\n"
+                "freeblock_size: %llu\n"
+                "node_offset: %llu\n"
+                "index_size: %llu\n"
+                "index_block_count: %llu\n"
+                "root_directory: ddfsroot\n"
+                "block_filename: ddfsblocks\n"
+                "index_filename: ddfsidx\n",
+           HASH_SIZE, BLOCK_SIZE, PAGE,
+           (unsigned long long)(nodeCount - blockCount),
+           (unsigned long long)blockCount * BLOCK_SIZE,
+           (unsigned long long)blockCount, addrBits, ADDR_SIZE,
+           NODE_SIZE, (unsigned long long)nodeCount,
+           (unsigned long long)((nodeCount * NODE_SIZE + PAGE - 1) / PAGE),
+           (unsigned long long)freeblockOffset,
+           (unsigned long long)freeblockSize,
+           (unsigned long long)nodeOffset, (unsigned long long)indexSize,
+           (unsigned long long)(indexSize / PAGE));
+   fclose(cfg);
+
+   fd = open(idxPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+   if (fd < 0 || write(fd, &index[0], indexSize) != (ssize_t)indexSize ||
+       fsync(fd) != 0) {
+      fprintf(stderr, "Cannot write %s: %s\n", idxPath.c_str(),
+              strerror(errno));
+      if (fd >= 0) {
+         close(fd);
+      }
+      return false;
+   }
+   close(fd);
+   return true;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * DropCache --
+ *
+ *      Asks the kernel to drop the index from the page cache, so the next
+ *      run starts cold. Without privileges this only works for clean
+ *      pages that nobody maps, which is the case between runs.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+DropCache(void)
+{
+   string idxPath = string(opts.dir) + "/ddfsidx";
+   int fd = open(idxPath.c_str(), O_RDONLY);
+
+   if (fd >= 0) {
+      posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+      close(fd);
+   }
+}
+
+
+static int
+OpenCacheMissCounter(void)
+{
+   struct perf_event_attr attr;
+
+   memset(&attr, 0, sizeof attr);
+   attr.size = sizeof attr;
+   attr.type = PERF_TYPE_HARDWARE;
+   attr.config = PERF_COUNT_HW_CACHE_MISSES;
+   attr.disabled = 1;
+   attr.exclude_kernel = 1;
+   attr.exclude_hv = 1;
+   return syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Run --
+ *
+ *      Times lookups of every hash in hashes, one at a time or in
+ *      batches, and prints lookups/sec, page faults and cache misses per
+ *      lookup. Checks that present hashes are found and absent ones not.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+Run(const DdfsIndex &index,            // IN
+    const char *state,                 // IN
+    bool batched,                      // IN
+    const vector<uint8_t> &hashes,     // IN
+    const vector<bool> &expected)      // IN
+{
+   size_t count = expected.size();
+   vector<uint64_t> addrs(count);
+   struct rusage before, after;
+   uint64_t misses = 0;
+   uint64_t start, end;
+   size_t wrong = 0;
+   long faults;
+   size_t i;
+   int perf = OpenCacheMissCounter();
+
+   getrusage(RUSAGE_SELF, &before);
+   if (perf >= 0) {
+      ioctl(perf, PERF_EVENT_IOC_RESET, 0);
+      ioctl(perf, PERF_EVENT_IOC_ENABLE, 0);
+   }
+   start = NowNsec();
+   if (batched) {
+      index.LookupBatch(&hashes[0], count, &addrs[0]);
+   } else {
+      for (i = 0; i < count; i++) {
+         addrs[i] = index.Lookup(&hashes[i * HASH_SIZE]);
+      }
+   }
+   end = NowNsec();
+   if (perf >= 0) {
+      ioctl(perf, PERF_EVENT_IOC_DISABLE, 0);
+      if (read(perf, &misses, sizeof misses) != sizeof misses) {
+         misses = 0;
+      }
+      close(perf);
+   }
+   getrusage(RUSAGE_SELF, &after);
+   faults = after.ru_majflt - before.ru_majflt +
+            after.ru_minflt - before.ru_minflt;
+
+   for (i = 0; i < count; i++) {
+      wrong += (addrs[i] != DDFS_NO_ADDR) != expected[i];
+   }
+
+   printf("%-7s %-7s %12.0f %10.1f %12.3f ", state,
+          batched ? "batch" : "single",
+          count / ((end - start) / 1e9), (end - start) / (double)count,
+          faults / (double)count);
+   if (perf >= 0) {
+      printf("%12.3f", misses / (double)count);
+   } else {
+      printf("%12s", "n/a");
+   }
+   printf("%s\n", wrong != 0 ? "  WRONG RESULTS" : "");
+}
+
+
+static int
+PrintUsage(void)
+{
+   printf("Usage: ddfs-index-bench [options]\n"
+          " -nodes N : node_count of the synthetic index in millions "
+          "(default 8)\n"
+          " -fill pct : used nodes, percent of node_count (default 75)\n"
+          " -lookups N : lookups per run in millions (default 2)\n"
+          " -hit pct : lookups of hashes present in the index "
+          "(default 50)\n"
+          " -dir path : where to build the index (default .)\n"
+          " -keep : keep ddfs.cfg and ddfsidx afterwards\n"
+          " -lock : only run with the index locked in RAM\n");
+   return 1;
+}
+
+
+int
+main(int argc, char *argv[])
+{
+   vector<uint8_t> hashes;
+   vector<bool> expected;
+   DdfsIndex index;
+   string error;
+   int i;
+
+   opts.nodes = 8 << 20;
+   opts.fillPct = 75;
+   opts.lookups = 2 << 20;
+   opts.hitPct = 50;
+   opts.dir = ".";
+
+   for (i = 1; i < argc; i++) {
+      if (!strcmp(argv[i], "-nodes") && i + 1 < argc) {
+         opts.nodes = strtod(argv[++i], NULL) * (1 << 20);
+      } else if (!strcmp(argv[i], "-fill") && i + 1 < argc) {
+         opts.fillPct = atoi(argv[++i]);
+      } else if (!strcmp(argv[i], "-lookups") && i + 1 < argc) {
+         opts.lookups = strtod(argv[++i], NULL) * (1 << 20);
+      } else if (!strcmp(argv[i], "-hit") && i + 1 < argc) {
+         opts.hitPct = atoi(argv[++i]);
+      } else if (!strcmp(argv[i], "-dir") && i + 1 < argc) {
+         opts.dir = argv[++i];
+      } else if (!strcmp(argv[i], "-keep")) {
+         opts.keep = true;
+      } else if (!strcmp(argv[i], "-lock")) {
+         opts.lockOnly = true;
+      } else {
+         return PrintUsage();
+      }
+   }
+   if (opts.nodes < 1024 || opts.fillPct < 1 || opts.fillPct > 95 ||
+       opts.lookups == 0 || opts.hitPct < 0 || opts.hitPct > 100) {
+      return PrintUsage();
+   }
+
+   if (!BuildIndex(hashes, expected)) {
+      return 1;
+   }
+
+   printf("%-7s %-7s %12s %10s %12s %12s\n", "index", "lookup",
+          "lookups/s", "ns/lookup", "faults/lkp", "misses/lkp");
+   if (!opts.lockOnly) {
+      const char *states[] = { "cold", "warm" };
+      int s, b;
+
+      for (b = 0; b < 2; b++) {
+         for (s = 0; s < 2; s++) {
+            if (s == 0) {
+               index.Close();
+               DropCache();
+            }
+            if (!index.IsOpen() && !index.Open(opts.dir, error)) {
+               fprintf(stderr, "%s\n", error.c_str());
+               return 1;
+            }
+            Run(index, states[s], b != 0, hashes, expected);
+         }
+      }
+   }
+
+   if (!index.IsOpen() && !index.Open(opts.dir, error)) {
+      fprintf(stderr, "%s\n", error.c_str());
+      return 1;
+   }
+   if (index.Lock(error)) {
+      Run(index, "locked", false, hashes, expected);
+      Run(index, "locked", true, hashes, expected);
+      printf("lock_index pins %llu MB for %llu nodes; %llu of %llu blocks "
+             "in use.\n",
+             (unsigned long long)((index.Config().nodeOffset +
+                                   index.Config().nodeCount *
+                                   index.Config().nodeSize) >> 20),
+             (unsigned long long)index.Config().nodeCount,
+             (unsigned long long)index.BlocksInUse(),
+             (unsigned long long)index.Config().blockCount);
+   } else {
+      printf("locked: %s\n", error.c_str());
+   }
+   index.Close();
+
+   if (!opts.keep) {
+      unlink((string(opts.dir) + "/ddfsidx").c_str());
+      unlink((string(opts.dir) + "/ddfs.cfg").c_str());
+   }
+   return 0;
+}
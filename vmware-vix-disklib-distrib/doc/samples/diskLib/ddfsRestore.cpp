@@ -0,0 +1,606 @@
+/*
+ * ddfsRestore.cpp --
+ *
+ *      Restores a VM directory from ddumbfs to the NFS restore folder, in
+ *      place of "rsync -rltzuv" in restore2nfs. Files are split into
+ *      large chunks that several threads read in parallel, with the next
+ *      chunks announced to the kernel (and to ddumbfs behind FUSE) by
+ *      posix_fadvise(). All-zero blocks are not written, so the copies
+ *      are sparse. Modes and timestamps are preserved, symbolic links
+ *      are copied as links, and like rsync -u files that are newer on
+ *      the target are left alone. Like rsync, each file is written under
+ *      a temporary name and renamed once complete, so an interrupted
+ *      restore never leaves a partial file that a re-run would skip.
+ *
+ *      Linux only.
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+using std::string;
+using std::vector;
+
+#define MB (1024 * 1024)
+
+// Granularity of zero detection; matches the grain size of sparse vmdks
+// and is a multiple of any file system block size.
+#define HOLE_BLOCK (64 * 1024)
+
+static struct {
+   unsigned numThreads;
+   size_t chunkSize;        // bytes per read
+   size_t readahead;        // bytes announced ahead of each read
+   bool verbose;
+} opts;
+
+// A file, directory or link to restore.
+struct Entry {
+   string src;
+   string dst;
+   string tmp;              // where a copied file is written, then renamed
+   struct stat st;
+   bool copy;               // regular file that needs its data copied
+};
+
+// A piece of a regular file, copied by one worker.
+struct Chunk {
+   size_t entry;
+   off_t offset;
+   size_t len;
+};
+
+// State shared by the workers, which claim chunks in order.
+struct RestoreJob {
+   vector<Entry> entries;
+   vector<Chunk> chunks;
+   std::atomic<size_t> nextChunk;
+   std::atomic<bool> failed;
+   std::atomic<uint64_t> bytesRead;
+   std::atomic<uint64_t> bytesWritten;
+   std::atomic<unsigned> workersDone;
+};
+
+
+static uint64_t
+NowNsec(void)
+{
+   return std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * IsZero --
+ *
+ *      Checks a block for all zeros, a word at a time.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static bool
+IsZero(const char *buf,   // IN
+       size_t len)        // IN
+{
+   const uint64_t *words = (const uint64_t *)buf;
+   size_t i;
+
+   for (i = 0; i < len / sizeof *words; i++) {
+      if (words[i] != 0) {
+         return false;
+      }
+   }
+   for (i = i * sizeof *words; i < len; i++) {
+      if (buf[i] != 0) {
+         return false;
+      }
+   }
+   return true;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Scan --
+ *
+ *      Adds src and, for a directory, everything below it to the job,
+ *      parents before their children.
+ *
+ * Results:
+ *      false with a message printed if src cannot be read.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static bool
+Scan(RestoreJob &job,          // IN/OUT
+     const string &src,        // IN
+     const string &dst)        // IN
+{
+   Entry entry;
+   DIR *dir;
+   struct dirent *de;
+   vector<string> names;
+   size_t i;
+
+   entry.src = src;
+   entry.dst = dst;
+   entry.copy = false;
+   if (lstat(src.c_str(), &entry.st) != 0) {
+      fprintf(stderr, "%s: %s\n", src.c_str(), strerror(errno));
+      return false;
+   }
+   if (S_ISREG(entry.st.st_mode)) {
+      struct stat dstSt;
+
+      // rsync -u: keep files that are newer on the target, and the
+      // quick check: same size and time means already restored.
+      entry.copy = lstat(dst.c_str(), &dstSt) != 0 ||
+                   (dstSt.st_mtime < entry.st.st_mtime ||
+                    (dstSt.st_mtime == entry.st.st_mtime &&
+                     dstSt.st_size != entry.st.st_size));
+   }
+   job.entries.push_back(entry);
+   if (!S_ISDIR(entry.st.st_mode)) {
+      return true;
+   }
+
+   dir = opendir(src.c_str());
+   if (dir == NULL) {
+      fprintf(stderr, "%s: %s\n", src.c_str(), strerror(errno));
+      return false;
+   }
+   while ((de = readdir(dir)) != NULL) {
+      if (strcmp(de->d_name, ".") != 0 && strcmp(de->d_name, "..") != 0) {
+         names.push_back(de->d_name);
+      }
+   }
+   closedir(dir);
+   for (i = 0; i < names.size(); i++) {
+      if (!Scan(job, src + "/" + names[i], dst + "/" + names[i])) {
+         return false;
+      }
+   }
+   return true;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * MakeTemp --
+ *
+ *      Creates the temporary file a copy is written to: ".name.XXXXXX"
+ *      in the target's directory, as rsync names them, so the rename
+ *      that completes it stays within one file system.
+ *
+ * Results:
+ *      The open file, -1 with errno set on failure.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+MakeTemp(Entry &entry)   // IN/OUT
+{
+   size_t slash = entry.dst.rfind('/');
+   size_t base = slash == string::npos ? 0 : slash + 1;
+   string name = entry.dst.substr(0, base) + "." + entry.dst.substr(base) +
+                 ".XXXXXX";
+   vector<char> path;
+   int fd;
+
+   path.assign(name.begin(), name.end());
+   path.push_back('\0');
+   fd = mkstemp(&path[0]);
+   if (fd >= 0) {
+      entry.tmp = &path[0];
+   }
+   return fd;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Prepare --
+ *
+ *      Creates the directories and links, and every file to copy at its
+ *      final size under a temporary name next to its target, so the
+ *      blocks the workers never write stay holes. Splits the files into
+ *      chunks.
+ *
+ * Results:
+ *      false with a message printed on failure.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static bool
+Prepare(RestoreJob &job)   // IN/OUT
+{
+   size_t i;
+
+   for (i = 0; i < job.entries.size(); i++) {
+      const Entry &entry = job.entries[i];
+      const char *dst = entry.dst.c_str();
+      off_t offset;
+      int fd;
+
+      if (S_ISDIR(entry.st.st_mode)) {
+         if (mkdir(dst, 0700) != 0 && errno != EEXIST) {
+            fprintf(stderr, "%s: %s\n", dst, strerror(errno));
+            return false;
+         }
+      } else if (S_ISLNK(entry.st.st_mode)) {
+         char target[PATH_MAX];
+         ssize_t len = readlink(entry.src.c_str(), target, sizeof target - 1);
+
+         if (len < 0) {
+            fprintf(stderr, "%s: %s\n", entry.src.c_str(), strerror(errno));
+            return false;
+         }
+         target[len] = '\0';
+         unlink(dst);
+         if (symlink(target, dst) != 0) {
+            fprintf(stderr, "%s: %s\n", dst, strerror(errno));
+            return false;
+         }
+      } else if (entry.copy) {
+         if (opts.verbose) {
+            printf("%s\n", entry.src.c_str());
+         }
+         fd = MakeTemp(job.entries[i]);
+         if (fd < 0 || ftruncate(fd, entry.st.st_size) != 0) {
+            fprintf(stderr, "%s: %s\n", dst, strerror(errno));
+            if (fd >= 0) {
+               close(fd);
+            }
+            return false;
+         }
+         close(fd);
+         for (offset = 0; offset < entry.st.st_size;
+              offset += opts.chunkSize) {
+            Chunk chunk;
+
+            chunk.entry = i;
+            chunk.offset = offset;
+            chunk.len = entry.st.st_size - offset < (off_t)opts.chunkSize ?
+                        entry.st.st_size - offset : opts.chunkSize;
+            job.chunks.push_back(chunk);
+         }
+      }
+   }
+   return true;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * CopyChunk --
+ *
+ *      Reads one chunk and writes its non-zero runs of HOLE_BLOCK blocks
+ *      with one pwrite() each. Before reading, asks for the readahead
+ *      window after the chunk; afterwards drops the chunk from the page
+ *      cache, since a restore never reads it again.
+ *
+ * Results:
+ *      false with a message printed on failure.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static bool
+CopyChunk(RestoreJob &job,        // IN/OUT
+          const Chunk &chunk,     // IN
+          char *buf)              // IN
+{
+   const Entry &entry = job.entries[chunk.entry];
+   size_t done = 0;
+   size_t pos;
+   int src, dst;
+   bool ok = false;
+
+   src = open(entry.src.c_str(), O_RDONLY);
+   if (src < 0) {
+      fprintf(stderr, "%s: %s\n", entry.src.c_str(), strerror(errno));
+      return false;
+   }
+   dst = open(entry.tmp.c_str(), O_WRONLY);
+   if (dst < 0) {
+      fprintf(stderr, "%s: %s\n", entry.tmp.c_str(), strerror(errno));
+      close(src);
+      return false;
+   }
+   posix_fadvise(src, chunk.offset + chunk.len, opts.readahead,
+                 POSIX_FADV_WILLNEED);
+
+   while (done < chunk.len) {
+      ssize_t n = pread(src, buf + done, chunk.len - done,
+                        chunk.offset + done);
+
+      if (n < 0 && errno == EINTR) {
+         continue;
+      }
+      if (n <= 0) {
+         fprintf(stderr, "%s: %s\n", entry.src.c_str(),
+                 n == 0 ? "file shrank while restoring" : strerror(errno));
+         goto out;
+      }
+      done += n;
+   }
+   job.bytesRead += chunk.len;
+
+   for (pos = 0; pos < chunk.len; ) {
+      size_t start, block;
+
+      block = chunk.len - pos < HOLE_BLOCK ? chunk.len - pos : HOLE_BLOCK;
+      if (IsZero(buf + pos, block)) {
+         pos += block;
+         continue;
+      }
+      start = pos;
+      while (pos < chunk.len) {
+         block = chunk.len - pos < HOLE_BLOCK ? chunk.len - pos : HOLE_BLOCK;
+         if (IsZero(buf + pos, block)) {
+            break;
+         }
+         pos += block;
+      }
+      for (done = start; done < pos; ) {
+         ssize_t n = pwrite(dst, buf + done, pos - done,
+                            chunk.offset + done);
+
+         if (n < 0 && errno == EINTR) {
+            continue;
+         }
+         if (n < 0) {
+            fprintf(stderr, "%s: %s\n", entry.tmp.c_str(), strerror(errno));
+            goto out;
+         }
+         done += n;
+      }
+      job.bytesWritten += pos - start;
+   }
+   posix_fadvise(src, chunk.offset, chunk.len, POSIX_FADV_DONTNEED);
+   ok = true;
+
+out:
+   close(src);
+   if (close(dst) != 0 && ok) {
+      fprintf(stderr, "%s: %s\n", entry.tmp.c_str(), strerror(errno));
+      ok = false;
+   }
+   return ok;
+}
+
+
+static void
+RestoreThread(RestoreJob *job)   // IN/OUT
+{
+   char *buf = NULL;
+
+   if (posix_memalign((void **)&buf, 4096, opts.chunkSize) != 0) {
+      fprintf(stderr, "Out of memory.\n");
+      job->failed = true;
+   }
+   while (!job->failed) {
+      size_t n = job->nextChunk++;
+
+      if (n >= job->chunks.size()) {
+         break;
+      }
+      if (!CopyChunk(*job, job->chunks[n], buf)) {
+         job->failed = true;
+      }
+   }
+   free(buf);
+   job->workersDone++;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Finish --
+ *
+ *      Applies modes and times, and renames each copied file over its
+ *      target. Children come before their directory, since creating
+ *      entries changes a directory's modification time.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static bool
+Finish(RestoreJob &job)   // IN/OUT
+{
+   size_t i;
+   bool ok = true;
+
+   for (i = job.entries.size(); i-- > 0; ) {
+      const Entry &entry = job.entries[i];
+      const char *path = entry.copy ? entry.tmp.c_str() : entry.dst.c_str();
+      struct timespec times[2];
+
+      if (!entry.copy && S_ISREG(entry.st.st_mode)) {
+         continue;
+      }
+      times[0] = entry.st.st_atim;
+      times[1] = entry.st.st_mtim;
+      if ((!S_ISLNK(entry.st.st_mode) &&
+           chmod(path, entry.st.st_mode & 07777) != 0) ||
+          utimensat(AT_FDCWD, path, times, AT_SYMLINK_NOFOLLOW) != 0) {
+         fprintf(stderr, "%s: %s\n", path, strerror(errno));
+         ok = false;
+         continue;
+      }
+      if (entry.copy) {
+         if (rename(path, entry.dst.c_str()) != 0) {
+            fprintf(stderr, "%s: %s\n", entry.dst.c_str(), strerror(errno));
+            ok = false;
+            continue;
+         }
+         job.entries[i].tmp.clear();
+      }
+   }
+   return ok;
+}
+
+
+// Removes the temporary files of copies that did not complete.
+static void
+RemoveTemps(const RestoreJob &job)   // IN
+{
+   size_t i;
+
+   for (i = 0; i < job.entries.size(); i++) {
+      if (!job.entries[i].tmp.empty()) {
+         unlink(job.entries[i].tmp.c_str());
+      }
+   }
+}
+
+
+static void
+PrintRate(const char *op,        // IN
+          uint64_t bytes,        // IN
+          uint64_t start,        // IN
+          uint64_t end)          // IN
+{
+   uint64_t msec = (end - start) / 1000000;
+
+   printf("%s %llu MBytes in %llu msec (%llu MBytes/sec)\n", op,
+          (unsigned long long)(bytes / MB), (unsigned long long)msec,
+          (unsigned long long)(bytes * 1000 / MB / (msec ? msec : 1)));
+   fflush(stdout);
+}
+
+
+static int
+PrintUsage(void)
+{
+   printf("Usage: ddfs-restore [options] sourceDir targetParentDir\n"
+          "Copies sourceDir into targetParentDir, like "
+          "rsync -rltu sourceDir targetParentDir.\n"
+          " -threads n : parallel readers (default=4)\n"
+          " -chunk MB : size of each read (default=16)\n"
+          " -readahead MB : data announced ahead of each read "
+          "(default=64)\n"
+          " -v : print the files copied\n");
+   return 1;
+}
+
+
+int
+main(int argc, char *argv[])
+{
+   RestoreJob job;
+   vector<std::thread> threads;
+   string src, dst;
+   uint64_t start, last, end, reported = 0;
+   uint64_t totalBytes = 0;
+   unsigned files = 0;
+   size_t slash;
+   size_t i;
+   int arg;
+
+   opts.numThreads = 4;
+   opts.chunkSize = 16 * MB;
+   opts.readahead = 64 * MB;
+
+   for (arg = 1; arg < argc - 2; arg++) {
+      if (!strcmp(argv[arg], "-threads")) {
+         opts.numThreads = strtoul(argv[++arg], NULL, 0);
+      } else if (!strcmp(argv[arg], "-chunk")) {
+         opts.chunkSize = strtoul(argv[++arg], NULL, 0) * MB;
+      } else if (!strcmp(argv[arg], "-readahead")) {
+         opts.readahead = strtoul(argv[++arg], NULL, 0) * MB;
+      } else if (!strcmp(argv[arg], "-v")) {
+         opts.verbose = true;
+      } else {
+         return PrintUsage();
+      }
+   }
+   if (arg != argc - 2 || opts.numThreads == 0 || opts.chunkSize == 0) {
+      return PrintUsage();
+   }
+
+   src = argv[arg];
+   while (src.size() > 1 && src[src.size() - 1] == '/') {
+      src.erase(src.size() - 1);
+   }
+   slash = src.rfind('/');
+   dst = string(argv[arg + 1]) + "/" +
+         (slash == string::npos ? src : src.substr(slash + 1));
+
+   job.nextChunk = 0;
+   job.failed = false;
+   job.bytesRead = 0;
+   job.bytesWritten = 0;
+   job.workersDone = 0;
+   if (!Scan(job, src, dst)) {
+      return 1;
+   }
+   if (!Prepare(job)) {
+      RemoveTemps(job);
+      return 1;
+   }
+   for (i = 0; i < job.entries.size(); i++) {
+      if (job.entries[i].copy) {
+         files++;
+         totalBytes += job.entries[i].st.st_size;
+      }
+   }
+   printf("Restoring %u files (%llu MBytes) from %s to %s with %u "
+          "threads.\n", files, (unsigned long long)(totalBytes / MB),
+          src.c_str(), dst.c_str(), opts.numThreads);
+   fflush(stdout);
+
+   start = NowNsec();
+   last = start;
+   for (i = 0; i < opts.numThreads; i++) {
+      threads.push_back(std::thread(RestoreThread, &job));
+   }
+   while (job.workersDone < opts.numThreads) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(100));
+      if (job.bytesRead - reported >= 1024ULL * MB) {
+         uint64_t now = NowNsec();
+
+         PrintRate("Restored", job.bytesRead - reported, last, now);
+         reported = job.bytesRead;
+         last = now;
+      }
+   }
+   for (i = 0; i < threads.size(); i++) {
+      threads[i].join();
+   }
+   end = NowNsec();
+   if (job.failed || !Finish(job)) {
+      RemoveTemps(job);
+      return 1;
+   }
+
+   PrintRate("Restored", job.bytesRead, start, end);
+   printf("Wrote %llu MBytes, left %llu MBytes of zeros as holes.\n",
+          (unsigned long long)(job.bytesWritten / MB),
+          (unsigned long long)((job.bytesRead - job.bytesWritten) / MB));
+   return 0;
+}
@@ -0,0 +1,453 @@
+/*
+ * ioArena.cpp --
+ *
+ *      Page-aligned I/O buffers carved from one preallocated slab.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <new>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#endif
+
+#include "ioArena.h"
+
+// The free buffers of this thread. A thread that exits gives them back
+// to the shared lists of their arena.
+static thread_local IoArena::Cache threadCache;
+
+
+// Smallest class holding size bytes, IO_ARENA_CLASSES if none does.
+static int
+SizeClass(size_t size)   // IN
+{
+   int c = 0;
+
+   while (c < IO_ARENA_CLASSES && ((size_t)IO_ARENA_PAGE << c) < size) {
+      c++;
+   }
+   return c;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * IoArena::~IoArena --
+ *
+ *      Unmaps the slab.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Buffers of the slab still allocated become invalid.
+ *
+ *----------------------------------------------------------------------
+ */
+
+IoArena::~IoArena()
+{
+   if (_slab == NULL) {
+      return;
+   }
+#ifdef _WIN32
+   VirtualFree(_slab, 0, MEM_RELEASE);
+#else
+   munmap(_slab, _slabBytes);
+#endif
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * IoArena::SetSlab --
+ *
+ *      Sets the size of the slab and whether to back it with huge
+ *      pages. Nothing is mapped until the first Alloc, so commands that
+ *      do no I/O cost nothing.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+IoArena::SetSlab(size_t bytes,       // IN
+                 bool hugePages)     // IN
+{
+   std::lock_guard<std::mutex> guard(_lock);
+
+   _wantBytes = bytes;
+   _wantHuge = hugePages;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * IoArena::MapSlab --
+ *
+ *      Maps the slab, with huge pages if asked for and the system has
+ *      them reserved, otherwise with normal pages (on Linux hinting
+ *      that transparent huge pages would do). Failing to map leaves no
+ *      slab: every buffer is then allocated outside it.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Sets _slab, _slabBytes, _hugePages and _mapped.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+IoArena::MapSlab(void)
+{
+   std::lock_guard<std::mutex> guard(_lock);
+   size_t bytes = _wantBytes;
+   void *map = NULL;
+
+   if (_mapped) {
+      return;
+   }
+   if (bytes != 0 && _wantHuge) {
+      bytes = (bytes + IO_ARENA_HUGE_PAGE - 1) / IO_ARENA_HUGE_PAGE *
+              IO_ARENA_HUGE_PAGE;
+#ifdef _WIN32
+      size_t large = GetLargePageMinimum();
+
+      if (large != 0) {
+         bytes = (bytes + large - 1) / large * large;
+         map = VirtualAlloc(NULL, bytes,
+                            MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES,
+                            PAGE_READWRITE);
+      }
+#else
+      // Reserving the huge pages up front makes this fail when the
+      // system has too few, rather than fault on first touch.
+      map = mmap(NULL, bytes, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+      if (map == MAP_FAILED) {
+         map = NULL;
+      }
+#endif
+      _hugePages = map != NULL;
+   }
+   if (bytes != 0 && map == NULL) {
+#ifdef _WIN32
+      map = VirtualAlloc(NULL, bytes, MEM_RESERVE | MEM_COMMIT,
+                         PAGE_READWRITE);
+#else
+      map = mmap(NULL, bytes, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+      if (map == MAP_FAILED) {
+         map = NULL;
+      }
+#ifdef MADV_HUGEPAGE
+      if (map != NULL && _wantHuge) {
+         madvise(map, bytes, MADV_HUGEPAGE);
+      }
+#endif
+#endif
+   }
+   if (map != NULL) {
+      _slab = (uint8 *)map;
+      _slabBytes = bytes;
+      _pageClass.resize(bytes / IO_ARENA_PAGE);
+   }
+   _mapped = true;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * IoArena::Carve --
+ *
+ *      Cuts a new buffer of sizeClass from the unused end of the slab.
+ *      Called with _lock held.
+ *
+ * Results:
+ *      The buffer, NULL if the slab is used up.
+ *
+ * Side effects:
+ *      Advances _carved.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void *
+IoArena::Carve(int sizeClass)   // IN
+{
+   size_t size = (size_t)IO_ARENA_PAGE << sizeClass;
+   uint8 *ptr;
+
+   if (_slabBytes - _carved < size) {
+      return NULL;
+   }
+   ptr = _slab + _carved;
+   _pageClass[_carved / IO_ARENA_PAGE] = sizeClass;
+   _carved += size;
+   return ptr;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * IoArena::AllocOutside --
+ *
+ *      Allocates an aligned buffer outside the slab, when there is no
+ *      slab, it is used up or size is larger than any class. The page
+ *      before the buffer records its size.
+ *
+ * Results:
+ *      The buffer.
+ *
+ * Side effects:
+ *      Throws std::bad_alloc if out of memory.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void *
+IoArena::AllocOutside(size_t size)   // IN
+{
+   void *ptr;
+
+#ifdef _WIN32
+   ptr = _aligned_malloc(size + IO_ARENA_PAGE, IO_ARENA_PAGE);
+#else
+   if (posix_memalign(&ptr, IO_ARENA_PAGE, size + IO_ARENA_PAGE) != 0) {
+      ptr = NULL;
+   }
+#endif
+   if (ptr == NULL) {
+      throw std::bad_alloc();
+   }
+   *(size_t *)ptr = size;
+   _overflows++;
+   Account(size);
+   return (uint8 *)ptr + IO_ARENA_PAGE;
+}
+
+
+void
+IoArena::FreeOutside(void *ptr)   // IN
+{
+   uint8 *base = (uint8 *)ptr - IO_ARENA_PAGE;
+
+   Account(-(int64)*(size_t *)base);
+#ifdef _WIN32
+   _aligned_free(base);
+#else
+   free(base);
+#endif
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * IoArena::Alloc --
+ *
+ *      Allocates size bytes aligned to IO_ARENA_PAGE: from this thread's
+ *      cache, else from the shared free list of the size class, else
+ *      from the unused part of the slab, else outside the slab. Only
+ *      the last allocates memory.
+ *
+ * Results:
+ *      The buffer, to be released with Free.
+ *
+ * Side effects:
+ *      Throws std::bad_alloc if out of memory. Maps the slab on the
+ *      first call.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void *
+IoArena::Alloc(size_t size)   // IN
+{
+   int c = SizeClass(size);
+   void *ptr;
+
+   if (!_mapped) {
+      MapSlab();
+   }
+   _allocs++;
+   if (_slab == NULL || c == IO_ARENA_CLASSES) {
+      return AllocOutside(size);
+   }
+
+   if (threadCache.arena == this && threadCache.head[c] != NULL) {
+      ptr = threadCache.head[c];
+      threadCache.head[c] = *(void **)ptr;
+      threadCache.count[c]--;
+      _cacheHits++;
+   } else {
+      std::lock_guard<std::mutex> guard(_lock);
+
+      ptr = _free[c];
+      if (ptr != NULL) {
+         _free[c] = *(void **)ptr;
+         _sharedHits++;
+      } else {
+         ptr = Carve(c);
+      }
+   }
+   if (ptr == NULL) {
+      return AllocOutside(size);
+   }
+   Account((int64)IO_ARENA_PAGE << c);
+   return ptr;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * IoArena::Free --
+ *
+ *      Releases a buffer from Alloc: slab buffers go to this thread's
+ *      cache, or the shared free list once the cache holds
+ *      IO_ARENA_CACHE_DEPTH of the class.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+IoArena::Free(void *ptr)   // IN
+{
+   int c;
+
+   if (ptr == NULL) {
+      return;
+   }
+   if (!InSlab(ptr)) {
+      FreeOutside(ptr);
+      return;
+   }
+   c = _pageClass[((uint8 *)ptr - _slab) / IO_ARENA_PAGE];
+   Account(-((int64)IO_ARENA_PAGE << c));
+
+   if (threadCache.arena != this) {
+      threadCache.Flush();
+      threadCache.arena = this;
+   }
+   if (threadCache.count[c] < IO_ARENA_CACHE_DEPTH) {
+      *(void **)ptr = threadCache.head[c];
+      threadCache.head[c] = ptr;
+      threadCache.count[c]++;
+   } else {
+      std::lock_guard<std::mutex> guard(_lock);
+
+      *(void **)ptr = _free[c];
+      _free[c] = ptr;
+   }
+}
+
+
+// Bytes in use go up and down; the peak is raised by whoever beats it.
+void
+IoArena::Account(int64 bytes)   // IN
+{
+   uint64 now = _inUse.fetch_add(bytes) + bytes;
+   uint64 peak = _peakInUse;
+
+   while (bytes > 0 && now > peak &&
+          !_peakInUse.compare_exchange_weak(peak, now)) {
+   }
+}
+
+
+void
+IoArena::ResetCounters(void)
+{
+   _inUse = 0;
+   _peakInUse = 0;
+   _allocs = 0;
+   _cacheHits = 0;
+   _sharedHits = 0;
+   _overflows = 0;
+}
+
+
+IoArenaCounters
+IoArena::Counters(void) const
+{
+   IoArenaCounters c;
+
+   c.slabBytes = _slabBytes;
+   c.hugePages = _hugePages;
+   c.inUse = _inUse;
+   c.peakInUse = _peakInUse;
+   c.allocs = _allocs;
+   c.cacheHits = _cacheHits;
+   c.sharedHits = _sharedHits;
+   c.overflows = _overflows;
+   return c;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * IoArena::Cache::Flush --
+ *
+ *      Moves the buffers of a thread cache to the shared free lists of
+ *      its arena.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Empties the cache.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+IoArena::Cache::Flush(void)
+{
+   int c;
+
+   if (arena == NULL) {
+      return;
+   }
+   std::lock_guard<std::mutex> guard(arena->_lock);
+
+   for (c = 0; c < IO_ARENA_CLASSES; c++) {
+      while (head[c] != NULL) {
+         void *ptr = head[c];
+
+         head[c] = *(void **)ptr;
+         *(void **)ptr = arena->_free[c];
+         arena->_free[c] = ptr;
+      }
+      count[c] = 0;
+   }
+}
+
+
+IoArena::Cache::~Cache()
+{
+   Flush();
+}
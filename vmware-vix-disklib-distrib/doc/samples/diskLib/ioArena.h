@@ -0,0 +1,119 @@
+/*
+ * ioArena.h --
+ *
+ *      Page-aligned I/O buffers carved from one preallocated slab,
+ *      optionally backed by 2 MByte huge pages. Freed buffers are kept
+ *      on free lists by power-of-two size class, a few per class in a
+ *      cache private to the freeing thread and the rest shared, so a
+ *      job that allocates the same buffers again allocates nothing.
+ */
+
+#ifndef IO_ARENA_H
+#define IO_ARENA_H
+
+#include <stddef.h>
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+#include "vixDiskLib.h"
+
+// Alignment and smallest size class of arena buffers
+#define IO_ARENA_PAGE 4096
+#define IO_ARENA_HUGE_PAGE (2 * 1024 * 1024)
+
+// Size classes IO_ARENA_PAGE << 0 .. IO_ARENA_PAGE << (CLASSES - 1)
+#define IO_ARENA_CLASSES 20
+
+// Free buffers of one class a thread keeps for itself
+#define IO_ARENA_CACHE_DEPTH 8
+
+struct IoArenaCounters {
+   uint64 slabBytes;     // 0 until the first buffer is allocated
+   bool hugePages;       // the slab got huge pages
+   uint64 inUse;         // bytes of buffers allocated and not freed
+   uint64 peakInUse;
+   uint64 allocs;
+   uint64 cacheHits;     // allocations from the thread's own cache
+   uint64 sharedHits;    // allocations from the shared free lists
+   uint64 overflows;     // allocations outside the slab
+};
+
+class IoArena
+{
+public:
+    IoArena() : _slab(NULL), _slabBytes(0), _carved(0), _hugePages(false),
+                _mapped(false), _wantBytes(0), _wantHuge(false)
+    {
+       for (int c = 0; c < IO_ARENA_CLASSES; c++) {
+          _free[c] = NULL;
+       }
+       ResetCounters();
+    }
+    // Buffers still allocated must not be used afterwards.
+    ~IoArena();
+    IoArena(const IoArena &) = delete;
+    IoArena &operator=(const IoArena &) = delete;
+
+    // Sets the slab size, mapped on the first Alloc. 0 makes every
+    // buffer a plain aligned allocation. Call before any Alloc.
+    void SetSlab(size_t bytes, bool hugePages);
+
+    // size bytes aligned to IO_ARENA_PAGE, to be released with Free.
+    // Throws std::bad_alloc if out of memory.
+    void *Alloc(size_t size);
+    void Free(void *ptr);
+
+    IoArenaCounters Counters(void) const;
+
+    // Thread cache, public only for the thread-local destructor.
+    struct Cache {
+       IoArena *arena;
+       void *head[IO_ARENA_CLASSES];
+       unsigned count[IO_ARENA_CLASSES];
+
+       Cache() : arena(NULL)
+       {
+          for (int c = 0; c < IO_ARENA_CLASSES; c++) {
+             head[c] = NULL;
+             count[c] = 0;
+          }
+       }
+       ~Cache();
+       void Flush(void);
+    };
+
+private:
+    void MapSlab(void);
+    void *Carve(int sizeClass);
+    void *AllocOutside(size_t size);
+    void FreeOutside(void *ptr);
+    bool InSlab(const void *ptr) const
+    {
+       return (const uint8 *)ptr >= _slab &&
+              (const uint8 *)ptr < _slab + _slabBytes;
+    }
+    void Account(int64 bytes);
+    void ResetCounters(void);
+
+    std::mutex _lock;
+    uint8 *_slab;
+    size_t _slabBytes;
+    size_t _carved;               // bytes of the slab handed out once
+    bool _hugePages;
+    std::atomic<bool> _mapped;    // MapSlab has run
+    std::vector<uint8> _pageClass;   // size class of the block at a page
+    void *_free[IO_ARENA_CLASSES];   // shared free lists, under _lock
+
+    size_t _wantBytes;
+    bool _wantHuge;
+
+    std::atomic<uint64> _inUse;
+    std::atomic<uint64> _peakInUse;
+    std::atomic<uint64> _allocs;
+    std::atomic<uint64> _cacheHits;
+    std::atomic<uint64> _sharedHits;
+    std::atomic<uint64> _overflows;
+};
+
+#endif // IO_ARENA_H
@@ -0,0 +1,940 @@
+/*
+ * rawImage.cpp --
+ *
+ *      Queued reads and writes of a raw disk image or block device,
+ *      through an io_uring where the kernel has one.
+ */
+
+#ifndef _WIN32
+#define _GNU_SOURCE 1
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <new>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#include <sys/uio.h>
+#endif
+
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/fs.h>
+#if defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter) && \
+    defined(__NR_io_uring_register)
+#include <linux/io_uring.h>
+#define RAW_HAVE_IO_URING 1
+#endif
+#endif
+
+#include "rawImage.h"
+#include "vixDisk.h"
+
+// Bytes of zeros written at a time where a range cannot be punched
+#define RAW_ZERO_BUF_SIZE (1024 * 1024)
+
+#define RAW_THROW_ERRNO(err) \
+   throw VixDiskError(strerror(err), __FILE__, __LINE__)
+
+// Marks a queue entry already done synchronously
+#define RAW_SLOT_DONE ((unsigned)-1)
+
+
+#ifdef RAW_HAVE_IO_URING
+
+// The rings shared with the kernel. Heads and tails are read and
+// written with acquire and release ordering, as the kernel does.
+struct RawRing {
+   int fd;
+   void *sqMap;
+   size_t sqMapSize;
+   void *cqMap;
+   size_t cqMapSize;
+   struct io_uring_sqe *sqes;
+   size_t sqesSize;
+   unsigned *sqTail;
+   unsigned sqMask;
+   unsigned *sqArray;
+   unsigned *cqHead;
+   unsigned *cqTail;
+   unsigned cqMask;
+   struct io_uring_cqe *cqes;
+   std::vector<struct iovec> iov;          // per slot, for READV/WRITEV
+   std::vector<struct iovec> registered;   // buffers for *_FIXED
+};
+
+
+static int
+RingEnter(int fd,               // IN
+          unsigned toSubmit,    // IN
+          unsigned minComplete, // IN
+          unsigned flags)       // IN
+{
+   return (int)syscall(__NR_io_uring_enter, fd, toSubmit, minComplete,
+                       flags, NULL, 0);
+}
+
+
+static void
+FreeRing(RawRing *ring)   // IN
+{
+   if (ring->sqes != NULL) {
+      munmap(ring->sqes, ring->sqesSize);
+   }
+   if (ring->cqMap != NULL && ring->cqMap != ring->sqMap) {
+      munmap(ring->cqMap, ring->cqMapSize);
+   }
+   if (ring->sqMap != NULL) {
+      munmap(ring->sqMap, ring->sqMapSize);
+   }
+   if (ring->fd >= 0) {
+      close(ring->fd);
+   }
+   delete ring;
+}
+
+#else
+
+struct RawRing {
+   int fd;
+};
+
+
+static void
+FreeRing(RawRing *ring)   // IN
+{
+   delete ring;
+}
+
+#endif
+
+
+// Whether a request can go to an O_DIRECT descriptor as it is.
+static bool
+DirectAligned(const uint8 *buf,    // IN
+              size_t len,          // IN
+              uint64 offset)       // IN
+{
+   return ((uintptr_t)buf | len | offset) % RAW_DIRECT_ALIGN == 0;
+}
+
+
+RawImage::RawImage()
+   : _fd(-1),
+     _bufferedFd(-1),
+     _size(0),
+     _isDevice(false),
+     _direct(false),
+     _preallocated(false),
+     _created(false),
+     _depth(0),
+     _ring(NULL),
+     _queued(0),
+     _inFlight(0),
+     _done(0),
+     _zeros(NULL)
+{
+}
+
+
+const char *
+RawImage::Backend() const
+{
+   return _ring != NULL ? "io_uring" : "pwritev";
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RawImage::Open --
+ *
+ *      Opens path, O_DIRECT if the file system supports it, finds its
+ *      size and sets up the request slots and the ring.
+ *
+ * Results:
+ *      None. Throws VixDiskError on failure.
+ *
+ * Side effects:
+ *      Creates path if write is set and it is missing.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+RawImage::Open(const char *path,       // IN
+               bool write,             // IN
+               unsigned queueDepth)    // IN
+{
+   int flags = write ? O_WRONLY | O_CREAT : O_RDONLY;
+   struct stat st;
+   unsigned i;
+
+   Close();
+#ifdef _WIN32
+   flags |= _O_BINARY;
+#endif
+#ifdef O_DIRECT
+   _fd = open(path, flags | O_DIRECT, 0644);
+   _direct = _fd >= 0;
+   if (_fd < 0 && errno == EINVAL) {
+      // The file system does not do direct I/O.
+      _fd = open(path, flags, 0644);
+   }
+#else
+   _fd = open(path, flags, 0644);
+#endif
+   if (_fd < 0) {
+      RAW_THROW_ERRNO(errno);
+   }
+   if (fstat(_fd, &st) != 0) {
+      int err = errno;
+
+      Close();
+      RAW_THROW_ERRNO(err);
+   }
+   _size = st.st_size;
+#ifdef __linux__
+   if (S_ISBLK(st.st_mode)) {
+      _isDevice = true;
+      if (ioctl(_fd, BLKGETSIZE64, &_size) != 0) {
+         int err = errno;
+
+         Close();
+         RAW_THROW_ERRNO(err);
+      }
+   }
+#endif
+   if (_direct) {
+      _bufferedFd = open(path, write ? O_WRONLY : O_RDONLY);
+      if (_bufferedFd < 0) {
+         int err = errno;
+
+         Close();
+         RAW_THROW_ERRNO(err);
+      }
+   }
+
+   _depth = queueDepth > 0 ? queueDepth : 1;
+   _slots.resize(_depth);
+   _freeSlots.clear();
+   for (i = _depth; i > 0; i--) {
+      _freeSlots.push_back(i - 1);
+   }
+   _queue.clear();
+   _queue.reserve(_depth);
+   _doneTags.clear();
+   _doneTags.reserve(_depth);
+   SetupRing();
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RawImage::SetupRing --
+ *
+ *      Creates an io_uring of _depth entries and maps its rings. On
+ *      kernels without io_uring (or where it is not allowed) there is
+ *      no ring and requests are done synchronously.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Sets _ring.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+RawImage::SetupRing(void)
+{
+#ifdef RAW_HAVE_IO_URING
+   struct io_uring_params p;
+   RawRing *ring = new RawRing();
+   uint8 *sq, *cq;
+
+   memset(&p, 0, sizeof p);
+   ring->fd = (int)syscall(__NR_io_uring_setup, _depth, &p);
+   if (ring->fd < 0) {
+      FreeRing(ring);
+      return;
+   }
+   ring->sqMapSize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+   ring->cqMapSize = p.cq_off.cqes +
+                     p.cq_entries * sizeof(struct io_uring_cqe);
+   if (p.features & IORING_FEAT_SINGLE_MMAP) {
+      if (ring->cqMapSize > ring->sqMapSize) {
+         ring->sqMapSize = ring->cqMapSize;
+      }
+      ring->cqMapSize = ring->sqMapSize;
+   }
+   ring->sqMap = mmap(NULL, ring->sqMapSize, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd,
+                      IORING_OFF_SQ_RING);
+   if (ring->sqMap == MAP_FAILED) {
+      ring->sqMap = NULL;
+      FreeRing(ring);
+      return;
+   }
+   if (p.features & IORING_FEAT_SINGLE_MMAP) {
+      ring->cqMap = ring->sqMap;
+   } else {
+      ring->cqMap = mmap(NULL, ring->cqMapSize, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, ring->fd,
+                         IORING_OFF_CQ_RING);
+      if (ring->cqMap == MAP_FAILED) {
+         ring->cqMap = NULL;
+         FreeRing(ring);
+         return;
+      }
+   }
+   ring->sqesSize = p.sq_entries * sizeof(struct io_uring_sqe);
+   ring->sqes = (struct io_uring_sqe *)
+                mmap(NULL, ring->sqesSize, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+   if (ring->sqes == MAP_FAILED) {
+      ring->sqes = NULL;
+      FreeRing(ring);
+      return;
+   }
+
+   sq = (uint8 *)ring->sqMap;
+   cq = (uint8 *)ring->cqMap;
+   ring->sqTail = (unsigned *)(sq + p.sq_off.tail);
+   ring->sqMask = *(unsigned *)(sq + p.sq_off.ring_mask);
+   ring->sqArray = (unsigned *)(sq + p.sq_off.array);
+   ring->cqHead = (unsigned *)(cq + p.cq_off.head);
+   ring->cqTail = (unsigned *)(cq + p.cq_off.tail);
+   ring->cqMask = *(unsigned *)(cq + p.cq_off.ring_mask);
+   ring->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+   ring->iov.resize(_depth);
+   _ring = ring;
+#endif
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RawImage::OpenSink --
+ *
+ *      Opens path to write a size byte image: a block device as it is,
+ *      a regular file set to size bytes and, with preallocate, given
+ *      all its blocks, which later reads as zeros until written.
+ *
+ * Results:
+ *      None. Throws VixDiskError on failure, or if a device is smaller
+ *      than size.
+ *
+ * Side effects:
+ *      Creates, extends or truncates the file.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+RawImage::OpenSink(const char *path,       // IN
+                   uint64 size,            // IN
+                   bool preallocate,       // IN
+                   unsigned queueDepth)    // IN
+{
+   struct stat st;
+   bool existed = stat(path, &st) == 0;
+
+   Open(path, true, queueDepth);
+   if (_isDevice) {
+      if (_size < size) {
+         Close();
+         throw VixDiskError("The target device is smaller than the disk",
+                            __FILE__, __LINE__);
+      }
+      return;
+   }
+
+#ifdef _WIN32
+   if (_chsize_s(_fd, size) != 0) {
+#else
+   if (ftruncate(_fd, size) != 0) {
+#endif
+      int err = errno;
+
+      Close();
+      RAW_THROW_ERRNO(err);
+   }
+   _size = size;
+   _created = !existed;
+#ifdef __linux__
+   if (preallocate && size > 0) {
+      if (fallocate(_fd, 0, 0, size) == 0) {
+         _preallocated = true;
+      } else if (errno != EOPNOTSUPP && errno != ENOSYS) {
+         int err = errno;
+
+         Close();
+         RAW_THROW_ERRNO(err);
+      }
+   }
+#endif
+}
+
+
+void
+RawImage::OpenSource(const char *path,       // IN
+                     unsigned queueDepth)    // IN
+{
+   Open(path, false, queueDepth);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RawImage::NextData --
+ *
+ *      Finds the next allocated range of a source with SEEK_DATA and
+ *      SEEK_HOLE. Block devices, and file systems that cannot tell,
+ *      are one range from offset to the end.
+ *
+ * Results:
+ *      True and the range, false past the last data. Throws
+ *      VixDiskError if the file cannot be searched.
+ *
+ * Side effects:
+ *      Moves the file offset, which requests do not use.
+ *
+ *----------------------------------------------------------------------
+ */
+
+bool
+RawImage::NextData(uint64 offset,   // IN
+                   uint64 *start,   // OUT
+                   uint64 *end)     // OUT
+{
+   if (offset >= _size) {
+      return false;
+   }
+#if defined(SEEK_DATA) && defined(SEEK_HOLE)
+   if (!_isDevice) {
+      off_t data = lseek(_fd, offset, SEEK_DATA);
+      off_t hole;
+
+      if (data < 0) {
+         if (errno == ENXIO) {
+            return false;
+         }
+         if (errno != EINVAL && errno != EOPNOTSUPP) {
+            RAW_THROW_ERRNO(errno);
+         }
+      } else {
+         hole = lseek(_fd, data, SEEK_HOLE);
+         if (hole < 0 || (uint64)hole > _size) {
+            hole = _size;
+         }
+         *start = data;
+         *end = hole;
+         return (uint64)data < _size;
+      }
+   }
+#endif
+   *start = offset;
+   *end = _size;
+   return true;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RawImage::Close --
+ *
+ *      Waits for the requests in flight, ignoring their errors, and
+ *      releases everything.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+RawImage::Close(void)
+{
+   _queue.clear();
+   _queued = 0;
+   while (_inFlight > 0) {
+      try {
+         Complete();
+      } catch (const VixDiskError &) {
+      }
+   }
+   if (_ring != NULL) {
+      FreeRing(_ring);
+      _ring = NULL;
+   }
+   if (_bufferedFd >= 0) {
+      close(_bufferedFd);
+      _bufferedFd = -1;
+   }
+   if (_fd >= 0) {
+      close(_fd);
+      _fd = -1;
+   }
+#ifdef _WIN32
+   _aligned_free(_zeros);
+#else
+   free(_zeros);
+#endif
+   _zeros = NULL;
+   _doneTags.clear();
+   _done = 0;
+   _size = 0;
+   _isDevice = false;
+   _direct = false;
+   _preallocated = false;
+   _created = false;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RawImage::RegisterBuffers --
+ *
+ *      Registers count buffers of size bytes with the ring, replacing
+ *      any registered before, so that requests within them are done
+ *      with READ_FIXED and WRITE_FIXED and the kernel does not pin and
+ *      map the pages again for each. Without a ring, or if the kernel
+ *      refuses (e.g. over RLIMIT_MEMLOCK), requests simply are not
+ *      fixed.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Pins the buffers until Close or the next call.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+RawImage::RegisterBuffers(uint8 *const *bufs,   // IN
+                          unsigned count,       // IN
+                          size_t size)          // IN
+{
+#ifdef RAW_HAVE_IO_URING
+   std::vector<struct iovec> iov(count);
+   unsigned i;
+
+   if (_ring == NULL) {
+      return;
+   }
+   if (!_ring->registered.empty()) {
+      syscall(__NR_io_uring_register, _ring->fd,
+              IORING_UNREGISTER_BUFFERS, NULL, 0);
+      _ring->registered.clear();
+   }
+   for (i = 0; i < count; i++) {
+      iov[i].iov_base = bufs[i];
+      iov[i].iov_len = size;
+   }
+   if (count > 0 &&
+       syscall(__NR_io_uring_register, _ring->fd, IORING_REGISTER_BUFFERS,
+               &iov[0], count) == 0) {
+      _ring->registered.swap(iov);
+   }
+#endif
+}
+
+
+void
+RawImage::Queue(const Request &req)   // IN
+{
+   unsigned slot;
+
+   if (_fd < 0 || Full()) {
+      throw VixDiskError("Raw image request queue is full", __FILE__,
+                         __LINE__);
+   }
+   slot = _freeSlots.back();
+   _freeSlots.pop_back();
+   _slots[slot] = req;
+   _queue.push_back(slot);
+   _queued++;
+}
+
+
+void
+RawImage::QueueWrite(const uint8 *buf,    // IN
+                     size_t len,          // IN
+                     uint64 offset,       // IN
+                     void *tag)           // IN
+{
+   Request req = { (uint8 *)buf, len, offset, tag, true };
+
+   Queue(req);
+}
+
+
+void
+RawImage::QueueRead(uint8 *buf,       // IN
+                    size_t len,       // IN
+                    uint64 offset,    // IN
+                    void *tag)        // IN
+{
+   Request req = { buf, len, offset, tag, false };
+
+   Queue(req);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RawImage::Submit --
+ *
+ *      Starts the queued requests: with one io_uring_enter for all of
+ *      them, or one preadv/pwritev each without a ring. Requests that
+ *      O_DIRECT cannot do (not RAW_DIRECT_ALIGN aligned, like the tail
+ *      of an odd sized disk) are done right away through the buffered
+ *      descriptor.
+ *
+ * Results:
+ *      None. Throws VixDiskError if a synchronous request fails.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+RawImage::Submit(void)
+{
+   unsigned toSubmit = 0;
+   size_t i;
+
+   for (i = 0; i < _queue.size(); i++) {
+      unsigned slot = _queue[i];
+      Request &req = _slots[slot];
+
+      if (_ring == NULL || (_direct && !DirectAligned(req.buf, req.len,
+                                                      req.offset))) {
+         Request copy = req;
+
+         _freeSlots.push_back(slot);
+         _queue[i] = RAW_SLOT_DONE;
+         _queued--;
+         try {
+            DoSync(copy);
+         } catch (...) {
+            // Nothing queued after a failure is started.
+            for (i = 0; i < _queue.size(); i++) {
+               if (_queue[i] != RAW_SLOT_DONE) {
+                  _freeSlots.push_back(_queue[i]);
+               }
+            }
+            _queue.clear();
+            _queued = 0;
+            throw;
+         }
+         _doneTags.push_back(copy.tag);
+         _done++;
+         continue;
+      }
+#ifdef RAW_HAVE_IO_URING
+      {
+         unsigned tail = *_ring->sqTail + toSubmit;
+         unsigned index = tail & _ring->sqMask;
+         struct io_uring_sqe *sqe = &_ring->sqes[index];
+         size_t fixed;
+
+         memset(sqe, 0, sizeof *sqe);
+         for (fixed = 0; fixed < _ring->registered.size(); fixed++) {
+            uint8 *base = (uint8 *)_ring->registered[fixed].iov_base;
+
+            if (req.buf >= base &&
+                req.buf + req.len <= base + _ring->registered[fixed].iov_len) {
+               break;
+            }
+         }
+         if (fixed < _ring->registered.size()) {
+            sqe->opcode = req.write ? IORING_OP_WRITE_FIXED :
+                                      IORING_OP_READ_FIXED;
+            sqe->addr = (uintptr_t)req.buf;
+            sqe->len = req.len;
+            sqe->buf_index = fixed;
+         } else {
+            _ring->iov[slot].iov_base = req.buf;
+            _ring->iov[slot].iov_len = req.len;
+            sqe->opcode = req.write ? IORING_OP_WRITEV : IORING_OP_READV;
+            sqe->addr = (uintptr_t)&_ring->iov[slot];
+            sqe->len = 1;
+         }
+         sqe->fd = _fd;
+         sqe->off = req.offset;
+         sqe->user_data = slot;
+         _ring->sqArray[index] = index;
+         _queued--;
+         toSubmit++;
+      }
+#endif
+   }
+   _queue.clear();
+
+#ifdef RAW_HAVE_IO_URING
+   if (toSubmit > 0) {
+      __atomic_store_n(_ring->sqTail, *_ring->sqTail + toSubmit,
+                       __ATOMIC_RELEASE);
+      _inFlight += toSubmit;
+      while (toSubmit > 0) {
+         int ret = RingEnter(_ring->fd, toSubmit, 0, 0);
+
+         if (ret < 0) {
+            if (errno == EINTR) {
+               continue;
+            }
+            // The entries stay in the ring for the next enter.
+            if (errno == EAGAIN || errno == EBUSY) {
+               RingEnter(_ring->fd, 0, 1, IORING_ENTER_GETEVENTS);
+               continue;
+            }
+            RAW_THROW_ERRNO(errno);
+         }
+         toSubmit -= ret;
+      }
+   }
+#endif
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RawImage::Complete --
+ *
+ *      Waits for the next completed request. A short transfer is
+ *      finished synchronously.
+ *
+ * Results:
+ *      The request's tag, NULL if nothing is queued or in flight.
+ *      Throws VixDiskError if the request failed.
+ *
+ * Side effects:
+ *      Submits queued requests first if nothing else is pending.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void *
+RawImage::Complete(void)
+{
+   if (_done == 0 && _inFlight == 0 && _queued > 0) {
+      Submit();
+   }
+   if (_done > 0) {
+      void *tag = _doneTags.back();
+
+      _doneTags.pop_back();
+      _done--;
+      return tag;
+   }
+   if (_inFlight == 0) {
+      return NULL;
+   }
+
+#ifdef RAW_HAVE_IO_URING
+   {
+      unsigned head = *_ring->cqHead;
+      struct io_uring_cqe *cqe;
+      Request req;
+      unsigned slot;
+      int res;
+
+      while (head == __atomic_load_n(_ring->cqTail, __ATOMIC_ACQUIRE)) {
+         if (RingEnter(_ring->fd, 0, 1, IORING_ENTER_GETEVENTS) < 0 &&
+             errno != EINTR) {
+            RAW_THROW_ERRNO(errno);
+         }
+      }
+      cqe = &_ring->cqes[head & _ring->cqMask];
+      slot = (unsigned)cqe->user_data;
+      res = cqe->res;
+      __atomic_store_n(_ring->cqHead, head + 1, __ATOMIC_RELEASE);
+      _inFlight--;
+
+      req = _slots[slot];
+      _freeSlots.push_back(slot);
+      if (res < 0) {
+         RAW_THROW_ERRNO(-res);
+      }
+      if ((size_t)res < req.len) {
+         req.buf += res;
+         req.len -= res;
+         req.offset += res;
+         DoSync(req);
+      }
+      return req.tag;
+   }
+#else
+   return NULL;
+#endif
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RawImage::DoSync --
+ *
+ *      Does a request with preadv or pwritev, retrying short transfers.
+ *
+ * Results:
+ *      None. Throws VixDiskError on failure or at the end of the image.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+RawImage::DoSync(Request &req)   // IN
+{
+   int fd = _direct && !DirectAligned(req.buf, req.len, req.offset) ?
+            _bufferedFd : _fd;
+   uint8 *buf = req.buf;
+   size_t left = req.len;
+   uint64 offset = req.offset;
+
+   while (left > 0) {
+      int64 ret;
+
+#ifdef _WIN32
+      if (_lseeki64(fd, offset, SEEK_SET) < 0) {
+         RAW_THROW_ERRNO(errno);
+      }
+      ret = req.write ? _write(fd, buf, (unsigned)left) :
+                        _read(fd, buf, (unsigned)left);
+#else
+      struct iovec iov;
+
+      iov.iov_base = buf;
+      iov.iov_len = left;
+      ret = req.write ? pwritev(fd, &iov, 1, offset) :
+                        preadv(fd, &iov, 1, offset);
+#endif
+      if (ret < 0) {
+         if (errno == EINTR) {
+            continue;
+         }
+         RAW_THROW_ERRNO(errno);
+      }
+      if (ret == 0) {
+         throw VixDiskError("Unexpected end of the raw image", __FILE__,
+                            __LINE__);
+      }
+      buf += ret;
+      left -= ret;
+      offset += ret;
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RawImage::Zero --
+ *
+ *      Makes a range read as zeros. Nothing needs to be done in a file
+ *      created by OpenSink, where unwritten ranges are holes (or
+ *      unwritten extents once preallocated). Elsewhere the range is
+ *      punched out, or with preallocation zeroed in place so it keeps
+ *      its blocks; a block device punches by discarding or zeroing.
+ *      Zeros are written where neither is supported.
+ *
+ * Results:
+ *      None. Throws VixDiskError on failure.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+RawImage::Zero(uint64 offset,   // IN
+               uint64 len)      // IN
+{
+   if (len == 0 || _created) {
+      return;
+   }
+#ifdef __linux__
+   int mode = FALLOC_FL_KEEP_SIZE |
+              (_preallocated ? FALLOC_FL_ZERO_RANGE : FALLOC_FL_PUNCH_HOLE);
+
+   if (fallocate(_fd, mode, offset, len) == 0) {
+      return;
+   }
+   if (errno != EOPNOTSUPP && errno != ENOSYS && errno != EINVAL) {
+      RAW_THROW_ERRNO(errno);
+   }
+#endif
+   WriteZeros(offset, len);
+}
+
+
+void
+RawImage::WriteZeros(uint64 offset,   // IN
+                     uint64 len)      // IN
+{
+   if (_zeros == NULL) {
+#ifdef _WIN32
+      _zeros = (uint8 *)_aligned_malloc(RAW_ZERO_BUF_SIZE, RAW_DIRECT_ALIGN);
+#else
+      void *ptr;
+
+      _zeros = posix_memalign(&ptr, RAW_DIRECT_ALIGN, RAW_ZERO_BUF_SIZE) == 0 ?
+               (uint8 *)ptr : NULL;
+#endif
+      if (_zeros == NULL) {
+         throw std::bad_alloc();
+      }
+      memset(_zeros, 0, RAW_ZERO_BUF_SIZE);
+   }
+   while (len > 0) {
+      Request req = { _zeros, len < RAW_ZERO_BUF_SIZE ? (size_t)len :
+                                                         RAW_ZERO_BUF_SIZE,
+                      offset, NULL, true };
+
+      DoSync(req);
+      offset += req.len;
+      len -= req.len;
+   }
+}
+
+
+void
+RawImage::Sync(void)
+{
+#ifdef _WIN32
+   if (_commit(_fd) != 0) {
+#else
+   if (fsync(_fd) != 0) {
+#endif
+      RAW_THROW_ERRNO(errno);
+   }
+}
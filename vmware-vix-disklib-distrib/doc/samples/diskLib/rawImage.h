@@ -0,0 +1,116 @@
+/*
+ * rawImage.h --
+ *
+ *      Queued reads and writes of a raw disk image or block device. On
+ *      Linux the I/O goes through an io_uring with the caller's buffers
+ *      registered, so queueDepth requests are in flight at once; where
+ *      the kernel has no io_uring, each request is a preadv or pwritev
+ *      done when it is submitted. Files are opened O_DIRECT where the
+ *      file system allows it.
+ */
+
+#ifndef RAW_IMAGE_H
+#define RAW_IMAGE_H
+
+#include <stddef.h>
+#include <vector>
+
+#include "vixDiskLib.h"
+
+// Requests in flight at once unless the caller asks otherwise
+#define RAW_DEFAULT_QUEUE_DEPTH 32
+
+// Offsets and lengths of O_DIRECT requests are multiples of this;
+// others are done through a buffered descriptor
+#define RAW_DIRECT_ALIGN 4096
+
+struct RawRing;
+
+class RawImage
+{
+public:
+    RawImage();
+    ~RawImage() { Close(); }
+    RawImage(const RawImage &) = delete;
+    RawImage &operator=(const RawImage &) = delete;
+
+    // Opens path to write an image of size bytes. A block device must
+    // be at least that large; a regular file is created if missing and
+    // set to size, and with preallocate gets all its blocks up front.
+    // Throws VixDiskError on failure.
+    void OpenSink(const char *path, uint64 size, bool preallocate,
+                  unsigned queueDepth);
+    // Opens path, an image file or block device, to read.
+    void OpenSource(const char *path, unsigned queueDepth);
+    // The first range at or after offset that may hold data, as
+    // [*start, *end). False if there is none.
+    bool NextData(uint64 offset, uint64 *start, uint64 *end);
+    // Waits for the requests in flight, then closes.
+    void Close(void);
+
+    uint64 Size() const { return _size; }
+    bool IsDevice() const { return _isDevice; }
+    bool IsDirect() const { return _direct; }
+    bool IsPreallocated() const { return _preallocated; }
+    // "io_uring" or "pwritev"; valid once opened.
+    const char *Backend() const;
+
+    // Registers the buffers requests will use, count of size bytes
+    // each, so the ring need not map them on every request. Optional:
+    // other memory works too, and so does failing to register.
+    void RegisterBuffers(uint8 *const *bufs, unsigned count, size_t size);
+
+    // Queue a write or read of len bytes at offset, which completes
+    // with tag. At most queueDepth requests may be queued or in flight;
+    // Complete() makes room. Submit() starts the queued ones.
+    void QueueWrite(const uint8 *buf, size_t len, uint64 offset, void *tag);
+    void QueueRead(uint8 *buf, size_t len, uint64 offset, void *tag);
+    void Submit(void);
+    // Waits for a request to complete and returns its tag, NULL if none
+    // is in flight. Throws VixDiskError if it failed or was short.
+    void *Complete(void);
+    bool Full() const { return _queued + _inFlight + _done == _depth; }
+
+    // Makes [offset, offset + len) read as zeros: nothing to do in a
+    // file this RawImage created, a hole punched (or a zeroed range in
+    // a preallocated file) elsewhere, zeros written where the file
+    // system or device cannot do either.
+    void Zero(uint64 offset, uint64 len);
+    // Flushes what was written to stable storage.
+    void Sync(void);
+
+private:
+    struct Request {
+       uint8 *buf;
+       size_t len;
+       uint64 offset;
+       void *tag;
+       bool write;
+    };
+
+    void Open(const char *path, bool write, unsigned queueDepth);
+    void SetupRing(void);
+    void DoSync(Request &req);
+    void WriteZeros(uint64 offset, uint64 len);
+    void Queue(const Request &req);
+
+    int _fd;
+    int _bufferedFd;          // for unaligned requests with O_DIRECT
+    uint64 _size;
+    bool _isDevice;
+    bool _direct;
+    bool _preallocated;
+    bool _created;            // reads as zeros wherever not written
+    unsigned _depth;
+    RawRing *_ring;           // NULL without io_uring
+    std::vector<Request> _slots;
+    std::vector<unsigned> _freeSlots;
+    std::vector<unsigned> _queue;      // slots queued, not submitted
+    std::vector<void *> _doneTags;     // completed by the fallback
+    unsigned _queued;
+    unsigned _inFlight;
+    unsigned _done;
+    uint8 *_zeros;            // RAW_DIRECT_ALIGN-aligned, for WriteZeros
+};
+
+#endif // RAW_IMAGE_H
@@ -0,0 +1,842 @@
+/*
+ * vixDisk.cpp --
+ *
+ *      Move-only owners of VixDiskLib connections, disks and disk info.
+ *      Calls VixDiskLib directly, so a DYNAMIC_LOADING build of a
+ *      program using it must still link the library.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <chrono>
+
+#include "vixDisk.h"
+
+using std::string;
+
+#define VIX_POOL_FOREVER ((uint64)-1)
+
+
+static uint64
+PoolNowNsec(void)
+{
+   return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+
+// Entries idle since this time or earlier have been idle for idleSec.
+static uint64
+IdleCutoff(unsigned idleSec)   // IN
+{
+   uint64 now = PoolNowNsec();
+   uint64 idle = idleSec * 1000000000ULL;
+
+   return now > idle ? now - idle : 0;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VixDiskError::VixDiskError --
+ *
+ *      Records a VixDiskLib error code, or a description with the code
+ *      VIX_E_FAIL, and where it was thrown.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+VixDiskError::VixDiskError(VixError errCode,    // IN
+                           const char *file,    // IN
+                           int line)            // IN
+   : _errCode(errCode),
+     _resolved(false),
+     _file(file),
+     _line(line)
+{
+}
+
+
+VixDiskError::VixDiskError(const char *description,   // IN
+                           const char *file,          // IN
+                           int line)                  // IN
+   : _errCode(VIX_E_FAIL),
+     _desc(description),
+     _resolved(true),
+     _file(file),
+     _line(line)
+{
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VixDiskError::Resolve --
+ *
+ *      Looks up the library's text for the error code, the first time.
+ *      An error is meant to be examined by one thread at a time.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Sets _desc.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+VixDiskError::Resolve() const
+{
+   if (!_resolved) {
+      char *msg = VixDiskLib_GetErrorText(_errCode, NULL);
+
+      _desc = msg != NULL ? msg : "Unknown error";
+      VixDiskLib_FreeErrorText(msg);
+      _resolved = true;
+   }
+}
+
+
+string
+VixDiskError::Description() const
+{
+   Resolve();
+   return _desc;
+}
+
+
+const char *
+VixDiskError::what() const noexcept
+{
+   try {
+      Resolve();
+   } catch (...) {
+      return "VixDiskLib error";
+   }
+   return _desc.c_str();
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VixConnection::Connect --
+ * VixConnection::ConnectEx --
+ *
+ *      Connects with VixDiskLib_Connect or VixDiskLib_ConnectEx.
+ *
+ * Results:
+ *      The connection. Throws VixDiskError on failure.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+VixConnection
+VixConnection::Connect(const VixDiskLibConnectParams &params)   // IN
+{
+   VixDiskLibConnection connection = NULL;
+
+   VIX_DISK_CHECK(VixDiskLib_Connect(&params, &connection));
+   return VixConnection(connection);
+}
+
+
+VixConnection
+VixConnection::ConnectEx(const VixDiskLibConnectParams &params,   // IN
+                         bool readOnly,                           // IN
+                         const char *ssMoRef,                     // IN
+                         const char *transportModes)              // IN
+{
+   VixDiskLibConnection connection = NULL;
+
+   VIX_DISK_CHECK(VixDiskLib_ConnectEx(&params, readOnly, ssMoRef,
+                                       transportModes, &connection));
+   return VixConnection(connection);
+}
+
+
+VixConnection::VixConnection(VixConnection &&other)   // IN/OUT
+   : _connection(other._connection)
+{
+   other._connection = NULL;
+}
+
+
+VixConnection &
+VixConnection::operator=(VixConnection &&other)   // IN/OUT
+{
+   if (this != &other) {
+      Reset();
+      _connection = other._connection;
+      other._connection = NULL;
+   }
+   return *this;
+}
+
+
+VixDiskLibConnection
+VixConnection::Release(void)
+{
+   VixDiskLibConnection connection = _connection;
+
+   _connection = NULL;
+   return connection;
+}
+
+
+void
+VixConnection::Reset(void)
+{
+   if (_connection != NULL) {
+      VixDiskLib_Disconnect(_connection);
+      _connection = NULL;
+   }
+}
+
+
+VixDiskInfo &
+VixDiskInfo::operator=(VixDiskInfo &&other)   // IN/OUT
+{
+   if (this != &other) {
+      if (_info != NULL) {
+         VixDiskLib_FreeInfo(_info);
+      }
+      _info = other._info;
+      other._info = NULL;
+   }
+   return *this;
+}
+
+
+VixDiskInfo::~VixDiskInfo()
+{
+   if (_info != NULL) {
+      VixDiskLib_FreeInfo(_info);
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VixDisk::VixDisk --
+ *
+ *      Opens path on connection with the VIXDISKLIB_FLAG_OPEN_* flags.
+ *
+ * Results:
+ *      None. Throws VixDiskError on failure.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+VixDisk::VixDisk(VixDiskLibConnection connection,   // IN
+                 const char *path,                  // IN
+                 uint32 flags)                      // IN
+   : _handle(NULL)
+{
+   VIX_DISK_CHECK(VixDiskLib_Open(connection, path, flags, &_handle));
+}
+
+
+VixDisk &
+VixDisk::operator=(VixDisk &&other)   // IN/OUT
+{
+   if (this != &other) {
+      Close();
+      _handle = other._handle;
+      other._handle = NULL;
+   }
+   return *this;
+}
+
+
+const char *
+VixDisk::TransportMode() const
+{
+   return VixDiskLib_GetTransportMode(_handle);
+}
+
+
+VixDiskInfo
+VixDisk::Info() const
+{
+   VixDiskLibInfo *info = NULL;
+
+   VIX_DISK_CHECK(VixDiskLib_GetInfo(_handle, &info));
+   return VixDiskInfo(info);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VixDiskView::Read --
+ * VixDiskView::Write --
+ *
+ *      Reads or writes the sectors of buf at sector, with no copy on
+ *      this side of VixDiskLib.
+ *
+ * Results:
+ *      None. Throws VixDiskError on failure, or with VIX_E_INVALID_ARG
+ *      if buf does not hold whole sectors.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+VixDiskView::Read(VixDiskLibSectorType sector,   // IN
+                  VixByteSpan buf) const         // OUT
+{
+   if (buf.Size() % VIXDISKLIB_SECTOR_SIZE != 0) {
+      VIX_DISK_THROW(VIX_E_INVALID_ARG);
+   }
+   VIX_DISK_CHECK(VixDiskLib_Read(_handle, sector, buf.Sectors(),
+                                  buf.Data()));
+}
+
+
+void
+VixDiskView::Write(VixDiskLibSectorType sector,   // IN
+                   VixConstByteSpan buf) const    // IN
+{
+   if (buf.Size() % VIXDISKLIB_SECTOR_SIZE != 0) {
+      VIX_DISK_THROW(VIX_E_INVALID_ARG);
+   }
+   VIX_DISK_CHECK(VixDiskLib_Write(_handle, sector, buf.Sectors(),
+                                   buf.Data()));
+}
+
+
+VixDiskLibHandle
+VixDisk::Release(void)
+{
+   VixDiskLibHandle handle = _handle;
+
+   _handle = NULL;
+   return handle;
+}
+
+
+void
+VixDisk::Close(void)
+{
+   if (_handle != NULL) {
+      VixDiskLib_Close(_handle);
+      _handle = NULL;
+   }
+}
+
+
+VixPooledConnection::VixPooledConnection(
+   VixPooledConnection &&other)   // IN/OUT
+   : _pool(other._pool),
+     _entry(other._entry)
+{
+   other._entry = NULL;
+}
+
+
+VixPooledConnection &
+VixPooledConnection::operator=(VixPooledConnection &&other)   // IN/OUT
+{
+   if (this != &other) {
+      Reset();
+      _pool = other._pool;
+      _entry = other._entry;
+      other._entry = NULL;
+   }
+   return *this;
+}
+
+
+VixDiskLibConnection
+VixPooledConnection::Get() const
+{
+   return _entry != NULL ? _entry->connection : NULL;
+}
+
+
+void
+VixPooledConnection::Reset(void)
+{
+   if (_entry != NULL) {
+      _pool->Return(_entry);
+      _entry = NULL;
+   }
+}
+
+
+VixPooledDisk::VixPooledDisk(VixPooledDisk &&other)   // IN/OUT
+   : _pool(other._pool),
+     _entry(other._entry)
+{
+   other._entry = NULL;
+}
+
+
+VixPooledDisk &
+VixPooledDisk::operator=(VixPooledDisk &&other)   // IN/OUT
+{
+   if (this != &other) {
+      Reset();
+      _pool = other._pool;
+      _entry = other._entry;
+      other._entry = NULL;
+   }
+   return *this;
+}
+
+
+VixDiskLibHandle
+VixPooledDisk::Handle() const
+{
+   return _entry != NULL ? _entry->handle : NULL;
+}
+
+
+void
+VixPooledDisk::Reset(void)
+{
+   if (_entry != NULL) {
+      _pool->Return(_entry, false);
+      _entry = NULL;
+   }
+}
+
+
+void
+VixPooledDisk::Discard(void)
+{
+   if (_entry != NULL) {
+      _pool->Return(_entry, true);
+      _entry = NULL;
+   }
+}
+
+
+VixPool::VixPool(unsigned idleSec,           // IN
+                 unsigned maxPerDatastore)   // IN
+   : _idleSec(idleSec),
+     _maxPerDatastore(maxPerDatastore)
+{
+   memset(&_counters, 0, sizeof _counters);
+}
+
+
+void
+VixPool::SetLimits(unsigned idleSec,           // IN
+                   unsigned maxPerDatastore)   // IN
+{
+   std::lock_guard<std::mutex> guard(_lock);
+
+   _idleSec = idleSec;
+   _maxPerDatastore = maxPerDatastore;
+}
+
+
+VixPoolCounters
+VixPool::Counters(void)
+{
+   std::lock_guard<std::mutex> guard(_lock);
+
+   return _counters;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VixPool::Datastore --
+ *
+ *      Names the datastore of path for the per-datastore limit.
+ *
+ * Results:
+ *      "name" for a "[name] dir/disk.vmdk" path, "" for a local file.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+string
+VixPool::Datastore(const char *path)   // IN
+{
+   const char *end;
+
+   if (path[0] != '[' || (end = strchr(path, ']')) == NULL) {
+      return "";
+   }
+   return string(path + 1, end - path - 1);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VixPool::Connect --
+ *
+ *      Lends a connection made with the same parameters, making one
+ *      if there is none: with VixDiskLib_ConnectEx if ssMoRef or
+ *      transportModes is given, else with VixDiskLib_Connect (which
+ *      does not take readOnly).
+ *
+ * Results:
+ *      The connection. Throws VixDiskError if connecting fails.
+ *
+ * Side effects:
+ *      Closes what has been idle too long.
+ *
+ *----------------------------------------------------------------------
+ */
+
+VixPooledConnection
+VixPool::Connect(const VixDiskLibConnectParams &params,   // IN
+                 bool readOnly,                           // IN
+                 const char *ssMoRef,                     // IN
+                 const char *transportModes)              // IN
+{
+   std::unique_lock<std::mutex> lock(_lock);
+   VixDiskLibConnection connection = NULL;
+   VixError vixError;
+   char num[32];
+   string key;
+
+#define VIX_POOL_KEY(s) (key += (s) != NULL ? (s) : "", key += '\n')
+   VIX_POOL_KEY(params.vmxSpec);
+   VIX_POOL_KEY(params.serverName);
+   VIX_POOL_KEY(params.thumbPrint);
+   if (params.credType == VIXDISKLIB_CRED_UID) {
+      VIX_POOL_KEY(params.creds.uid.userName);
+      VIX_POOL_KEY(params.creds.uid.password);
+   } else if (params.credType == VIXDISKLIB_CRED_SESSIONID) {
+      VIX_POOL_KEY(params.creds.sessionId.cookie);
+      VIX_POOL_KEY(params.creds.sessionId.userName);
+      VIX_POOL_KEY(params.creds.sessionId.key);
+   }
+   VIX_POOL_KEY(ssMoRef);
+   VIX_POOL_KEY(transportModes);
+#undef VIX_POOL_KEY
+   // VixDiskLib_Connect has no readOnly to tell connections apart.
+   snprintf(num, sizeof num, "%d %u %d", (int)params.credType,
+            (unsigned)params.port,
+            readOnly && (ssMoRef != NULL || transportModes != NULL));
+   key += num;
+
+   if (_idleSec > 0) {
+      CloseIdle(IdleCutoff(_idleSec), lock);
+   }
+   for (std::list<VixPoolConnection>::iterator c = _connections.begin();
+        c != _connections.end(); ++c) {
+      if (c->key == key) {
+         c->users++;
+         _counters.connectHits++;
+         return VixPooledConnection(this, &*c);
+      }
+   }
+   _counters.connectMisses++;
+
+   lock.unlock();
+   if (ssMoRef != NULL || transportModes != NULL) {
+      vixError = VixDiskLib_ConnectEx(&params, readOnly, ssMoRef,
+                                      transportModes, &connection);
+   } else {
+      vixError = VixDiskLib_Connect(&params, &connection);
+   }
+   VIX_DISK_CHECK(vixError);
+   lock.lock();
+
+   VixPoolConnection entry = { key, connection, 1, 0 };
+   _connections.push_back(entry);
+   return VixPooledConnection(this, &_connections.back());
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VixPool::Open --
+ *
+ *      Lends an idle handle of path opened with flags on connection, or
+ *      opens one. Over the datastore limit, closes the handle of that
+ *      datastore idle the longest or, if none is idle, waits for one to
+ *      be returned (only if wait is set).
+ *
+ * Results:
+ *      The handle; not open if wait is not set and the datastore is at
+ *      its limit. Throws VixDiskError if opening fails.
+ *
+ * Side effects:
+ *      Closes what has been idle too long.
+ *
+ *----------------------------------------------------------------------
+ */
+
+VixPooledDisk
+VixPool::Open(const VixPooledConnection &connection,   // IN
+              const char *path,                        // IN
+              uint32 flags,                            // IN
+              bool wait)                               // IN
+{
+   VixPoolConnection *conn = connection._entry;
+   std::unique_lock<std::mutex> lock(_lock);
+   VixDiskLibHandle handle = NULL;
+   string datastore = Datastore(path);
+   bool waited = false;
+   VixError vixError;
+   char num[16];
+   string key;
+
+   snprintf(num, sizeof num, "\n%u\n", (unsigned)flags);
+   key = conn->key + num + path;
+
+   if (_idleSec > 0) {
+      CloseIdle(IdleCutoff(_idleSec), lock);
+   }
+   for (;;) {
+      std::list<VixPoolDisk>::iterator d, oldest = _disks.end();
+
+      for (d = _disks.begin(); d != _disks.end(); ++d) {
+         if (!d->lent && d->key == key) {
+            d->lent = true;
+            _counters.openHits++;
+            return VixPooledDisk(this, &*d);
+         }
+      }
+      if (_maxPerDatastore == 0 ||
+          _openPerDatastore[datastore] < _maxPerDatastore) {
+         break;
+      }
+      for (d = _disks.begin(); d != _disks.end(); ++d) {
+         if (!d->lent && d->datastore == datastore &&
+             (oldest == _disks.end() || d->idleSince < oldest->idleSince)) {
+            oldest = d;
+         }
+      }
+      if (oldest != _disks.end()) {
+         CloseDisk(oldest, lock);
+         continue;
+      }
+      if (!wait) {
+         return VixPooledDisk();
+      }
+      if (!waited) {
+         _counters.waits++;
+         waited = true;
+      }
+      _returned.wait(lock);
+   }
+   _counters.openMisses++;
+   _openPerDatastore[datastore]++;
+   conn->users++;
+
+   lock.unlock();
+   vixError = VixDiskLib_Open(conn->connection, path, flags, &handle);
+   lock.lock();
+
+   if (VIX_FAILED(vixError)) {
+      _openPerDatastore[datastore]--;
+      DropUser(conn);
+      _returned.notify_all();
+      VIX_DISK_THROW(vixError);
+   }
+   VixPoolDisk entry = { key, datastore, handle, conn, true, 0 };
+   _disks.push_back(entry);
+   return VixPooledDisk(this, &_disks.back());
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VixPool::Return --
+ *
+ *      Takes back a lent connection or handle. The handle is closed if
+ *      discard is set or nothing is kept idle.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Wakes up the opens waiting for the datastore limit.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+VixPool::Return(VixPoolConnection *entry)   // IN
+{
+   std::unique_lock<std::mutex> lock(_lock);
+
+   DropUser(entry);
+   if (_idleSec == 0) {
+      CloseIdle(VIX_POOL_FOREVER, lock);
+   }
+}
+
+
+void
+VixPool::Return(VixPoolDisk *entry,   // IN
+                bool discard)         // IN
+{
+   std::unique_lock<std::mutex> lock(_lock);
+
+   if (discard) {
+      std::list<VixPoolDisk>::iterator d;
+
+      for (d = _disks.begin(); &*d != entry; ++d) {
+      }
+      CloseDisk(d, lock);
+   } else {
+      entry->lent = false;
+      entry->idleSince = PoolNowNsec();
+      _returned.notify_all();
+      if (_idleSec == 0) {
+         CloseIdle(VIX_POOL_FOREVER, lock);
+      }
+   }
+}
+
+
+void
+VixPool::DropUser(VixPoolConnection *entry)   // IN
+{
+   if (--entry->users == 0) {
+      entry->idleSince = PoolNowNsec();
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VixPool::CloseDisk --
+ *
+ *      Closes a pooled handle that is not lent, with the lock released
+ *      for VixDiskLib_Close.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Wakes up the opens waiting for the datastore limit.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+VixPool::CloseDisk(std::list<VixPoolDisk>::iterator disk,   // IN
+                   std::unique_lock<std::mutex> &lock)      // IN
+{
+   VixDiskLibHandle handle = disk->handle;
+
+   _openPerDatastore[disk->datastore]--;
+   DropUser(disk->connection);
+   _disks.erase(disk);
+   lock.unlock();
+   VixDiskLib_Close(handle);
+   lock.lock();
+   _returned.notify_all();
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VixPool::CloseIdle --
+ *
+ *      Closes the handles, then the connections, idle since idleSince
+ *      or earlier, with the lock released for the VixDiskLib calls.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Wakes up the opens waiting for the datastore limit.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+VixPool::CloseIdle(uint64 idleSince,                      // IN
+                   std::unique_lock<std::mutex> &lock)   // IN
+{
+   std::vector<VixDiskLibHandle> handles;
+   std::vector<VixDiskLibConnection> connections;
+   std::list<VixPoolDisk>::iterator d;
+   std::list<VixPoolConnection>::iterator c;
+   size_t i;
+
+   for (d = _disks.begin(); d != _disks.end(); ) {
+      if (d->lent || d->idleSince > idleSince) {
+         ++d;
+         continue;
+      }
+      handles.push_back(d->handle);
+      _openPerDatastore[d->datastore]--;
+      DropUser(d->connection);
+      d = _disks.erase(d);
+   }
+   // A connection whose last handle just closed waits for the next
+   // time, unless everything idle goes.
+   for (c = _connections.begin(); c != _connections.end(); ) {
+      if (c->users != 0 || c->idleSince > idleSince) {
+         ++c;
+         continue;
+      }
+      connections.push_back(c->connection);
+      c = _connections.erase(c);
+   }
+   if (handles.empty() && connections.empty()) {
+      return;
+   }
+   _counters.closedIdle += handles.size() + connections.size();
+
+   lock.unlock();
+   for (i = 0; i < handles.size(); i++) {
+      VixDiskLib_Close(handles[i]);
+   }
+   for (i = 0; i < connections.size(); i++) {
+      VixDiskLib_Disconnect(connections[i]);
+   }
+   lock.lock();
+   _returned.notify_all();
+}
+
+
+void
+VixPool::Expire(void)
+{
+   std::unique_lock<std::mutex> lock(_lock);
+
+   if (_idleSec > 0) {
+      CloseIdle(IdleCutoff(_idleSec), lock);
+   }
+}
+
+
+void
+VixPool::Clear(void)
+{
+   std::unique_lock<std::mutex> lock(_lock);
+
+   CloseIdle(VIX_POOL_FOREVER, lock);
+}
@@ -0,0 +1,387 @@
+/*
+ * vixDisk.h --
+ *
+ *      Move-only owners of VixDiskLib connections, disks and disk info,
+ *      views of disks and sector buffers, and the exception thrown on
+ *      VixDiskLib errors. The types keep no state outside their
+ *      instances, so a program can own any number of connections and
+ *      disks at once. The sample's copies read and write through these
+ *      views under a per-job context; its benchmark, dump and export
+ *      paths still use raw handles and per-process options.
+ */
+
+#ifndef VIX_DISK_H
+#define VIX_DISK_H
+
+#include <stddef.h>
+#include <condition_variable>
+#include <exception>
+#include <list>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "vixDiskLib.h"
+
+#define VIX_DISK_THROW(vixError) \
+   throw VixDiskError((vixError), __FILE__, __LINE__)
+
+#define VIX_DISK_CHECK(vixError)                                     \
+   do {                                                              \
+      VixError _vixError = (vixError);                               \
+      if (VIX_FAILED(_vixError)) {                                   \
+         VIX_DISK_THROW(_vixError);                                  \
+      }                                                              \
+   } while (0)
+
+
+// A failed VixDiskLib call, or a failure described by the caller. The
+// library's text for the error code is only looked up, once, when
+// Description() is called: throwing and catching costs no allocation.
+// file should be a string literal such as __FILE__.
+
+class VixDiskError : public std::exception
+{
+public:
+    VixDiskError(VixError errCode, const char *file, int line);
+    VixDiskError(const char *description, const char *file, int line);
+
+    std::string Description() const;
+    VixError ErrorCode() const { return _errCode; }
+    std::string File() const { return _file; }
+    int Line() const { return _line; }
+    const char *what() const noexcept;
+
+private:
+    void Resolve() const;
+
+    VixError _errCode;
+    mutable std::string _desc;
+    mutable bool _resolved;
+    const char *_file;
+    int _line;
+};
+
+
+// Views of caller-owned memory holding whole sectors, for reads and
+// writes without copying. A view does not own or free its data.
+
+class VixByteSpan
+{
+public:
+    VixByteSpan(uint8 *data, size_t size) : _data(data), _size(size) {}
+    VixByteSpan(std::vector<uint8> &v)
+       : _data(v.empty() ? NULL : &v[0]), _size(v.size()) {}
+
+    uint8 *Data() const { return _data; }
+    size_t Size() const { return _size; }
+    VixDiskLibSectorType Sectors() const
+    {
+       return _size / VIXDISKLIB_SECTOR_SIZE;
+    }
+    // The sectors [first, first + count) of the view.
+    VixByteSpan Sub(VixDiskLibSectorType first,
+                    VixDiskLibSectorType count) const
+    {
+       return VixByteSpan(_data + first * VIXDISKLIB_SECTOR_SIZE,
+                          count * VIXDISKLIB_SECTOR_SIZE);
+    }
+
+private:
+    uint8 *_data;
+    size_t _size;
+};
+
+class VixConstByteSpan
+{
+public:
+    VixConstByteSpan(const uint8 *data, size_t size)
+       : _data(data), _size(size) {}
+    VixConstByteSpan(const std::vector<uint8> &v)
+       : _data(v.empty() ? NULL : &v[0]), _size(v.size()) {}
+    VixConstByteSpan(const VixByteSpan &span)
+       : _data(span.Data()), _size(span.Size()) {}
+
+    const uint8 *Data() const { return _data; }
+    size_t Size() const { return _size; }
+    VixDiskLibSectorType Sectors() const
+    {
+       return _size / VIXDISKLIB_SECTOR_SIZE;
+    }
+    VixConstByteSpan Sub(VixDiskLibSectorType first,
+                         VixDiskLibSectorType count) const
+    {
+       return VixConstByteSpan(_data + first * VIXDISKLIB_SECTOR_SIZE,
+                               count * VIXDISKLIB_SECTOR_SIZE);
+    }
+
+private:
+    const uint8 *_data;
+    size_t _size;
+};
+
+
+// A VixDiskLib connection, disconnected when the owner goes away.
+
+class VixConnection
+{
+public:
+    VixConnection() : _connection(NULL) {}
+    // Takes ownership of connection.
+    explicit VixConnection(VixDiskLibConnection connection)
+       : _connection(connection) {}
+    VixConnection(VixConnection &&other);
+    VixConnection &operator=(VixConnection &&other);
+    VixConnection(const VixConnection &) = delete;
+    VixConnection &operator=(const VixConnection &) = delete;
+    ~VixConnection() { Reset(); }
+
+    // Connect to params (all zero for local disks) or throw.
+    static VixConnection Connect(const VixDiskLibConnectParams &params);
+    static VixConnection ConnectEx(const VixDiskLibConnectParams &params,
+                                   bool readOnly, const char *ssMoRef,
+                                   const char *transportModes);
+
+    VixDiskLibConnection Get() const { return _connection; }
+    bool IsOpen() const { return _connection != NULL; }
+    // Gives up ownership without disconnecting.
+    VixDiskLibConnection Release();
+    void Reset(void);
+
+private:
+    VixDiskLibConnection _connection;
+};
+
+
+// The VixDiskLibInfo of a disk, freed when the owner goes away.
+
+class VixDiskInfo
+{
+public:
+    VixDiskInfo() : _info(NULL) {}
+    explicit VixDiskInfo(VixDiskLibInfo *info) : _info(info) {}
+    VixDiskInfo(VixDiskInfo &&other) : _info(other._info)
+    {
+       other._info = NULL;
+    }
+    VixDiskInfo &operator=(VixDiskInfo &&other);
+    VixDiskInfo(const VixDiskInfo &) = delete;
+    VixDiskInfo &operator=(const VixDiskInfo &) = delete;
+    ~VixDiskInfo();
+
+    const VixDiskLibInfo *Get() const { return _info; }
+    const VixDiskLibInfo *operator->() const { return _info; }
+
+private:
+    VixDiskLibInfo *_info;
+};
+
+
+// A disk handle owned by someone else (a VixDisk, a VixPooledDisk or
+// the caller), for reads and writes without taking ownership. Copying a
+// view copies the handle only.
+
+class VixDiskView
+{
+public:
+    explicit VixDiskView(VixDiskLibHandle handle) : _handle(handle) {}
+
+    VixDiskLibHandle Handle() const { return _handle; }
+
+    // Read or write buf.Sectors() sectors at sector, straight from and to
+    // the caller's memory. buf must hold whole sectors.
+    void Read(VixDiskLibSectorType sector, VixByteSpan buf) const;
+    void Write(VixDiskLibSectorType sector, VixConstByteSpan buf) const;
+
+private:
+    VixDiskLibHandle _handle;
+};
+
+
+// An open disk, closed when the owner goes away. Moving a VixDisk moves
+// the handle, so a handle is closed exactly once.
+
+class VixDisk
+{
+public:
+    VixDisk() : _handle(NULL) {}
+    // Opens path on connection or throws.
+    VixDisk(VixDiskLibConnection connection, const char *path, uint32 flags);
+    VixDisk(const VixConnection &connection, const char *path, uint32 flags)
+       : VixDisk(connection.Get(), path, flags) {}
+    // Takes ownership of handle.
+    explicit VixDisk(VixDiskLibHandle handle) : _handle(handle) {}
+    VixDisk(VixDisk &&other) : _handle(other._handle)
+    {
+       other._handle = NULL;
+    }
+    VixDisk &operator=(VixDisk &&other);
+    VixDisk(const VixDisk &) = delete;
+    VixDisk &operator=(const VixDisk &) = delete;
+    ~VixDisk() { Close(); }
+
+    VixDiskLibHandle Handle() const { return _handle; }
+    VixDiskView View() const { return VixDiskView(_handle); }
+    bool IsOpen() const { return _handle != NULL; }
+    const char *TransportMode() const;
+    VixDiskInfo Info() const;
+
+    // As VixDiskView::Read and Write.
+    void Read(VixDiskLibSectorType sector, VixByteSpan buf) const
+    {
+       View().Read(sector, buf);
+    }
+    void Write(VixDiskLibSectorType sector, VixConstByteSpan buf) const
+    {
+       View().Write(sector, buf);
+    }
+
+    // Gives up ownership without closing.
+    VixDiskLibHandle Release();
+    void Close(void);
+
+private:
+    VixDiskLibHandle _handle;
+};
+
+
+// Connections and open disks kept for reuse, so that a job that needs a
+// disk another job just used (or that it opened itself to look at) does
+// not pay the connect and open latency again, which is hundreds of
+// milliseconds with remote transports. Connections are keyed by their
+// connect parameters and transport modes and shared by any number of
+// users. Disk handles are keyed by connection, path and open flags and
+// lent to one user at a time. Entries unused for idleSec are closed.
+// At most maxPerDatastore handles, lent or idle, are open on one
+// datastore (the "[name]" a remote path starts with; local files share
+// one); an open over the limit closes an idle handle there or waits.
+
+class VixPool;
+
+struct VixPoolConnection {
+   std::string key;
+   VixDiskLibConnection connection;
+   unsigned users;       // lent connections and pooled handles
+   uint64 idleSince;     // when users dropped to 0
+};
+
+struct VixPoolDisk {
+   std::string key;
+   std::string datastore;
+   VixDiskLibHandle handle;
+   VixPoolConnection *connection;
+   bool lent;
+   uint64 idleSince;     // when it was last returned
+};
+
+struct VixPoolCounters {
+   uint64 connectHits;
+   uint64 connectMisses;
+   uint64 openHits;
+   uint64 openMisses;
+   uint64 waits;         // opens that had to wait for the limit
+   uint64 closedIdle;    // handles and connections closed when idle
+};
+
+// A connection lent by a VixPool, returned when the owner goes away.
+class VixPooledConnection
+{
+public:
+    VixPooledConnection() : _pool(NULL), _entry(NULL) {}
+    VixPooledConnection(VixPooledConnection &&other);
+    VixPooledConnection &operator=(VixPooledConnection &&other);
+    VixPooledConnection(const VixPooledConnection &) = delete;
+    VixPooledConnection &operator=(const VixPooledConnection &) = delete;
+    ~VixPooledConnection() { Reset(); }
+
+    VixDiskLibConnection Get() const;
+    bool IsOpen() const { return _entry != NULL; }
+    void Reset(void);
+
+private:
+    friend class VixPool;
+    VixPooledConnection(VixPool *pool, VixPoolConnection *entry)
+       : _pool(pool), _entry(entry) {}
+
+    VixPool *_pool;
+    VixPoolConnection *_entry;
+};
+
+// A disk handle lent by a VixPool, returned when the owner goes away.
+class VixPooledDisk
+{
+public:
+    VixPooledDisk() : _pool(NULL), _entry(NULL) {}
+    VixPooledDisk(VixPooledDisk &&other);
+    VixPooledDisk &operator=(VixPooledDisk &&other);
+    VixPooledDisk(const VixPooledDisk &) = delete;
+    VixPooledDisk &operator=(const VixPooledDisk &) = delete;
+    ~VixPooledDisk() { Reset(); }
+
+    VixDiskLibHandle Handle() const;
+    VixDiskView View() const { return VixDiskView(Handle()); }
+    bool IsOpen() const { return _entry != NULL; }
+    // Returns the handle to the pool.
+    void Reset(void);
+    // Closes the handle instead, e.g. after an error on it.
+    void Discard(void);
+
+private:
+    friend class VixPool;
+    VixPooledDisk(VixPool *pool, VixPoolDisk *entry)
+       : _pool(pool), _entry(entry) {}
+
+    VixPool *_pool;
+    VixPoolDisk *_entry;
+};
+
+class VixPool
+{
+public:
+    VixPool(unsigned idleSec = 30, unsigned maxPerDatastore = 0);
+    // Everything lent must have been returned.
+    ~VixPool() { Clear(); }
+
+    void SetLimits(unsigned idleSec, unsigned maxPerDatastore);
+
+    // Throw VixDiskError if a new connection or handle fails. Without
+    // wait, Open returns a handle that is not open instead of waiting
+    // for the datastore limit.
+    VixPooledConnection Connect(const VixDiskLibConnectParams &params,
+                                bool readOnly = false,
+                                const char *ssMoRef = NULL,
+                                const char *transportModes = NULL);
+    VixPooledDisk Open(const VixPooledConnection &connection,
+                       const char *path, uint32 flags, bool wait = true);
+
+    // Closes what has been idle for idleSec; Clear closes all idle.
+    // The library must still be initialized.
+    void Expire(void);
+    void Clear(void);
+
+    VixPoolCounters Counters(void);
+    static std::string Datastore(const char *path);
+
+private:
+    friend class VixPooledConnection;
+    friend class VixPooledDisk;
+
+    void Return(VixPoolConnection *entry);
+    void Return(VixPoolDisk *entry, bool discard);
+    void CloseIdle(uint64 idleSince, std::unique_lock<std::mutex> &lock);
+    void CloseDisk(std::list<VixPoolDisk>::iterator disk,
+                   std::unique_lock<std::mutex> &lock);
+    void DropUser(VixPoolConnection *entry);
+
+    std::mutex _lock;
+    std::condition_variable _returned;
+    std::list<VixPoolConnection> _connections;
+    std::list<VixPoolDisk> _disks;
+    std::map<std::string, unsigned> _openPerDatastore;
+    unsigned _idleSec;
+    unsigned _maxPerDatastore;
+    VixPoolCounters _counters;
+};
+
+#endif // VIX_DISK_H
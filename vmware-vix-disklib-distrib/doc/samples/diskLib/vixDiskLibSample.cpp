@@ -12,21 +12,54 @@
 #include <windows.h>
 #include <tchar.h>
 #include <process.h>
+#include <io.h>
 #else
 #include <dlfcn.h>
-#include <sys/time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #endif
 
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/stat.h>
+
 #include <time.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <iostream>
 #include <iomanip>
 #include <sstream>
 #include <string>
 #include <vector>
 #include <stdexcept>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <unordered_set>
+#include <algorithm>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <emmintrin.h>
+#include <immintrin.h>
+#define HAVE_X86_SIMD 1
+#endif
+
+#include <zlib.h>
 
 #include "vixDiskLib.h"
+#include "ddfsIndex.h"
+#include "ioArena.h"
+#include "rawImage.h"
+#include "vixDisk.h"
 
 using std::cout;
 using std::string;
@@ -45,6 +78,12 @@ using std::vector;
 #define COMMAND_CLONE           (1 << 9)
 #define COMMAND_READBENCH       (1 << 10)
 #define COMMAND_WRITEBENCH      (1 << 11)
+#define COMMAND_COPY            (1 << 12)
+#define COMMAND_ESTIMATE_DEDUP  (1 << 13)
+#define COMMAND_EXPORT          (1 << 14)
+#define COMMAND_DAEMON          (1 << 15)
+#define COMMAND_STATS           (1 << 16)
+#define COMMAND_IMPORT          (1 << 17)
 
 #define VIXDISKLIB_VERSION_MAJOR 5
 #define VIXDISKLIB_VERSION_MINOR 0
@@ -52,34 +91,243 @@ using std::vector;
 // Default buffer size (in sectors) for read/write benchmarks
 #define DEFAULT_BUFSIZE 128
 
+// Default chunk size (in sectors) for copy operations (1MByte)
+#define DEFAULT_CHUNKSIZE 2048
+
+// Granularity (in sectors) of zero detection when copying to a sparse
+// disk; matches the 64KByte grain size of sparse vmdks
+#define ZERO_CHECK_SECTORS 128
+
+// Hex dump layout: DUMP_LINE_BYTES bytes per line, each line is
+// "oooo : " + "xx " per byte + "  " + one character per byte + '\n',
+// and every sector is followed by an empty line
+#define DUMP_LINE_BYTES 16
+#define DUMP_LINE_TEXT (7 + 4 * DUMP_LINE_BYTES + 2 + 1)
+#define DUMP_SECTOR_TEXT \
+   (VIXDISKLIB_SECTOR_SIZE / DUMP_LINE_BYTES * DUMP_LINE_TEXT + 1)
+
+// Number of read buffers in flight between -dump's reader and formatter
+#define DUMP_NUM_BUFFERS 4
+
+// Grain size (in sectors) and grain table length of the streamOptimized
+// images written by -export, the values VMware products use
+#define STREAM_GRAIN_SECTORS 128
+#define STREAM_GTES_PER_GT 512
+
+// Default chunk size (in sectors) of copy manifests; 128KBytes, the
+// ddumbfs block_size
+#define DEFAULT_HASHCHUNK 256
+
+#define SHA1_HASH_SIZE 20
+
+// Block sizes -estimate-dedup can evaluate, those mkddumbfs accepts:
+// bit n of a size mask stands for (1 << n) KBytes
+#define ESTIMATE_MIN_KB 4
+#define ESTIMATE_MAX_KB 128
+#define DEFAULT_ESTIMATE_SIZES (0x3f << 2)   // 4, 8, ... 128 KBytes
+
 // Print updated statistics for read/write benchmarks roughly every
 // BUFS_PER_STAT sectors (current value is 64MBytes worth of data)
 #define BUFS_PER_STAT (128 * 1024)
 
+class Manifest;
+class HashPool;
+class DedupCheckStage;
+class VerifyStage;
+class CopyJournal;
+class DedupEstimator;
+
 // Per-thread information for multi-threaded VixDiskLib test.
 struct ThreadData {
    std::string dstDisk;
-   VixDiskLibHandle srcHandle;
+   VixPooledDisk src;
+   VixDiskLibHandle srcHandle;   // src.Handle()
+   VixDiskLibHandle dstHandle;
+   VixDiskLibSectorType numSectors;
+   Manifest *manifest;   // set for the one copy that fills the manifest
+   HashPool *hashPool;
+};
+
+// Shared state of a parallel copy of one disk. Workers take the next
+// unclaimed chunk from nextChunk until the sector range is exhausted.
+struct ParallelCopyJob {
+   VixDiskLibSectorType numSectors;
+   VixDiskLibSectorType chunkSize;
+   std::atomic<uint64> nextChunk;
+   std::atomic<bool> failed;
+   std::mutex writeLock;
+   Manifest *manifest;
+   CopyJournal *journal;
+};
+
+// A chunk of an -import: numSectors sectors from startSector, of which
+// the image holds len bytes (less at its end if not whole sectors).
+struct ImportChunk {
+   VixDiskLibSectorType startSector;
+   VixDiskLibSectorType numSectors;
+   uint64 len;
+};
+
+// Shared state of -import. Workers claim the chunks of the allocated
+// ranges of the image from nextChunk, like a parallel copy.
+struct ImportJob {
+   const char *rawPath;
    VixDiskLibHandle dstHandle;
+   VixDiskLibSectorType chunkSize;
+   vector<ImportChunk> chunks;
+   std::atomic<uint64> nextChunk;
+   std::atomic<bool> failed;
+   std::mutex writeLock;
+};
+
+// Per-worker information for -import.
+struct ImportWorker {
+   ImportJob *job;
+   uint64 chunksTaken;
+   VixDiskLibSectorType sectorsRead;
+   VixDiskLibSectorType sectorsWritten;
+};
+
+// Contents written by -fill.
+enum FillPattern {
+   FILL_BYTE,     // every byte is -val
+   FILL_SECTOR,   // every 64-bit word holds its sector number
+   FILL_RANDOM    // pseudo-random, reproducible from -seed
+};
+
+// Shared state of a -fill (or its -verify pass) split into chunks that
+// workers claim like a parallel copy. Mismatches are only counted when
+// verifying.
+struct FillJob {
+   VixDiskLibSectorType startSector;
    VixDiskLibSectorType numSectors;
+   VixDiskLibSectorType chunkSize;
+   bool verify;
+   std::atomic<uint64> nextChunk;
+   std::atomic<bool> failed;
+   std::mutex writeLock;
+   std::atomic<uint64> mismatches;
+   std::atomic<uint64> firstMismatch;
+};
+
+// Per-worker information for a fill or verify.
+struct FillWorker {
+   FillJob *job;
+   VixDiskLibHandle handle;
+   bool sharedHandle;
+   VixDiskLibSectorType sectorsDone;
+};
+
+// Access patterns of the read/write benchmarks.
+enum BenchPattern {
+   PATTERN_SEQ,
+   PATTERN_RAND,
+   PATTERN_MIXED
+};
+
+// Output formats of job statistics.
+enum StatsFormat {
+   STATS_TEXT,
+   STATS_JSON,
+   STATS_CSV
+};
+
+// Progress of a clone, for turning percentages into statistics.
+struct CloneProgress {
+   VixDiskLibSectorType capacity;
+   VixDiskLibSectorType reported;
+   uint64 start;
+   uint64 last;
+};
+
+// Shared state of -estimate-dedup. The chunks of all disks are numbered
+// one disk after the other (disk i starts at firstChunk[i]) and workers
+// claim them like a parallel copy.
+struct EstimateJob {
+   vector<VixDiskLibSectorType> capacities;
+   vector<uint64> firstChunk;
+   uint64 numChunks;
+   VixDiskLibSectorType chunkSize;
+   std::atomic<uint64> nextChunk;
+   std::atomic<bool> failed;
+   std::atomic<uint64> sectorsRead;
+   std::atomic<unsigned> workersDone;
+   DedupEstimator *estimator;
+   HashPool *hashPool;
+};
+
+// Per-worker information for -estimate-dedup: a read-only handle on
+// every disk of the job and a chunk buffer.
+struct EstimateWorker {
+   EstimateJob *job;
+   vector<VixDiskLibHandle> handles;
+   uint8 *buf;
+};
+
+// Per-worker information for a parallel copy.
+struct ParallelCopyWorker {
+   ParallelCopyJob *job;
+   VixDiskLibHandle srcHandle;
+   VixDiskLibHandle dstHandle;
+   bool sharedDst;
+   uint64 chunksTaken;
+   VixDiskLibSectorType sectorsCopied;
+   VixDiskLibSectorType sectorsSkipped;
 };
 
 
 static struct {
     int command;
     VixDiskLibAdapterType adapterType;
+    VixDiskLibDiskType diskType;
     char *transportModes;
     char *diskPath;
     char *parentPath;
     char *metaKey;
     char *metaVal;
     int filler;
+    FillPattern fillPattern;
+    uint64 fillSeed;
+    bool verify;
     unsigned mbSize;
     VixDiskLibSectorType numSectors;
     VixDiskLibSectorType startSector;
     VixDiskLibSectorType bufSize;
+    VixDiskLibSectorType chunkSize;
     uint32 openFlags;
     unsigned numThreads;
+    unsigned numBuffers;
+    BenchPattern pattern;
+    unsigned readPct;
+    unsigned queueDepth;
+    StatsFormat statsFormat;
+    char *statsFile;
+    FILE *statsOut;
+    const char *statsTransport;
+    char *manifestPath;
+    char *recordPath;
+    char *ddfsDir;
+    char *verifyRecord;
+    bool resume;
+    bool toRaw;
+    bool preallocate;
+    double maxMbps;
+    double maxIops;
+    char *limitFile;
+    unsigned maxJobs;
+    char *liveStatsDir;
+    char *prometheusSocket;
+    unsigned poolIdleSec;
+    unsigned poolMax;
+    unsigned arenaMb;
+    bool hugePages;
+    char *diskList;
+    uint32 estimateSizes;   // bit n: (1 << n) KByte blocks
+    unsigned sampleRate;
+    unsigned compressThreads;
+    int compressLevel;
+    VixDiskLibSectorType hashChunk;
+    unsigned hashThreads;
     Bool success;
     Bool isRemote;
     char *host;
@@ -88,6 +336,7 @@ static struct {
     char *thumbPrint;
     int port;
     char *srcPath;
+    char *rawPath;
     VixDiskLibConnection connection;
     char *vmxSpec;
     bool useInitEx;
@@ -108,17 +357,59 @@ static void DoInfo(void);
 static void DoTestMultiThread(void);
 static void DoClone(void);
 static int BitCount(int number);
-static void DumpBytes(const uint8 *buf, size_t n, int step);
+static bool IsZeroBuffer(const uint8 *buf, size_t len);
+static VixDiskLibSectorType MarkZeroGrains(const uint8 *buf,
+                                           VixDiskLibSectorType startSector,
+                                           VixDiskLibSectorType numSectors,
+                                           vector<uint8> &zeroGrains);
+static VixDiskLibSectorType WriteGrains(VixDiskView dst,
+                                        VixDiskLibSectorType startSector,
+                                        VixDiskLibSectorType numSectors,
+                                        const uint8 *buf,
+                                        const uint8 *skipGrains,
+                                        std::mutex *writeLock);
+static void LockedWrite(VixDiskView dst,
+                        VixDiskLibSectorType startSector,
+                        VixDiskLibSectorType numSectors,
+                        const uint8 *buf, std::mutex *writeLock);
 static void DoRWBench(bool read);
+static void DoCopy(void);
+static void DoCopyToRaw(void);
+static void DoEstimateDedup(void);
+static void DoExport(void);
+static void DoImport(void);
+static VixDiskLibDiskType ParseDiskType(const char *name);
+static void DoDaemon(void);
+static uint64 NowNsec(void);
+static string DiskUuid(VixDiskLibHandle handle, const VixDiskLibInfo *info);
+static void SaveManifest(const Manifest &manifest);
+static bool IncrementalCopy(VixDiskLibHandle srcHandle,
+                            VixDiskLibConnection dstConnection,
+                            const VixDiskLibCreateParams &createParams,
+                            Manifest &record, Manifest &current,
+                            HashPool &hashPool, DedupCheckStage *dedup,
+                            VerifyStage *verify);
+static bool OpenStats(void);
+static void CloseStats(void);
+static void PrintPoolCounters(void);
+static void PrintArenaCounters(void);
+static uint8 *AllocAligned(size_t size);
+static void FreeAligned(uint8 *ptr);
+static void OpenLiveStats(void);
+static void CloseLiveStats(void);
+static int DoStats(void);
+static const char *CommandName(void);
+static void PrintStat(const char *op, uint64 start, uint64 end,
+                      VixDiskLibSectorType numSectors);
 
 
 #define THROW_ERROR(vixError) \
-   throw VixDiskLibErrWrapper((vixError), __FILE__, __LINE__)
+   throw VixDiskError((vixError), __FILE__, __LINE__)
 
 #define CHECK_AND_THROW(vixError)                                    \
    do {                                                              \
       if (VIX_FAILED((vixError))) {                                  \
-         throw VixDiskLibErrWrapper((vixError), __FILE__, __LINE__); \
+         throw VixDiskError((vixError), __FILE__, __LINE__);         \
       }                                                              \
    } while (0)
 
@@ -450,18 +741,16 @@ DynLoadDiskLib(void)
 
 
 
-#ifdef _WIN32
-
 /*
  *----------------------------------------------------------------------
  *
- * gettimeofday --
+ * NowNsec --
  *
- *      Mimics BSD style gettimeofday in a way that is close enough
- *      for some I/O benchmarking.
+ *      Reads the monotonic high-resolution clock used for all timings,
+ *      so they are not disturbed by wall clock adjustments.
  *
  * Results:
- *      None.
+ *      Nanoseconds since an arbitrary fixed point.
  *
  * Side effects:
  *      None.
@@ -469,18 +758,13 @@ DynLoadDiskLib(void)
  *----------------------------------------------------------------------
  */
 
-static void
-gettimeofday(struct timeval *tv,
-             void *)
+static uint64
+NowNsec(void)
 {
-   uint64 ticks = GetTickCount();
-
-   tv->tv_sec = ticks / 1000;
-   tv->tv_usec = 1000 * (ticks % 1000);
+   return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch()).count();
 }
 
-#endif
-
 
 /*
  *--------------------------------------------------------------------------
@@ -557,67 +841,719 @@ PanicFunc(const char *fmt, va_list args)
 typedef void (VixDiskLibGenericLogFunc)(const char *fmt, va_list args);
 
 
-// Wrapper class for VixDiskLib disk objects.
+/*
+ *----------------------------------------------------------------------
+ *
+ * OpenDisk --
+ *
+ *      Opens path on connection and tells which transport mode is used.
+ *
+ * Results:
+ *      The disk. Throws VixDiskError on failure.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static VixDisk
+OpenDisk(VixDiskLibConnection connection,   // IN
+         const char *path,                  // IN
+         uint32 flags)                      // IN
+{
+   VixDisk disk(connection, path, flags);
+
+   printf("Disk \"%s\" is open using transport mode \"%s\".\n",
+          path, disk.TransportMode());
+   return disk;
+}
+
+
+// Connections and open disks reused by the jobs of the process, limited
+// by -pool-idle and -pool-max. appConnection is the connection given on
+// the command line (local by default), appGlobals.connection its handle.
+static VixPool diskPool;
+static VixPooledConnection appConnection;
+
+
+// The I/O buffers of every job, from a slab of -arena-mb, with huge
+// pages if -huge-pages.
+static IoArena ioArena;
+
 
-class VixDiskLibErrWrapper
+// Bandwidth and IOPS limits shared by all the threads of a job, as token
+// buckets. Each bucket is a virtual clock: taking tokens moves it ahead
+// by the time they take to refill, and a caller whose turn lies in the
+// future sleeps until then. An idle bucket fills up to LIMIT_BURST_MSEC
+// worth of tokens. Taking is a compare-and-swap per limit, and a single
+// load when there is no limit, so threads never queue on a lock. A
+// control file, if set, is re-read when it changes (checked once a
+// second) or when RequestReload() is called from a SIGHUP handler.
+
+#define LIMIT_BURST_MSEC   100
+#define LIMIT_CHECK_MSEC   1000
+
+class RateLimiter
 {
 public:
-    explicit VixDiskLibErrWrapper(VixError errCode, const char* file, int line)
-          :
-          _errCode(errCode),
-          _file(file),
-          _line(line)
-    {
-        char* msg = VixDiskLib_GetErrorText(errCode, NULL);
-        _desc = msg;
-        VixDiskLib_FreeErrorText(msg);
-    }
+    RateLimiter();
 
-    VixDiskLibErrWrapper(const char* description, const char* file, int line)
-          :
-         _errCode(VIX_E_FAIL),
-         _desc(description),
-         _file(file),
-         _line(line)
-    {
-    }
+    // Limits in MB/s and I/Os per second, 0 meaning no limit.
+    void SetLimits(double mbps, double iops);
+    // The file holds "max-mbps n" and "max-iops n" lines that replace
+    // the limits given to SetLimits while it exists.
+    void SetControlFile(const char *path) { _controlFile = path; }
+    void RequestReload() { _reload = true; }
 
-    string Description() const { return _desc; }
-    VixError ErrorCode() const { return _errCode; }
-    string File() const { return _file; }
-    int Line() const { return _line; }
+    // Waits until numBytes bytes in numOps I/Os are within the limits.
+    void Acquire(uint64 numBytes, uint64 numOps);
 
 private:
-    VixError _errCode;
-    string _desc;
-    string _file;
-    int _line;
+    void Apply(double mbps, double iops);
+    void CheckControlFile(uint64 now);
+    static uint64 Take(std::atomic<uint64> &clock, uint64 cost, uint64 now);
+
+    std::atomic<uint64> _psecPerByte;   // 0 if unlimited
+    std::atomic<uint64> _nsecPerOp;
+    std::atomic<uint64> _byteClock;
+    std::atomic<uint64> _opClock;
+    double _mbps;                       // as given to SetLimits
+    double _iops;
+    const char *_controlFile;
+    time_t _controlMtime;               // 0 while the file is not used
+    std::atomic<uint64> _nextCheck;
+    std::atomic<bool> _reload;
+    std::mutex _controlLock;
+};
+
+static RateLimiter rateLimiter;
+
+
+// Live statistics of the jobs of a process, in a file mapped shared
+// (under /dev/shm by default) so that 'vix-disklib-sample -stats' can
+// watch a job while it runs, like ddumbfs' /.ddumbfs/stats. A process
+// has one block with a slot per job: one for a plain command, one per
+// running job of -daemon. Workers update the counters with relaxed
+// atomic adds, which cost next to nothing; a reader may see the fields
+// of a slot from slightly different moments.
+
+#define LIVE_STATS_MAGIC    "VDLKSTA1"
+#define LIVE_STATS_VERSION  1
+#define LIVE_STATS_SLOTS    16
+#define LIVE_STATS_PREFIX   "vix-disklib-sample."
+#define LIVE_STATS_SUFFIX   ".stats"
+
+// Longest wait for a -prometheus client to send or receive
+#define PROMETHEUS_TIMEOUT_SEC 2
+
+struct LiveJobStats {
+   std::atomic<uint32> active;       // set last when a slot is claimed
+   std::atomic<uint32> errors;
+   std::atomic<uint64> startTime;    // nsec since the epoch
+   std::atomic<uint64> totalBytes;   // 0 if unknown
+   std::atomic<uint64> bytesRead;
+   std::atomic<uint64> bytesWritten;
+   std::atomic<uint64> bytesSkipped;
+   std::atomic<uint64> readOps;
+   std::atomic<uint64> writeOps;
+   std::atomic<uint64> queueDepth;   // buffers read but not yet written
+   char name[64];
+   char src[256];
+   char dst[256];
+};
+
+struct LiveStatsBlock {
+   char magic[8];
+   uint32 version;
+   uint32 numSlots;
+   uint64 pid;
+   LiveJobStats slots[LIVE_STATS_SLOTS];
+};
+
+// Slot of the command being run, NULL if there is no block.
+static LiveJobStats *liveStats;
+static LiveStatsBlock *liveBlock;
+static string liveBlockPath;
+static std::mutex liveSlotLock;   // claiming and releasing slots
+
+static inline void
+LiveAdd(std::atomic<uint64> &counter,   // IN/OUT
+        uint64 n)                       // IN
+{
+   counter.fetch_add(n, std::memory_order_relaxed);
+}
+
+static inline void
+LiveError(LiveJobStats *stats)   // IN: may be NULL
+{
+   if (stats != NULL) {
+      stats->errors.fetch_add(1, std::memory_order_relaxed);
+   }
+}
+
+static LiveJobStats *ClaimLiveSlot(const char *name, const char *src,
+                                   const char *dst);
+static void ReleaseLiveSlot(LiveJobStats *slot);
+
+
+// What one copy job runs under. CopyEngine and CopyPipeline take their
+// limits, statistics, chunk size and flags from here rather than from
+// appGlobals, so jobs with their own contexts do not share state.
+
+struct CopyContext {
+   RateLimiter *limiter;           // budget of the source reads
+   LiveJobStats *stats;            // counts the I/O if not NULL
+   VixDiskLibSectorType chunkSize;
+   bool skipZero;                  // CopyEngine only; pipelines use a
+                                   // ZeroCheckStage
+   bool printProgress;
 };
 
-class VixDisk
+// A context for a copy run by this process' command: the process-wide
+// limits and live statistics slot, and -chunk.
+static inline CopyContext
+CommandCopyContext(bool skipZero,        // IN
+                   bool printProgress)   // IN
+{
+   CopyContext context;
+
+   context.limiter = &rateLimiter;
+   context.stats = liveStats;
+   context.chunkSize = appGlobals.chunkSize;
+   context.skipZero = skipZero;
+   context.printProgress = printProgress;
+   return context;
+}
+
+
+// Chunked copy engine: moves a sector range between two open disks
+// using one reusable buffer of context.chunkSize sectors. With
+// context.skipZero set, all-zero grains are not written, leaving holes
+// in a sparse target.
+
+class CopyEngine
 {
 public:
+    explicit CopyEngine(const CopyContext &context);
+    ~CopyEngine() { FreeAligned(_buf); }
+    CopyEngine(const CopyEngine &) = delete;
+    CopyEngine &operator=(const CopyEngine &) = delete;
 
-    VixDiskLibHandle Handle() { return _handle; }
-    VixDisk(VixDiskLibConnection connection, char *path, uint32 flags)
+    void Copy(VixDiskView src,
+              VixDiskView dst,
+              VixDiskLibSectorType startSector,
+              VixDiskLibSectorType numSectors);
+
+    // Serializes writes when dst is shared with other engines.
+    void SetWriteLock(std::mutex *writeLock) { _writeLock = writeLock; }
+
+    // Hashes every chunk read into manifest, on hashPool if not NULL.
+    void SetManifest(Manifest *manifest, HashPool *hashPool)
     {
-       _handle = NULL;
-       VixError vixError = VixDiskLib_Open(connection, path, flags, &_handle);
-       CHECK_AND_THROW(vixError);
-       printf("Disk \"%s\" is open using transport mode \"%s\".\n",
-              path, VixDiskLib_GetTransportMode(_handle));
+       _manifest = manifest;
+       _hashPool = hashPool;
     }
 
-    ~VixDisk()
+    // Leaves out the chunks done in journal and marks the ones copied.
+    void SetJournal(CopyJournal *journal) { _journal = journal; }
+
+    VixDiskLibSectorType SectorsCopied() const { return _sectorsCopied; }
+    VixDiskLibSectorType SectorsSkipped() const { return _sectorsSkipped; }
+
+private:
+    void WriteNonZero(VixDiskView dst,
+                      VixDiskLibSectorType startSector,
+                      VixDiskLibSectorType numSectors);
+
+    RateLimiter *_limiter;
+    VixDiskLibSectorType _chunkSize;
+    bool _skipZero;
+    bool _printProgress;
+    uint8 *_buf;
+    vector<uint8> _zeroGrains;
+    std::mutex *_writeLock;
+    Manifest *_manifest;
+    HashPool *_hashPool;
+    CopyJournal *_journal;
+    LiveJobStats *_stats;
+    VixDiskLibSectorType _sectorsCopied;
+    VixDiskLibSectorType _sectorsSkipped;
+};
+
+
+// Bounded lock-free queue for exactly one producer and one consumer
+// thread. Push() and Pop() wait (spinning, then sleeping) until there is
+// room or an item, or until abort becomes true.
+
+template <typename T>
+class SpscRing
+{
+public:
+    explicit SpscRing(size_t capacity);
+
+    bool TryPush(const T &item);
+    bool TryPop(T &item);
+    bool Push(const T &item, const std::atomic<bool> &abort);
+    bool Pop(T &item, const std::atomic<bool> &abort);
+
+private:
+    vector<T> _slots;
+    size_t _mask;
+    alignas(64) std::atomic<size_t> _head;   // next slot to pop
+    alignas(64) std::atomic<size_t> _tail;   // next slot to push
+};
+
+
+// One in-flight chunk of a pipelined copy. A buffer with numSectors == 0
+// marks the end of the stream.
+struct PipelineBuffer {
+   uint8 *data;
+   VixDiskLibSectorType startSector;
+   VixDiskLibSectorType numSectors;
+   bool grainsMarked;
+   vector<uint8> skipGrains;   // grains the writer leaves out, filled in
+                               // by ZeroCheckStage and DeltaStage
+};
+
+
+// Processing step between the reader and the writer of a pipeline.
+// Each stage runs on its own thread.
+
+class PipelineStage
+{
+public:
+    virtual ~PipelineStage() {}
+    virtual void Process(PipelineBuffer *buf) = 0;
+};
+
+
+// Flags the all-zero grains of each buffer so the writer skips them.
+
+class ZeroCheckStage : public PipelineStage
+{
+public:
+    ZeroCheckStage() : _sectorsSkipped(0) {}
+    virtual void Process(PipelineBuffer *buf);
+    VixDiskLibSectorType SectorsSkipped() const { return _sectorsSkipped; }
+
+private:
+    VixDiskLibSectorType _sectorsSkipped;
+};
+
+
+// On-disk layout of a copy manifest: this header, then numChunks hashes
+// of hashSize bytes at hashOffset, then a bitmap at bitmapOffset with a
+// bit set for every chunk that was hashed (a benchmark may skip some).
+// Chunk i covers sectors [i * chunkSectors, (i + 1) * chunkSectors) of
+// the disk, the last chunk may be shorter. Integers are little endian
+// and all offsets are fixed, so readers can simply mmap the file.
+
+#define MANIFEST_MAGIC      "VDLKMAN1"
+#define MANIFEST_VERSION    1
+#define MANIFEST_HASH_SHA1  1
+
+struct ManifestHeader {
+   char magic[8];
+   uint32 version;
+   uint32 hashType;
+   uint32 hashSize;
+   uint32 chunkSectors;
+   uint64 capacity;          // in sectors
+   uint64 numChunks;
+   uint64 hashOffset;
+   uint64 bitmapOffset;
+   char uuid[64];            // disk uuid, NUL terminated
+   uint8 reserved[8];
+};
+
+
+// Per-chunk SHA-1 hashes of a disk, collected while a copy or benchmark
+// reads it. Different chunks may be hashed from different threads.
+
+class Manifest
+{
+public:
+    Manifest(const string &uuid, VixDiskLibSectorType capacity,
+             VixDiskLibSectorType chunkSectors);
+
+    // Hashes the whole chunks within a buffer read from startSector.
+    void HashRange(const uint8 *buf, VixDiskLibSectorType startSector,
+                   VixDiskLibSectorType numSectors, HashPool *pool);
+    void Save(const char *path) const;
+    // Reads a manifest saved for the same disk, chunk size and capacity.
+    bool Load(const char *path);
+
+    // Whether chunk was hashed in both manifests with the same result.
+    bool SameChunk(const Manifest &other, uint64 chunk) const;
+
+    VixDiskLibSectorType ChunkSectors() const { return _chunkSectors; }
+    uint64 NumChunks() const { return _hashed.size(); }
+    uint64 ChunksHashed() const;
+    const string &Uuid() const { return _uuid; }
+    // Hash of chunk, NULL if the chunk was not hashed.
+    const uint8 *ChunkHash(uint64 chunk) const
     {
-        if (_handle) {
-           VixDiskLib_Close(_handle);
-        }
-        _handle = NULL;
+       return chunk < _hashed.size() && _hashed[chunk] ?
+              &_hashes[chunk * SHA1_HASH_SIZE] : NULL;
     }
 
 private:
-    VixDiskLibHandle _handle;
+    string _uuid;
+    VixDiskLibSectorType _capacity;
+    VixDiskLibSectorType _chunkSectors;
+    vector<uint8> _hashes;
+    vector<uint8> _hashed;   // one byte per chunk, packed on Save
+    std::mutex _allocLock;   // first HashRange allocates the tables
+};
+
+
+// On-disk layout of a copy journal: this header, then a bitmap at
+// bitmapOffset with a bit set for every chunk of chunkSectors sectors
+// that has been copied. Integers are little endian, like a manifest.
+
+#define JOURNAL_MAGIC      "VDLKJRN1"
+#define JOURNAL_VERSION    1
+#define JOURNAL_SYNC_MSEC  1000
+
+struct JournalHeader {
+   char magic[8];
+   uint32 version;
+   uint32 chunkSectors;
+   uint64 capacity;          // in sectors
+   uint64 numChunks;
+   uint64 bitmapOffset;
+   char srcUuid[64];         // NUL terminated
+   char dstUuid[64];
+   uint8 reserved[8];
+};
+
+
+// Chunks of a copy that are known to be on the target, so that -resume
+// can leave them out after a failure. Copies mark each chunk once it is
+// written, from any thread. Marking only sets a bit in memory; at most
+// every JOURNAL_SYNC_MSEC the changed part of the bitmap is copied, the
+// target file is fsync()ed and then the copy is written and fsync()ed,
+// so a crash loses at most that much work and a chunk is never recorded
+// before its data. The fsyncs run outside the bitmap lock, so marking
+// and IsDone() do not wait for them.
+
+class CopyJournal
+{
+public:
+    explicit CopyJournal(const string &path);
+    ~CopyJournal();
+
+    // Starts a new journal for a copy into the disk file dataPath.
+    void Create(const char *dataPath, const string &srcUuid,
+                const string &dstUuid, VixDiskLibSectorType capacity,
+                VixDiskLibSectorType chunkSectors);
+    // Reopens the journal of an interrupted copy of the same disks.
+    bool Open(const char *dataPath, const string &srcUuid,
+              const string &dstUuid, VixDiskLibSectorType capacity,
+              VixDiskLibSectorType chunkSectors);
+    // Deletes the journal of a completed copy.
+    void Remove(void);
+
+    bool IsDone(VixDiskLibSectorType sector) const;
+    void Mark(VixDiskLibSectorType startSector,
+              VixDiskLibSectorType numSectors);
+    void Sync(void);
+
+    uint64 NumChunks() const { return _numChunks; }
+    uint64 ChunksDone() const { return _chunksDone; }
+    VixDiskLibSectorType FirstIncomplete() const;
+
+private:
+    void DoSync(void);
+    void Close(void);
+
+    string _path;
+    FILE *_file;
+    int _dataFd;
+    VixDiskLibSectorType _capacity;
+    VixDiskLibSectorType _chunkSectors;
+    uint64 _numChunks;
+    uint64 _bitmapOffset;
+    vector<uint8> _bitmap;
+    size_t _dirtyStart;      // byte range of _bitmap not yet written
+    size_t _dirtyEnd;
+    uint64 _lastSync;
+    std::atomic<uint64> _chunksDone;
+    mutable std::mutex _lock;   // _bitmap, _dirtyStart/End and _lastSync
+    std::mutex _syncLock;       // one DoSync at a time, on _file
+};
+
+
+// Fills a Manifest from the buffers of a pipelined copy, spreading the
+// chunks of each buffer over the threads of a HashPool.
+
+class HashStage : public PipelineStage
+{
+public:
+    HashStage(Manifest *manifest, HashPool *pool)
+       : _manifest(manifest), _pool(pool) {}
+    virtual void Process(PipelineBuffer *buf);
+
+private:
+    Manifest *_manifest;
+    HashPool *_pool;
+};
+
+
+// Incremental copy into an existing image: hashes each buffer into the
+// current manifest and flags the grains of chunks whose hash is the same
+// in the record of the previous run, so the writer leaves them out.
+
+class DeltaStage : public PipelineStage
+{
+public:
+    DeltaStage(const Manifest *record, Manifest *current, HashPool *pool)
+       : _record(record), _current(current), _pool(pool),
+         _chunksChanged(0), _chunksUnchanged(0) {}
+    virtual void Process(PipelineBuffer *buf);
+
+    uint64 ChunksChanged() const { return _chunksChanged; }
+    uint64 ChunksUnchanged() const { return _chunksUnchanged; }
+
+private:
+    const Manifest *_record;   // NULL if there is none
+    Manifest *_current;
+    HashPool *_pool;
+    uint64 _chunksChanged;
+    uint64 _chunksUnchanged;
+};
+
+
+// Looks up every ddumbfs block of each buffer in a DdfsIndex and counts
+// the bytes ddumbfs would not have to store: all-zero blocks and blocks
+// it already has. Blocks whose grains the writer skips entirely are
+// counted as skipped instead, since they never reach the filesystem.
+
+class DedupCheckStage : public PipelineStage
+{
+public:
+    DedupCheckStage(const DdfsIndex *index, HashPool *pool);
+    virtual void Process(PipelineBuffer *buf);
+
+    uint64 BytesChecked() const { return _bytesChecked; }
+    uint64 BytesSkipped() const { return _bytesSkipped; }
+    uint64 BytesZero() const { return _bytesZero; }
+    uint64 BytesKnown() const { return _bytesKnown; }
+
+private:
+    const DdfsIndex *_index;
+    HashPool *_pool;
+    VixDiskLibSectorType _blockSectors;
+    uint64 _bytesChecked;
+    uint64 _bytesSkipped;
+    uint64 _bytesZero;
+    uint64 _bytesKnown;
+};
+
+
+// Checks a copy while it runs: after the writer has written a buffer,
+// re-reads the chunks it wrote from the target and compares their hashes
+// with the source hashes an earlier stage put into the manifest. Chunks
+// left out entirely (zero or unchanged) are not read back. The target
+// should be opened unbuffered, so the data comes from the disk and not
+// from the host cache. Run by CopyPipeline after its writer, not as one
+// of its stages.
+
+class VerifyStage : public PipelineStage
+{
+public:
+    VerifyStage(const Manifest *source, HashPool *pool);
+    ~VerifyStage();
+
+    // Reads back through dstHandle, serialized with the writer by lock.
+    void SetTarget(VixDiskLibHandle dstHandle, std::mutex *lock,
+                   VixDiskLibSectorType chunkSize);
+    virtual void Process(PipelineBuffer *buf);
+
+    uint64 ChunksVerified() const { return _chunksVerified; }
+    uint64 ChunksMismatched() const { return _chunksMismatched; }
+    uint64 ChunksUnwritten() const { return _chunksUnwritten; }
+    VixDiskLibSectorType FirstMismatch() const { return _firstMismatch; }
+    VixDiskLibSectorType SectorsReread() const { return _sectorsReread; }
+
+private:
+    void CheckRun(VixDiskLibSectorType startSector,
+                  VixDiskLibSectorType numSectors);
+
+    const Manifest *_source;
+    HashPool *_pool;
+    VixDiskLibHandle _dstHandle;
+    std::mutex *_lock;
+    uint8 *_readBuf;
+    uint64 _chunksVerified;
+    uint64 _chunksMismatched;
+    uint64 _chunksUnwritten;
+    VixDiskLibSectorType _firstMismatch;
+    VixDiskLibSectorType _sectorsReread;
+};
+
+
+// Pipelined copy: a reader thread fills buffers from a fixed pool of
+// page-aligned buffers, optional stages process them in order, and the
+// calling thread writes them out. Stages hand buffers to each other
+// through SpscRings; the writer returns them to the reader the same way.
+
+// Estimates how well a set of disks would deduplicate for several block
+// sizes in one pass. Blocks of the smallest size are hashed with SHA-1;
+// a larger block is identified by the SHA-1 of the digests of the
+// smallest blocks it consists of, so the data itself is hashed only
+// once. Zero blocks are counted apart. With a sample rate of n, only
+// blocks whose fingerprint is a multiple of n are remembered: copies of
+// a block are sampled or not alike, so the ratio stays unbiased while
+// the memory shrinks n times.
+
+class DedupEstimator
+{
+public:
+    DedupEstimator(uint32 sizeMask, unsigned sampleRate);
+
+    // Adds len bytes read at a multiple of the largest block size. A
+    // partial block at the end of a disk counts as unique data.
+    void Add(const uint8 *buf, size_t len, HashPool *pool);
+    void Print(FILE *out, unsigned numDisks, uint64 elapsed) const;
+
+private:
+    struct Level {
+       uint32 blockSize;
+       uint64 blocks;          // non-zero full blocks
+       uint64 zeroBlocks;
+       uint64 sampled;         // non-zero blocks sampled
+       uint64 partialBytes;
+       std::unordered_set<uint64> seen;
+    };
+
+    vector<Level> _levels;
+    unsigned _sampleRate;
+    uint8 _zeroDigest[SHA1_HASH_SIZE];
+    uint64 _bytes;
+    std::mutex _lock;
+};
+
+
+class CopyPipeline
+{
+public:
+    CopyPipeline(const CopyContext &context, unsigned numBuffers);
+    ~CopyPipeline();
+
+    // Stages are run in the order added and are not owned.
+    void AddStage(PipelineStage *stage) { _stages.push_back(stage); }
+    // Checks each buffer on its own thread once it has been written.
+    void SetVerifyStage(VerifyStage *stage) { _verifyStage = stage; }
+    // Leaves out the chunks done in journal and marks the ones copied,
+    // after the verify stage if there is one. Buffers must start on a
+    // journal chunk.
+    void SetJournal(CopyJournal *journal) { _journal = journal; }
+
+    void Copy(VixDiskView src,
+              VixDiskView dst,
+              VixDiskLibSectorType startSector,
+              VixDiskLibSectorType numSectors);
+
+    VixDiskLibSectorType SectorsCopied() const { return _sectorsCopied; }
+    VixDiskLibSectorType SectorsWritten() const { return _sectorsWritten; }
+
+    // Thread bodies, public only for the thread entry points.
+    void RunReader(void);
+    void RunStage(size_t index);
+    void RunVerify(void);
+
+private:
+    void Fail(VixError vixError);
+
+    RateLimiter *_limiter;
+    VixDiskLibSectorType _chunkSize;
+    bool _printProgress;
+    vector<PipelineBuffer> _buffers;
+    PipelineBuffer _endMarker;
+    vector<PipelineStage *> _stages;
+    vector<SpscRing<PipelineBuffer *> *> _rings;   // reader->stages->writer
+    SpscRing<PipelineBuffer *> *_freeRing;         // writer->reader
+    VerifyStage *_verifyStage;
+    CopyJournal *_journal;
+    LiveJobStats *_stats;
+    SpscRing<PipelineBuffer *> *_verifyRing;       // writer->verify
+    std::mutex _dstLock;                           // with _verifyStage
+    VixDiskView _src;
+    VixDiskLibSectorType _startSector;
+    VixDiskLibSectorType _numSectors;
+    VixDiskLibSectorType _sectorsCopied;
+    VixDiskLibSectorType _sectorsWritten;
+    std::atomic<bool> _failed;
+    VixError _error;
+    std::mutex _errorLock;
+};
+
+
+// Latency histogram with logarithmic buckets: LAT_SUB_BUCKETS buckets
+// per power of two nanoseconds, so a percentile is within 12.5% of the
+// true value. Adding a sample is a few instructions and no allocation.
+
+#define LAT_SUB_BITS     3
+#define LAT_SUB_BUCKETS  (1 << LAT_SUB_BITS)
+#define LAT_NUM_BUCKETS  (64 * LAT_SUB_BUCKETS)
+
+class LatencyHistogram
+{
+public:
+    LatencyHistogram();
+
+    void Add(uint64 nsec) { _counts[Bucket(nsec)]++; _count++; }
+    void Merge(const LatencyHistogram &other);
+    uint64 Count() const { return _count; }
+    uint64 Percentile(double pct) const;
+
+private:
+    static unsigned Bucket(uint64 nsec);
+    static uint64 BucketValue(unsigned bucket);
+
+    uint64 _counts[LAT_NUM_BUCKETS];
+    uint64 _count;
+};
+
+
+static void PrintTotalStat(const char *op, uint64 start, uint64 end,
+                           VixDiskLibSectorType numSectors, uint64 numOps,
+                           const LatencyHistogram *readLatency,
+                           const LatencyHistogram *writeLatency);
+static void PrintCopyTotal(uint64 start, uint64 end,
+                           VixDiskLibSectorType numSectors,
+                           VixDiskLibSectorType copied);
+
+
+// Shared state of a read/write benchmark run by queueDepth workers.
+struct BenchJob {
+   BenchPattern pattern;
+   bool read;                         // seq/rand: read or write only
+   unsigned readPct;                  // mixed: percentage of reads
+   VixDiskLibSectorType bufSize;
+   uint64 maxOps;
+   const uint8 *writeBuf;
+   std::mutex *handleLock;            // set if workers share one handle
+   Manifest *manifest;                // hashes what is read, if set
+   std::atomic<uint64> nextOp;
+   std::atomic<uint64> sectorsDone;
+   std::atomic<uint64> zeroBytes;     // read buffers that were all zero
+   std::atomic<unsigned> running;
+   std::atomic<bool> failed;
+   VixError error;
+};
+
+// Per-worker information for a read/write benchmark.
+struct BenchWorker {
+   BenchJob *job;
+   VixDiskLibHandle handle;
+   uint64 seed;
+   uint64 reads;
+   uint64 writes;
+   LatencyHistogram readLatency;
+   LatencyHistogram writeLatency;
 };
 
 
@@ -642,33 +1578,156 @@ PrintUsage(void)
 {
     printf("Usage: vixdisklibsample.exe command [options] diskPath\n");
     printf("commands:\n");
-    printf(" -create : creates a sparse virtual disk with capacity "
+    printf(" -create : creates a virtual disk of -disktype with capacity "
            "specified by -cap\n");
     printf(" -redo parentPath : creates a redo log 'diskPath' "
            "for base disk 'parentPath'\n");
     printf(" -info : displays information for specified virtual disk\n");
     printf(" -dump : dumps the contents of specified range of sectors "
            "in hexadecimal\n");
-    printf(" -fill : fills specified range of sectors with byte value "
-           "specified by -val\n");
+    printf(" -fill : fills specified range of sectors with the pattern "
+           "specified by -fillpattern\n");
     printf(" -wmeta key value : writes (key,value) entry into disk's metadata table\n");
     printf(" -rmeta key : displays the value of the specified metada entry\n");
     printf(" -meta : dumps all entries of the disk's metadata\n");
     printf(" -clone sourcePath : clone source vmdk possibly to a remote site\n");
+    printf(" -copy sourcePath : copies source disk to a new local disk diskPath\n");
+    printf(" -import rawPath : creates diskPath of -disktype from a raw "
+           "image or block\n");
+    printf("device, writing only its allocated ranges with -threads "
+           "workers\n");
+    printf(" -export sourcePath : writes source disk to diskPath as a "
+           "compressed\n");
+    printf("streamOptimized vmdk, compressing on -zthreads threads\n");
+    printf(" -daemon : runs the copy jobs queued in the spool directory "
+           "diskPath, -jobs\n");
+    printf("at a time under one -max-mbps/-max-iops budget, largest disk "
+           "first, and\n");
+    printf("keeps their state in diskPath/status\n");
+    printf(" -stats : shows the running jobs whose live statistics are in "
+           "the directory\n");
+    printf("diskPath (e.g. /dev/shm): bytes, MB/s, ETA, queue depth and "
+           "errors\n");
     printf(" -readbench blocksize: Does a read benchmark on a disk using the \n");
     printf("specified I/O block size (in sectors).\n");
     printf(" -writebench blocksize: Does a write benchmark on a disk using the\n");
     printf("specified I/O block size (in sectors). WARNING: This will\n");
     printf("overwrite the contents of the disk specified.\n");
+    printf(" -pattern seq|rand|mixed:readpct : access pattern for benchmarks "
+           "(default=seq,\n");
+    printf("mixed requires -writebench)\n");
+    printf(" -qd n : number of outstanding benchmark I/Os, each on its own "
+           "handle (default=1),\n");
+    printf("or of raw image requests with -to-raw (default=%u)\n",
+           RAW_DEFAULT_QUEUE_DEPTH);
+    printf(" -manifest path : with 'copy/multithread/readbench', writes the "
+           "SHA-1 of every\n");
+    printf("chunk of the source disk to path\n");
+    printf(" -hashchunk n : manifest chunk size in sectors (default=256)\n");
+    printf(" -ddfs parentdir : with 'copy', looks up each block in the index "
+           "of the ddumbfs\n");
+    printf("in parentdir and reports the bytes it already stores, exactly "
+           "with -to-raw and\n");
+    printf("as an estimate for a sparse vmdk target\n");
+    printf(" -incremental record : with 'copy', updates an existing target "
+           "by writing only\n");
+    printf("the chunks whose hash differs from the manifest in record, then "
+           "updates record\n");
+    printf(" -estimate-dedup : reads diskPath and the -disklist disks once "
+           "and estimates\n");
+    printf("their ddumbfs dedup ratio for each -blocksizes size\n");
+    printf(" -disklist file : with 'estimate-dedup', also reads the disks "
+           "listed in file,\n");
+    printf("one path per line\n");
+    printf(" -blocksizes list : comma separated block sizes in KB for "
+           "'estimate-dedup',\n");
+    printf("powers of two from 4 to 128 (default=4,8,16,32,64,128)\n");
+    printf(" -sample n : with 'estimate-dedup', remembers only 1 in n "
+           "block hashes to bound\n");
+    printf("memory (default=1)\n");
+    printf(" -zthreads n : threads compressing an 'export' "
+           "(default=number of CPUs)\n");
+    printf(" -zlevel n : zlib compression level of 'export', 1-9 "
+           "(default=6)\n");
+    printf(" -hashthreads n : threads hashing a pipelined copy or "
+           "'estimate-dedup'\n");
+    printf("(default=number of CPUs)\n");
+    printf(" -stats-format text|json|csv : format of bench/copy/clone "
+           "statistics (default=text)\n");
+    printf(" -stats-file path : append statistics to path instead of "
+           "stdout\n");
+    printf("(json and csv records go to stderr without -stats-file)\n");
+    printf(" -stats-dir dir : directory of this process' live statistics "
+           "for 'stats'\n");
+    printf("(default=/dev/shm)\n");
+    printf(" -prometheus socketPath : with 'stats', serves them in the "
+           "Prometheus text\n");
+    printf("format over HTTP on a Unix socket\n");
     printf("options:\n");
     printf(" -adapter [ide|scsi] : bus adapter type for 'create' option "
            "(default='scsi')\n");
     printf(" -start n : start sector for 'dump/fill' options (default=0)\n");
     printf(" -count n : number of sectors for 'dump/fill' options (default=1)\n");
+    printf(" -raw path : with -dump, writes the raw sector contents to path "
+           "instead of a hex dump\n");
     printf(" -val byte : byte value to fill with for 'write' option (default=255)\n");
+    printf(" -fillpattern byte|sector|random : 'fill' contents: the -val byte, "
+           "the sector\n");
+    printf("number in every 64-bit word, or pseudo-random data (default=byte)\n");
+    printf(" -seed n : seed of the 'random' fill pattern (default=1)\n");
+    printf(" -verify : after 'fill', re-reads the range and checks the "
+           "pattern; with\n");
+    printf("'copy', re-reads each written chunk unbuffered and checks its "
+           "source hash\n");
+    printf(" -verify-record path : with 'copy -verify', writes the result "
+           "of the check to path\n");
+    printf(" -max-mbps n : limits the source reads of 'copy/multithread/"
+           "export/clone' and the\n");
+    printf("I/Os of 'readbench/writebench' to n MB/s, shared by all "
+           "threads (default=none)\n");
+    printf(" -max-iops n : limits the same I/Os to n per second "
+           "(default=none)\n");
+    printf(" -limit-file path : while path exists, its 'max-mbps n' and "
+           "'max-iops n' lines\n");
+    printf("replace the limits; re-read when it changes or on SIGHUP\n");
+    printf(" -jobs n : number of 'daemon' jobs running at once "
+           "(default=2)\n");
+    printf(" -pool-idle sec : keep unused connections and open disks "
+           "for reuse this long\n");
+    printf("(default=30)\n");
+    printf(" -pool-max n : open disks per datastore at most (default=no "
+           "limit)\n");
+    printf(" -arena-mb n : I/O buffers come from a slab of n MB, 0 for "
+           "none (default=256)\n");
+    printf(" -huge-pages : back the slab with 2 MB huge pages when the "
+           "system has them\n");
+    printf(" -resume : with 'copy', continues an interrupted copy into an "
+           "existing target,\n");
+    printf("skipping the chunks recorded in diskPath.journal; the source "
+           "must be unchanged\n");
+    printf("(not with -verify or -manifest, which would miss the skipped "
+           "chunks)\n");
+    printf(" -to-raw : with 'copy', writes diskPath as a raw image file or "
+           "block device,\n");
+    printf("through io_uring and O_DIRECT where available; zero ranges are "
+           "left as holes\n");
+    printf(" -preallocate : with -to-raw, allocates all of a raw image file "
+           "up front\n");
     printf(" -cap megabytes : capacity in MB for -create option (default=100)\n");
+    printf(" -disktype type : disk type for 'create/clone/import': sparse, "
+           "flat, split-sparse,\n");
+    printf("split-flat, vmfs-flat, vmfs-thin, vmfs-sparse or "
+           "stream-optimized (default=sparse)\n");
     printf(" -single : open file as single disk link (default=open entire chain)\n");
     printf(" -multithread n: start n threads and copy the file to n new files\n");
+    printf(" -chunk n : chunk size in sectors for 'copy/multithread' options "
+           "(default=2048)\n");
+    printf(" -threads n : number of workers sharing one 'copy', 'fill', "
+           "'import' or\n");
+    printf("'estimate-dedup'\n");
+    printf("(default=1)\n");
+    printf(" -pipeline n : overlap reads and writes of 'copy/multithread' "
+           "with n buffers in flight\n");
     printf(" -host hostname : hostname / IP addresss (ESX 3.x or VC 2.x) \n");
     printf(" -user userid : user name on host (default = root) \n");
     printf(" -password password : password on host \n");
@@ -683,6 +1742,31 @@ PrintUsage(void)
 }
 
 
+#ifndef _WIN32
+/*
+ *--------------------------------------------------------------------------
+ *
+ * ReloadLimits --
+ *
+ *      SIGHUP handler: makes the next I/O re-read the -limit-file.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+static void
+ReloadLimits(UNUSED_PARAM(int sig))   // IN
+{
+   rateLimiter.RequestReload();
+}
+#endif
+
+
 /*
  *--------------------------------------------------------------------------
  *
@@ -708,12 +1792,29 @@ main(int argc, char* argv[])
     memset(&appGlobals, 0, sizeof appGlobals);
     appGlobals.command = 0;
     appGlobals.adapterType = VIXDISKLIB_ADAPTER_SCSI_BUSLOGIC;
+    appGlobals.diskType = VIXDISKLIB_DISK_MONOLITHIC_SPARSE;
     appGlobals.startSector = 0;
     appGlobals.numSectors = 1;
     appGlobals.mbSize = 100;
     appGlobals.filler = 0xff;
+    appGlobals.fillPattern = FILL_BYTE;
+    appGlobals.fillSeed = 1;
     appGlobals.openFlags = 0;
     appGlobals.numThreads = 1;
+    appGlobals.chunkSize = DEFAULT_CHUNKSIZE;
+    appGlobals.pattern = PATTERN_SEQ;
+    appGlobals.hashChunk = DEFAULT_HASHCHUNK;
+    appGlobals.estimateSizes = DEFAULT_ESTIMATE_SIZES;
+    appGlobals.sampleRate = 1;
+    appGlobals.compressLevel = Z_DEFAULT_COMPRESSION;
+    appGlobals.hashThreads = std::thread::hardware_concurrency();
+    if (appGlobals.hashThreads == 0) {
+       appGlobals.hashThreads = 2;
+    }
+    appGlobals.compressThreads = appGlobals.hashThreads;
+    appGlobals.maxJobs = 2;
+    appGlobals.poolIdleSec = 30;
+    appGlobals.arenaMb = 256;
     appGlobals.success = TRUE;
     appGlobals.isRemote = FALSE;
 
@@ -721,6 +1822,27 @@ main(int argc, char* argv[])
     if (retval) {
         return retval;
     }
+    if (appGlobals.command & COMMAND_STATS) {
+        return DoStats();
+    }
+    if (!OpenStats()) {
+        return 1;
+    }
+    OpenLiveStats();
+    if (!(appGlobals.command & COMMAND_DAEMON)) {
+       // The daemon takes a slot per job instead.
+       liveStats = ClaimLiveSlot(CommandName(), appGlobals.srcPath,
+                                 appGlobals.diskPath);
+    }
+    rateLimiter.SetLimits(appGlobals.maxMbps, appGlobals.maxIops);
+    diskPool.SetLimits(appGlobals.poolIdleSec, appGlobals.poolMax);
+    ioArena.SetSlab((size_t)appGlobals.arenaMb << 20, appGlobals.hugePages);
+    if (appGlobals.limitFile != NULL) {
+       rateLimiter.SetControlFile(appGlobals.limitFile);
+#ifndef _WIN32
+       signal(SIGHUP, ReloadLimits);
+#endif
+    }
 
 #ifdef DYNAMIC_LOADING
     DynLoadDiskLib();
@@ -757,16 +1879,12 @@ main(int argc, char* argv[])
        if (appGlobals.vmxSpec != NULL) {
           vixError = VixDiskLib_PrepareForAccess(&cnxParams, "Sample");
        }
-       if (appGlobals.ssMoRef == NULL && appGlobals.transportModes == NULL) {
-          vixError = VixDiskLib_Connect(&cnxParams,
-                                        &appGlobals.connection);
-       } else {
-          Bool ro = (appGlobals.openFlags & VIXDISKLIB_FLAG_OPEN_READ_ONLY);
-          vixError = VixDiskLib_ConnectEx(&cnxParams, ro, appGlobals.ssMoRef,
-                                          appGlobals.transportModes,
-                                          &appGlobals.connection);
-       }
-       CHECK_AND_THROW(vixError);
+       appConnection = diskPool.Connect(cnxParams,
+                                        (appGlobals.openFlags &
+                                         VIXDISKLIB_FLAG_OPEN_READ_ONLY) != 0,
+                                        appGlobals.ssMoRef,
+                                        appGlobals.transportModes);
+       appGlobals.connection = appConnection.Get();
         if (appGlobals.command & COMMAND_INFO) {
             DoInfo();
         } else if (appGlobals.command & COMMAND_CREATE) {
@@ -791,9 +1909,23 @@ main(int argc, char* argv[])
             DoRWBench(true);
         } else if (appGlobals.command & COMMAND_WRITEBENCH) {
             DoRWBench(false);
+        } else if (appGlobals.command & COMMAND_COPY) {
+            if (appGlobals.toRaw) {
+                DoCopyToRaw();
+            } else {
+                DoCopy();
+            }
+        } else if (appGlobals.command & COMMAND_ESTIMATE_DEDUP) {
+            DoEstimateDedup();
+        } else if (appGlobals.command & COMMAND_EXPORT) {
+            DoExport();
+        } else if (appGlobals.command & COMMAND_DAEMON) {
+            DoDaemon();
+        } else if (appGlobals.command & COMMAND_IMPORT) {
+            DoImport();
         }
         retval = 0;
-    } catch (const VixDiskLibErrWrapper& e) {
+    } catch (const VixDiskError& e) {
        cout << "Error: [" << e.File() << ":" << e.Line() << "]  " <<
                std::hex << e.ErrorCode() << " " << e.Description() << "\n";
        retval = 1;
@@ -802,12 +1934,16 @@ main(int argc, char* argv[])
     if (appGlobals.vmxSpec != NULL) {
        vixError = VixDiskLib_EndAccess(&cnxParams, "Sample");
     }
-    if (appGlobals.connection != NULL) {
-       VixDiskLib_Disconnect(appGlobals.connection);
-    }
+    appConnection.Reset();
+    appGlobals.connection = NULL;
+    PrintPoolCounters();
+    PrintArenaCounters();
+    diskPool.Clear();
     if (bVixInit) {
        VixDiskLib_Exit();
     }
+    CloseLiveStats();
+    CloseStats();
     return retval;
 }
 
@@ -844,6 +1980,11 @@ ParseArguments(int argc, char* argv[])
         } else if (!strcmp(argv[i], "-dump")) {
             appGlobals.command |= COMMAND_DUMP;
             appGlobals.openFlags |= VIXDISKLIB_FLAG_OPEN_READ_ONLY;
+        } else if (!strcmp(argv[i], "-raw")) {
+            if (i >= argc - 2) {
+                return PrintUsage();
+            }
+            appGlobals.rawPath = argv[++i];
         } else if (!strcmp(argv[i], "-fill")) {
             appGlobals.command |= COMMAND_FILL;
         } else if (!strcmp(argv[i], "-meta")) {
@@ -884,6 +2025,53 @@ ParseArguments(int argc, char* argv[])
                 return PrintUsage();
             }
             appGlobals.filler = strtol(argv[++i], NULL, 0);
+        } else if (!strcmp(argv[i], "-fillpattern")) {
+            if (i >= argc - 2) {
+                return PrintUsage();
+            }
+            ++i;
+            if (!strcmp(argv[i], "byte")) {
+                appGlobals.fillPattern = FILL_BYTE;
+            } else if (!strcmp(argv[i], "sector")) {
+                appGlobals.fillPattern = FILL_SECTOR;
+            } else if (!strcmp(argv[i], "random")) {
+                appGlobals.fillPattern = FILL_RANDOM;
+            } else {
+                return PrintUsage();
+            }
+        } else if (!strcmp(argv[i], "-seed")) {
+            if (i >= argc - 2) {
+                return PrintUsage();
+            }
+            appGlobals.fillSeed = strtoull(argv[++i], NULL, 0);
+        } else if (!strcmp(argv[i], "-verify")) {
+            appGlobals.verify = true;
+        } else if (!strcmp(argv[i], "-resume")) {
+            appGlobals.resume = true;
+        } else if (!strcmp(argv[i], "-to-raw")) {
+            appGlobals.toRaw = true;
+        } else if (!strcmp(argv[i], "-preallocate")) {
+            appGlobals.preallocate = true;
+        } else if (!strcmp(argv[i], "-max-mbps")) {
+            if (i >= argc - 2) {
+                return PrintUsage();
+            }
+            appGlobals.maxMbps = strtod(argv[++i], NULL);
+        } else if (!strcmp(argv[i], "-max-iops")) {
+            if (i >= argc - 2) {
+                return PrintUsage();
+            }
+            appGlobals.maxIops = strtod(argv[++i], NULL);
+        } else if (!strcmp(argv[i], "-limit-file")) {
+            if (i >= argc - 2) {
+                return PrintUsage();
+            }
+            appGlobals.limitFile = argv[++i];
+        } else if (!strcmp(argv[i], "-verify-record")) {
+            if (i >= argc - 2) {
+                return PrintUsage();
+            }
+            appGlobals.verifyRecord = argv[++i];
         } else if (!strcmp(argv[i], "-start")) {
             if (i >= argc - 2) {
                 return PrintUsage();
@@ -905,6 +2093,214 @@ ParseArguments(int argc, char* argv[])
             }
             appGlobals.srcPath = argv[++i];
             appGlobals.command |= COMMAND_CLONE;
+        } else if (!strcmp(argv[i], "-copy")) {
+            if (i >= argc - 2) {
+                return PrintUsage();
+            }
+            appGlobals.srcPath = argv[++i];
+            appGlobals.command |= COMMAND_COPY;
+            appGlobals.openFlags |= VIXDISKLIB_FLAG_OPEN_READ_ONLY;
+        } else if (!strcmp(argv[i], "-import")) {
+            if (i >= argc - 2) {
+                return PrintUsage();
+            }
+            appGlobals.srcPath = argv[++i];
+            appGlobals.command |= COMMAND_IMPORT;
+        } else if (!strcmp(argv[i], "-disktype")) {
+            if (i >= argc - 2) {
+                return PrintUsage();
+            }
+            appGlobals.diskType = ParseDiskType(argv[++i]);
+            if (appGlobals.diskType == VIXDISKLIB_DISK_UNKNOWN) {
+                return PrintUsage();
+            }
+        } else if (!strcmp(argv[i], "-export")) {
+            if (i >= argc - 2) {
+                return PrintUsage();
+            }
+            appGlobals.srcPath = argv[++i];
+            appGlobals.command |= COMMAND_EXPORT;
+            appGlobals.openFlags |= VIXDISKLIB_FLAG_OPEN_READ_ONLY;
+        } else if (!strcmp(argv[i], "-zthreads")) {
+            if (i >= argc - 2) {
+                return PrintUsage();
+            }
+            appGlobals.compressThreads = strtol(argv[++i], NULL, 0);
+            if (appGlobals.compressThreads == 0) {
+                return PrintUsage();
+            }
+        } else if (!strcmp(argv[i], "-zlevel")) {
+            if (i >= argc - 2) {
+                return PrintUsage();
+            }
+            appGlobals.compressLevel = strtol(argv[++i], NULL, 0);
+            if (appGlobals.compressLevel < 1 || appGlobals.compressLevel > 9) {
+                return PrintUsage();
+            }
+        } else if (!strcmp(argv[i], "-chunk")) {
+            if (i >= argc - 2) {
+                return PrintUsage();
+            }
+            appGlobals.chunkSize = strtol(argv[++i], NULL, 0);
+        } else if (!strcmp(argv[i], "-threads")) {
+            if (i >= argc - 2) {
+                return PrintUsage();
+            }
+            appGlobals.numThreads = strtol(argv[++i], NULL, 0);
+        } else if (!strcmp(argv[i], "-pipeline")) {
+            if (i >= argc - 2) {
+                return PrintUsage();
+            }
+            appGlobals.numBuffers = strtol(argv[++i], NULL, 0);
+            if (appGlobals.numBuffers < 2) {
+                return PrintUsage();
+            }
+        } else if (!strcmp(argv[i], "-pattern")) {
+            if (i >= argc - 2) {
+                return PrintUsage();
+            }
+            ++i;
+            if (!strcmp(argv[i], "seq")) {
+                appGlobals.pattern = PATTERN_SEQ;
+            } else if (!strcmp(argv[i], "rand")) {
+                appGlobals.pattern = PATTERN_RAND;
+            } else if (!strncmp(argv[i], "mixed:", 6)) {
+                appGlobals.pattern = PATTERN_MIXED;
+                appGlobals.readPct = strtol(argv[i] + 6, NULL, 0);
+                if (appGlobals.readPct > 100) {
+                    return PrintUsage();
+                }
+            } else {
+                return PrintUsage();
+            }
+        } else if (!strcmp(argv[i], "-manifest")) {
+            if (i >= argc - 2) {
+                return PrintUsage();
+            }
+            appGlobals.manifestPath = argv[++i];
+        } else if (!strcmp(argv[i], "-incremental")) {
+            if (i >= argc - 2) {
+                return PrintUsage();
+            }
+            appGlobals.recordPath = argv[++i];
+        } else if (!strcmp(argv[i], "-ddfs")) {
+            if (i >= argc - 2) {
+                return PrintUsage();
+            }
+            appGlobals.ddfsDir = argv[++i];
+        } else if (!strcmp(argv[i], "-daemon")) {
+            appGlobals.command |= COMMAND_DAEMON;
+            appGlobals.openFlags |= VIXDISKLIB_FLAG_OPEN_READ_ONLY;
+        } else if (!strcmp(argv[i], "-jobs")) {
+            if (i >= argc - 2) {
+                return PrintUsage();
+            }
+            appGlobals.maxJobs = strtoul(argv[++i], NULL, 0);
+        } else if (!strcmp(argv[i], "-pool-idle")) {
+            if (i >= argc - 2) {
+                return PrintUsage();
+            }
+            appGlobals.poolIdleSec = strtoul(argv[++i], NULL, 0);
+        } else if (!strcmp(argv[i], "-pool-max")) {
+            if (i >= argc - 2) {
+                return PrintUsage();
+            }
+            appGlobals.poolMax = strtoul(argv[++i], NULL, 0);
+        } else if (!strcmp(argv[i], "-arena-mb")) {
+            if (i >= argc - 2) {
+                return PrintUsage();
+            }
+            appGlobals.arenaMb = strtoul(argv[++i], NULL, 0);
+        } else if (!strcmp(argv[i], "-huge-pages")) {
+            appGlobals.hugePages = true;
+        } else if (!strcmp(argv[i], "-estimate-dedup")) {
+            appGlobals.command |= COMMAND_ESTIMATE_DEDUP;
+            appGlobals.openFlags |= VIXDISKLIB_FLAG_OPEN_READ_ONLY;
+        } else if (!strcmp(argv[i], "-disklist")) {
+            if (i >= argc - 2) {
+                return PrintUsage();
+            }
+            appGlobals.diskList = argv[++i];
+        } else if (!strcmp(argv[i], "-blocksizes")) {
+            char *kb;
+
+            if (i >= argc - 2) {
+                return PrintUsage();
+            }
+            appGlobals.estimateSizes = 0;
+            for (kb = argv[++i]; *kb != '\0'; kb += *kb == ',') {
+                unsigned long size = strtoul(kb, &kb, 10);
+                int bit = 0;
+
+                while ((1UL << bit) < size) {
+                    bit++;
+                }
+                if (size < ESTIMATE_MIN_KB || size > ESTIMATE_MAX_KB ||
+                    (1UL << bit) != size || (*kb != ',' && *kb != '\0')) {
+                    return PrintUsage();
+                }
+                appGlobals.estimateSizes |= 1 << bit;
+            }
+            if (appGlobals.estimateSizes == 0) {
+                return PrintUsage();
+            }
+        } else if (!strcmp(argv[i], "-sample")) {
+            if (i >= argc - 2) {
+                return PrintUsage();
+            }
+            appGlobals.sampleRate = strtol(argv[++i], NULL, 0);
+            if (appGlobals.sampleRate == 0) {
+                return PrintUsage();
+            }
+        } else if (!strcmp(argv[i], "-hashchunk")) {
+            if (i >= argc - 2) {
+                return PrintUsage();
+            }
+            appGlobals.hashChunk = strtol(argv[++i], NULL, 0);
+        } else if (!strcmp(argv[i], "-hashthreads")) {
+            if (i >= argc - 2) {
+                return PrintUsage();
+            }
+            appGlobals.hashThreads = strtol(argv[++i], NULL, 0);
+        } else if (!strcmp(argv[i], "-qd")) {
+            if (i >= argc - 2) {
+                return PrintUsage();
+            }
+            appGlobals.queueDepth = strtol(argv[++i], NULL, 0);
+            if (appGlobals.queueDepth == 0) {
+                return PrintUsage();
+            }
+        } else if (!strcmp(argv[i], "-stats-format")) {
+            if (i >= argc - 2) {
+                return PrintUsage();
+            }
+            ++i;
+            if (!strcmp(argv[i], "text")) {
+                appGlobals.statsFormat = STATS_TEXT;
+            } else if (!strcmp(argv[i], "json")) {
+                appGlobals.statsFormat = STATS_JSON;
+            } else if (!strcmp(argv[i], "csv")) {
+                appGlobals.statsFormat = STATS_CSV;
+            } else {
+                return PrintUsage();
+            }
+        } else if (!strcmp(argv[i], "-stats-file")) {
+            if (i >= argc - 2) {
+                return PrintUsage();
+            }
+            appGlobals.statsFile = argv[++i];
+        } else if (!strcmp(argv[i], "-stats")) {
+            appGlobals.command |= COMMAND_STATS;
+        } else if (!strcmp(argv[i], "-stats-dir")) {
+            if (i >= argc - 2) {
+                return PrintUsage();
+            }
+            appGlobals.liveStatsDir = argv[++i];
+        } else if (!strcmp(argv[i], "-prometheus")) {
+            if (i >= argc - 2) {
+                return PrintUsage();
+            }
+            appGlobals.prometheusSocket = argv[++i];
         } else if (!strcmp(argv[i], "-readbench")) {
             if (0 && i >= argc - 2) {
                 return PrintUsage();
@@ -995,6 +2391,106 @@ ParseArguments(int argc, char* argv[])
        return PrintUsage();
     }
 
+    if (appGlobals.chunkSize == 0 || appGlobals.numThreads == 0) {
+       return PrintUsage();
+    }
+    if (appGlobals.verify && !(appGlobals.command & COMMAND_FILL)) {
+       // A verified copy compares whole manifest chunks of each buffer.
+       if (!(appGlobals.command & COMMAND_COPY) || appGlobals.numThreads > 1 ||
+           appGlobals.hashChunk == 0 ||
+           appGlobals.chunkSize % appGlobals.hashChunk != 0) {
+          return PrintUsage();
+       }
+    }
+    if (appGlobals.verifyRecord != NULL &&
+        (!appGlobals.verify || !(appGlobals.command & COMMAND_COPY))) {
+       return PrintUsage();
+    }
+    if (appGlobals.prometheusSocket != NULL &&
+        !(appGlobals.command & COMMAND_STATS)) {
+       return PrintUsage();
+    }
+    if (appGlobals.maxMbps < 0 || appGlobals.maxIops < 0 ||
+        appGlobals.maxJobs == 0) {
+       return PrintUsage();
+    }
+    if (appGlobals.resume &&
+        (!(appGlobals.command & COMMAND_COPY) ||
+         appGlobals.recordPath != NULL)) {
+       // An incremental copy only writes what changed anyway.
+       return PrintUsage();
+    }
+    if (appGlobals.resume &&
+        (appGlobals.verify || appGlobals.manifestPath != NULL)) {
+       // The journaled chunks are neither read nor hashed again, so the
+       // manifest and the verify result would cover part of the disk.
+       return PrintUsage();
+    }
+    if ((appGlobals.command & COMMAND_ESTIMATE_DEDUP) &&
+        appGlobals.chunkSize * VIXDISKLIB_SECTOR_SIZE %
+        (ESTIMATE_MAX_KB * 1024) != 0) {
+       // Chunks must start on a block boundary for every block size.
+       return PrintUsage();
+    }
+    if (appGlobals.diskList != NULL &&
+        !(appGlobals.command & COMMAND_ESTIMATE_DEDUP)) {
+       return PrintUsage();
+    }
+    if ((appGlobals.command & COMMAND_EXPORT) &&
+        appGlobals.chunkSize % STREAM_GRAIN_SECTORS != 0) {
+       return PrintUsage();
+    }
+    if ((appGlobals.command & COMMAND_COPY) && appGlobals.numThreads > 1 &&
+        appGlobals.numBuffers > 0) {
+       return PrintUsage();
+    }
+    if (appGlobals.recordPath != NULL &&
+        (!(appGlobals.command & COMMAND_COPY) || appGlobals.numThreads > 1 ||
+         appGlobals.hashChunk == 0 ||
+         appGlobals.hashChunk % ZERO_CHECK_SECTORS != 0 ||
+         appGlobals.chunkSize % appGlobals.hashChunk != 0)) {
+       return PrintUsage();
+    }
+    if (appGlobals.ddfsDir != NULL &&
+        (!(appGlobals.command & COMMAND_COPY) || appGlobals.numThreads > 1)) {
+       return PrintUsage();
+    }
+    if (appGlobals.manifestPath != NULL) {
+       // Copy chunks and benchmark reads must cover whole manifest chunks.
+       VixDiskLibSectorType ioSize = appGlobals.chunkSize;
+
+       if (appGlobals.command & COMMAND_READBENCH) {
+          ioSize = appGlobals.bufSize ? appGlobals.bufSize : DEFAULT_BUFSIZE;
+       } else if (!(appGlobals.command & (COMMAND_COPY |
+                                          COMMAND_MULTITHREAD))) {
+          return PrintUsage();
+       }
+       if (appGlobals.hashChunk == 0 || ioSize % appGlobals.hashChunk != 0) {
+          return PrintUsage();
+       }
+    }
+    if (appGlobals.pattern == PATTERN_MIXED &&
+        !(appGlobals.command & COMMAND_WRITEBENCH)) {
+       return PrintUsage();
+    }
+    if (appGlobals.toRaw &&
+        (!(appGlobals.command & COMMAND_COPY) || appGlobals.numThreads > 1 ||
+         appGlobals.resume || appGlobals.recordPath != NULL ||
+         appGlobals.verifyRecord != NULL)) {
+       // A raw copy has no journal, record or verify stage.
+       return PrintUsage();
+    }
+    if (appGlobals.preallocate && !appGlobals.toRaw) {
+       return PrintUsage();
+    }
+    if ((appGlobals.command & COMMAND_IMPORT) && appGlobals.isRemote) {
+       // VixDiskLib_Create makes local disks only.
+       return PrintUsage();
+    }
+    if (appGlobals.queueDepth == 0) {
+       appGlobals.queueDepth = appGlobals.toRaw ? RAW_DEFAULT_QUEUE_DEPTH : 1;
+    }
+
     if (appGlobals.isRemote) {
        if (appGlobals.port == 0) {
           appGlobals.port = 902;
@@ -1033,7 +2529,8 @@ ParseArguments(int argc, char* argv[])
 static void
 DoInfo(void)
 {
-    VixDisk disk(appGlobals.connection, appGlobals.diskPath, appGlobals.openFlags);
+    VixDisk disk = OpenDisk(appGlobals.connection, appGlobals.diskPath,
+                            appGlobals.openFlags);
     VixDiskLibInfo *info = NULL;
     VixError vixError;
 
@@ -1072,6 +2569,49 @@ DoInfo(void)
 }
 
 
+/*
+ *--------------------------------------------------------------------------
+ *
+ * ParseDiskType --
+ *
+ *      Maps a -disktype name to its VixDiskLibDiskType.
+ *
+ * Results:
+ *      The disk type, VIXDISKLIB_DISK_UNKNOWN for an unknown name.
+ *
+ * Side effects:
+ *      None.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+static VixDiskLibDiskType
+ParseDiskType(const char *name)   // IN
+{
+   static const struct {
+      const char *name;
+      VixDiskLibDiskType type;
+   } types[] = {
+      { "sparse",           VIXDISKLIB_DISK_MONOLITHIC_SPARSE },
+      { "flat",             VIXDISKLIB_DISK_MONOLITHIC_FLAT },
+      { "split-sparse",     VIXDISKLIB_DISK_SPLIT_SPARSE },
+      { "split-flat",       VIXDISKLIB_DISK_SPLIT_FLAT },
+      { "vmfs-flat",        VIXDISKLIB_DISK_VMFS_FLAT },
+      { "vmfs-thin",        VIXDISKLIB_DISK_VMFS_THIN },
+      { "vmfs-sparse",      VIXDISKLIB_DISK_VMFS_SPARSE },
+      { "stream-optimized", VIXDISKLIB_DISK_STREAM_OPTIMIZED },
+   };
+   size_t i;
+
+   for (i = 0; i < sizeof types / sizeof types[0]; i++) {
+      if (strcmp(name, types[i].name) == 0) {
+         return types[i].type;
+      }
+   }
+   return VIXDISKLIB_DISK_UNKNOWN;
+}
+
+
 /*
  *--------------------------------------------------------------------------
  *
@@ -1097,7 +2637,7 @@ DoCreate(void)
    createParams.adapterType = appGlobals.adapterType;
 
    createParams.capacity = appGlobals.mbSize * 2048;
-   createParams.diskType = VIXDISKLIB_DISK_MONOLITHIC_SPARSE;
+   createParams.diskType = appGlobals.diskType;
    createParams.hwVersion = VIXDISKLIB_HWVERSION_WORKSTATION_5;
 
    vixError = VixDiskLib_Create(appGlobals.connection,
@@ -1129,7 +2669,8 @@ static void
 DoRedo(void)
 {
    VixError vixError;
-   VixDisk parentDisk(appGlobals.connection, appGlobals.parentPath, 0);
+   VixDisk parentDisk = OpenDisk(appGlobals.connection,
+                                 appGlobals.parentPath, 0);
    vixError = VixDiskLib_CreateChild(parentDisk.Handle(),
                                      appGlobals.diskPath,
                                      VIXDISKLIB_DISK_MONOLITHIC_SPARSE,
@@ -1138,41 +2679,6 @@ DoRedo(void)
 }
 
 
-/*
- *--------------------------------------------------------------------------
- *
- * DoFill --
- *
- *      Writes to a virtual disk.
- *
- * Results:
- *      None.
- *
- * Side effects:
- *      None.
- *
- *--------------------------------------------------------------------------
- */
-
-static void
-DoFill(void)
-{
-    VixDisk disk(appGlobals.connection, appGlobals.diskPath, appGlobals.openFlags);
-    uint8 buf[VIXDISKLIB_SECTOR_SIZE];
-    VixDiskLibSectorType startSector;
-
-    memset(buf, appGlobals.filler, sizeof buf);
-
-    for (startSector = 0; startSector < appGlobals.numSectors; ++startSector) {
-       VixError vixError;
-       vixError = VixDiskLib_Write(disk.Handle(),
-                                   appGlobals.startSector + startSector,
-                                   1, buf);
-       CHECK_AND_THROW(vixError);
-    }
-}
-
-
 /*
  *--------------------------------------------------------------------------
  *
@@ -1193,7 +2699,8 @@ static void
 DoReadMetadata(void)
 {
     size_t requiredLen;
-    VixDisk disk(appGlobals.connection, appGlobals.diskPath, appGlobals.openFlags);
+    VixDisk disk = OpenDisk(appGlobals.connection, appGlobals.diskPath,
+                            appGlobals.openFlags);
     VixError vixError = VixDiskLib_ReadMetadata(disk.Handle(),
                                                 appGlobals.metaKey,
                                                 NULL, 0, &requiredLen);
@@ -1230,7 +2737,8 @@ DoReadMetadata(void)
 static void
 DoWriteMetadata(void)
 {
-    VixDisk disk(appGlobals.connection, appGlobals.diskPath, appGlobals.openFlags);
+    VixDisk disk = OpenDisk(appGlobals.connection, appGlobals.diskPath,
+                            appGlobals.openFlags);
     VixError vixError = VixDiskLib_WriteMetadata(disk.Handle(),
                                                  appGlobals.metaKey,
                                                  appGlobals.metaVal);
@@ -1257,7 +2765,8 @@ DoWriteMetadata(void)
 static void
 DoDumpMetadata(void)
 {
-    VixDisk disk(appGlobals.connection, appGlobals.diskPath, appGlobals.openFlags);
+    VixDisk disk = OpenDisk(appGlobals.connection, appGlobals.diskPath,
+                            appGlobals.openFlags);
     char *key;
     size_t requiredLen;
 
@@ -1287,39 +2796,6 @@ DoDumpMetadata(void)
 }
 
 
-/*
- *--------------------------------------------------------------------------
- *
- * DoDump --
- *
- *      Dumps the content of a virtual disk.
- *
- * Results:
- *      None.
- *
- * Side effects:
- *      None.
- *
- *--------------------------------------------------------------------------
- */
-
-static void
-DoDump(void)
-{
-    VixDisk disk(appGlobals.connection, appGlobals.diskPath, appGlobals.openFlags);
-    uint8 buf[VIXDISKLIB_SECTOR_SIZE];
-    VixDiskLibSectorType i;
-
-    for (i = 0; i < appGlobals.numSectors; i++) {
-        VixError vixError = VixDiskLib_Read(disk.Handle(),
-                                            appGlobals.startSector + i,
-                                            1, buf);
-        CHECK_AND_THROW(vixError);
-        DumpBytes(buf, sizeof buf, 16);
-    }
-}
-
-
 /*
  *--------------------------------------------------------------------------
  *
@@ -1351,12 +2827,12 @@ BitCount(int number)    // IN
 /*
  *----------------------------------------------------------------------
  *
- * DumpBytes --
+ * IsZeroScalar --
  *
- *      Displays an array of n bytes.
+ *      Portable all-zero check, one machine word at a time.
  *
  * Results:
- *      None.
+ *      true if all len bytes of buf are zero.
  *
  * Side effects:
  *      None.
@@ -1364,99 +2840,80 @@ BitCount(int number)    // IN
  *----------------------------------------------------------------------
  */
 
-static void
-DumpBytes(const unsigned char *buf,     // IN
-          size_t n,                     // IN
-          int step)                     // IN
+static bool
+IsZeroScalar(const uint8 *buf,   // IN
+             size_t len)         // IN
 {
-   size_t lines = n / step;
+   const uint64 *words = (const uint64 *)buf;
+   size_t numWords = len / sizeof(uint64);
    size_t i;
 
-   for (i = 0; i < lines; i++) {
-      int k, last;
-      printf("%04"FMTSZ"x : ", i * step);
-      for (k = 0; n != 0 && k < step; k++, n--) {
-         printf("%02x ", buf[i * step + k]);
+   for (i = 0; i + 4 <= numWords; i += 4) {
+      if ((words[i] | words[i + 1] | words[i + 2] | words[i + 3]) != 0) {
+         return false;
       }
-      printf("  ");
-      last = k;
-      while (k --) {
-         unsigned char c = buf[i * step + last - k - 1];
-         if (c < ' ' || c >= 127) {
-            c = '.';
-         }
-         printf("%c", c);
+   }
+   for (; i < numWords; i++) {
+      if (words[i] != 0) {
+         return false;
       }
-      printf("\n");
    }
-   printf("\n");
+   for (i = numWords * sizeof(uint64); i < len; i++) {
+      if (buf[i] != 0) {
+         return false;
+      }
+   }
+   return true;
 }
 
 
+#ifdef HAVE_X86_SIMD
 /*
  *----------------------------------------------------------------------
  *
- * CopyThread --
+ * IsZeroSSE2 --
  *
- *       Copies a source disk to the given file.
+ *      All-zero check ORing 64 bytes per iteration into SSE2 registers.
  *
  * Results:
- *       0 if succeeded, 1 if not.
+ *      true if all len bytes of buf are zero.
  *
  * Side effects:
- *      Creates a new disk; sets appGlobals.success to false if fails
+ *      None.
  *
  *----------------------------------------------------------------------
  */
 
-#ifdef _WIN32
-#define TASK_OK 0
-#define TASK_FAIL 1
-
-static unsigned __stdcall
-#else
-#define TASK_OK ((void*)0)
-#define TASK_FAIL ((void*)1)
-
-static void *
-#endif
-CopyThread(void *arg)
+__attribute__((target("sse2"))) static bool
+IsZeroSSE2(const uint8 *buf,   // IN
+           size_t len)         // IN
 {
-   ThreadData *td = (ThreadData *)arg;
-
-    try {
-      VixDiskLibSectorType i;
-      VixError vixError;
-      uint8 buf[VIXDISKLIB_SECTOR_SIZE];
+   const __m128i zero = _mm_setzero_si128();
+   size_t i;
 
-      for (i = 0; i < td->numSectors; i ++) {
-         vixError = VixDiskLib_Read(td->srcHandle, i, 1, buf);
-         CHECK_AND_THROW(vixError);
-         vixError = VixDiskLib_Write(td->dstHandle, i, 1, buf);
-         CHECK_AND_THROW(vixError);
+   for (i = 0; i + 64 <= len; i += 64) {
+      __m128i acc = _mm_or_si128(
+         _mm_or_si128(_mm_loadu_si128((const __m128i *)(buf + i)),
+                      _mm_loadu_si128((const __m128i *)(buf + i + 16))),
+         _mm_or_si128(_mm_loadu_si128((const __m128i *)(buf + i + 32)),
+                      _mm_loadu_si128((const __m128i *)(buf + i + 48))));
+      if (_mm_movemask_epi8(_mm_cmpeq_epi8(acc, zero)) != 0xffff) {
+         return false;
       }
-
-    } catch (const VixDiskLibErrWrapper& e) {
-       cout << "CopyThread (" << td->dstDisk << ")Error: " << e.ErrorCode()
-            <<" " << e.Description();
-        appGlobals.success = FALSE;
-        return TASK_FAIL;
-    }
-
-    cout << "CopyThread to " << td->dstDisk << " succeeded.\n";
-    return TASK_OK;
+   }
+   return IsZeroScalar(buf + i, len - i);
 }
 
 
 /*
  *----------------------------------------------------------------------
  *
- * PrepareThreadData --
+ * IsZeroAVX2 --
  *
- *      Open the source and destination disk for multi threaded copy.
+ *      All-zero check ORing 128 bytes per iteration into AVX2 registers.
  *
  * Results:
- *      Fills in ThreadData in td.
+ *      true if all len bytes of buf are zero.
  *
  * Side effects:
  *      None.
@@ -1464,59 +2921,79 @@ CopyThread(void *arg)
  *----------------------------------------------------------------------
  */
 
-static void
-PrepareThreadData(VixDiskLibConnection &dstConnection,
-                  ThreadData &td)
+__attribute__((target("avx2"))) static bool
+IsZeroAVX2(const uint8 *buf,   // IN
+           size_t len)         // IN
 {
-   VixError vixError;
-   VixDiskLibCreateParams createParams;
-   VixDiskLibInfo *info = NULL;
-   char *tmpDir;
+   size_t i;
 
-#ifdef _WIN32
-   tmpDir = _tempnam("c:\\", "test");
-#else
-   tmpDir = tempnam("/tmp", "test");
+   for (i = 0; i + 128 <= len; i += 128) {
+      __m256i acc = _mm256_or_si256(
+         _mm256_or_si256(_mm256_loadu_si256((const __m256i *)(buf + i)),
+                         _mm256_loadu_si256((const __m256i *)(buf + i + 32))),
+         _mm256_or_si256(_mm256_loadu_si256((const __m256i *)(buf + i + 64)),
+                         _mm256_loadu_si256((const __m256i *)(buf + i + 96))));
+      if (!_mm256_testz_si256(acc, acc)) {
+         return false;
+      }
+   }
+   return IsZeroScalar(buf + i, len - i);
+}
 #endif
-   td.dstDisk = tmpDir;
-   free(tmpDir);
-
-   vixError = VixDiskLib_Open(appGlobals.connection,
-                              appGlobals.diskPath,
-                              appGlobals.openFlags,
-                              &td.srcHandle);
-   CHECK_AND_THROW(vixError);
 
-   vixError = VixDiskLib_GetInfo(td.srcHandle, &info);
-   CHECK_AND_THROW(vixError);
-   td.numSectors = info->capacity;
-   VixDiskLib_FreeInfo(info);
 
-   createParams.adapterType = VIXDISKLIB_ADAPTER_SCSI_BUSLOGIC;
-   createParams.capacity = td.numSectors;
-   createParams.diskType = VIXDISKLIB_DISK_SPLIT_SPARSE;
-   createParams.hwVersion = VIXDISKLIB_HWVERSION_WORKSTATION_5;
+/*
+ *----------------------------------------------------------------------
+ *
+ * IsZeroBuffer --
+ *
+ *      Checks whether a buffer contains only zero bytes, using the
+ *      widest vector unit the CPU supports (picked on first use).
+ *
+ * Results:
+ *      true if all len bytes of buf are zero.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
 
-   vixError = VixDiskLib_Create(dstConnection, td.dstDisk.c_str(),
-                                &createParams, NULL, NULL);
-   CHECK_AND_THROW(vixError);
+static bool
+IsZeroBuffer(const uint8 *buf,   // IN
+             size_t len)         // IN
+{
+   typedef bool (*IsZeroFunc)(const uint8 *, size_t);
+   struct Selector {
+      static IsZeroFunc Select(void)
+      {
+#ifdef HAVE_X86_SIMD
+         __builtin_cpu_init();
+         if (__builtin_cpu_supports("avx2")) {
+            return IsZeroAVX2;
+         }
+         if (__builtin_cpu_supports("sse2")) {
+            return IsZeroSSE2;
+         }
+#endif
+         return IsZeroScalar;
+      }
+   };
+   static const IsZeroFunc isZero = Selector::Select();
 
-   vixError = VixDiskLib_Open(dstConnection, td.dstDisk.c_str(), 0,
-                              &td.dstHandle);
-   CHECK_AND_THROW(vixError);
+   return isZero(buf, len);
 }
 
 
 /*
  *----------------------------------------------------------------------
  *
- * DoTestMultiThread --
+ * IsEqualScalar --
  *
- *      Starts a given number of threads, each of which will copy the
- *      source disk to a temp. file.
+ *      Portable buffer comparison, one machine word at a time.
  *
  * Results:
- *      None.
+ *      true if the len bytes of a and b are equal.
  *
  * Side effects:
  *      None.
@@ -1524,63 +3001,89 @@ PrepareThreadData(VixDiskLibConnection &dstConnection,
  *----------------------------------------------------------------------
  */
 
-static void
-DoTestMultiThread(void)
+static bool
+IsEqualScalar(const uint8 *a,   // IN
+              const uint8 *b,   // IN
+              size_t len)       // IN
 {
-   VixDiskLibConnectParams cnxParams = { 0 };
-   VixDiskLibConnection dstConnection;
-   VixError vixError;
-   vector<ThreadData> threadData(appGlobals.numThreads);
-   int i;
+   const uint64 *wa = (const uint64 *)a;
+   const uint64 *wb = (const uint64 *)b;
+   size_t numWords = len / sizeof(uint64);
+   size_t i;
 
-   vixError = VixDiskLib_Connect(&cnxParams, &dstConnection);
-   CHECK_AND_THROW(vixError);
+   for (i = 0; i + 4 <= numWords; i += 4) {
+      if (((wa[i] ^ wb[i]) | (wa[i + 1] ^ wb[i + 1]) |
+           (wa[i + 2] ^ wb[i + 2]) | (wa[i + 3] ^ wb[i + 3])) != 0) {
+         return false;
+      }
+   }
+   for (; i < numWords; i++) {
+      if (wa[i] != wb[i]) {
+         return false;
+      }
+   }
+   for (i = numWords * sizeof(uint64); i < len; i++) {
+      if (a[i] != b[i]) {
+         return false;
+      }
+   }
+   return true;
+}
 
-#ifdef _WIN32
-   vector<HANDLE> threads(appGlobals.numThreads);
 
-   for (i = 0; i < appGlobals.numThreads; i++) {
-      unsigned int threadId;
+#ifdef HAVE_X86_SIMD
+/*
+ *----------------------------------------------------------------------
+ *
+ * IsEqualSSE2 --
+ *
+ *      Buffer comparison ORing the XOR of 64 bytes per iteration into
+ *      SSE2 registers.
+ *
+ * Results:
+ *      true if the len bytes of a and b are equal.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
 
-      PrepareThreadData(dstConnection, threadData[i]);
-      threads[i] = (HANDLE)_beginthreadex(NULL, 0, &CopyThread,
-                                          (void*)&threadData[i], 0, &threadId);
-   }
-   WaitForMultipleObjects(appGlobals.numThreads, &threads[0], TRUE, INFINITE);
-#else
-   vector<pthread_t> threads(appGlobals.numThreads);
+__attribute__((target("sse2"))) static bool
+IsEqualSSE2(const uint8 *a,   // IN
+            const uint8 *b,   // IN
+            size_t len)       // IN
+{
+   const __m128i zero = _mm_setzero_si128();
+   size_t i;
 
-   for (i = 0; i < appGlobals.numThreads; i++) {
-      PrepareThreadData(dstConnection, threadData[i]);
-      pthread_create(&threads[i], NULL, &CopyThread, (void*)&threadData[i]);
-   }
-   for (i = 0; i < appGlobals.numThreads; i++) {
-      void *hlp;
-      pthread_join(threads[i], &hlp);
-   }
-#endif
+   for (i = 0; i + 64 <= len; i += 64) {
+      __m128i acc = _mm_setzero_si128();
+      size_t k;
 
-   for (i = 0; i < appGlobals.numThreads; i++) {
-      VixDiskLib_Close(threadData[i].srcHandle);
-      VixDiskLib_Close(threadData[i].dstHandle);
-      VixDiskLib_Unlink(dstConnection, threadData[i].dstDisk.c_str());
-   }
-   VixDiskLib_Disconnect(dstConnection);
-   if (!appGlobals.success) {
-      THROW_ERROR(VIX_E_FAIL);
+      for (k = 0; k < 64; k += 16) {
+         acc = _mm_or_si128(acc,
+                  _mm_xor_si128(_mm_loadu_si128((const __m128i *)(a + i + k)),
+                                _mm_loadu_si128((const __m128i *)(b + i + k))));
+      }
+      if (_mm_movemask_epi8(_mm_cmpeq_epi8(acc, zero)) != 0xffff) {
+         return false;
+      }
    }
+   return IsEqualScalar(a + i, b + i, len - i);
 }
 
 
 /*
  *----------------------------------------------------------------------
  *
- * CloneProgress --
+ * IsEqualAVX2 --
  *
- *      Callback for the clone function.
+ *      Buffer comparison ORing the XOR of 128 bytes per iteration into
+ *      AVX2 registers.
  *
  * Results:
- *      None
+ *      true if the len bytes of a and b are equal.
  *
  * Side effects:
  *      None.
@@ -1588,24 +3091,42 @@ DoTestMultiThread(void)
  *----------------------------------------------------------------------
  */
 
-static Bool
-CloneProgressFunc(void * /*progressData*/,      // IN
-                  int percentCompleted)         // IN
+__attribute__((target("avx2"))) static bool
+IsEqualAVX2(const uint8 *a,   // IN
+            const uint8 *b,   // IN
+            size_t len)       // IN
 {
-   cout << "Cloning : " << percentCompleted << "% Done" << "\r";
-   return TRUE;
+   size_t i;
+
+   for (i = 0; i + 128 <= len; i += 128) {
+      __m256i acc = _mm256_setzero_si256();
+      size_t k;
+
+      for (k = 0; k < 128; k += 32) {
+         acc = _mm256_or_si256(acc,
+                  _mm256_xor_si256(
+                     _mm256_loadu_si256((const __m256i *)(a + i + k)),
+                     _mm256_loadu_si256((const __m256i *)(b + i + k))));
+      }
+      if (!_mm256_testz_si256(acc, acc)) {
+         return false;
+      }
+   }
+   return IsEqualScalar(a + i, b + i, len - i);
 }
+#endif
 
 
 /*
  *----------------------------------------------------------------------
  *
- * DoClone --
+ * IsEqualBuffer --
  *
- *      Clones a local disk (possibly to an ESX host).
+ *      Compares two buffers with the widest vector unit the CPU
+ *      supports (picked on first use).
  *
  * Results:
- *      None.
+ *      true if the len bytes of a and b are equal.
  *
  * Side effects:
  *      None.
@@ -1613,47 +3134,73 @@ CloneProgressFunc(void * /*progressData*/,      // IN
  *----------------------------------------------------------------------
  */
 
-static void
-DoClone(void)
+static bool
+IsEqualBuffer(const uint8 *a,   // IN
+              const uint8 *b,   // IN
+              size_t len)       // IN
 {
-   VixDiskLibConnection srcConnection;
-   VixDiskLibConnectParams cnxParams = { 0 };
-   VixError vixError = VixDiskLib_Connect(&cnxParams, &srcConnection);
-   CHECK_AND_THROW(vixError);
+   typedef bool (*IsEqualFunc)(const uint8 *, const uint8 *, size_t);
+   struct Selector {
+      static IsEqualFunc Select(void)
+      {
+#ifdef HAVE_X86_SIMD
+         __builtin_cpu_init();
+         if (__builtin_cpu_supports("avx2")) {
+            return IsEqualAVX2;
+         }
+         if (__builtin_cpu_supports("sse2")) {
+            return IsEqualSSE2;
+         }
+#endif
+         return IsEqualScalar;
+      }
+   };
+   static const IsEqualFunc isEqual = Selector::Select();
 
-   /*
-    *  Note : These createParams are ignored for remote case
-    */
+   return isEqual(a, b, len);
+}
 
-   VixDiskLibCreateParams createParams;
-   createParams.adapterType = appGlobals.adapterType;
-   createParams.capacity = appGlobals.mbSize * 2048;
-   createParams.diskType = VIXDISKLIB_DISK_MONOLITHIC_SPARSE;
-   createParams.hwVersion = VIXDISKLIB_HWVERSION_WORKSTATION_5;
 
-   vixError = VixDiskLib_Clone(appGlobals.connection,
-                               appGlobals.diskPath,
-                               srcConnection,
-                               appGlobals.srcPath,
-                               &createParams,
-                               CloneProgressFunc,
-                               NULL,   // clientData
-                               TRUE);  // doOverWrite
-   VixDiskLib_Disconnect(srcConnection);
-   CHECK_AND_THROW(vixError);
-   cout << "\n Done" << "\n";
+/*
+ *----------------------------------------------------------------------
+ *
+ * GrainSectors --
+ *
+ *      Length of the ZERO_CHECK_SECTORS grain starting at sector pos of
+ *      a chunk, where grains are aligned to absolute disk sectors and
+ *      the last one is cut short at the end of the chunk.
+ *
+ * Results:
+ *      Number of sectors in the grain.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static VixDiskLibSectorType
+GrainSectors(VixDiskLibSectorType startSector,   // IN
+             VixDiskLibSectorType numSectors,    // IN
+             VixDiskLibSectorType pos)           // IN
+{
+   VixDiskLibSectorType count = ZERO_CHECK_SECTORS -
+                                (startSector + pos) % ZERO_CHECK_SECTORS;
+
+   return count < numSectors - pos ? count : numSectors - pos;
 }
 
 
 /*
  *----------------------------------------------------------------------
  *
- * PrintStat --
+ * MarkZeroGrains --
  *
- *      Print performance statistics for read/write benchmarks.
+ *      Checks every grain of a chunk for zero data.
  *
  * Results:
- *      None
+ *      Number of sectors in all-zero grains. zeroGrains gets one entry
+ *      per grain, non-zero if the grain is all zero.
  *
  * Side effects:
  *      None.
@@ -1661,36 +3208,41 @@ DoClone(void)
  *----------------------------------------------------------------------
  */
 
-static void
-PrintStat(bool read,            // IN
-          struct timeval start, // IN
-          struct timeval end,   // IN
-          uint32 numSectors)    // IN
+static VixDiskLibSectorType
+MarkZeroGrains(const uint8 *buf,                   // IN
+               VixDiskLibSectorType startSector,   // IN
+               VixDiskLibSectorType numSectors,    // IN
+               vector<uint8> &zeroGrains)          // OUT
 {
-   uint64 elapsed;
-   uint32 speed;
-
-   elapsed = ((uint64)end.tv_sec * 1000000 + end.tv_usec -
-              ((uint64)start.tv_sec * 1000000 + start.tv_usec)) / 1000;
-   if (elapsed == 0) {
-      elapsed = 1;
+   VixDiskLibSectorType pos = 0;
+   VixDiskLibSectorType zeroSectors = 0;
+
+   zeroGrains.clear();
+   while (pos < numSectors) {
+      VixDiskLibSectorType count = GrainSectors(startSector, numSectors, pos);
+      bool zero = IsZeroBuffer(buf + pos * VIXDISKLIB_SECTOR_SIZE,
+                               count * VIXDISKLIB_SECTOR_SIZE);
+
+      zeroGrains.push_back(zero);
+      if (zero) {
+         zeroSectors += count;
+      }
+      pos += count;
    }
-   speed = (1000 * VIXDISKLIB_SECTOR_SIZE * (uint64)numSectors) / (1024 * 1024 * elapsed);
-   printf("%s %d MBytes in %d msec (%d MBytes/sec)\n", read ? "Read" : "Wrote",
-          (uint32)(numSectors /(2048)), (uint32)elapsed, speed);
+   return zeroSectors;
 }
 
 
 /*
  *----------------------------------------------------------------------
  *
- * InitBuffer --
+ * LockedWrite --
  *
- *      Fill an array of uint32 with random values, to defeat any
- *      attempts to compress it.
+ *      Writes numSectors sectors of buf to dst, holding writeLock (if
+ *      not NULL) for the duration of the call.
  *
  * Results:
- *      None
+ *      None. Throws VixDiskError on failure.
  *
  * Side effects:
  *      None.
@@ -1699,15 +3251,19 @@ PrintStat(bool read,            // IN
  */
 
 static void
-InitBuffer(uint32 *buf,     // OUT
-           uint32 numElems) // IN
+LockedWrite(VixDiskView dst,                    // IN
+            VixDiskLibSectorType startSector,   // IN
+            VixDiskLibSectorType numSectors,    // IN
+            const uint8 *buf,                   // IN
+            std::mutex *writeLock)              // IN
 {
-   int i;
-
-   srand(time(NULL));
+   VixConstByteSpan span(buf, numSectors * VIXDISKLIB_SECTOR_SIZE);
 
-   for (i = 0; i < numElems; i++) {
-      buf[i] = (uint32)rand();
+   if (writeLock != NULL) {
+      std::lock_guard<std::mutex> guard(*writeLock);
+      dst.Write(startSector, span);
+   } else {
+      dst.Write(startSector, span);
    }
 }
 
@@ -1715,14 +3271,15 @@ InitBuffer(uint32 *buf,     // OUT
 /*
  *----------------------------------------------------------------------
  *
- * DoRWBench --
+ * WriteGrains --
  *
- *      Perform read/write benchmarks according to settings in
- *      appGlobals. Note that a write benchmark will destroy the data
- *      in the target disk.
+ *      Writes a chunk to dst, leaving out the grains flagged in
+ *      skipGrains (as filled in by MarkZeroGrains). Adjacent written
+ *      grains are merged into a single write.
  *
  * Results:
- *      None
+ *      Number of sectors written. Throws VixDiskError on
+ *      failure.
  *
  * Side effects:
  *      None.
@@ -1730,69 +3287,7883 @@ InitBuffer(uint32 *buf,     // OUT
  *----------------------------------------------------------------------
  */
 
-static void
-DoRWBench(bool read) // IN
+static VixDiskLibSectorType
+WriteGrains(VixDiskView dst,                    // IN
+            VixDiskLibSectorType startSector,   // IN
+            VixDiskLibSectorType numSectors,    // IN
+            const uint8 *buf,                   // IN
+            const uint8 *skipGrains,            // IN
+            std::mutex *writeLock)              // IN
 {
-   VixDisk disk(appGlobals.connection, appGlobals.diskPath, appGlobals.openFlags);
-   size_t bufSize;
-   uint8 *buf;
-   VixDiskLibInfo *info;
-   VixError err;
-   uint32 maxOps, i;
-   uint32 bufUpdate;
-   struct timeval start, end, total;
-
-   if (appGlobals.bufSize == 0) {
-      appGlobals.bufSize = DEFAULT_BUFSIZE;
+   VixDiskLibSectorType pos = 0;
+   VixDiskLibSectorType runStart = 0;
+   VixDiskLibSectorType written = 0;
+   bool inRun = false;
+   size_t grain;
+
+   for (grain = 0; pos < numSectors; grain++) {
+      if (skipGrains[grain]) {
+         if (inRun) {
+            LockedWrite(dst, startSector + runStart, pos - runStart,
+                        buf + runStart * VIXDISKLIB_SECTOR_SIZE, writeLock);
+            written += pos - runStart;
+            inRun = false;
+         }
+      } else if (!inRun) {
+         runStart = pos;
+         inRun = true;
+      }
+      pos += GrainSectors(startSector, numSectors, pos);
    }
-   bufSize = appGlobals.bufSize * VIXDISKLIB_SECTOR_SIZE;
-
-   buf = new uint8[bufSize];
-   if (!read) {
-      InitBuffer((uint32*)buf, bufSize / sizeof(uint32));
+   if (inRun) {
+      LockedWrite(dst, startSector + runStart, numSectors - runStart,
+                  buf + runStart * VIXDISKLIB_SECTOR_SIZE, writeLock);
+      written += numSectors - runStart;
    }
+   return written;
+}
 
-   err = VixDiskLib_GetInfo(disk.Handle(), &info);
-   if (VIX_FAILED(err)) {
-      delete [] buf;
-      throw VixDiskLibErrWrapper(err, __FILE__, __LINE__);
-   }
 
-   maxOps = info->capacity / appGlobals.bufSize;
-   VixDiskLib_FreeInfo(info);
+RateLimiter::RateLimiter()
+   : _psecPerByte(0),
+     _nsecPerOp(0),
+     _byteClock(0),
+     _opClock(0),
+     _mbps(0),
+     _iops(0),
+     _controlFile(NULL),
+     _controlMtime(0),
+     _nextCheck(0),
+     _reload(false)
+{
+}
 
-   printf("Processing %d buffers of %d bytes.\n", maxOps, (uint32)bufSize);
 
-   gettimeofday(&total, NULL);
-   start = total;
-   bufUpdate = 0;
-   for (i = 0; i < maxOps; i++) {
-      VixError vixError;
+void
+RateLimiter::SetLimits(double mbps,   // IN
+                       double iops)   // IN
+{
+   _mbps = mbps;
+   _iops = iops;
+   Apply(mbps, iops);
+}
 
-      if (read) {
-         vixError = VixDiskLib_Read(disk.Handle(),
-                                    i * appGlobals.bufSize,
-                                    appGlobals.bufSize, buf);
-      } else {
-         vixError = VixDiskLib_Write(disk.Handle(),
-                                     i * appGlobals.bufSize,
-                                     appGlobals.bufSize, buf);
 
-      }
-      if (VIX_FAILED(vixError)) {
-         delete [] buf;
-         throw VixDiskLibErrWrapper(vixError, __FILE__, __LINE__);
-      }
+/*
+ *----------------------------------------------------------------------
+ *
+ * RateLimiter::Apply --
+ *
+ *      Switches to new limits. Both buckets start over full, so a job
+ *      made faster does not first wait out its slower past.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
 
-      bufUpdate += appGlobals.bufSize;
-      if (bufUpdate >= BUFS_PER_STAT) {
-         gettimeofday(&end, NULL);
-         PrintStat(read, start, end, bufUpdate);
-         start = end;
-         bufUpdate = 0;
+void
+RateLimiter::Apply(double mbps,   // IN
+                   double iops)   // IN
+{
+   uint64 now = NowNsec();
+
+   // MB as in the statistics: 2^20 bytes.
+   _psecPerByte = mbps > 0 ? (uint64)(1e12 / (mbps * 1048576)) + 1 : 0;
+   _nsecPerOp = iops > 0 ? (uint64)(1e9 / iops) + 1 : 0;
+   _byteClock = now;
+   _opClock = now;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RateLimiter::Take --
+ *
+ *      Takes cost nanoseconds worth of tokens from the bucket whose
+ *      clock is given.
+ *
+ * Results:
+ *      The time at which the caller may go ahead.
+ *
+ * Side effects:
+ *      Advances clock.
+ *
+ *----------------------------------------------------------------------
+ */
+
+uint64
+RateLimiter::Take(std::atomic<uint64> &clock,   // IN/OUT
+                  uint64 cost,                  // IN
+                  uint64 now)                   // IN
+{
+   const uint64 burst = LIMIT_BURST_MSEC * 1000000ULL;
+   uint64 old = clock.load(std::memory_order_relaxed);
+   uint64 start;
+
+   do {
+      start = old;
+      if (now > burst && start < now - burst) {
+         start = now - burst;
+      }
+   } while (!clock.compare_exchange_weak(old, start + cost,
+                                         std::memory_order_relaxed));
+   return start;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RateLimiter::Acquire --
+ *
+ *      Called before an I/O (or a batch of numOps of them) moving
+ *      numBytes bytes; sleeps as long as the limits require.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      May re-read the control file.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+RateLimiter::Acquire(uint64 numBytes,   // IN
+                     uint64 numOps)     // IN
+{
+   uint64 now, until, psecPerByte, nsecPerOp;
+
+   if (_controlFile == NULL &&
+       _psecPerByte.load(std::memory_order_relaxed) == 0 &&
+       _nsecPerOp.load(std::memory_order_relaxed) == 0) {
+      return;
+   }
+   now = NowNsec();
+   if (_controlFile != NULL &&
+       (now >= _nextCheck.load(std::memory_order_relaxed) || _reload)) {
+      CheckControlFile(now);
+   }
+
+   until = now;
+   psecPerByte = _psecPerByte.load(std::memory_order_relaxed);
+   nsecPerOp = _nsecPerOp.load(std::memory_order_relaxed);
+   if (psecPerByte != 0 && numBytes != 0) {
+      until = std::max(until, Take(_byteClock, numBytes * psecPerByte / 1000,
+                                   now));
+   }
+   if (nsecPerOp != 0 && numOps != 0) {
+      until = std::max(until, Take(_opClock, numOps * nsecPerOp, now));
+   }
+   if (until > now) {
+      std::this_thread::sleep_for(std::chrono::nanoseconds(until - now));
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RateLimiter::CheckControlFile --
+ *
+ *      Applies the limits in the control file if it was modified since
+ *      it was last read, or a reload was requested. Reverts to the
+ *      SetLimits values once the file is removed. Unknown lines are
+ *      ignored; a limit not in the file is off.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Prints the new limits.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+RateLimiter::CheckControlFile(uint64 now)   // IN
+{
+   std::unique_lock<std::mutex> lock(_controlLock, std::try_to_lock);
+   double mbps = 0, iops = 0;
+   struct stat st;
+   char line[256];
+   bool force;
+   FILE *file;
+
+   if (!lock.owns_lock()) {
+      return;   // another thread is at it
+   }
+   _nextCheck = now + LIMIT_CHECK_MSEC * 1000000ULL;
+   force = _reload.exchange(false);
+
+   if (stat(_controlFile, &st) != 0) {
+      if (_controlMtime != 0) {
+         _controlMtime = 0;
+         Apply(_mbps, _iops);
+         printf("%s is gone, back to %.1f MB/s, %.0f IOPS (0: no limit).\n",
+                _controlFile, _mbps, _iops);
+      }
+      return;
+   }
+   if (!force && st.st_mtime == _controlMtime) {
+      return;
+   }
+   file = fopen(_controlFile, "r");
+   if (file == NULL) {
+      return;
+   }
+   while (fgets(line, sizeof line, file) != NULL) {
+      double value;
+      char key[32];
+
+      if (sscanf(line, "%31s %lf", key, &value) != 2 || key[0] == '#') {
+         continue;
+      }
+      if (!strcmp(key, "max-mbps")) {
+         mbps = value;
+      } else if (!strcmp(key, "max-iops")) {
+         iops = value;
+      }
+   }
+   fclose(file);
+   // A file never has mtime 0, which marks it unused.
+   _controlMtime = st.st_mtime != 0 ? st.st_mtime : 1;
+   Apply(mbps, iops);
+   printf("Limits from %s: %.1f MB/s, %.0f IOPS (0: no limit).\n",
+          _controlFile, mbps, iops);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * CopyEngine::CopyEngine --
+ *
+ *      Sets up a copy engine moving context.chunkSize sectors per library
+ *      call, under the limits and statistics of context.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Allocates the chunk buffer, which is reused by every Copy().
+ *
+ *----------------------------------------------------------------------
+ */
+
+CopyEngine::CopyEngine(const CopyContext &context)   // IN
+   : _limiter(context.limiter),
+     _chunkSize(context.chunkSize),
+     _skipZero(context.skipZero),
+     _printProgress(context.printProgress),
+     _buf(AllocAligned((size_t)_chunkSize * VIXDISKLIB_SECTOR_SIZE)),
+     _writeLock(NULL),
+     _manifest(NULL),
+     _hashPool(NULL),
+     _journal(NULL),
+     _stats(context.stats),
+     _sectorsCopied(0),
+     _sectorsSkipped(0)
+{
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * CopyEngine::WriteNonZero --
+ *
+ *      Writes the chunk buffer to dst, leaving out every grain
+ *      that is all zero.
+ *
+ * Results:
+ *      None. Throws VixDiskError on failure.
+ *
+ * Side effects:
+ *      Updates the skipped sector counter.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+CopyEngine::WriteNonZero(VixDiskView dst,                    // IN
+                         VixDiskLibSectorType startSector,   // IN
+                         VixDiskLibSectorType numSectors)    // IN
+{
+   VixDiskLibSectorType skipped, written;
+
+   skipped = MarkZeroGrains(_buf, startSector, numSectors, _zeroGrains);
+   written = WriteGrains(dst, startSector, numSectors, _buf,
+                         &_zeroGrains[0], _writeLock);
+   _sectorsSkipped += skipped;
+   if (_stats != NULL) {
+      LiveAdd(_stats->bytesWritten, written * VIXDISKLIB_SECTOR_SIZE);
+      LiveAdd(_stats->bytesSkipped, skipped * VIXDISKLIB_SECTOR_SIZE);
+      LiveAdd(_stats->writeOps, 1);
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * CopyEngine::Copy --
+ *
+ *      Copies numSectors sectors starting at startSector from src to the
+ *      same offset in dst, one chunk per read/write. The
+ *      last chunk is shortened to whatever is left of the range.
+ *
+ * Results:
+ *      None. Throws VixDiskError on failure.
+ *
+ * Side effects:
+ *      Prints MB/s statistics like DoRWBench if printProgress was set.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+CopyEngine::Copy(VixDiskView src,                    // IN
+                 VixDiskView dst,                    // IN
+                 VixDiskLibSectorType startSector,   // IN
+                 VixDiskLibSectorType numSectors)    // IN
+{
+   VixDiskLibSectorType done = 0;
+   VixDiskLibSectorType bufUpdate = 0;
+   VixDiskLibSectorType copiedBefore = _sectorsCopied;
+   uint64 start, end, total;
+
+   total = NowNsec();
+   start = total;
+   try {
+      while (done < numSectors) {
+         VixDiskLibSectorType count = numSectors - done;
+
+         if (count > _chunkSize) {
+            count = _chunkSize;
+         }
+         if (_journal != NULL && _journal->IsDone(startSector + done)) {
+            done += count;
+            continue;
+         }
+         _limiter->Acquire(count * VIXDISKLIB_SECTOR_SIZE, 1);
+         src.Read(startSector + done,
+                  VixByteSpan(_buf, count * VIXDISKLIB_SECTOR_SIZE));
+         if (_stats != NULL) {
+            LiveAdd(_stats->bytesRead, count * VIXDISKLIB_SECTOR_SIZE);
+            LiveAdd(_stats->readOps, 1);
+         }
+         if (_manifest != NULL) {
+            _manifest->HashRange(_buf, startSector + done, count, _hashPool);
+         }
+         if (_skipZero) {
+            WriteNonZero(dst, startSector + done, count);
+         } else {
+            LockedWrite(dst, startSector + done, count, _buf,
+                        _writeLock);
+            if (_stats != NULL) {
+               LiveAdd(_stats->bytesWritten, count * VIXDISKLIB_SECTOR_SIZE);
+               LiveAdd(_stats->writeOps, 1);
+            }
+         }
+         if (_journal != NULL) {
+            _journal->Mark(startSector + done, count);
+         }
+
+         done += count;
+         _sectorsCopied += count;
+         bufUpdate += count;
+         if (_printProgress && bufUpdate >= BUFS_PER_STAT) {
+            end = NowNsec();
+            PrintStat("Copied", start, end, bufUpdate);
+            start = end;
+            bufUpdate = 0;
+         }
+      }
+   } catch (...) {
+      LiveError(_stats);
+      throw;
+   }
+   if (_printProgress) {
+      PrintCopyTotal(total, NowNsec(), numSectors,
+                     _sectorsCopied - copiedBefore);
+   }
+}
+
+
+#ifdef _WIN32
+#define TASK_OK 0
+#define TASK_FAIL 1
+#define THREAD_RESULT unsigned __stdcall
+
+typedef HANDLE ThreadHandle;
+typedef unsigned (__stdcall *ThreadFunc)(void *);
+#else
+#define TASK_OK ((void*)0)
+#define TASK_FAIL ((void*)1)
+#define THREAD_RESULT void *
+
+typedef pthread_t ThreadHandle;
+typedef void *(*ThreadFunc)(void *);
+#endif
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * StartThread --
+ *
+ *      Starts a thread running func(arg).
+ *
+ * Results:
+ *      Handle of the new thread, to be passed to JoinThread.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static ThreadHandle
+StartThread(ThreadFunc func,   // IN
+            void *arg)         // IN
+{
+#ifdef _WIN32
+   unsigned int threadId;
+
+   return (HANDLE)_beginthreadex(NULL, 0, func, arg, 0, &threadId);
+#else
+   pthread_t thread;
+
+   pthread_create(&thread, NULL, func, arg);
+   return thread;
+#endif
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * JoinThread --
+ *
+ *      Waits for a thread started by StartThread to finish.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+JoinThread(ThreadHandle thread)   // IN
+{
+#ifdef _WIN32
+   WaitForSingleObject(thread, INFINITE);
+   CloseHandle(thread);
+#else
+   void *hlp;
+
+   pthread_join(thread, &hlp);
+#endif
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * AllocAligned --
+ *
+ *      Allocates an I/O buffer of size bytes aligned to IO_ARENA_PAGE
+ *      from ioArena, which once warmed up allocates no memory.
+ *
+ * Results:
+ *      Pointer to the buffer, to be released with FreeAligned.
+ *
+ * Side effects:
+ *      Throws std::bad_alloc if out of memory.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static uint8 *
+AllocAligned(size_t size)   // IN
+{
+   return (uint8 *)ioArena.Alloc(size);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * FreeAligned --
+ *
+ *      Releases a buffer allocated by AllocAligned.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+FreeAligned(uint8 *ptr)   // IN
+{
+   ioArena.Free(ptr);
+}
+
+
+// One chunk to hash on a HashPool.
+struct HashTask {
+   const uint8 *data;
+   size_t len;
+   uint8 *digest;
+   size_t *pending;   // tasks of the batch still to do, under the pool lock
+};
+
+
+// Threads hashing batches of chunks. The thread submitting a batch
+// helps with the work, so a pool without threads hashes inline.
+
+class HashPool
+{
+public:
+    explicit HashPool(unsigned numThreads);
+    ~HashPool();
+
+    // Hashes all tasks and returns when done.
+    void Hash(vector<HashTask> &tasks);
+
+    // Thread body, public only for the thread entry point.
+    void Run(void);
+
+private:
+    void RunOne(std::unique_lock<std::mutex> &lock);
+
+    vector<ThreadHandle> _threads;
+    std::mutex _lock;
+    std::condition_variable _workCv;
+    std::condition_variable _doneCv;
+    std::deque<HashTask *> _queue;
+    bool _stop;
+};
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Sha1Block --
+ *
+ *      SHA-1 compression function (FIPS 180-4) over one 64-byte block.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Updates state.
+ *
+ *----------------------------------------------------------------------
+ */
+
+#define SHA1_ROTL(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+
+static void
+Sha1Block(uint32 state[5],      // IN/OUT
+          const uint8 *block)   // IN
+{
+   uint32 w[80];
+   uint32 a, b, c, d, e;
+   int i;
+
+   for (i = 0; i < 16; i++) {
+      w[i] = (uint32)block[4 * i] << 24 | (uint32)block[4 * i + 1] << 16 |
+             (uint32)block[4 * i + 2] << 8 | block[4 * i + 3];
+   }
+   for (i = 16; i < 80; i++) {
+      w[i] = SHA1_ROTL(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+   }
+
+   a = state[0];
+   b = state[1];
+   c = state[2];
+   d = state[3];
+   e = state[4];
+   for (i = 0; i < 80; i++) {
+      uint32 f, k, t;
+
+      if (i < 20) {
+         f = (b & c) | (~b & d);
+         k = 0x5a827999;
+      } else if (i < 40) {
+         f = b ^ c ^ d;
+         k = 0x6ed9eba1;
+      } else if (i < 60) {
+         f = (b & c) | (b & d) | (c & d);
+         k = 0x8f1bbcdc;
+      } else {
+         f = b ^ c ^ d;
+         k = 0xca62c1d6;
+      }
+      t = SHA1_ROTL(a, 5) + f + e + k + w[i];
+      e = d;
+      d = c;
+      c = SHA1_ROTL(b, 30);
+      b = a;
+      a = t;
+   }
+   state[0] += a;
+   state[1] += b;
+   state[2] += c;
+   state[3] += d;
+   state[4] += e;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Sha1 --
+ *
+ *      Computes the SHA-1 digest of len bytes.
+ *
+ * Results:
+ *      SHA1_HASH_SIZE bytes in digest.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+Sha1(const uint8 *data,   // IN
+     size_t len,          // IN
+     uint8 *digest)       // OUT
+{
+   uint32 state[5] = { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476,
+                       0xc3d2e1f0 };
+   uint64 bits = (uint64)len * 8;
+   uint8 tail[128];
+   size_t tailLen = len % 64;
+   size_t padLen;
+   size_t i;
+
+   for (i = 0; i + 64 <= len; i += 64) {
+      Sha1Block(state, data + i);
+   }
+   memcpy(tail, data + i, tailLen);
+   padLen = tailLen < 56 ? 64 : 128;
+   memset(tail + tailLen, 0, padLen - tailLen);
+   tail[tailLen] = 0x80;
+   for (i = 0; i < 8; i++) {
+      tail[padLen - 1 - i] = (uint8)(bits >> (8 * i));
+   }
+   for (i = 0; i < padLen; i += 64) {
+      Sha1Block(state, tail + i);
+   }
+   for (i = 0; i < 5; i++) {
+      digest[4 * i] = (uint8)(state[i] >> 24);
+      digest[4 * i + 1] = (uint8)(state[i] >> 16);
+      digest[4 * i + 2] = (uint8)(state[i] >> 8);
+      digest[4 * i + 3] = (uint8)state[i];
+   }
+}
+
+
+static THREAD_RESULT
+HashPoolThread(void *arg)
+{
+   ((HashPool *)arg)->Run();
+   return TASK_OK;
+}
+
+
+HashPool::HashPool(unsigned numThreads)   // IN
+   : _threads(numThreads),
+     _stop(false)
+{
+   size_t i;
+
+   for (i = 0; i < _threads.size(); i++) {
+      _threads[i] = StartThread(&HashPoolThread, (void*)this);
+   }
+}
+
+
+HashPool::~HashPool()
+{
+   size_t i;
+
+   {
+      std::lock_guard<std::mutex> guard(_lock);
+      _stop = true;
+   }
+   _workCv.notify_all();
+   for (i = 0; i < _threads.size(); i++) {
+      JoinThread(_threads[i]);
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * HashPool::RunOne --
+ *
+ *      Takes the first queued task and hashes it with the lock dropped.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Wakes the submitter when its batch is complete.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+HashPool::RunOne(std::unique_lock<std::mutex> &lock)   // IN/OUT
+{
+   HashTask *task = _queue.front();
+
+   _queue.pop_front();
+   lock.unlock();
+   Sha1(task->data, task->len, task->digest);
+   lock.lock();
+   if (--*task->pending == 0) {
+      _doneCv.notify_all();
+   }
+}
+
+
+void
+HashPool::Run(void)
+{
+   std::unique_lock<std::mutex> lock(_lock);
+
+   for (;;) {
+      while (!_stop && _queue.empty()) {
+         _workCv.wait(lock);
+      }
+      if (_queue.empty()) {
+         break;
+      }
+      RunOne(lock);
+   }
+}
+
+
+void
+HashPool::Hash(vector<HashTask> &tasks)   // IN/OUT
+{
+   std::unique_lock<std::mutex> lock(_lock);
+   size_t pending = tasks.size();
+   size_t i;
+
+   for (i = 0; i < tasks.size(); i++) {
+      tasks[i].pending = &pending;
+      _queue.push_back(&tasks[i]);
+   }
+   _workCv.notify_all();
+   while (pending > 0) {
+      if (!_queue.empty()) {
+         RunOne(lock);
+      } else {
+         _doneCv.wait(lock);
+      }
+   }
+}
+
+
+Manifest::Manifest(const string &uuid,                    // IN
+                   VixDiskLibSectorType capacity,         // IN
+                   VixDiskLibSectorType chunkSectors)     // IN
+   : _uuid(uuid),
+     _capacity(capacity),
+     _chunkSectors(chunkSectors)
+{
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Manifest::HashRange --
+ *
+ *      Hashes the chunks lying entirely within numSectors sectors read
+ *      from startSector into buf, in parallel on pool if not NULL. A
+ *      chunk cut short by the end of the disk counts as entire.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Allocates the hash table on first use.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+Manifest::HashRange(const uint8 *buf,                   // IN
+                    VixDiskLibSectorType startSector,   // IN
+                    VixDiskLibSectorType numSectors,    // IN
+                    HashPool *pool)                     // IN
+{
+   VixDiskLibSectorType pos = 0;
+   vector<HashTask> tasks;
+   size_t i;
+
+   {
+      std::lock_guard<std::mutex> guard(_allocLock);
+
+      if (_hashed.empty()) {
+         uint64 numChunks = (_capacity + _chunkSectors - 1) / _chunkSectors;
+
+         _hashes.resize(numChunks * SHA1_HASH_SIZE);
+         _hashed.resize(numChunks);
+      }
+   }
+
+   if (startSector % _chunkSectors != 0) {
+      pos = _chunkSectors - startSector % _chunkSectors;
+   }
+   while (pos < numSectors && startSector + pos < _capacity) {
+      VixDiskLibSectorType sector = startSector + pos;
+      VixDiskLibSectorType count = _capacity - sector;
+      uint64 chunk = sector / _chunkSectors;
+      HashTask task;
+
+      if (count > _chunkSectors) {
+         count = _chunkSectors;
+      }
+      if (pos + count > numSectors) {
+         break;
+      }
+      task.data = buf + pos * VIXDISKLIB_SECTOR_SIZE;
+      task.len = count * VIXDISKLIB_SECTOR_SIZE;
+      task.digest = &_hashes[chunk * SHA1_HASH_SIZE];
+      task.pending = NULL;
+      tasks.push_back(task);
+      _hashed[chunk] = 1;
+      pos += count;
+   }
+
+   if (pool != NULL) {
+      pool->Hash(tasks);
+   } else {
+      for (i = 0; i < tasks.size(); i++) {
+         Sha1(tasks[i].data, tasks[i].len, tasks[i].digest);
+      }
+   }
+}
+
+
+uint64
+Manifest::ChunksHashed() const
+{
+   uint64 count = 0;
+   size_t i;
+
+   for (i = 0; i < _hashed.size(); i++) {
+      count += _hashed[i];
+   }
+   return count;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Manifest::Save --
+ *
+ *      Writes the manifest to path in the ManifestHeader layout.
+ *
+ * Results:
+ *      None. Throws VixDiskError on failure.
+ *
+ * Side effects:
+ *      Creates or replaces path.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+Manifest::Save(const char *path) const   // IN
+{
+   uint64 numChunks = (_capacity + _chunkSectors - 1) / _chunkSectors;
+   vector<uint8> bitmap((numChunks + 7) / 8);
+   vector<uint8> hashes(_hashes);
+   string tmpPath = string(path) + ".tmp";
+   ManifestHeader header;
+   FILE *file;
+   bool ok;
+   size_t i;
+
+   hashes.resize(numChunks * SHA1_HASH_SIZE);
+   for (i = 0; i < _hashed.size(); i++) {
+      if (_hashed[i]) {
+         bitmap[i / 8] |= 1 << (i % 8);
+      }
+   }
+
+   memset(&header, 0, sizeof header);
+   memcpy(header.magic, MANIFEST_MAGIC, sizeof header.magic);
+   header.version = MANIFEST_VERSION;
+   header.hashType = MANIFEST_HASH_SHA1;
+   header.hashSize = SHA1_HASH_SIZE;
+   header.chunkSectors = (uint32)_chunkSectors;
+   header.capacity = _capacity;
+   header.numChunks = numChunks;
+   header.hashOffset = sizeof header;
+   header.bitmapOffset = header.hashOffset + hashes.size();
+   strncpy(header.uuid, _uuid.c_str(), sizeof header.uuid - 1);
+
+   // Written aside and renamed, so an interrupted save keeps the old file.
+   file = fopen(tmpPath.c_str(), "wb");
+   if (file == NULL) {
+      throw VixDiskError(strerror(errno), __FILE__, __LINE__);
+   }
+   ok = fwrite(&header, sizeof header, 1, file) == 1 &&
+        (hashes.empty() ||
+         fwrite(&hashes[0], hashes.size(), 1, file) == 1) &&
+        (bitmap.empty() ||
+         fwrite(&bitmap[0], bitmap.size(), 1, file) == 1);
+   if (fclose(file) != 0) {
+      ok = false;
+   }
+#ifdef _WIN32
+   if (ok) {
+      remove(path);
+   }
+#endif
+   if (!ok || rename(tmpPath.c_str(), path) != 0) {
+      remove(tmpPath.c_str());
+      throw VixDiskError("Cannot write manifest", __FILE__, __LINE__);
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Manifest::Load --
+ *
+ *      Reads the hashes saved in path, provided the file describes a
+ *      disk with the same uuid, capacity and chunk size as this one.
+ *
+ * Results:
+ *      true if loaded, false (with a message) if path is missing,
+ *      unreadable or for another disk.
+ *
+ * Side effects:
+ *      Replaces the hashes of this manifest.
+ *
+ *----------------------------------------------------------------------
+ */
+
+bool
+Manifest::Load(const char *path)   // IN
+{
+   uint64 numChunks = (_capacity + _chunkSectors - 1) / _chunkSectors;
+   vector<uint8> bitmap((numChunks + 7) / 8);
+   ManifestHeader header;
+   FILE *file;
+   bool ok;
+   size_t i;
+
+   file = fopen(path, "rb");
+   if (file == NULL) {
+      printf("No manifest in %s.\n", path);
+      return false;
+   }
+   ok = fread(&header, sizeof header, 1, file) == 1;
+   header.uuid[sizeof header.uuid - 1] = '\0';
+   if (!ok || memcmp(header.magic, MANIFEST_MAGIC, sizeof header.magic) != 0 ||
+       header.version != MANIFEST_VERSION ||
+       header.hashType != MANIFEST_HASH_SHA1 ||
+       header.hashSize != SHA1_HASH_SIZE) {
+      printf("%s is not a manifest.\n", path);
+      fclose(file);
+      return false;
+   }
+   if (header.chunkSectors != _chunkSectors || header.capacity != _capacity ||
+       header.numChunks != numChunks || _uuid != header.uuid) {
+      printf("Manifest %s is for another disk or chunk size.\n", path);
+      fclose(file);
+      return false;
+   }
+
+   _hashes.resize(numChunks * SHA1_HASH_SIZE);
+   _hashed.assign(numChunks, 0);
+   ok = fseek(file, (long)header.hashOffset, SEEK_SET) == 0 &&
+        (_hashes.empty() ||
+         fread(&_hashes[0], _hashes.size(), 1, file) == 1) &&
+        fseek(file, (long)header.bitmapOffset, SEEK_SET) == 0 &&
+        (bitmap.empty() ||
+         fread(&bitmap[0], bitmap.size(), 1, file) == 1);
+   fclose(file);
+   if (!ok) {
+      printf("Manifest %s is truncated.\n", path);
+      _hashed.assign(numChunks, 0);
+      return false;
+   }
+   for (i = 0; i < numChunks; i++) {
+      _hashed[i] = (bitmap[i / 8] >> (i % 8)) & 1;
+   }
+   return true;
+}
+
+
+bool
+Manifest::SameChunk(const Manifest &other,   // IN
+                    uint64 chunk) const      // IN
+{
+   return chunk < _hashed.size() && chunk < other._hashed.size() &&
+          _hashed[chunk] && other._hashed[chunk] &&
+          memcmp(&_hashes[chunk * SHA1_HASH_SIZE],
+                 &other._hashes[chunk * SHA1_HASH_SIZE], SHA1_HASH_SIZE) == 0;
+}
+
+
+CopyJournal::CopyJournal(const string &path)   // IN
+   : _path(path),
+     _file(NULL),
+     _dataFd(-1),
+     _capacity(0),
+     _chunkSectors(0),
+     _numChunks(0),
+     _bitmapOffset(sizeof(JournalHeader)),
+     _dirtyStart(0),
+     _dirtyEnd(0),
+     _lastSync(0),
+     _chunksDone(0)
+{
+}
+
+
+CopyJournal::~CopyJournal()
+{
+   Close();
+}
+
+
+void
+CopyJournal::Close(void)
+{
+   if (_file != NULL) {
+      fclose(_file);
+      _file = NULL;
+   }
+   if (_dataFd >= 0) {
+#ifdef _WIN32
+      _close(_dataFd);
+#else
+      close(_dataFd);
+#endif
+      _dataFd = -1;
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * CopyJournal::Create --
+ *
+ *      Writes an empty journal for a copy of the disk srcUuid into the
+ *      disk dstUuid, whose single file is dataPath.
+ *
+ * Results:
+ *      None. Throws VixDiskError on failure.
+ *
+ * Side effects:
+ *      Creates or replaces the journal file.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+CopyJournal::Create(const char *dataPath,                // IN
+                    const string &srcUuid,               // IN
+                    const string &dstUuid,               // IN
+                    VixDiskLibSectorType capacity,       // IN
+                    VixDiskLibSectorType chunkSectors)   // IN
+{
+   JournalHeader header;
+
+   Close();
+   _capacity = capacity;
+   _chunkSectors = chunkSectors;
+   _numChunks = (capacity + chunkSectors - 1) / chunkSectors;
+   _bitmap.assign((_numChunks + 7) / 8, 0);
+   _chunksDone = 0;
+
+   memset(&header, 0, sizeof header);
+   memcpy(header.magic, JOURNAL_MAGIC, sizeof header.magic);
+   header.version = JOURNAL_VERSION;
+   header.chunkSectors = (uint32)chunkSectors;
+   header.capacity = capacity;
+   header.numChunks = _numChunks;
+   header.bitmapOffset = _bitmapOffset;
+   strncpy(header.srcUuid, srcUuid.c_str(), sizeof header.srcUuid - 1);
+   strncpy(header.dstUuid, dstUuid.c_str(), sizeof header.dstUuid - 1);
+
+   _file = fopen(_path.c_str(), "w+b");
+   if (_file == NULL) {
+      throw VixDiskError(strerror(errno), __FILE__, __LINE__);
+   }
+   if (fwrite(&header, sizeof header, 1, _file) != 1 ||
+       (!_bitmap.empty() &&
+        fwrite(&_bitmap[0], _bitmap.size(), 1, _file) != 1)) {
+      throw VixDiskError("Cannot write the copy journal", __FILE__,
+                         __LINE__);
+   }
+#ifdef _WIN32
+   _dataFd = _open(dataPath, _O_RDWR | _O_BINARY);
+#else
+   _dataFd = open(dataPath, O_RDONLY);
+#endif
+   _dirtyStart = 0;
+   _dirtyEnd = 0;
+   _lastSync = NowNsec();
+   DoSync();
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * CopyJournal::Open --
+ *
+ *      Reads the journal left by an interrupted copy, provided it is for
+ *      the same source and target disks, capacity and chunk size.
+ *
+ * Results:
+ *      true if the copy can resume, false (with a message) if not.
+ *
+ * Side effects:
+ *      Keeps the journal open for more chunks.
+ *
+ *----------------------------------------------------------------------
+ */
+
+bool
+CopyJournal::Open(const char *dataPath,                // IN
+                  const string &srcUuid,               // IN
+                  const string &dstUuid,               // IN
+                  VixDiskLibSectorType capacity,       // IN
+                  VixDiskLibSectorType chunkSectors)   // IN
+{
+   uint64 numChunks = (capacity + chunkSectors - 1) / chunkSectors;
+   JournalHeader header;
+   uint64 i;
+
+   Close();
+   _file = fopen(_path.c_str(), "r+b");
+   if (_file == NULL) {
+      printf("No copy journal in %s.\n", _path.c_str());
+      return false;
+   }
+   if (fread(&header, sizeof header, 1, _file) != 1 ||
+       memcmp(header.magic, JOURNAL_MAGIC, sizeof header.magic) != 0 ||
+       header.version != JOURNAL_VERSION) {
+      printf("%s is not a copy journal.\n", _path.c_str());
+      Close();
+      return false;
+   }
+   header.srcUuid[sizeof header.srcUuid - 1] = '\0';
+   header.dstUuid[sizeof header.dstUuid - 1] = '\0';
+   if (srcUuid != header.srcUuid || dstUuid != header.dstUuid ||
+       header.capacity != capacity || header.chunkSectors != chunkSectors ||
+       header.numChunks != numChunks) {
+      printf("Copy journal %s is for other disks or another chunk size.\n",
+             _path.c_str());
+      Close();
+      return false;
+   }
+
+   _capacity = capacity;
+   _chunkSectors = chunkSectors;
+   _numChunks = numChunks;
+   _bitmapOffset = header.bitmapOffset;
+   _bitmap.assign((numChunks + 7) / 8, 0);
+   if (fseek(_file, (long)_bitmapOffset, SEEK_SET) != 0 ||
+       (!_bitmap.empty() &&
+        fread(&_bitmap[0], _bitmap.size(), 1, _file) != 1)) {
+      printf("Copy journal %s is truncated.\n", _path.c_str());
+      Close();
+      return false;
+   }
+   _chunksDone = 0;
+   for (i = 0; i < numChunks; i++) {
+      _chunksDone += (_bitmap[i / 8] >> (i % 8)) & 1;
+   }
+#ifdef _WIN32
+   _dataFd = _open(dataPath, _O_RDWR | _O_BINARY);
+#else
+   _dataFd = open(dataPath, O_RDONLY);
+#endif
+   _dirtyStart = 0;
+   _dirtyEnd = 0;
+   _lastSync = NowNsec();
+   return true;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * CopyJournal::Remove --
+ *
+ *      Closes and deletes the journal once the copy is complete.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+CopyJournal::Remove(void)
+{
+   Close();
+   remove(_path.c_str());
+}
+
+
+bool
+CopyJournal::IsDone(VixDiskLibSectorType sector) const   // IN
+{
+   uint64 chunk = sector / _chunkSectors;
+   std::lock_guard<std::mutex> guard(_lock);
+
+   return (_bitmap[chunk / 8] >> (chunk % 8)) & 1;
+}
+
+
+VixDiskLibSectorType
+CopyJournal::FirstIncomplete() const
+{
+   uint64 chunk;
+   std::lock_guard<std::mutex> guard(_lock);
+
+   for (chunk = 0; chunk < _numChunks; chunk++) {
+      if (!((_bitmap[chunk / 8] >> (chunk % 8)) & 1)) {
+         return chunk * _chunkSectors;
+      }
+   }
+   return _capacity;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * CopyJournal::Mark --
+ *
+ *      Records that numSectors sectors from startSector are on the
+ *      target. Only the chunks entirely within the range are marked; a
+ *      chunk cut short by the end of the disk counts as entire.
+ *
+ * Results:
+ *      None. Throws VixDiskError if a due sync fails.
+ *
+ * Side effects:
+ *      Syncs the journal if the last sync is JOURNAL_SYNC_MSEC old.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+CopyJournal::Mark(VixDiskLibSectorType startSector,   // IN
+                  VixDiskLibSectorType numSectors)    // IN
+{
+   VixDiskLibSectorType end = startSector + numSectors;
+   uint64 chunk = (startSector + _chunkSectors - 1) / _chunkSectors;
+   uint64 now = NowNsec();
+   bool due;
+   std::unique_lock<std::mutex> guard(_lock);
+
+   for (; chunk < _numChunks; chunk++) {
+      VixDiskLibSectorType chunkEnd = (chunk + 1) * _chunkSectors;
+      uint8 bit = 1 << (chunk % 8);
+
+      if (chunkEnd > _capacity) {
+         chunkEnd = _capacity;
+      }
+      if (chunkEnd > end) {
+         break;
+      }
+      if (!(_bitmap[chunk / 8] & bit)) {
+         _bitmap[chunk / 8] |= bit;
+         _chunksDone++;
+         if (_dirtyStart == _dirtyEnd) {
+            _dirtyStart = chunk / 8;
+            _dirtyEnd = chunk / 8 + 1;
+         } else {
+            _dirtyStart = std::min(_dirtyStart, (size_t)(chunk / 8));
+            _dirtyEnd = std::max(_dirtyEnd, (size_t)(chunk / 8 + 1));
+         }
+      }
+   }
+   // Whoever finds the sync due takes it; the others carry on.
+   due = now - _lastSync >= JOURNAL_SYNC_MSEC * 1000000ULL;
+   if (due) {
+      _lastSync = now;
+   }
+   guard.unlock();
+   if (due) {
+      DoSync();
+   }
+}
+
+
+void
+CopyJournal::Sync(void)
+{
+   DoSync();
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * CopyJournal::DoSync --
+ *
+ *      Makes the chunks marked so far durable. The changed bytes of the
+ *      bitmap are copied first, under _lock; then the target file is
+ *      flushed, which covers the data of every chunk in the copy, and
+ *      only then is the copy written to the journal and flushed. Chunks
+ *      marked meanwhile wait for the next sync.
+ *
+ * Results:
+ *      None. Throws VixDiskError on failure; the copied bytes are then
+ *      left dirty.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+CopyJournal::DoSync(void)
+{
+   std::lock_guard<std::mutex> syncGuard(_syncLock);
+   vector<uint8> dirty;
+   size_t dirtyStart;
+   bool ok;
+
+   if (_file == NULL) {
+      return;
+   }
+   {
+      std::lock_guard<std::mutex> guard(_lock);
+
+      dirtyStart = _dirtyStart;
+      if (_dirtyEnd > _dirtyStart) {
+         dirty.assign(_bitmap.begin() + _dirtyStart,
+                      _bitmap.begin() + _dirtyEnd);
+      }
+      _dirtyStart = 0;
+      _dirtyEnd = 0;
+   }
+
+#ifdef _WIN32
+   ok = _dataFd < 0 || _commit(_dataFd) == 0;
+#else
+   ok = _dataFd < 0 || fsync(_dataFd) == 0;
+#endif
+   if (ok && !dirty.empty()) {
+      ok = fseek(_file, (long)(_bitmapOffset + dirtyStart), SEEK_SET) == 0 &&
+           fwrite(&dirty[0], dirty.size(), 1, _file) == 1;
+   }
+#ifdef _WIN32
+   ok = ok && fflush(_file) == 0 && _commit(_fileno(_file)) == 0;
+#else
+   ok = ok && fflush(_file) == 0 && fsync(fileno(_file)) == 0;
+#endif
+   if (!ok) {
+      std::lock_guard<std::mutex> guard(_lock);
+
+      if (!dirty.empty()) {
+         if (_dirtyStart == _dirtyEnd) {
+            _dirtyStart = dirtyStart;
+            _dirtyEnd = dirtyStart + dirty.size();
+         } else {
+            _dirtyStart = std::min(_dirtyStart, dirtyStart);
+            _dirtyEnd = std::max(_dirtyEnd, dirtyStart + dirty.size());
+         }
+      }
+      throw VixDiskError("Cannot sync the copy journal", __FILE__,
+                         __LINE__);
+   }
+}
+
+
+void
+HashStage::Process(PipelineBuffer *buf)   // IN
+{
+   _manifest->HashRange(buf->data, buf->startSector, buf->numSectors, _pool);
+}
+
+
+VerifyStage::VerifyStage(const Manifest *source,   // IN
+                         HashPool *pool)            // IN
+   : _source(source),
+     _pool(pool),
+     _dstHandle(NULL),
+     _lock(NULL),
+     _readBuf(NULL),
+     _chunksVerified(0),
+     _chunksMismatched(0),
+     _chunksUnwritten(0),
+     _firstMismatch(0),
+     _sectorsReread(0)
+{
+}
+
+
+VerifyStage::~VerifyStage()
+{
+   FreeAligned(_readBuf);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VerifyStage::SetTarget --
+ *
+ *      Sets the disk written by the pipeline, the lock its writer holds
+ *      around each write and the largest buffer size.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Allocates the read buffer on first use.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+VerifyStage::SetTarget(VixDiskLibHandle dstHandle,        // IN
+                       std::mutex *lock,                  // IN
+                       VixDiskLibSectorType chunkSize)    // IN
+{
+   _dstHandle = dstHandle;
+   _lock = lock;
+   if (_readBuf == NULL) {
+      _readBuf = AllocAligned(chunkSize * VIXDISKLIB_SECTOR_SIZE);
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VerifyStage::Process --
+ *
+ *      Finds the manifest chunks of a written buffer that have at least
+ *      one written grain and checks each run of them with one read.
+ *      Buffers must start on a chunk boundary.
+ *
+ * Results:
+ *      None. Throws VixDiskError if the target cannot be read.
+ *
+ * Side effects:
+ *      Updates the chunk counters.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+VerifyStage::Process(PipelineBuffer *buf)   // IN
+{
+   VixDiskLibSectorType chunkSectors = _source->ChunkSectors();
+   vector<uint8> written((buf->numSectors + chunkSectors - 1) / chunkSectors,
+                         buf->grainsMarked ? 0 : 1);
+   VixDiskLibSectorType pos = 0;
+   size_t grain, i, run;
+
+   if (buf->grainsMarked) {
+      for (grain = 0; pos < buf->numSectors; grain++) {
+         VixDiskLibSectorType len = GrainSectors(buf->startSector,
+                                                 buf->numSectors, pos);
+
+         if (!buf->skipGrains[grain]) {
+            for (i = pos / chunkSectors;
+                 i <= (pos + len - 1) / chunkSectors; i++) {
+               written[i] = 1;
+            }
+         }
+         pos += len;
+      }
+   }
+
+   for (i = 0; i < written.size(); i = run) {
+      VixDiskLibSectorType start, end;
+
+      for (run = i; run < written.size() && written[run] == written[i];
+           run++) {
+      }
+      if (!written[i]) {
+         _chunksUnwritten += run - i;
+         continue;
+      }
+      start = i * chunkSectors;
+      end = run * chunkSectors;
+      if (end > buf->numSectors) {
+         end = buf->numSectors;
+      }
+      CheckRun(buf->startSector + start, end - start);
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VerifyStage::CheckRun --
+ *
+ *      Reads numSectors sectors at startSector back from the target and
+ *      compares the hash of each chunk with the source hash.
+ *
+ * Results:
+ *      None. Throws VixDiskError if the target cannot be read.
+ *
+ * Side effects:
+ *      Updates the chunk counters, prints the chunks that differ.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+VerifyStage::CheckRun(VixDiskLibSectorType startSector,   // IN
+                      VixDiskLibSectorType numSectors)    // IN
+{
+   VixDiskLibSectorType chunkSectors = _source->ChunkSectors();
+   size_t numChunks = (numSectors + chunkSectors - 1) / chunkSectors;
+   vector<uint8> digests(numChunks * SHA1_HASH_SIZE);
+   vector<HashTask> tasks(numChunks);
+   VixError vixError;
+   size_t i;
+
+   {
+      std::lock_guard<std::mutex> guard(*_lock);
+      vixError = VixDiskLib_Read(_dstHandle, startSector, numSectors,
+                                 _readBuf);
+   }
+   CHECK_AND_THROW(vixError);
+   _sectorsReread += numSectors;
+
+   for (i = 0; i < numChunks; i++) {
+      VixDiskLibSectorType len = numSectors - i * chunkSectors;
+
+      tasks[i].data = _readBuf + i * chunkSectors * VIXDISKLIB_SECTOR_SIZE;
+      tasks[i].len = (len > chunkSectors ? chunkSectors : len) *
+                     VIXDISKLIB_SECTOR_SIZE;
+      tasks[i].digest = &digests[i * SHA1_HASH_SIZE];
+      tasks[i].pending = NULL;
+   }
+   if (_pool != NULL) {
+      _pool->Hash(tasks);
+   } else {
+      for (i = 0; i < tasks.size(); i++) {
+         Sha1(tasks[i].data, tasks[i].len, tasks[i].digest);
+      }
+   }
+
+   for (i = 0; i < numChunks; i++) {
+      VixDiskLibSectorType sector = startSector + i * chunkSectors;
+      const uint8 *hash = _source->ChunkHash(sector / chunkSectors);
+
+      if (hash != NULL &&
+          memcmp(hash, &digests[i * SHA1_HASH_SIZE], SHA1_HASH_SIZE) == 0) {
+         _chunksVerified++;
+         continue;
+      }
+      if (_chunksMismatched++ == 0) {
+         _firstMismatch = sector;
+      }
+      printf("Chunk at sector %" FMT64 "u differs from the source.\n",
+             sector);
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * DeltaStage::Process --
+ *
+ *      Pipeline stage hashing a buffer and flagging the grains of its
+ *      unchanged chunks. Grains already flagged by an earlier stage stay
+ *      flagged. The chunk size must be a multiple of the grain size.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Updates the chunk counters.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+DeltaStage::Process(PipelineBuffer *buf)   // IN/OUT
+{
+   VixDiskLibSectorType chunkSectors = _current->ChunkSectors();
+   VixDiskLibSectorType pos = 0;
+   size_t grain;
+
+   _current->HashRange(buf->data, buf->startSector, buf->numSectors, _pool);
+
+   if (!buf->grainsMarked) {
+      buf->skipGrains.clear();
+      while (pos < buf->numSectors) {
+         buf->skipGrains.push_back(0);
+         pos += GrainSectors(buf->startSector, buf->numSectors, pos);
+      }
+      buf->grainsMarked = true;
+   }
+
+   pos = 0;
+   for (grain = 0; pos < buf->numSectors; grain++) {
+      VixDiskLibSectorType sector = buf->startSector + pos;
+      bool same = _record != NULL &&
+                  _record->SameChunk(*_current, sector / chunkSectors);
+
+      if (sector % chunkSectors == 0) {
+         if (same) {
+            _chunksUnchanged++;
+         } else {
+            _chunksChanged++;
+         }
+      }
+      if (same) {
+         buf->skipGrains[grain] = 1;
+      }
+      pos += GrainSectors(buf->startSector, buf->numSectors, pos);
+   }
+}
+
+
+DedupCheckStage::DedupCheckStage(const DdfsIndex *index,   // IN
+                                 HashPool *pool)           // IN
+   : _index(index),
+     _pool(pool),
+     _blockSectors(index->Config().blockSize / VIXDISKLIB_SECTOR_SIZE),
+     _bytesChecked(0),
+     _bytesSkipped(0),
+     _bytesZero(0),
+     _bytesKnown(0)
+{
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * DedupCheckStage::Process --
+ *
+ *      Pipeline stage hashing the ddumbfs blocks of a buffer (in
+ *      parallel on the pool) and looking each up in the index. Blocks
+ *      are aligned to absolute disk offsets, which are the file offsets
+ *      of a flat or raw image; partial blocks at the buffer ends are
+ *      counted as new.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Updates the byte counters.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+DedupCheckStage::Process(PipelineBuffer *buf)   // IN
+{
+   VixDiskLibSectorType first = buf->startSector / _blockSectors;
+   VixDiskLibSectorType last = (buf->startSector + buf->numSectors - 1) /
+                               _blockSectors;
+   vector<uint8> written(last - first + 1, !buf->grainsMarked);
+   vector<uint8> digests((last - first + 1) * SHA1_HASH_SIZE);
+   vector<HashTask> tasks;
+   vector<uint64> blocks;
+   VixDiskLibSectorType pos = 0;
+   size_t grain, i;
+
+   for (grain = 0; buf->grainsMarked && pos < buf->numSectors; grain++) {
+      if (!buf->skipGrains[grain]) {
+         written[(buf->startSector + pos) / _blockSectors - first] = 1;
+      }
+      pos += GrainSectors(buf->startSector, buf->numSectors, pos);
+   }
+
+   for (i = 0; i < written.size(); i++) {
+      VixDiskLibSectorType start = (first + i) * _blockSectors;
+      VixDiskLibSectorType end = start + _blockSectors;
+      uint64 bytes;
+
+      if (start < buf->startSector) {
+         start = buf->startSector;
+      }
+      if (end > buf->startSector + buf->numSectors) {
+         end = buf->startSector + buf->numSectors;
+      }
+      bytes = (end - start) * VIXDISKLIB_SECTOR_SIZE;
+      _bytesChecked += bytes;
+      if (!written[i]) {
+         _bytesSkipped += bytes;
+      } else if (end - start == _blockSectors) {
+         const uint8 *data = buf->data +
+                             (start - buf->startSector) * VIXDISKLIB_SECTOR_SIZE;
+
+         if (IsZeroBuffer(data, bytes)) {
+            _bytesZero += bytes;
+         } else {
+            HashTask task;
+
+            task.data = data;
+            task.len = bytes;
+            task.digest = &digests[tasks.size() * SHA1_HASH_SIZE];
+            task.pending = NULL;
+            tasks.push_back(task);
+         }
+      }
+   }
+
+   _pool->Hash(tasks);
+   for (i = 0; i < tasks.size(); i++) {
+      if (_index->Contains(tasks[i].digest)) {
+         _bytesKnown += tasks[i].len;
+      }
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * PrintDedupCheck --
+ *
+ *      Reports what a DedupCheckStage found. Blocks are counted at
+ *      disk offsets, which are the file offsets of a raw image only; a
+ *      sparse vmdk places its grains freely, so for one the counts are
+ *      an estimate.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+PrintDedupCheck(const DedupCheckStage &dedup,   // IN
+                bool exact)                     // IN: target is raw
+{
+   uint64 sent = dedup.BytesChecked() - dedup.BytesSkipped();
+
+   printf("ddumbfs: %" FMT64 "u of %" FMT64 "u bytes written were "
+          "redundant (%" FMT64 "u zero, %" FMT64 "u already stored), %"
+          FMT64 "u bytes not written.\n",
+          dedup.BytesZero() + dedup.BytesKnown(), sent, dedup.BytesZero(),
+          dedup.BytesKnown(), dedup.BytesSkipped());
+   if (!exact) {
+      printf("ddumbfs: the target is a sparse vmdk, so these counts are "
+             "an estimate.\n");
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * OpenDdfsIndex --
+ *
+ *      Opens the index of the ddumbfs in -ddfs for a copy.
+ *
+ * Results:
+ *      None. Throws VixDiskError on failure.
+ *
+ * Side effects:
+ *      Maps the index file.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+OpenDdfsIndex(DdfsIndex &index)   // OUT
+{
+   string error;
+
+   if (!index.Open(appGlobals.ddfsDir, error)) {
+      printf("%s\n", error.c_str());
+      throw VixDiskError("Cannot use the ddumbfs index", __FILE__, __LINE__);
+   }
+   printf("Using ddumbfs index %s: %" FMT64 "u nodes, block size %u, "
+          "addr_bits %u.\n", appGlobals.ddfsDir,
+          (uint64)index.Config().nodeCount, index.Config().blockSize,
+          index.Config().addrBits);
+   if (appGlobals.chunkSize * VIXDISKLIB_SECTOR_SIZE %
+       index.Config().blockSize != 0) {
+      throw VixDiskError("-chunk is not a multiple of the ddumbfs "
+                         "block size", __FILE__, __LINE__);
+   }
+}
+
+
+DedupEstimator::DedupEstimator(uint32 sizeMask,        // IN
+                               unsigned sampleRate)    // IN
+   : _sampleRate(sampleRate),
+     _bytes(0)
+{
+   int bit;
+
+   for (bit = 0; bit < 32; bit++) {
+      if (sizeMask & (1U << bit)) {
+         _levels.push_back(Level());
+         _levels.back().blockSize = (1U << bit) * 1024;
+         _levels.back().blocks = 0;
+         _levels.back().zeroBlocks = 0;
+         _levels.back().sampled = 0;
+         _levels.back().partialBytes = 0;
+      }
+   }
+   vector<uint8> zeros(_levels[0].blockSize, 0);
+   Sha1(&zeros[0], zeros.size(), _zeroDigest);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * DedupEstimator::Add --
+ *
+ *      Hashes the smallest blocks of a buffer on pool, derives the
+ *      fingerprints of the larger block sizes from their digests and
+ *      adds the sampled ones to the sets of blocks seen.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Takes the estimator lock only to merge the buffer's counts, so
+ *      several readers can hash at the same time.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+DedupEstimator::Add(const uint8 *buf,   // IN
+                    size_t len,         // IN
+                    HashPool *pool)     // IN
+{
+   uint32 unit = _levels[0].blockSize;
+   size_t numUnits = len / unit;
+   vector<uint8> digests(numUnits * SHA1_HASH_SIZE);
+   vector<uint8> zero(numUnits);
+   vector<HashTask> tasks;
+   vector<vector<uint64> > sampled(_levels.size());
+   vector<uint64> blocks(_levels.size(), 0);
+   vector<uint64> zeroBlocks(_levels.size(), 0);
+   size_t i, j, l;
+
+   for (i = 0; i < numUnits; i++) {
+      zero[i] = IsZeroBuffer(buf + i * unit, unit);
+      if (zero[i]) {
+         memcpy(&digests[i * SHA1_HASH_SIZE], _zeroDigest, SHA1_HASH_SIZE);
+      } else {
+         HashTask task;
+
+         task.data = buf + i * unit;
+         task.len = unit;
+         task.digest = &digests[i * SHA1_HASH_SIZE];
+         task.pending = NULL;
+         tasks.push_back(task);
+      }
+   }
+   pool->Hash(tasks);
+
+   for (l = 0; l < _levels.size(); l++) {
+      size_t units = _levels[l].blockSize / unit;
+
+      for (i = 0; i + units <= numUnits; i += units) {
+         const uint8 *fingerprint = &digests[i * SHA1_HASH_SIZE];
+         uint8 digest[SHA1_HASH_SIZE];
+         uint64 value;
+
+         for (j = i; j < i + units && zero[j]; j++) {
+         }
+         if (j == i + units) {
+            zeroBlocks[l]++;
+            continue;
+         }
+         blocks[l]++;
+         if (units > 1) {
+            Sha1(fingerprint, units * SHA1_HASH_SIZE, digest);
+            fingerprint = digest;
+         }
+         memcpy(&value, fingerprint, sizeof value);
+         if (value % _sampleRate == 0) {
+            sampled[l].push_back(value);
+         }
+      }
+   }
+
+   std::lock_guard<std::mutex> guard(_lock);
+   _bytes += len;
+   for (l = 0; l < _levels.size(); l++) {
+      Level &level = _levels[l];
+
+      level.blocks += blocks[l];
+      level.zeroBlocks += zeroBlocks[l];
+      level.sampled += sampled[l].size();
+      level.partialBytes += len % level.blockSize;
+      level.seen.insert(sampled[l].begin(), sampled[l].end());
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * DedupEstimator::Print --
+ *
+ *      Reports the estimate for every block size in the -stats-format:
+ *      a table, one JSON object, or CSV rows. The unique block count is
+ *      extrapolated from the sampled blocks; stored bytes are what
+ *      ddumbfs would keep (unique blocks plus partial blocks), and the
+ *      total ratio also credits the zero blocks.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+DedupEstimator::Print(FILE *out,            // IN
+                      unsigned numDisks,    // IN
+                      uint64 elapsed) const // IN
+{
+   size_t l;
+
+   if (appGlobals.statsFormat == STATS_TEXT) {
+      fprintf(out, "Dedup estimate for %u disks, %" FMT64 "u MBytes, "
+              "1 in %u block hashes sampled:\n", numDisks, _bytes >> 20,
+              _sampleRate);
+      fprintf(out, "%10s %14s %14s %14s %10s %14s %10s\n", "block size",
+              "blocks", "zero blocks", "unique blocks", "dedup",
+              "stored MB", "total");
+   } else if (appGlobals.statsFormat == STATS_JSON) {
+      fprintf(out, "{\"kind\":\"dedup_estimate\",\"disks\":%u,"
+              "\"bytes\":%" FMT64 "u,\"elapsed_ms\":%" FMT64 "u,"
+              "\"sample_rate\":%u,\"block_sizes\":[", numDisks, _bytes,
+              elapsed / 1000000, _sampleRate);
+   } else if (appGlobals.statsFile == NULL || ftell(out) == 0) {
+      fprintf(out, "block_size,bytes,blocks,zero_blocks,sampled_blocks,"
+              "unique_blocks,dedup_ratio,stored_bytes,total_ratio\n");
+   }
+
+   for (l = 0; l < _levels.size(); l++) {
+      const Level &level = _levels[l];
+      uint64 unique = level.sampled == 0 ? 0 :
+                      (uint64)((double)level.seen.size() * level.blocks /
+                               level.sampled + 0.5);
+      uint64 stored = unique * level.blockSize + level.partialBytes;
+      double dedup = unique == 0 ? 1.0 : (double)level.blocks / unique;
+      double total = stored == 0 ? 0.0 : (double)_bytes / stored;
+
+      if (appGlobals.statsFormat == STATS_TEXT) {
+         fprintf(out, "%8uKB %14" FMT64 "u %14" FMT64 "u %14" FMT64 "u "
+                 "%9.2fx %14.1f %9.2fx\n", level.blockSize / 1024,
+                 level.blocks, level.zeroBlocks, unique, dedup,
+                 stored / 1048576.0, total);
+      } else if (appGlobals.statsFormat == STATS_JSON) {
+         fprintf(out, "%s{\"block_size\":%u,\"blocks\":%" FMT64 "u,"
+                 "\"zero_blocks\":%" FMT64 "u,\"sampled_blocks\":%" FMT64
+                 "u,\"unique_blocks\":%" FMT64 "u,\"dedup_ratio\":%.3f,"
+                 "\"stored_bytes\":%" FMT64 "u,\"total_ratio\":%.3f}",
+                 l == 0 ? "" : ",", level.blockSize, level.blocks,
+                 level.zeroBlocks, level.sampled, unique, dedup, stored,
+                 total);
+      } else {
+         fprintf(out, "%u,%" FMT64 "u,%" FMT64 "u,%" FMT64 "u,%" FMT64 "u,%"
+                 FMT64 "u,%.3f,%" FMT64 "u,%.3f\n", level.blockSize, _bytes,
+                 level.blocks, level.zeroBlocks, level.sampled, unique, dedup,
+                 stored, total);
+      }
+   }
+   if (appGlobals.statsFormat == STATS_JSON) {
+      fprintf(out, "]}\n");
+   }
+   fflush(out);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * DiskUuid --
+ *
+ *      Identifies a disk for its manifest: the uuid from GetInfo, or the
+ *      "uuid" metadata entry if GetInfo does not report one.
+ *
+ * Results:
+ *      The uuid, empty if there is none.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static string
+DiskUuid(VixDiskLibHandle handle,        // IN
+         const VixDiskLibInfo *info)     // IN
+{
+   size_t requiredLen;
+   VixError vixError;
+
+   if (info->uuid != NULL && info->uuid[0] != '\0') {
+      return info->uuid;
+   }
+   vixError = VixDiskLib_ReadMetadata(handle, "uuid", NULL, 0, &requiredLen);
+   if (vixError != VIX_OK && vixError != VIX_E_BUFFER_TOOSMALL) {
+      return "";
+   }
+   std::vector<char> val(requiredLen);
+   vixError = VixDiskLib_ReadMetadata(handle, "uuid", &val[0], requiredLen,
+                                      NULL);
+   return VIX_FAILED(vixError) ? "" : &val[0];
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * SaveManifest --
+ *
+ *      Writes manifest to the -manifest path.
+ *
+ * Results:
+ *      None. Throws VixDiskError on failure.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+SaveManifest(const Manifest &manifest)   // IN
+{
+   manifest.Save(appGlobals.manifestPath);
+   printf("Wrote %" FMT64 "u of %" FMT64 "u chunk hashes to %s.\n",
+          manifest.ChunksHashed(), manifest.NumChunks(),
+          appGlobals.manifestPath);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Backoff --
+ *
+ *      Waits a little while polling a ring: yields for the first few
+ *      attempts, then sleeps so an idle stage does not burn a CPU.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Increments spins.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+Backoff(unsigned &spins)   // IN/OUT
+{
+   if (spins++ < 64) {
+      std::this_thread::yield();
+   } else {
+      std::this_thread::sleep_for(std::chrono::microseconds(100));
+   }
+}
+
+
+template <typename T>
+SpscRing<T>::SpscRing(size_t capacity)   // IN
+   : _head(0),
+     _tail(0)
+{
+   size_t size = 1;
+
+   while (size < capacity) {
+      size <<= 1;
+   }
+   _slots.resize(size);
+   _mask = size - 1;
+}
+
+
+template <typename T>
+bool
+SpscRing<T>::TryPush(const T &item)   // IN
+{
+   size_t tail = _tail.load(std::memory_order_relaxed);
+
+   if (tail - _head.load(std::memory_order_acquire) > _mask) {
+      return false;
+   }
+   _slots[tail & _mask] = item;
+   _tail.store(tail + 1, std::memory_order_release);
+   return true;
+}
+
+
+template <typename T>
+bool
+SpscRing<T>::TryPop(T &item)   // OUT
+{
+   size_t head = _head.load(std::memory_order_relaxed);
+
+   if (head == _tail.load(std::memory_order_acquire)) {
+      return false;
+   }
+   item = _slots[head & _mask];
+   _head.store(head + 1, std::memory_order_release);
+   return true;
+}
+
+
+template <typename T>
+bool
+SpscRing<T>::Push(const T &item,                     // IN
+                  const std::atomic<bool> &abort)    // IN
+{
+   unsigned spins = 0;
+
+   while (!TryPush(item)) {
+      if (abort) {
+         return false;
+      }
+      Backoff(spins);
+   }
+   return true;
+}
+
+
+template <typename T>
+bool
+SpscRing<T>::Pop(T &item,                            // OUT
+                 const std::atomic<bool> &abort)     // IN
+{
+   unsigned spins = 0;
+
+   while (!TryPop(item)) {
+      if (abort) {
+         return false;
+      }
+      Backoff(spins);
+   }
+   return true;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ZeroCheckStage::Process --
+ *
+ *      Pipeline stage flagging the all-zero grains of a buffer.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Updates the skipped sector counter.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+ZeroCheckStage::Process(PipelineBuffer *buf)   // IN/OUT
+{
+   _sectorsSkipped += MarkZeroGrains(buf->data, buf->startSector,
+                                     buf->numSectors, buf->skipGrains);
+   buf->grainsMarked = true;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * CopyPipeline::CopyPipeline --
+ *
+ *      Sets up a pipeline with numBuffers page-aligned buffers of
+ *      context.chunkSize sectors each, running under the limits and
+ *      statistics of context.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Allocates the buffer pool, which is reused by every Copy().
+ *
+ *----------------------------------------------------------------------
+ */
+
+CopyPipeline::CopyPipeline(const CopyContext &context,   // IN
+                           unsigned numBuffers)          // IN
+   : _limiter(context.limiter),
+     _chunkSize(context.chunkSize),
+     _printProgress(context.printProgress),
+     _buffers(numBuffers),
+     _freeRing(NULL),
+     _verifyStage(NULL),
+     _journal(NULL),
+     _stats(context.stats),
+     _verifyRing(NULL),
+     _src(NULL),
+     _startSector(0),
+     _numSectors(0),
+     _sectorsCopied(0),
+     _sectorsWritten(0),
+     _failed(false),
+     _error(VIX_OK)
+{
+   size_t i;
+
+   for (i = 0; i < _buffers.size(); i++) {
+      _buffers[i].data = NULL;
+   }
+   try {
+      for (i = 0; i < _buffers.size(); i++) {
+         _buffers[i].data = AllocAligned(_chunkSize * VIXDISKLIB_SECTOR_SIZE);
+      }
+   } catch (...) {
+      for (i = 0; i < _buffers.size(); i++) {
+         if (_buffers[i].data != NULL) {
+            FreeAligned(_buffers[i].data);
+         }
+      }
+      throw;
+   }
+   _endMarker.data = NULL;
+   _endMarker.startSector = 0;
+   _endMarker.numSectors = 0;
+   _endMarker.grainsMarked = false;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * CopyPipeline::~CopyPipeline --
+ *
+ *      Releases the buffer pool.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+CopyPipeline::~CopyPipeline()
+{
+   size_t i;
+
+   for (i = 0; i < _buffers.size(); i++) {
+      FreeAligned(_buffers[i].data);
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * CopyPipeline::Fail --
+ *
+ *      Records the first error of any pipeline thread and tells all
+ *      the others to stop.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+CopyPipeline::Fail(VixError vixError)   // IN
+{
+   std::lock_guard<std::mutex> guard(_errorLock);
+
+   if (_error == VIX_OK) {
+      _error = vixError;
+      LiveError(_stats);
+   }
+   _failed = true;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * CopyPipeline::RunReader --
+ *
+ *      Reader thread: takes free buffers, fills them from the source
+ *      and passes them to the first stage, then sends the end marker.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Calls Fail() on a read error.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+CopyPipeline::RunReader(void)
+{
+   VixDiskLibSectorType done = 0;
+
+   while (done < _numSectors) {
+      VixDiskLibSectorType count = _numSectors - done;
+      PipelineBuffer *buf;
+
+      if (count > _chunkSize) {
+         count = _chunkSize;
+      }
+      if (_journal != NULL && _journal->IsDone(_startSector + done)) {
+         done += count;
+         continue;
+      }
+      if (!_freeRing->Pop(buf, _failed)) {
+         return;
+      }
+      _limiter->Acquire(count * VIXDISKLIB_SECTOR_SIZE, 1);
+      try {
+         _src.Read(_startSector + done,
+                   VixByteSpan(buf->data, count * VIXDISKLIB_SECTOR_SIZE));
+      } catch (const VixDiskError& e) {
+         Fail(e.ErrorCode());
+         return;
+      }
+      if (_stats != NULL) {
+         LiveAdd(_stats->bytesRead, count * VIXDISKLIB_SECTOR_SIZE);
+         LiveAdd(_stats->readOps, 1);
+         LiveAdd(_stats->queueDepth, 1);
+      }
+      buf->startSector = _startSector + done;
+      buf->numSectors = count;
+      buf->grainsMarked = false;
+      if (!_rings[0]->Push(buf, _failed)) {
+         return;
+      }
+      done += count;
+   }
+   _rings[0]->Push(&_endMarker, _failed);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * CopyPipeline::RunStage --
+ *
+ *      Stage thread: runs stage 'index' on each buffer and passes it on,
+ *      until the end marker has gone through.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+CopyPipeline::RunStage(size_t index)   // IN
+{
+   PipelineBuffer *buf;
+
+   while (_rings[index]->Pop(buf, _failed)) {
+      if (buf->numSectors != 0) {
+         _stages[index]->Process(buf);
+      }
+      if (!_rings[index + 1]->Push(buf, _failed) || buf->numSectors == 0) {
+         return;
+      }
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * CopyPipeline::RunVerify --
+ *
+ *      Verify thread: runs the verify stage on each written buffer and
+ *      returns it to the reader, until the end marker arrives.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Marks the verified buffers in the journal. Calls Fail() on a read
+ *      error.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+CopyPipeline::RunVerify(void)
+{
+   PipelineBuffer *buf;
+
+   while (_verifyRing->Pop(buf, _failed) && buf->numSectors != 0) {
+      uint64 mismatched = _verifyStage->ChunksMismatched();
+
+      try {
+         _verifyStage->Process(buf);
+         // A chunk that differs is left for -resume to copy again.
+         if (_journal != NULL &&
+             _verifyStage->ChunksMismatched() == mismatched) {
+            _journal->Mark(buf->startSector, buf->numSectors);
+         }
+      } catch (const VixDiskError& e) {
+         Fail(e.ErrorCode());
+         return;
+      }
+      _freeRing->Push(buf, _failed);
+   }
+}
+
+
+struct PipelineStageArg {
+   CopyPipeline *pipeline;
+   size_t index;
+};
+
+
+static THREAD_RESULT
+PipelineReaderThread(void *arg)
+{
+   ((CopyPipeline *)arg)->RunReader();
+   return TASK_OK;
+}
+
+
+static THREAD_RESULT
+PipelineStageThread(void *arg)
+{
+   PipelineStageArg *stageArg = (PipelineStageArg *)arg;
+
+   stageArg->pipeline->RunStage(stageArg->index);
+   return TASK_OK;
+}
+
+
+static THREAD_RESULT
+PipelineVerifyThread(void *arg)
+{
+   ((CopyPipeline *)arg)->RunVerify();
+   return TASK_OK;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * CopyPipeline::Copy --
+ *
+ *      Copies numSectors sectors starting at startSector from src to
+ *      dst. Reading and the stages run on their own threads
+ *      while this thread writes, so the source and the destination are
+ *      busy at the same time. Zero grains flagged by a ZeroCheckStage
+ *      are not written. With a verify stage, written buffers are read
+ *      back on one more thread before they are reused.
+ *
+ * Results:
+ *      None. Throws VixDiskError on failure.
+ *
+ * Side effects:
+ *      Prints MB/s statistics like DoRWBench if printProgress was set.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+CopyPipeline::Copy(VixDiskView src,                    // IN
+                   VixDiskView dst,                    // IN
+                   VixDiskLibSectorType startSector,   // IN
+                   VixDiskLibSectorType numSectors)    // IN
+{
+   vector<PipelineStageArg> stageArgs(_stages.size());
+   vector<ThreadHandle> stageThreads(_stages.size());
+   ThreadHandle readerThread;
+   ThreadHandle verifyThread = ThreadHandle();   // only with _verifyStage
+   std::mutex *dstLock = _verifyStage != NULL ? &_dstLock : NULL;
+   SpscRing<PipelineBuffer *> *doneRing;
+   VixDiskLibSectorType bufUpdate = 0;
+   VixDiskLibSectorType copiedBefore = _sectorsCopied;
+   uint64 start, end, total;
+   PipelineBuffer *buf;
+   size_t i;
+
+   _src = src;
+   _startSector = startSector;
+   _numSectors = numSectors;
+   _failed = false;
+   _error = VIX_OK;
+
+   // Every ring can hold all buffers plus the end marker, so a push
+   // never has to wait for room.
+   for (i = 0; i <= _stages.size(); i++) {
+      _rings.push_back(new SpscRing<PipelineBuffer *>(_buffers.size() + 1));
+   }
+   _freeRing = new SpscRing<PipelineBuffer *>(_buffers.size() + 1);
+   for (i = 0; i < _buffers.size(); i++) {
+      _freeRing->TryPush(&_buffers[i]);
+   }
+   doneRing = _freeRing;
+   if (_verifyStage != NULL) {
+      _verifyRing = new SpscRing<PipelineBuffer *>(_buffers.size() + 1);
+      _verifyStage->SetTarget(dst.Handle(), dstLock, _chunkSize);
+      doneRing = _verifyRing;
+   }
+
+   total = NowNsec();
+   start = total;
+   readerThread = StartThread(&PipelineReaderThread, (void*)this);
+   for (i = 0; i < _stages.size(); i++) {
+      stageArgs[i].pipeline = this;
+      stageArgs[i].index = i;
+      stageThreads[i] = StartThread(&PipelineStageThread,
+                                    (void*)&stageArgs[i]);
+   }
+   if (_verifyStage != NULL) {
+      verifyThread = StartThread(&PipelineVerifyThread, (void*)this);
+   }
+
+   while (_rings[_stages.size()]->Pop(buf, _failed) && buf->numSectors != 0) {
+      try {
+         VixDiskLibSectorType written = buf->numSectors;
+
+         if (buf->grainsMarked) {
+            written = WriteGrains(dst, buf->startSector,
+                                  buf->numSectors, buf->data,
+                                  &buf->skipGrains[0], dstLock);
+         } else {
+            LockedWrite(dst, buf->startSector, buf->numSectors,
+                        buf->data, dstLock);
+         }
+         _sectorsWritten += written;
+         if (_stats != NULL) {
+            LiveAdd(_stats->bytesWritten, written * VIXDISKLIB_SECTOR_SIZE);
+            LiveAdd(_stats->bytesSkipped, (buf->numSectors - written) *
+                                          VIXDISKLIB_SECTOR_SIZE);
+            LiveAdd(_stats->writeOps, 1);
+            _stats->queueDepth.fetch_sub(1, std::memory_order_relaxed);
+         }
+         if (_journal != NULL && _verifyStage == NULL) {
+            _journal->Mark(buf->startSector, buf->numSectors);
+         }
+      } catch (const VixDiskError& e) {
+         Fail(e.ErrorCode());
+         break;
+      }
+      _sectorsCopied += buf->numSectors;
+      bufUpdate += buf->numSectors;
+      if (_printProgress && bufUpdate >= BUFS_PER_STAT) {
+         end = NowNsec();
+         PrintStat("Copied", start, end, bufUpdate);
+         start = end;
+         bufUpdate = 0;
+      }
+      doneRing->Push(buf, _failed);
+   }
+
+   JoinThread(readerThread);
+   for (i = 0; i < _stages.size(); i++) {
+      JoinThread(stageThreads[i]);
+   }
+   if (_verifyStage != NULL) {
+      _verifyRing->Push(&_endMarker, _failed);
+      JoinThread(verifyThread);
+      delete _verifyRing;
+      _verifyRing = NULL;
+   }
+   for (i = 0; i < _rings.size(); i++) {
+      delete _rings[i];
+   }
+   _rings.clear();
+   delete _freeRing;
+   _freeRing = NULL;
+
+   CHECK_AND_THROW(_error);
+   if (_printProgress) {
+      PrintCopyTotal(total, NowNsec(), numSectors,
+                     _sectorsCopied - copiedBefore);
+   }
+}
+
+
+// Output side of -dump. DoDump reads chunks of the disk into buffers
+// from a small pool; a writer thread turns each into a hex dump (or,
+// for -raw, takes the bytes as they are) and writes it with one large
+// write(), so the disk reads and the formatting overlap.
+
+class DumpWriter
+{
+public:
+    DumpWriter(int fd, bool raw, VixDiskLibSectorType chunkSize);
+    ~DumpWriter();
+
+    // Next free buffer to read into, NULL if the writer has failed.
+    PipelineBuffer *GetBuffer(void);
+    void Submit(PipelineBuffer *buf);
+    // Flushes all submitted buffers; throws if a write failed.
+    void Finish(void);
+
+    // Thread body, public only for the thread entry point.
+    void Run(void);
+
+private:
+    size_t FormatHex(const PipelineBuffer *buf);
+    bool WriteAll(const char *data, size_t len);
+
+    int _fd;
+    bool _raw;
+    vector<PipelineBuffer> _buffers;
+    PipelineBuffer _endMarker;
+    SpscRing<PipelineBuffer *> _fullRing;   // reader->writer
+    SpscRing<PipelineBuffer *> _freeRing;   // writer->reader
+    vector<char> _text;
+    ThreadHandle _thread;
+    bool _running;
+    std::atomic<bool> _abort;
+    int _errno;
+};
+
+
+// Hex digit pairs and printable characters of all byte values, for the
+// table driven formatter of DumpWriter.
+
+static char hexPairs[256][2];
+static char printables[256];
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * InitDumpTables --
+ *
+ *      Fills in hexPairs and printables.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+InitDumpTables(void)
+{
+   static const char digits[] = "0123456789abcdef";
+   int c;
+
+   for (c = 0; c < 256; c++) {
+      hexPairs[c][0] = digits[c >> 4];
+      hexPairs[c][1] = digits[c & 0xf];
+      printables[c] = c < ' ' || c >= 127 ? '.' : (char)c;
+   }
+}
+
+
+static THREAD_RESULT
+DumpWriterThread(void *arg)
+{
+   ((DumpWriter *)arg)->Run();
+   return TASK_OK;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * DumpWriter::DumpWriter --
+ *
+ *      Sets up DUMP_NUM_BUFFERS buffers of chunkSize sectors and starts
+ *      the writer thread, which writes to fd.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Allocates the buffers and, for hex output, the text buffer.
+ *
+ *----------------------------------------------------------------------
+ */
+
+DumpWriter::DumpWriter(int fd,                            // IN
+                       bool raw,                          // IN
+                       VixDiskLibSectorType chunkSize)    // IN
+   : _fd(fd),
+     _raw(raw),
+     _buffers(DUMP_NUM_BUFFERS),
+     _fullRing(DUMP_NUM_BUFFERS + 1),
+     _freeRing(DUMP_NUM_BUFFERS + 1),
+     _running(false),
+     _abort(false),
+     _errno(0)
+{
+   size_t i;
+
+   for (i = 0; i < _buffers.size(); i++) {
+      _buffers[i].data = NULL;
+   }
+   try {
+      for (i = 0; i < _buffers.size(); i++) {
+         _buffers[i].data = AllocAligned(chunkSize * VIXDISKLIB_SECTOR_SIZE);
+         _buffers[i].startSector = 0;
+         _buffers[i].numSectors = 0;
+         _buffers[i].grainsMarked = false;
+         _freeRing.TryPush(&_buffers[i]);
+      }
+      if (!raw) {
+         _text.resize(chunkSize * DUMP_SECTOR_TEXT);
+      }
+   } catch (...) {
+      for (i = 0; i < _buffers.size(); i++) {
+         if (_buffers[i].data != NULL) {
+            FreeAligned(_buffers[i].data);
+         }
+      }
+      throw;
+   }
+   _endMarker.data = NULL;
+   _endMarker.startSector = 0;
+   _endMarker.numSectors = 0;
+   _endMarker.grainsMarked = false;
+
+   InitDumpTables();
+   _thread = StartThread(&DumpWriterThread, (void*)this);
+   _running = true;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * DumpWriter::~DumpWriter --
+ *
+ *      Stops the writer thread if Finish() was not reached and releases
+ *      the buffers.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Output not yet written is dropped.
+ *
+ *----------------------------------------------------------------------
+ */
+
+DumpWriter::~DumpWriter()
+{
+   size_t i;
+
+   if (_running) {
+      _abort = true;
+      JoinThread(_thread);
+   }
+   for (i = 0; i < _buffers.size(); i++) {
+      FreeAligned(_buffers[i].data);
+   }
+}
+
+
+PipelineBuffer *
+DumpWriter::GetBuffer(void)
+{
+   PipelineBuffer *buf;
+
+   return _freeRing.Pop(buf, _abort) ? buf : NULL;
+}
+
+
+void
+DumpWriter::Submit(PipelineBuffer *buf)   // IN
+{
+   // The ring holds every buffer plus the end marker, so this never waits.
+   _fullRing.Push(buf, _abort);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * DumpWriter::Finish --
+ *
+ *      Waits until all submitted buffers are written.
+ *
+ * Results:
+ *      None. Throws VixDiskError if a write failed.
+ *
+ * Side effects:
+ *      The writer thread exits.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+DumpWriter::Finish(void)
+{
+   _fullRing.Push(&_endMarker, _abort);
+   JoinThread(_thread);
+   _running = false;
+   if (_errno != 0) {
+      throw VixDiskError(strerror(_errno), __FILE__, __LINE__);
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * DumpWriter::WriteAll --
+ *
+ *      write()s len bytes, retrying short and interrupted writes.
+ *
+ * Results:
+ *      true on success, false with _errno set on failure.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+bool
+DumpWriter::WriteAll(const char *data,   // IN
+                     size_t len)         // IN
+{
+   while (len > 0) {
+#ifdef _WIN32
+      int chunk = len > INT_MAX ? INT_MAX : (int)len;
+      int written = _write(_fd, data, chunk);
+#else
+      ssize_t written = write(_fd, data, len);
+#endif
+
+      if (written < 0) {
+         if (errno == EINTR) {
+            continue;
+         }
+         _errno = errno;
+         return false;
+      }
+      data += written;
+      len -= written;
+   }
+   return true;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * DumpWriter::FormatHex --
+ *
+ *      Formats the sectors of buf into _text, in the same layout as the
+ *      classic one-printf-per-byte dump: 16 bytes per line with the
+ *      offset within the sector, hex bytes and printable characters,
+ *      and an empty line after each sector.
+ *
+ * Results:
+ *      Number of characters in _text.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+size_t
+DumpWriter::FormatHex(const PipelineBuffer *buf)   // IN
+{
+   const uint8 *data = buf->data;
+   char *out = &_text[0];
+   VixDiskLibSectorType sector;
+   unsigned offset;
+   int k;
+
+   for (sector = 0; sector < buf->numSectors; sector++) {
+      for (offset = 0; offset < VIXDISKLIB_SECTOR_SIZE;
+           offset += DUMP_LINE_BYTES) {
+         out[0] = '0';
+         out[1] = hexPairs[offset >> 8][1];
+         out[2] = hexPairs[offset & 0xff][0];
+         out[3] = hexPairs[offset & 0xff][1];
+         out[4] = ' ';
+         out[5] = ':';
+         out[6] = ' ';
+         out += 7;
+         for (k = 0; k < DUMP_LINE_BYTES; k++) {
+            out[0] = hexPairs[data[k]][0];
+            out[1] = hexPairs[data[k]][1];
+            out[2] = ' ';
+            out += 3;
+         }
+         out[0] = ' ';
+         out[1] = ' ';
+         out += 2;
+         for (k = 0; k < DUMP_LINE_BYTES; k++) {
+            *out++ = printables[data[k]];
+         }
+         *out++ = '\n';
+         data += DUMP_LINE_BYTES;
+      }
+      *out++ = '\n';
+   }
+   return out - &_text[0];
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * DumpWriter::Run --
+ *
+ *      Writer thread: formats and writes buffers until the end marker,
+ *      returning each to the free ring once written.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      On a write error, sets _errno and _abort, which makes GetBuffer()
+ *      fail.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+DumpWriter::Run(void)
+{
+   PipelineBuffer *buf;
+
+   while (_fullRing.Pop(buf, _abort) && buf->numSectors != 0) {
+      bool ok;
+
+      if (_raw) {
+         ok = WriteAll((const char *)buf->data,
+                       buf->numSectors * VIXDISKLIB_SECTOR_SIZE);
+      } else {
+         ok = WriteAll(&_text[0], FormatHex(buf));
+      }
+      if (!ok) {
+         _abort = true;
+         break;
+      }
+      _freeRing.Push(buf, _abort);
+   }
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * DoDump --
+ *
+ *      Dumps the content of a virtual disk, as hex to stdout or with
+ *      -raw as binary to a file. Sectors are read chunkSize at a time
+ *      and formatted and written on a separate thread.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Creates or truncates the -raw file.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+static void
+DoDump(void)
+{
+    VixDisk disk = OpenDisk(appGlobals.connection, appGlobals.diskPath,
+                            appGlobals.openFlags);
+    VixDiskLibSectorType done = 0;
+    int fd = 1;
+
+    if (appGlobals.rawPath != NULL) {
+#ifdef _WIN32
+       fd = _open(appGlobals.rawPath, _O_WRONLY | _O_CREAT | _O_TRUNC | _O_BINARY,
+                  _S_IREAD | _S_IWRITE);
+#else
+       fd = open(appGlobals.rawPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+#endif
+       if (fd < 0) {
+          throw VixDiskError(strerror(errno), __FILE__, __LINE__);
+       }
+    } else {
+       fflush(stdout);
+    }
+
+    try {
+       DumpWriter writer(fd, appGlobals.rawPath != NULL, appGlobals.chunkSize);
+
+       while (done < appGlobals.numSectors) {
+          PipelineBuffer *buf = writer.GetBuffer();
+
+          if (buf == NULL) {
+             break;
+          }
+          buf->startSector = appGlobals.startSector + done;
+          buf->numSectors = appGlobals.numSectors - done;
+          if (buf->numSectors > appGlobals.chunkSize) {
+             buf->numSectors = appGlobals.chunkSize;
+          }
+          disk.Read(buf->startSector,
+                    VixByteSpan(buf->data,
+                                buf->numSectors * VIXDISKLIB_SECTOR_SIZE));
+          writer.Submit(buf);
+          done += buf->numSectors;
+       }
+       writer.Finish();
+    } catch (...) {
+       if (appGlobals.rawPath != NULL) {
+#ifdef _WIN32
+          _close(fd);
+#else
+          close(fd);
+#endif
+       }
+       throw;
+    }
+    if (appGlobals.rawPath != NULL) {
+#ifdef _WIN32
+       _close(fd);
+#else
+       close(fd);
+#endif
+    }
+}
+
+
+// On-disk structures of a streamOptimized sparse extent (VMDK 5.0
+// specification), little endian and packed.
+
+#pragma pack(push, 1)
+struct SparseExtentHeader {
+   uint32 magicNumber;
+   uint32 version;
+   uint32 flags;
+   uint64 capacity;
+   uint64 grainSize;
+   uint64 descriptorOffset;
+   uint64 descriptorSize;
+   uint32 numGTEsPerGT;
+   uint64 rgdOffset;
+   uint64 gdOffset;
+   uint64 overHead;
+   uint8 uncleanShutdown;
+   char singleEndLineChar;
+   char nonEndLineChar;
+   char doubleEndLineChar1;
+   char doubleEndLineChar2;
+   uint16 compressAlgorithm;
+   uint8 pad[433];
+};
+
+struct SparseGrainMarker {
+   uint64 lba;
+   uint32 size;              // of the compressed data that follows
+};
+
+struct SparseMetaMarker {
+   uint64 numSectors;        // of the metadata that follows
+   uint32 size;              // always 0
+   uint32 type;
+   uint8 pad[496];
+};
+#pragma pack(pop)
+
+#define SPARSE_MAGICNUMBER        0x564d444b   // "KDMV"
+#define SPARSE_FLAG_VALID_NEWLINE (1 << 0)
+#define SPARSE_FLAG_COMPRESSED    (1 << 16)
+#define SPARSE_FLAG_MARKERS       (1 << 17)
+#define SPARSE_COMPRESSION_DEFLATE 1
+#define SPARSE_GD_AT_END          ((uint64)-1)
+#define SPARSE_MARKER_EOS         0
+#define SPARSE_MARKER_GT          1
+#define SPARSE_MARKER_GD          2
+#define SPARSE_MARKER_FOOTER      3
+
+// Metadata sectors at the start of an exported image: header and
+// embedded descriptor, padded to a grain like VMware's own exports.
+#define STREAM_OVERHEAD_SECTORS STREAM_GRAIN_SECTORS
+
+
+// One chunk of an export in flight: the source sectors, and the grain
+// markers compressed from them, padded to whole sectors.
+struct ExportChunk {
+   enum { FREE, READ, COMPRESSED } state;
+   uint8 *data;
+   VixDiskLibSectorType startSector;
+   VixDiskLibSectorType numSectors;
+   vector<uint8> out;
+   vector<uint32> grainSectors;   // of each grain's marker within out,
+                                  // STREAM_NO_GRAIN for zero grains
+};
+
+#define STREAM_NO_GRAIN ((uint32)-1)
+
+
+// Writes a disk as a streamOptimized vmdk. A reader thread fills chunk
+// buffers in order, worker threads deflate the grains of whole chunks
+// in parallel and the calling thread writes the results strictly in
+// chunk order: chunk n always uses slot n % numBuffers, which doubles as
+// the reorder buffer. All-zero grains are left out of the stream.
+
+class StreamExport
+{
+public:
+    StreamExport(VixDiskLibSectorType chunkSize, unsigned numThreads,
+                 int level);
+    ~StreamExport();
+
+    void Export(VixDiskLibHandle srcHandle, const VixDiskLibInfo *info,
+                const char *path);
+
+    uint64 GrainsWritten() const { return _grainsWritten; }
+    uint64 GrainsSkipped() const { return _grainsSkipped; }
+    uint64 BytesWritten() const { return _fileSector * VIXDISKLIB_SECTOR_SIZE; }
+
+    // Thread bodies, public only for the thread entry points.
+    void RunReader(void);
+    void RunCompressor(void);
+
+private:
+    void Compress(ExportChunk *chunk, vector<uint8> &grain);
+    void Fail(VixError vixError);
+    void Write(FILE *file, const void *data, size_t len);
+    void WriteMarker(FILE *file, uint64 numSectors, uint32 type);
+    void WriteHeader(FILE *file, const VixDiskLibInfo *info,
+                     const char *path, uint64 gdOffset);
+
+    VixDiskLibSectorType _chunkSize;
+    unsigned _numThreads;
+    int _level;
+    vector<ExportChunk> _chunks;
+    std::mutex _lock;
+    std::condition_variable _freeCv;        // a slot became FREE
+    std::condition_variable _readCv;        // a chunk became READ
+    std::condition_variable _compressedCv;  // a chunk became COMPRESSED
+    std::deque<ExportChunk *> _queue;       // READ chunks to compress
+    bool _failed;
+    VixError _error;
+    VixDiskLibHandle _srcHandle;
+    VixDiskLibSectorType _capacity;
+    uint64 _numChunks;
+    vector<uint32> _grainTable;             // of all GTs, in file sectors
+    uint64 _fileSector;
+    uint64 _grainsWritten;
+    uint64 _grainsSkipped;
+    string _descriptor;
+};
+
+
+static THREAD_RESULT
+ExportReaderThread(void *arg)
+{
+   ((StreamExport *)arg)->RunReader();
+   return TASK_OK;
+}
+
+
+static THREAD_RESULT
+ExportCompressorThread(void *arg)
+{
+   ((StreamExport *)arg)->RunCompressor();
+   return TASK_OK;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * StreamExport::StreamExport --
+ *
+ *      Sets up two chunk buffers per compressing thread, so the workers
+ *      stay busy while the writer waits for the oldest chunk.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Allocates the chunk buffers.
+ *
+ *----------------------------------------------------------------------
+ */
+
+StreamExport::StreamExport(VixDiskLibSectorType chunkSize,   // IN
+                           unsigned numThreads,              // IN
+                           int level)                        // IN
+   : _chunkSize(chunkSize),
+     _numThreads(numThreads),
+     _level(level),
+     _chunks(2 * numThreads + 2),
+     _failed(false),
+     _error(VIX_OK),
+     _srcHandle(NULL),
+     _capacity(0),
+     _numChunks(0),
+     _fileSector(0),
+     _grainsWritten(0),
+     _grainsSkipped(0)
+{
+   size_t i;
+
+   for (i = 0; i < _chunks.size(); i++) {
+      _chunks[i].data = NULL;
+   }
+   try {
+      for (i = 0; i < _chunks.size(); i++) {
+         _chunks[i].state = ExportChunk::FREE;
+         _chunks[i].data = AllocAligned(chunkSize * VIXDISKLIB_SECTOR_SIZE);
+      }
+   } catch (...) {
+      for (i = 0; i < _chunks.size(); i++) {
+         FreeAligned(_chunks[i].data);
+      }
+      throw;
+   }
+}
+
+
+StreamExport::~StreamExport()
+{
+   size_t i;
+
+   for (i = 0; i < _chunks.size(); i++) {
+      FreeAligned(_chunks[i].data);
+   }
+}
+
+
+void
+StreamExport::Fail(VixError vixError)   // IN
+{
+   std::lock_guard<std::mutex> guard(_lock);
+
+   if (!_failed) {
+      _error = vixError;
+      LiveError(liveStats);
+   }
+   _failed = true;
+   _freeCv.notify_all();
+   _readCv.notify_all();
+   _compressedCv.notify_all();
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * StreamExport::RunReader --
+ *
+ *      Reader thread: reads chunk n into slot n % numBuffers as soon as
+ *      the writer has freed it and queues it for compression.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Calls Fail() on a read error.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+StreamExport::RunReader(void)
+{
+   uint64 n;
+
+   for (n = 0; n < _numChunks; n++) {
+      ExportChunk *chunk = &_chunks[n % _chunks.size()];
+      VixError vixError;
+
+      {
+         std::unique_lock<std::mutex> lock(_lock);
+
+         while (!_failed && chunk->state != ExportChunk::FREE) {
+            _freeCv.wait(lock);
+         }
+         if (_failed) {
+            return;
+         }
+      }
+      chunk->startSector = n * _chunkSize;
+      chunk->numSectors = _capacity - chunk->startSector;
+      if (chunk->numSectors > _chunkSize) {
+         chunk->numSectors = _chunkSize;
+      }
+      rateLimiter.Acquire(chunk->numSectors * VIXDISKLIB_SECTOR_SIZE, 1);
+      vixError = VixDiskLib_Read(_srcHandle, chunk->startSector,
+                                 chunk->numSectors, chunk->data);
+      if (VIX_FAILED(vixError)) {
+         Fail(vixError);
+         return;
+      }
+      if (liveStats != NULL) {
+         LiveAdd(liveStats->bytesRead,
+                 chunk->numSectors * VIXDISKLIB_SECTOR_SIZE);
+         LiveAdd(liveStats->readOps, 1);
+         LiveAdd(liveStats->queueDepth, 1);
+      }
+
+      std::lock_guard<std::mutex> guard(_lock);
+      chunk->state = ExportChunk::READ;
+      _queue.push_back(chunk);
+      _readCv.notify_one();
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * StreamExport::Compress --
+ *
+ *      Turns the non-zero grains of a chunk into grain markers: the LBA
+ *      and compressed size of the grain, then its zlib stream, padded to
+ *      a sector. A short last grain is padded with zeros to a full grain
+ *      before compressing.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Fills chunk->out and chunk->grainSectors; grain is scratch space.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+StreamExport::Compress(ExportChunk *chunk,      // IN/OUT
+                       vector<uint8> &grain)    // IN/OUT
+{
+   const uLong grainBytes = STREAM_GRAIN_SECTORS * VIXDISKLIB_SECTOR_SIZE;
+   const size_t maxMarker = sizeof(SparseGrainMarker) +
+                            compressBound(grainBytes) +
+                            VIXDISKLIB_SECTOR_SIZE;
+   VixDiskLibSectorType pos;
+
+   chunk->out.clear();
+   chunk->grainSectors.clear();
+   for (pos = 0; pos < chunk->numSectors; pos += STREAM_GRAIN_SECTORS) {
+      const uint8 *data = chunk->data + pos * VIXDISKLIB_SECTOR_SIZE;
+      VixDiskLibSectorType count = chunk->numSectors - pos;
+      SparseGrainMarker marker;
+      size_t offset = chunk->out.size();
+      uLongf len;
+
+      if (count > STREAM_GRAIN_SECTORS) {
+         count = STREAM_GRAIN_SECTORS;
+      }
+      if (IsZeroBuffer(data, count * VIXDISKLIB_SECTOR_SIZE)) {
+         chunk->grainSectors.push_back(STREAM_NO_GRAIN);
+         continue;
+      }
+      if (count < STREAM_GRAIN_SECTORS) {
+         memset(&grain[0], 0, grainBytes);
+         memcpy(&grain[0], data, count * VIXDISKLIB_SECTOR_SIZE);
+         data = &grain[0];
+      }
+
+      chunk->out.resize(offset + maxMarker);
+      len = compressBound(grainBytes);
+      if (compress2(&chunk->out[offset + sizeof marker], &len, data,
+                    grainBytes, _level) != Z_OK) {
+         THROW_ERROR(VIX_E_FAIL);
+      }
+      marker.lba = chunk->startSector + pos;
+      marker.size = (uint32)len;
+      memcpy(&chunk->out[offset], &marker, sizeof marker);
+      len += sizeof marker;
+      len = (len + VIXDISKLIB_SECTOR_SIZE - 1) / VIXDISKLIB_SECTOR_SIZE *
+            VIXDISKLIB_SECTOR_SIZE;
+      memset(&chunk->out[offset + sizeof marker + marker.size], 0,
+             len - sizeof marker - marker.size);
+      chunk->out.resize(offset + len);
+      chunk->grainSectors.push_back((uint32)(offset /
+                                             VIXDISKLIB_SECTOR_SIZE));
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * StreamExport::RunCompressor --
+ *
+ *      Compressing thread: takes queued chunks in any order until the
+ *      export is over or has failed.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Calls Fail() if zlib fails.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+StreamExport::RunCompressor(void)
+{
+   vector<uint8> grain(STREAM_GRAIN_SECTORS * VIXDISKLIB_SECTOR_SIZE);
+   std::unique_lock<std::mutex> lock(_lock);
+
+   for (;;) {
+      ExportChunk *chunk;
+
+      while (!_failed && _queue.empty()) {
+         _readCv.wait(lock);
+      }
+      if (_failed || _queue.front() == NULL) {
+         return;
+      }
+      chunk = _queue.front();
+      _queue.pop_front();
+      lock.unlock();
+      try {
+         Compress(chunk, grain);
+      } catch (const VixDiskError& e) {
+         Fail(e.ErrorCode());
+         return;
+      }
+      lock.lock();
+      chunk->state = ExportChunk::COMPRESSED;
+      _compressedCv.notify_all();
+   }
+}
+
+
+void
+StreamExport::Write(FILE *file,         // IN
+                    const void *data,   // IN
+                    size_t len)         // IN
+{
+   if (len > 0 && fwrite(data, len, 1, file) != 1) {
+      throw VixDiskError(strerror(errno), __FILE__, __LINE__);
+   }
+   _fileSector += len / VIXDISKLIB_SECTOR_SIZE;
+}
+
+
+void
+StreamExport::WriteMarker(FILE *file,          // IN
+                          uint64 numSectors,   // IN
+                          uint32 type)         // IN
+{
+   SparseMetaMarker marker;
+
+   memset(&marker, 0, sizeof marker);
+   marker.numSectors = numSectors;
+   marker.type = type;
+   Write(file, &marker, sizeof marker);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * StreamExport::WriteHeader --
+ *
+ *      Writes a sparse extent header. The header at the start of the
+ *      stream has its grain directory "at the end"; the footer repeats
+ *      it with the real gdOffset. The first one is followed by the
+ *      embedded descriptor, padded to STREAM_OVERHEAD_SECTORS.
+ *
+ * Results:
+ *      None. Throws VixDiskError on failure.
+ *
+ * Side effects:
+ *      Builds _descriptor on the first call.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+StreamExport::WriteHeader(FILE *file,                  // IN
+                          const VixDiskLibInfo *info,  // IN
+                          const char *path,            // IN
+                          uint64 gdOffset)             // IN
+{
+   SparseExtentHeader header;
+   uint64 descriptorSectors;
+
+   if (_descriptor.empty()) {
+      const char *name = strrchr(path, '/');
+      const char *adapter = "lsilogic";
+      uint32 heads = info->physGeo.heads;
+      uint32 sectors = info->physGeo.sectors;
+      uint32 cylinders = info->physGeo.cylinders;
+      std::ostringstream desc;
+
+      if (info->adapterType == VIXDISKLIB_ADAPTER_IDE) {
+         adapter = "ide";
+      } else if (info->adapterType == VIXDISKLIB_ADAPTER_SCSI_BUSLOGIC) {
+         adapter = "buslogic";
+      }
+      if (heads == 0 || sectors == 0) {
+         heads = info->adapterType == VIXDISKLIB_ADAPTER_IDE ? 16 : 255;
+         sectors = 63;
+         cylinders = (uint32)(info->capacity / (heads * sectors));
+      }
+      desc << "# Disk DescriptorFile\n"
+           << "version=1\n"
+           << "encoding=\"UTF-8\"\n"
+           << "CID=" << std::hex << std::setw(8) << std::setfill('0')
+           << (uint32)NowNsec() << std::dec << "\n"
+           << "parentCID=ffffffff\n"
+           << "createType=\"streamOptimized\"\n\n"
+           << "# Extent description\n"
+           << "RW " << info->capacity << " SPARSE \""
+           << (name != NULL ? name + 1 : path) << "\"\n\n"
+           << "# The Disk Data Base\n"
+           << "#DDB\n\n"
+           << "ddb.virtualHWVersion = \"4\"\n"
+           << "ddb.geometry.cylinders = \"" << cylinders << "\"\n"
+           << "ddb.geometry.heads = \"" << heads << "\"\n"
+           << "ddb.geometry.sectors = \"" << sectors << "\"\n"
+           << "ddb.adapterType = \"" << adapter << "\"\n";
+      _descriptor = desc.str();
+   }
+   descriptorSectors = (_descriptor.size() + VIXDISKLIB_SECTOR_SIZE - 1) /
+                       VIXDISKLIB_SECTOR_SIZE;
+   if (1 + descriptorSectors > STREAM_OVERHEAD_SECTORS) {
+      THROW_ERROR(VIX_E_FAIL);
+   }
+
+   memset(&header, 0, sizeof header);
+   header.magicNumber = SPARSE_MAGICNUMBER;
+   header.version = 3;
+   header.flags = SPARSE_FLAG_VALID_NEWLINE | SPARSE_FLAG_COMPRESSED |
+                  SPARSE_FLAG_MARKERS;
+   header.capacity = info->capacity;
+   header.grainSize = STREAM_GRAIN_SECTORS;
+   header.descriptorOffset = 1;
+   header.descriptorSize = descriptorSectors;
+   header.numGTEsPerGT = STREAM_GTES_PER_GT;
+   header.gdOffset = gdOffset;
+   header.overHead = STREAM_OVERHEAD_SECTORS;
+   header.singleEndLineChar = '\n';
+   header.nonEndLineChar = ' ';
+   header.doubleEndLineChar1 = '\r';
+   header.doubleEndLineChar2 = '\n';
+   header.compressAlgorithm = SPARSE_COMPRESSION_DEFLATE;
+   Write(file, &header, sizeof header);
+
+   if (gdOffset == SPARSE_GD_AT_END) {
+      vector<uint8> meta((STREAM_OVERHEAD_SECTORS - 1) *
+                         VIXDISKLIB_SECTOR_SIZE, 0);
+
+      memcpy(&meta[0], _descriptor.data(), _descriptor.size());
+      Write(file, &meta[0], meta.size());
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * StreamExport::Export --
+ *
+ *      Writes the disk open as srcHandle to path: header and descriptor,
+ *      the grains in LBA order as they come out of the reorder buffer,
+ *      then grain tables, grain directory, footer and end-of-stream
+ *      marker.
+ *
+ * Results:
+ *      None. Throws VixDiskError on failure.
+ *
+ * Side effects:
+ *      Creates or truncates path.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+StreamExport::Export(VixDiskLibHandle srcHandle,    // IN
+                     const VixDiskLibInfo *info,    // IN
+                     const char *path)              // IN
+{
+   uint64 numGrains = (info->capacity + STREAM_GRAIN_SECTORS - 1) /
+                      STREAM_GRAIN_SECTORS;
+   uint64 numGTs = (numGrains + STREAM_GTES_PER_GT - 1) / STREAM_GTES_PER_GT;
+   uint64 gtSectors = STREAM_GTES_PER_GT * sizeof(uint32) /
+                      VIXDISKLIB_SECTOR_SIZE;
+   uint64 gdSectors = (numGTs * sizeof(uint32) + VIXDISKLIB_SECTOR_SIZE - 1) /
+                      VIXDISKLIB_SECTOR_SIZE;
+   vector<ThreadHandle> threads(_numThreads);
+   ThreadHandle readerThread;
+   VixDiskLibSectorType bufUpdate = 0;
+   uint64 start, end, total;
+   FILE *file;
+   uint64 n;
+   size_t i;
+
+   file = fopen(path, "wb");
+   if (file == NULL) {
+      throw VixDiskError(strerror(errno), __FILE__, __LINE__);
+   }
+   _srcHandle = srcHandle;
+   _capacity = info->capacity;
+   _numChunks = (_capacity + _chunkSize - 1) / _chunkSize;
+   _grainTable.assign(numGTs * STREAM_GTES_PER_GT, 0);
+   _fileSector = 0;
+   _failed = false;
+   _error = VIX_OK;
+   _queue.clear();
+   for (i = 0; i < _chunks.size(); i++) {
+      _chunks[i].state = ExportChunk::FREE;
+   }
+
+   total = NowNsec();
+   start = total;
+   readerThread = StartThread(&ExportReaderThread, (void*)this);
+   for (i = 0; i < threads.size(); i++) {
+      threads[i] = StartThread(&ExportCompressorThread, (void*)this);
+   }
+
+   try {
+      WriteHeader(file, info, path, SPARSE_GD_AT_END);
+      for (n = 0; n < _numChunks; n++) {
+         ExportChunk *chunk = &_chunks[n % _chunks.size()];
+         uint64 grain;
+
+         {
+            std::unique_lock<std::mutex> lock(_lock);
+
+            while (!_failed && chunk->state != ExportChunk::COMPRESSED) {
+               _compressedCv.wait(lock);
+            }
+            if (_failed) {
+               break;
+            }
+         }
+         grain = chunk->startSector / STREAM_GRAIN_SECTORS;
+         for (i = 0; i < chunk->grainSectors.size(); i++, grain++) {
+            if (chunk->grainSectors[i] == STREAM_NO_GRAIN) {
+               _grainsSkipped++;
+            } else {
+               _grainTable[grain] = (uint32)(_fileSector +
+                                             chunk->grainSectors[i]);
+               _grainsWritten++;
+            }
+         }
+         if (_fileSector + chunk->out.size() / VIXDISKLIB_SECTOR_SIZE >
+             0xffffffffULL) {
+            // Grain table entries are 32-bit sector numbers.
+            THROW_ERROR(VIX_E_FILE_TOO_BIG);
+         }
+         Write(file, chunk->out.empty() ? NULL : &chunk->out[0],
+               chunk->out.size());
+         if (liveStats != NULL) {
+            uint64 skipped = 0;
+
+            for (i = 0; i < chunk->grainSectors.size(); i++) {
+               if (chunk->grainSectors[i] == STREAM_NO_GRAIN) {
+                  skipped += STREAM_GRAIN_SECTORS * VIXDISKLIB_SECTOR_SIZE;
+               }
+            }
+            // Compressed bytes out; skipped is capped at the chunk.
+            LiveAdd(liveStats->bytesWritten, chunk->out.size());
+            LiveAdd(liveStats->bytesSkipped,
+                    std::min(skipped, (uint64)chunk->numSectors *
+                                      VIXDISKLIB_SECTOR_SIZE));
+            LiveAdd(liveStats->writeOps, 1);
+            liveStats->queueDepth.fetch_sub(1, std::memory_order_relaxed);
+         }
+
+         bufUpdate += chunk->numSectors;
+         if (bufUpdate >= BUFS_PER_STAT) {
+            end = NowNsec();
+            PrintStat("Exported", start, end, bufUpdate);
+            start = end;
+            bufUpdate = 0;
+         }
+
+         std::lock_guard<std::mutex> guard(_lock);
+         chunk->state = ExportChunk::FREE;
+         _freeCv.notify_one();
+      }
+   } catch (const VixDiskError& e) {
+      Fail(e.ErrorCode());
+   }
+
+   {
+      std::lock_guard<std::mutex> guard(_lock);
+      _queue.push_back(NULL);   // stops the compressors once drained
+      _readCv.notify_all();
+   }
+   JoinThread(readerThread);
+   for (i = 0; i < threads.size(); i++) {
+      JoinThread(threads[i]);
+   }
+
+   try {
+      CHECK_AND_THROW(_error);
+
+      vector<uint32> gd(gdSectors * VIXDISKLIB_SECTOR_SIZE / sizeof(uint32),
+                        0);
+
+      for (n = 0; n < numGTs; n++) {
+         WriteMarker(file, gtSectors, SPARSE_MARKER_GT);
+         gd[n] = (uint32)_fileSector;
+         Write(file, &_grainTable[n * STREAM_GTES_PER_GT],
+               STREAM_GTES_PER_GT * sizeof(uint32));
+      }
+      WriteMarker(file, gdSectors, SPARSE_MARKER_GD);
+      n = _fileSector;
+      Write(file, &gd[0], gd.size() * sizeof(uint32));
+      WriteMarker(file, 1, SPARSE_MARKER_FOOTER);
+      WriteHeader(file, info, path, n);
+      WriteMarker(file, 0, SPARSE_MARKER_EOS);
+      if (fclose(file) != 0) {
+         file = NULL;
+         throw VixDiskError(strerror(errno), __FILE__, __LINE__);
+      }
+   } catch (...) {
+      if (file != NULL) {
+         fclose(file);
+      }
+      throw;
+   }
+   PrintTotalStat("Exported", total, NowNsec(), _capacity, 0, NULL, NULL);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * DoExport --
+ *
+ *      Exports the source disk to diskPath as a compressed
+ *      streamOptimized vmdk, reading -chunk sectors at a time and
+ *      compressing on -zthreads threads.
+ *
+ * Results:
+ *      None. Throws VixDiskError on failure.
+ *
+ * Side effects:
+ *      Creates or truncates diskPath.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+DoExport(void)
+{
+   VixDisk srcDisk = OpenDisk(appGlobals.connection, appGlobals.srcPath,
+                              appGlobals.openFlags);
+   StreamExport exporter(appGlobals.chunkSize, appGlobals.compressThreads,
+                         appGlobals.compressLevel);
+   VixDiskLibInfo *info = NULL;
+   VixError vixError;
+
+   vixError = VixDiskLib_GetInfo(srcDisk.Handle(), &info);
+   CHECK_AND_THROW(vixError);
+   appGlobals.statsTransport = VixDiskLib_GetTransportMode(srcDisk.Handle());
+   if (liveStats != NULL) {
+      liveStats->totalBytes = (uint64)info->capacity * VIXDISKLIB_SECTOR_SIZE;
+   }
+   printf("Exporting %" FMT64 "u sectors in chunks of %" FMT64 "u sectors "
+          "with %u compressing threads.\n", info->capacity,
+          appGlobals.chunkSize, appGlobals.compressThreads);
+   try {
+      exporter.Export(srcDisk.Handle(), info, appGlobals.diskPath);
+   } catch (...) {
+      VixDiskLib_FreeInfo(info);
+      throw;
+   }
+   VixDiskLib_FreeInfo(info);
+   printf("Wrote %" FMT64 "u grains (%" FMT64 "u bytes), skipped %" FMT64
+          "u zero grains.\n", exporter.GrainsWritten(),
+          exporter.BytesWritten(), exporter.GrainsSkipped());
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * CopyThread --
+ *
+ *       Copies a source disk to the given file.
+ *
+ * Results:
+ *       0 if succeeded, 1 if not.
+ *
+ * Side effects:
+ *      Creates a new disk; sets appGlobals.success to false if fails
+ *
+ *----------------------------------------------------------------------
+ */
+
+static THREAD_RESULT
+CopyThread(void *arg)
+{
+   ThreadData *td = (ThreadData *)arg;
+
+    try {
+      // The target was just created sparse, so zero grains may be skipped.
+      VixDiskLibSectorType skipped;
+      uint64 start = NowNsec();
+
+      if (appGlobals.numBuffers > 0) {
+         CopyPipeline pipeline(CommandCopyContext(false, false),
+                               appGlobals.numBuffers);
+         ZeroCheckStage zeroCheck;
+         HashStage hashStage(td->manifest, td->hashPool);
+
+         pipeline.AddStage(&zeroCheck);
+         if (td->manifest != NULL) {
+            pipeline.AddStage(&hashStage);
+         }
+         pipeline.Copy(VixDiskView(td->srcHandle), VixDiskView(td->dstHandle),
+                       0, td->numSectors);
+         skipped = zeroCheck.SectorsSkipped();
+      } else {
+         CopyEngine engine(CommandCopyContext(true, false));
+
+         engine.SetManifest(td->manifest, td->hashPool);
+         engine.Copy(VixDiskView(td->srcHandle), VixDiskView(td->dstHandle),
+                     0, td->numSectors);
+         skipped = engine.SectorsSkipped();
+      }
+      PrintTotalStat(("Copied to " + td->dstDisk).c_str(), start, NowNsec(),
+                     td->numSectors, 0, NULL, NULL);
+      printf("%s: skipped %" FMT64 "u bytes of zero data.\n",
+             td->dstDisk.c_str(), skipped * VIXDISKLIB_SECTOR_SIZE);
+    } catch (const VixDiskError& e) {
+       cout << "CopyThread (" << td->dstDisk << ")Error: " << e.ErrorCode()
+            <<" " << e.Description();
+        appGlobals.success = FALSE;
+        return TASK_FAIL;
+    }
+
+    cout << "CopyThread to " << td->dstDisk << " succeeded.\n";
+    return TASK_OK;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * PrepareThreadData --
+ *
+ *      Open the source and destination disk for multi threaded copy.
+ *
+ * Results:
+ *      Fills in ThreadData in td.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+PrepareThreadData(VixDiskLibConnection &dstConnection,
+                  ThreadData &td)
+{
+   VixError vixError;
+   VixDiskLibCreateParams createParams;
+   VixDiskLibInfo *info = NULL;
+   char *tmpDir;
+
+#ifdef _WIN32
+   tmpDir = _tempnam("c:\\", "test");
+#else
+   tmpDir = tempnam("/tmp", "test");
+#endif
+   td.dstDisk = tmpDir;
+   free(tmpDir);
+   td.manifest = NULL;
+   td.hashPool = NULL;
+
+   // All the threads run at once: rather than wait for a handle none
+   // of them will return, fail if -pool-max does not allow one each.
+   td.src = diskPool.Open(appConnection, appGlobals.diskPath,
+                          appGlobals.openFlags, false);
+   if (!td.src.IsOpen()) {
+      throw VixDiskError("-multithread needs a handle per thread, over "
+                         "-pool-max", __FILE__, __LINE__);
+   }
+   td.srcHandle = td.src.Handle();
+
+   appGlobals.statsTransport = VixDiskLib_GetTransportMode(td.srcHandle);
+   vixError = VixDiskLib_GetInfo(td.srcHandle, &info);
+   CHECK_AND_THROW(vixError);
+   td.numSectors = info->capacity;
+   VixDiskLib_FreeInfo(info);
+
+   createParams.adapterType = VIXDISKLIB_ADAPTER_SCSI_BUSLOGIC;
+   createParams.capacity = td.numSectors;
+   createParams.diskType = VIXDISKLIB_DISK_SPLIT_SPARSE;
+   createParams.hwVersion = VIXDISKLIB_HWVERSION_WORKSTATION_5;
+
+   vixError = VixDiskLib_Create(dstConnection, td.dstDisk.c_str(),
+                                &createParams, NULL, NULL);
+   CHECK_AND_THROW(vixError);
+
+   vixError = VixDiskLib_Open(dstConnection, td.dstDisk.c_str(), 0,
+                              &td.dstHandle);
+   CHECK_AND_THROW(vixError);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * DoTestMultiThread --
+ *
+ *      Starts a given number of threads, each of which will copy the
+ *      source disk to a temp. file.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+DoTestMultiThread(void)
+{
+   VixDiskLibConnectParams cnxParams = { 0 };
+   VixPooledConnection dstPooled = diskPool.Connect(cnxParams);
+   VixDiskLibConnection dstConnection = dstPooled.Get();
+   VixError vixError;
+   vector<ThreadData> threadData(appGlobals.numThreads);
+   int i;
+
+   if (appGlobals.poolMax != 0 &&
+       (unsigned)appGlobals.numThreads > appGlobals.poolMax) {
+      throw VixDiskError("-multithread needs a handle per thread, over "
+                         "-pool-max", __FILE__, __LINE__);
+   }
+
+   vector<ThreadHandle> threads(appGlobals.numThreads);
+   HashPool hashPool(appGlobals.manifestPath != NULL ?
+                     appGlobals.hashThreads : 0);
+   Manifest *manifest = NULL;
+
+   for (i = 0; i < appGlobals.numThreads; i++) {
+      PrepareThreadData(dstConnection, threadData[i]);
+      // All threads copy the same source, one manifest is enough.
+      if (i == 0 && appGlobals.manifestPath != NULL) {
+         VixDiskLibInfo *info;
+
+         vixError = VixDiskLib_GetInfo(threadData[0].srcHandle, &info);
+         CHECK_AND_THROW(vixError);
+         manifest = new Manifest(DiskUuid(threadData[0].srcHandle, info),
+                                 info->capacity, appGlobals.hashChunk);
+         VixDiskLib_FreeInfo(info);
+         threadData[0].manifest = manifest;
+         threadData[0].hashPool = &hashPool;
+      }
+      threads[i] = StartThread(&CopyThread, (void*)&threadData[i]);
+   }
+   for (i = 0; i < appGlobals.numThreads; i++) {
+      JoinThread(threads[i]);
+   }
+   if (manifest != NULL) {
+      if (appGlobals.success) {
+         SaveManifest(*manifest);
+      }
+      delete manifest;
+   }
+
+   for (i = 0; i < appGlobals.numThreads; i++) {
+      threadData[i].src.Reset();
+      VixDiskLib_Close(threadData[i].dstHandle);
+      VixDiskLib_Unlink(dstConnection, threadData[i].dstDisk.c_str());
+   }
+   if (!appGlobals.success) {
+      THROW_ERROR(VIX_E_FAIL);
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * CloneProgress --
+ *
+ *      Callback for the clone function.
+ *
+ * Results:
+ *      None
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static Bool
+CloneProgressFunc(void *progressData,           // IN
+                  int percentCompleted)         // IN
+{
+   CloneProgress *progress = (CloneProgress *)progressData;
+   uint64 now = NowNsec();
+   VixDiskLibSectorType done = progress->capacity * percentCompleted / 100;
+
+   if (appGlobals.statsFormat == STATS_TEXT && appGlobals.statsFile == NULL) {
+      cout << "Cloning : " << percentCompleted << "% Done" << "\r";
+   } else if (done > progress->reported) {
+      PrintStat("Cloned", progress->last, now, done - progress->reported);
+      progress->last = now;
+   }
+   // The clone waits for this callback, which is all the control over
+   // its pace there is: throttle by the data done since the last call.
+   if (done > progress->reported) {
+      rateLimiter.Acquire((done - progress->reported) *
+                          VIXDISKLIB_SECTOR_SIZE, 0);
+      if (liveStats != NULL) {
+         LiveAdd(liveStats->bytesWritten,
+                 (done - progress->reported) * VIXDISKLIB_SECTOR_SIZE);
+      }
+      progress->reported = done;
+   }
+   return TRUE;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * DoClone --
+ *
+ *      Clones a local disk (possibly to an ESX host).
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+DoClone(void)
+{
+   VixDiskLibConnectParams cnxParams = { 0 };
+   VixPooledConnection srcConnection = diskPool.Connect(cnxParams);
+   CloneProgress progress;
+   VixError vixError;
+
+   // The source capacity turns the clone percentage into byte counts.
+   {
+      VixPooledDisk src = diskPool.Open(srcConnection, appGlobals.srcPath,
+                                        VIXDISKLIB_FLAG_OPEN_READ_ONLY);
+      VixDiskLibInfo *info;
+
+      vixError = VixDiskLib_GetInfo(src.Handle(), &info);
+      CHECK_AND_THROW(vixError);
+      progress.capacity = info->capacity;
+      VixDiskLib_FreeInfo(info);
+      // Closed rather than kept: the clone opens the source itself.
+      src.Discard();
+   }
+   if (liveStats != NULL) {
+      liveStats->totalBytes = (uint64)progress.capacity *
+                              VIXDISKLIB_SECTOR_SIZE;
+   }
+   appGlobals.statsTransport = appGlobals.transportModes != NULL ?
+                               appGlobals.transportModes : "file";
+
+   /*
+    *  Note : These createParams are ignored for remote case
+    */
+
+   VixDiskLibCreateParams createParams;
+   createParams.adapterType = appGlobals.adapterType;
+   createParams.capacity = appGlobals.mbSize * 2048;
+   createParams.diskType = appGlobals.diskType;
+   createParams.hwVersion = VIXDISKLIB_HWVERSION_WORKSTATION_5;
+
+   progress.start = NowNsec();
+   progress.last = progress.start;
+   progress.reported = 0;
+   vixError = VixDiskLib_Clone(appGlobals.connection,
+                               appGlobals.diskPath,
+                               srcConnection.Get(),
+                               appGlobals.srcPath,
+                               &createParams,
+                               CloneProgressFunc,
+                               &progress,   // clientData
+                               TRUE);       // doOverWrite
+   CHECK_AND_THROW(vixError);
+   cout << "\n Done" << "\n";
+   PrintTotalStat("Cloned", progress.start, NowNsec(), progress.capacity, 0,
+                  NULL, NULL);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * OpenStats --
+ *
+ *      Opens the -stats-file (appending). Without one, text statistics
+ *      go to stdout with the rest of the output, and JSON and CSV
+ *      records to stderr, so neither stream mixes the two. A CSV header
+ *      is written if the file is empty.
+ *
+ * Results:
+ *      true on success.
+ *
+ * Side effects:
+ *      Sets appGlobals.statsOut.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static bool
+OpenStats(void)
+{
+   appGlobals.statsOut = appGlobals.statsFormat == STATS_TEXT ? stdout :
+                                                                stderr;
+   if (appGlobals.statsFile != NULL) {
+      appGlobals.statsOut = fopen(appGlobals.statsFile, "a");
+      if (appGlobals.statsOut == NULL) {
+         perror(appGlobals.statsFile);
+         return false;
+      }
+   }
+   if (appGlobals.statsFormat == STATS_CSV &&
+       !(appGlobals.command & COMMAND_ESTIMATE_DEDUP) &&
+       (appGlobals.statsFile == NULL || ftell(appGlobals.statsOut) == 0)) {
+      fprintf(appGlobals.statsOut,
+              "timestamp,kind,op,interval_ms,interval_bytes,total_bytes,"
+              "mbytes_per_sec,ops,iops,read_ops,read_p50_us,read_p90_us,"
+              "read_p99_us,read_p999_us,write_ops,write_p50_us,write_p90_us,"
+              "write_p99_us,write_p999_us,open_flags,transport\n");
+   }
+   return true;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * CloseStats --
+ *
+ *      Closes the -stats-file, if any.
+ *
+ * Results:
+ *      None
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+CloseStats(void)
+{
+   if (appGlobals.statsOut != NULL && appGlobals.statsFile != NULL) {
+      fclose(appGlobals.statsOut);
+   }
+   appGlobals.statsOut = NULL;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * PrintPoolCounters --
+ *
+ *      Tells how many connects and opens the pool saved, if it was used
+ *      for more than the connection of the command line.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+PrintPoolCounters(void)
+{
+   VixPoolCounters c = diskPool.Counters();
+
+   if (c.connectHits + c.openHits + c.openMisses == 0) {
+      return;
+   }
+   printf("Pool: %" FMT64 "u of %" FMT64 "u connects and %" FMT64 "u of %"
+          FMT64 "u opens reused, %" FMT64 "u waits for -pool-max, %" FMT64
+          "u closed idle.\n", c.connectHits, c.connectHits + c.connectMisses,
+          c.openHits, c.openHits + c.openMisses, c.waits, c.closedIdle);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * PrintArenaCounters --
+ *
+ *      Tells how much of the buffer arena the command used at most and
+ *      how many buffers were reused, if it allocated any.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+PrintArenaCounters(void)
+{
+   IoArenaCounters c = ioArena.Counters();
+
+   if (c.allocs == 0) {
+      return;
+   }
+   printf("Arena: %" FMT64 "u KB peak of a %" FMT64 "u MB slab (%s), %"
+          FMT64 "u buffers, %" FMT64 "u reused in thread, %" FMT64
+          "u shared, %" FMT64 "u outside the slab.\n", c.peakInUse >> 10,
+          c.slabBytes >> 20, c.hugePages ? "huge pages" : "4 KB pages",
+          c.allocs, c.cacheHits, c.sharedHits, c.overflows);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * OpenLiveStats --
+ *
+ *      Creates and maps the live statistics block of this process,
+ *      -stats-dir/vix-disklib-sample.<pid>.stats (/dev/shm by default).
+ *      Failing to is not an error: the command runs without one.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Sets liveBlock.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+OpenLiveStats(void)
+{
+#ifndef _WIN32
+   const char *dir = appGlobals.liveStatsDir != NULL ?
+                     appGlobals.liveStatsDir : "/dev/shm";
+   char name[64];
+   void *map = MAP_FAILED;
+   int fd;
+
+   snprintf(name, sizeof name, LIVE_STATS_PREFIX "%d" LIVE_STATS_SUFFIX,
+            (int)getpid());
+   liveBlockPath = string(dir) + "/" + name;
+   // A stale block of a process with the same pid is replaced, not
+   // truncated under a reader that may have it mapped.
+   unlink(liveBlockPath.c_str());
+   fd = open(liveBlockPath.c_str(), O_RDWR | O_CREAT | O_EXCL, 0644);
+   if (fd >= 0) {
+      // The new, zero filled block has no active slot.
+      if (ftruncate(fd, sizeof(LiveStatsBlock)) == 0) {
+         map = mmap(NULL, sizeof(LiveStatsBlock), PROT_READ | PROT_WRITE,
+                    MAP_SHARED, fd, 0);
+      }
+      close(fd);
+   }
+   if (map == MAP_FAILED) {
+      fprintf(stderr, "Warning: no live statistics in %s: %s\n",
+              liveBlockPath.c_str(), strerror(errno));
+      if (fd >= 0) {
+         unlink(liveBlockPath.c_str());
+      }
+      liveBlockPath.clear();
+      return;
+   }
+   liveBlock = (LiveStatsBlock *)map;
+   liveBlock->version = LIVE_STATS_VERSION;
+   liveBlock->numSlots = LIVE_STATS_SLOTS;
+   liveBlock->pid = getpid();
+   // Readers ignore the block until the magic is there.
+   std::atomic_thread_fence(std::memory_order_release);
+   memcpy(liveBlock->magic, LIVE_STATS_MAGIC, sizeof liveBlock->magic);
+#endif
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * CloseLiveStats --
+ *
+ *      Unmaps and removes the live statistics block, if any.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      liveStats and the slots claimed are no longer valid.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+CloseLiveStats(void)
+{
+#ifndef _WIN32
+   if (liveBlock != NULL) {
+      munmap(liveBlock, sizeof(LiveStatsBlock));
+      unlink(liveBlockPath.c_str());
+   }
+#endif
+   liveBlock = NULL;
+   liveStats = NULL;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ClaimLiveSlot --
+ *
+ *      Takes a free slot of the live statistics block for a job named
+ *      name copying src to dst (either may be NULL) and clears it.
+ *
+ * Results:
+ *      The slot, or NULL if there is no block or no free slot.
+ *
+ * Side effects:
+ *      The slot is shown by -stats until ReleaseLiveSlot.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static LiveJobStats *
+ClaimLiveSlot(const char *name,   // IN
+              const char *src,    // IN
+              const char *dst)    // IN
+{
+   std::lock_guard<std::mutex> guard(liveSlotLock);
+   uint32 i;
+
+   if (liveBlock == NULL) {
+      return NULL;
+   }
+   for (i = 0; i < LIVE_STATS_SLOTS; i++) {
+      LiveJobStats *slot = &liveBlock->slots[i];
+
+      if (slot->active.load(std::memory_order_relaxed) != 0) {
+         continue;
+      }
+      slot->errors.store(0, std::memory_order_relaxed);
+      slot->totalBytes.store(0, std::memory_order_relaxed);
+      slot->bytesRead.store(0, std::memory_order_relaxed);
+      slot->bytesWritten.store(0, std::memory_order_relaxed);
+      slot->bytesSkipped.store(0, std::memory_order_relaxed);
+      slot->readOps.store(0, std::memory_order_relaxed);
+      slot->writeOps.store(0, std::memory_order_relaxed);
+      slot->queueDepth.store(0, std::memory_order_relaxed);
+      slot->startTime.store(
+         std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count(),
+         std::memory_order_relaxed);
+      snprintf(slot->name, sizeof slot->name, "%s", name);
+      snprintf(slot->src, sizeof slot->src, "%s", src != NULL ? src : "");
+      snprintf(slot->dst, sizeof slot->dst, "%s", dst != NULL ? dst : "");
+      slot->active.store(1, std::memory_order_release);
+      return slot;
+   }
+   return NULL;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ReleaseLiveSlot --
+ *
+ *      Frees a slot taken by ClaimLiveSlot. slot may be NULL.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+ReleaseLiveSlot(LiveJobStats *slot)   // IN
+{
+   std::lock_guard<std::mutex> guard(liveSlotLock);
+
+   if (slot != NULL) {
+      slot->active.store(0, std::memory_order_release);
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * CommandName --
+ *
+ *      Names the command being run, for the live statistics.
+ *
+ * Results:
+ *      The option that selects it, without the '-'.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static const char *
+CommandName(void)
+{
+   static const char *names[] = {
+      "create", "dump", "fill", "info", "redo", "meta", "rmeta", "wmeta",
+      "multithread", "clone", "readbench", "writebench", "copy",
+      "estimate-dedup", "export", "daemon", "stats", "import",
+   };
+   size_t i;
+
+   for (i = 0; i < sizeof names / sizeof names[0]; i++) {
+      if (appGlobals.command & (1 << i)) {
+         return names[i];
+      }
+   }
+   return "";
+}
+
+
+#ifndef _WIN32
+// A job seen in a live statistics block.
+struct LiveJobSample {
+   uint64 pid;
+   uint32 slot;
+   string name;
+   string src;
+   string dst;
+   uint32 errors;
+   uint64 startTime;
+   uint64 totalBytes;
+   uint64 bytesRead;
+   uint64 bytesWritten;
+   uint64 bytesSkipped;
+   uint64 readOps;
+   uint64 writeOps;
+   uint64 queueDepth;
+
+   // Bytes of the job done: what was read, or for a job that only
+   // writes (clone, writebench) what was written or skipped.
+   uint64 Done() const
+   {
+      return std::max(bytesRead, bytesWritten + bytesSkipped);
+   }
+   bool operator<(const LiveJobSample &other) const
+   {
+      return pid != other.pid ? pid < other.pid : slot < other.slot;
+   }
+};
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * SampleLiveStats --
+ *
+ *      Reads the active slots of the live statistics blocks in dir
+ *      whose process is still running. Blocks left behind by a process
+ *      that was killed are skipped.
+ *
+ * Results:
+ *      The jobs, ordered by pid and slot.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static vector<LiveJobSample>
+SampleLiveStats(const char *dir)   // IN
+{
+   vector<LiveJobSample> jobs;
+   DIR *d = opendir(dir);
+   struct dirent *entry;
+   size_t prefixLen = strlen(LIVE_STATS_PREFIX);
+   size_t suffixLen = strlen(LIVE_STATS_SUFFIX);
+
+   if (d == NULL) {
+      return jobs;
+   }
+   while ((entry = readdir(d)) != NULL) {
+      string file = entry->d_name;
+      string path = string(dir) + "/" + file;
+      LiveStatsBlock *block;
+      struct stat st;
+      void *map;
+      int fd;
+      uint32 i;
+
+      if (file.size() <= prefixLen + suffixLen ||
+          file.compare(0, prefixLen, LIVE_STATS_PREFIX) != 0 ||
+          file.compare(file.size() - suffixLen, suffixLen,
+                       LIVE_STATS_SUFFIX) != 0) {
+         continue;
+      }
+      fd = open(path.c_str(), O_RDONLY);
+      if (fd < 0) {
+         continue;
+      }
+      // Reading the mapping past the end of a short file, e.g. one just
+      // created and not sized yet, would raise SIGBUS.
+      if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(LiveStatsBlock)) {
+         close(fd);
+         continue;
+      }
+      map = mmap(NULL, sizeof(LiveStatsBlock), PROT_READ, MAP_SHARED, fd, 0);
+      close(fd);
+      if (map == MAP_FAILED) {
+         continue;
+      }
+      block = (LiveStatsBlock *)map;
+      if (memcmp(block->magic, LIVE_STATS_MAGIC, sizeof block->magic) != 0 ||
+          block->version != LIVE_STATS_VERSION ||
+          (kill((pid_t)block->pid, 0) != 0 && errno == ESRCH)) {
+         munmap(map, sizeof(LiveStatsBlock));
+         continue;
+      }
+      std::atomic_thread_fence(std::memory_order_acquire);
+      for (i = 0; i < LIVE_STATS_SLOTS && i < block->numSlots; i++) {
+         LiveJobStats *s = &block->slots[i];
+         LiveJobSample job;
+
+         if (s->active.load(std::memory_order_acquire) == 0) {
+            continue;
+         }
+         job.pid = block->pid;
+         job.slot = i;
+         job.name.assign(s->name, strnlen(s->name, sizeof s->name));
+         job.src.assign(s->src, strnlen(s->src, sizeof s->src));
+         job.dst.assign(s->dst, strnlen(s->dst, sizeof s->dst));
+         job.errors = s->errors.load(std::memory_order_relaxed);
+         job.startTime = s->startTime.load(std::memory_order_relaxed);
+         job.totalBytes = s->totalBytes.load(std::memory_order_relaxed);
+         job.bytesRead = s->bytesRead.load(std::memory_order_relaxed);
+         job.bytesWritten = s->bytesWritten.load(std::memory_order_relaxed);
+         job.bytesSkipped = s->bytesSkipped.load(std::memory_order_relaxed);
+         job.readOps = s->readOps.load(std::memory_order_relaxed);
+         job.writeOps = s->writeOps.load(std::memory_order_relaxed);
+         job.queueDepth = s->queueDepth.load(std::memory_order_relaxed);
+         jobs.push_back(job);
+      }
+      munmap(map, sizeof(LiveStatsBlock));
+   }
+   closedir(d);
+   std::sort(jobs.begin(), jobs.end());
+   return jobs;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * PrometheusLabel --
+ *
+ *      Escapes a label value for the Prometheus text format.
+ *
+ * Results:
+ *      value with '\', '"' and newlines escaped.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static string
+PrometheusLabel(const string &value)   // IN
+{
+   string out;
+   size_t i;
+
+   for (i = 0; i < value.size(); i++) {
+      if (value[i] == '\\' || value[i] == '"') {
+         out += '\\';
+         out += value[i];
+      } else if (value[i] == '\n') {
+         out += "\\n";
+      } else {
+         out += value[i];
+      }
+   }
+   return out;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * FormatPrometheus --
+ *
+ *      Renders jobs in the Prometheus text exposition format, one
+ *      series per job labelled with its pid, slot, name and paths.
+ *
+ * Results:
+ *      The text.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static string
+FormatPrometheus(const vector<LiveJobSample> &jobs)   // IN
+{
+   static const struct {
+      const char *name;
+      const char *type;
+      const char *help;
+   } metrics[] = {
+      { "vdlk_bytes_read_total", "counter", "Bytes read from the source." },
+      { "vdlk_bytes_written_total", "counter",
+        "Bytes written to the target." },
+      { "vdlk_bytes_skipped_total", "counter",
+        "Bytes not written because they were zero or unchanged." },
+      { "vdlk_read_ops_total", "counter", "Read calls." },
+      { "vdlk_write_ops_total", "counter", "Write calls." },
+      { "vdlk_errors_total", "counter", "I/O errors." },
+      { "vdlk_queue_depth", "gauge", "Buffers read but not yet written." },
+      { "vdlk_size_bytes", "gauge", "Bytes the job moves, 0 if unknown." },
+      { "vdlk_start_time_seconds", "gauge",
+        "Start of the job, in seconds since the epoch." },
+   };
+   std::ostringstream out;
+   size_t m, i;
+
+   for (m = 0; m < sizeof metrics / sizeof metrics[0]; m++) {
+      out << "# HELP " << metrics[m].name << " " << metrics[m].help << "\n";
+      out << "# TYPE " << metrics[m].name << " " << metrics[m].type << "\n";
+      for (i = 0; i < jobs.size(); i++) {
+         const LiveJobSample &job = jobs[i];
+         uint64 values[] = {
+            job.bytesRead, job.bytesWritten, job.bytesSkipped, job.readOps,
+            job.writeOps, job.errors, job.queueDepth, job.totalBytes,
+            job.startTime / 1000000000,
+         };
+
+         out << metrics[m].name << "{pid=\"" << job.pid << "\",slot=\""
+             << job.slot << "\",job=\"" << PrometheusLabel(job.name)
+             << "\",src=\"" << PrometheusLabel(job.src) << "\",dst=\""
+             << PrometheusLabel(job.dst) << "\"} " << values[m] << "\n";
+      }
+   }
+   return out.str();
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ServePrometheus --
+ *
+ *      Answers each connection to the Unix socket path with the live
+ *      statistics in dir in the Prometheus text format, as an HTTP/1.0
+ *      response, whatever the request. Runs until killed.
+ *
+ * Results:
+ *      1 if the socket cannot be set up.
+ *
+ * Side effects:
+ *      Replaces the file at path with the socket.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+ServePrometheus(const char *dir,    // IN
+                const char *path)   // IN
+{
+   struct sockaddr_un addr;
+   int listenFd;
+
+   memset(&addr, 0, sizeof addr);
+   addr.sun_family = AF_UNIX;
+   if (strlen(path) >= sizeof addr.sun_path) {
+      fprintf(stderr, "Socket path too long: %s\n", path);
+      return 1;
+   }
+   strcpy(addr.sun_path, path);
+   listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+   unlink(path);
+   if (listenFd < 0 ||
+       bind(listenFd, (struct sockaddr *)&addr, sizeof addr) != 0 ||
+       listen(listenFd, 8) != 0) {
+      perror(path);
+      if (listenFd >= 0) {
+         close(listenFd);
+      }
+      return 1;
+   }
+   signal(SIGPIPE, SIG_IGN);
+   printf("Serving statistics of %s on %s.\n", dir, path);
+   fflush(stdout);
+
+   for (;;) {
+      int fd = accept(listenFd, NULL, NULL);
+      // One client at a time: a silent or stuck one gives up its turn.
+      struct timeval timeout = { PROMETHEUS_TIMEOUT_SEC, 0 };
+      char request[1024];
+      char header[128];
+      string response;
+      size_t sent = 0;
+
+      if (fd < 0) {
+         if (errno == EINTR) {
+            continue;
+         }
+         perror("accept");
+         close(listenFd);
+         return 1;
+      }
+      setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof timeout);
+      setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof timeout);
+      // The request itself does not matter; read what has been sent.
+      (void)recv(fd, request, sizeof request, 0);
+      response = FormatPrometheus(SampleLiveStats(dir));
+      snprintf(header, sizeof header, "HTTP/1.0 200 OK\r\n"
+               "Content-Type: text/plain; version=0.0.4\r\n"
+               "Content-Length: %u\r\n\r\n", (unsigned)response.size());
+      response = header + response;
+      while (sent < response.size()) {
+         ssize_t n = send(fd, response.data() + sent,
+                          response.size() - sent, 0);
+
+         if (n <= 0) {
+            break;
+         }
+         sent += n;
+      }
+      close(fd);
+   }
+}
+#endif
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * DoStats --
+ *
+ *      Shows the jobs of the processes with live statistics in the
+ *      directory diskPath: samples them twice, a second apart, and
+ *      prints per job the bytes read, written and skipped, the current
+ *      and average rate, the time left, the operations, the queue depth
+ *      and the errors. With -prometheus, serves them on a Unix socket
+ *      instead.
+ *
+ * Results:
+ *      Exit code of the program.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+DoStats(void)
+{
+#ifdef _WIN32
+   fprintf(stderr, "Live statistics are not supported on Windows.\n");
+   return 1;
+#else
+   vector<LiveJobSample> before, after;
+   uint64 t0, t1, now;
+   size_t i, j;
+
+   if (appGlobals.prometheusSocket != NULL) {
+      return ServePrometheus(appGlobals.diskPath,
+                             appGlobals.prometheusSocket);
+   }
+
+   t0 = NowNsec();
+   before = SampleLiveStats(appGlobals.diskPath);
+   std::this_thread::sleep_for(std::chrono::seconds(1));
+   after = SampleLiveStats(appGlobals.diskPath);
+   t1 = NowNsec();
+   now = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count();
+
+   if (after.empty()) {
+      printf("No running jobs in %s.\n", appGlobals.diskPath);
+      return 0;
+   }
+   for (i = 0; i < after.size(); i++) {
+      const LiveJobSample &job = after[i];
+      double elapsed = now > job.startTime ? (now - job.startTime) / 1e9 : 0;
+      double average = elapsed > 0 ? job.Done() / 1048576.0 / elapsed : 0;
+      double current = -1;
+
+      for (j = 0; j < before.size(); j++) {
+         if (before[j].pid == job.pid && before[j].slot == job.slot &&
+             before[j].startTime == job.startTime) {
+            current = (job.Done() - before[j].Done()) / 1048576.0 /
+                      ((t1 - t0) / 1e9);
+         }
+      }
+
+      printf("%" FMT64 "u %s: %s -> %s\n", job.pid, job.name.c_str(),
+             job.src.c_str(), job.dst.c_str());
+      printf("   read %.1f MB, written %.1f MB, skipped %.1f MB",
+             job.bytesRead / 1048576.0, job.bytesWritten / 1048576.0,
+             job.bytesSkipped / 1048576.0);
+      if (job.totalBytes > 0) {
+         printf(" of %.1f MB (%.0f%%)", job.totalBytes / 1048576.0,
+                100.0 * std::min(job.Done(), job.totalBytes) / job.totalBytes);
+      }
+      printf("\n   ");
+      if (current >= 0) {
+         printf("now %.2f MB/s, ", current);
+      }
+      printf("average %.2f MB/s", average);
+      if (job.totalBytes > job.Done() && average > 0) {
+         printf(", ETA %.0f s",
+                (job.totalBytes - job.Done()) / 1048576.0 / average);
+      }
+      printf("\n   %" FMT64 "u reads, %" FMT64 "u writes, queue depth %"
+             FMT64 "u, %u errors\n", job.readOps, job.writeOps,
+             job.queueDepth, job.errors);
+   }
+   return 0;
+#endif
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * OpenFlagsString --
+ *
+ *      Names the VixDiskLib open flags in use, '|' separated.
+ *
+ * Results:
+ *      Flag names, "none" if no flag is set.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static string
+OpenFlagsString(uint32 flags)   // IN
+{
+   string str;
+
+   if (flags & VIXDISKLIB_FLAG_OPEN_UNBUFFERED) {
+      str += "|unbuffered";
+   }
+   if (flags & VIXDISKLIB_FLAG_OPEN_SINGLE_LINK) {
+      str += "|single_link";
+   }
+   if (flags & VIXDISKLIB_FLAG_OPEN_READ_ONLY) {
+      str += "|read_only";
+   }
+   return str.empty() ? "none" : str.substr(1);
+}
+
+
+// Escapes a string for a JSON string literal.
+static string
+JsonEscape(const char *value)   // IN
+{
+   string out;
+   char hex[8];
+
+   for (; *value != '\0'; value++) {
+      if (*value == '\\' || *value == '"') {
+         out += '\\';
+         out += *value;
+      } else if ((unsigned char)*value < 0x20) {
+         snprintf(hex, sizeof hex, "\\u%04x", (unsigned char)*value);
+         out += hex;
+      } else {
+         out += *value;
+      }
+   }
+   return out;
+}
+
+
+// Escapes a string for a quoted CSV field: quotes are doubled.
+static string
+CsvEscape(const char *value)   // IN
+{
+   string out;
+
+   for (; *value != '\0'; value++) {
+      if (*value == '"') {
+         out += '"';
+      }
+      out += *value;
+   }
+   return out;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * EmitStat --
+ *
+ *      Writes one statistics record in the selected format. Text
+ *      records are the classic human readable lines; JSON records are
+ *      one object per line; CSV records follow the header written by
+ *      OpenStats.
+ *
+ * Results:
+ *      None
+ *
+ * Side effects:
+ *      Adds interval records to the running byte total of the calling
+ *      thread, which is the thread running the job: every job reports
+ *      its intervals and its total from one thread.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+EmitStat(bool total,                           // IN
+         const char *op,                       // IN
+         uint64 start,                         // IN
+         uint64 end,                           // IN
+         VixDiskLibSectorType numSectors,      // IN
+         uint64 numOps,                        // IN
+         const LatencyHistogram *readLatency,  // IN
+         const LatencyHistogram *writeLatency) // IN
+{
+   static std::mutex statsLock;
+   static thread_local uint64 totalBytes = 0;
+   std::lock_guard<std::mutex> guard(statsLock);
+   FILE *out = appGlobals.statsOut != NULL ? appGlobals.statsOut :
+               appGlobals.statsFormat == STATS_TEXT ? stdout : stderr;
+   uint64 bytes = numSectors * VIXDISKLIB_SECTOR_SIZE;
+   uint64 elapsed = (end - start) / 1000000;
+   double usec[2][4] = { { 0 } };
+   uint64 latOps[2] = { 0, 0 };
+   const LatencyHistogram *lat[2] = { readLatency, writeLatency };
+   static const double pcts[4] = { 50, 90, 99, 99.9 };
+   double mbps;
+   uint64 iops;
+   int i, j;
+
+   if (elapsed == 0) {
+      elapsed = 1;
+   }
+   mbps = (double)bytes * 1000 / (1024 * 1024 * elapsed);
+   iops = numOps * 1000 / elapsed;
+   for (i = 0; i < 2; i++) {
+      if (lat[i] != NULL) {
+         latOps[i] = lat[i]->Count();
+         for (j = 0; j < 4; j++) {
+            usec[i][j] = lat[i]->Percentile(pcts[j]) / 1000.0;
+         }
+      }
+   }
+   totalBytes = total ? bytes : totalBytes + bytes;
+
+   if (appGlobals.statsFormat == STATS_TEXT) {
+      fprintf(out, "%s %d MBytes in %d msec (%d MBytes/sec)\n", op,
+              (uint32)(numSectors /(2048)), (uint32)elapsed, (uint32)mbps);
+      if (total && numOps != 0) {
+         fprintf(out, "%" FMT64 "u IOPS\n", iops);
+      }
+      for (i = 0; total && i < 2; i++) {
+         if (latOps[i] != 0) {
+            fprintf(out, "%s latency (usec) over %" FMT64 "u ops: p50 %.1f  "
+                    "p90 %.1f  p99 %.1f  p99.9 %.1f\n", i ? "Write" : "Read",
+                    latOps[i], usec[i][0], usec[i][1], usec[i][2], usec[i][3]);
+         }
+      }
+   } else {
+      std::chrono::system_clock::time_point now =
+         std::chrono::system_clock::now();
+      time_t secs = std::chrono::system_clock::to_time_t(now);
+      int msec = (int)(std::chrono::duration_cast<std::chrono::milliseconds>(
+                          now.time_since_epoch()).count() % 1000);
+      string flags = OpenFlagsString(appGlobals.openFlags);
+      const char *transport = appGlobals.statsTransport != NULL ?
+                              appGlobals.statsTransport : "";
+      char stamp[32];
+      struct tm tm;
+
+#ifdef _WIN32
+      gmtime_s(&tm, &secs);
+#else
+      gmtime_r(&secs, &tm);
+#endif
+      strftime(stamp, sizeof stamp, "%Y-%m-%dT%H:%M:%S", &tm);
+
+      if (appGlobals.statsFormat == STATS_JSON) {
+         fprintf(out, "{\"timestamp\":\"%s.%03dZ\",\"kind\":\"%s\","
+                 "\"op\":\"%s\",\"interval_ms\":%" FMT64 "u,"
+                 "\"interval_bytes\":%" FMT64 "u,\"total_bytes\":%" FMT64 "u,"
+                 "\"mbytes_per_sec\":%.1f,\"ops\":%" FMT64 "u,"
+                 "\"iops\":%" FMT64 "u",
+                 stamp, msec, total ? "total" : "interval",
+                 JsonEscape(op).c_str(), elapsed,
+                 bytes, totalBytes, mbps, numOps, iops);
+         for (i = 0; i < 2; i++) {
+            const char *name = i ? "write" : "read";
+
+            fprintf(out, ",\"%s_ops\":%" FMT64 "u,\"%s_latency_us\":"
+                    "{\"p50\":%.1f,\"p90\":%.1f,\"p99\":%.1f,"
+                    "\"p99.9\":%.1f}", name, latOps[i], name, usec[i][0],
+                    usec[i][1], usec[i][2], usec[i][3]);
+         }
+         fprintf(out, ",\"open_flags\":\"%s\",\"transport\":\"%s\"}\n",
+                 flags.c_str(), transport);
+      } else {
+         fprintf(out, "%s.%03dZ,%s,\"%s\",%" FMT64 "u,%" FMT64 "u,%" FMT64 "u,"
+                 "%.1f,%" FMT64 "u,%" FMT64 "u", stamp, msec,
+                 total ? "total" : "interval", CsvEscape(op).c_str(),
+                 elapsed, bytes, totalBytes, mbps, numOps, iops);
+         for (i = 0; i < 2; i++) {
+            fprintf(out, ",%" FMT64 "u,%.1f,%.1f,%.1f,%.1f", latOps[i],
+                    usec[i][0], usec[i][1], usec[i][2], usec[i][3]);
+         }
+         fprintf(out, ",%s,%s\n", flags.c_str(), transport);
+      }
+   }
+   fflush(out);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * PrintStat --
+ *
+ *      Print performance statistics for one interval of a benchmark,
+ *      copy or clone. Times are NowNsec() values.
+ *
+ * Results:
+ *      None
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+PrintStat(const char *op,                   // IN
+          uint64 start,                     // IN
+          uint64 end,                       // IN
+          VixDiskLibSectorType numSectors)  // IN
+{
+   EmitStat(false, op, start, end, numSectors, 0, NULL, NULL);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * PrintTotalStat --
+ *
+ *      Print performance statistics for a whole job. numOps and the
+ *      latency histograms are optional (0 and NULL).
+ *
+ * Results:
+ *      None
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+PrintTotalStat(const char *op,                       // IN
+               uint64 start,                         // IN
+               uint64 end,                           // IN
+               VixDiskLibSectorType numSectors,      // IN
+               uint64 numOps,                        // IN
+               const LatencyHistogram *readLatency,  // IN
+               const LatencyHistogram *writeLatency) // IN
+{
+   EmitStat(true, op, start, end, numSectors, numOps, readLatency,
+            writeLatency);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * PrintCopyTotal --
+ *
+ *      Print the statistics of a copy of numSectors sectors, of which
+ *      copied were read and written; the rest were left out as done in
+ *      the -resume journal and are reported on a line of their own.
+ *
+ * Results:
+ *      None
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+PrintCopyTotal(uint64 start,                      // IN
+               uint64 end,                        // IN
+               VixDiskLibSectorType numSectors,   // IN
+               VixDiskLibSectorType copied)       // IN
+{
+   PrintTotalStat("Copied", start, end, copied, 0, NULL, NULL);
+   if (copied < numSectors) {
+      printf("Left out %" FMT64 "u bytes already copied according to the "
+             "journal.\n", (uint64)(numSectors - copied) *
+                           VIXDISKLIB_SECTOR_SIZE);
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * InitBuffer --
+ *
+ *      Fill an array of uint32 with random values, to defeat any
+ *      attempts to compress it.
+ *
+ * Results:
+ *      None
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+InitBuffer(uint32 *buf,     // OUT
+           uint32 numElems) // IN
+{
+   int i;
+
+   srand(time(NULL));
+
+   for (i = 0; i < numElems; i++) {
+      buf[i] = (uint32)rand();
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LatencyHistogram::LatencyHistogram --
+ *
+ *      Creates an empty histogram.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+LatencyHistogram::LatencyHistogram()
+   : _count(0)
+{
+   memset(_counts, 0, sizeof _counts);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LatencyHistogram::Bucket --
+ *
+ *      Maps a latency to its bucket: values below LAT_SUB_BUCKETS get a
+ *      bucket each, larger ones are split by their most significant bit
+ *      and the LAT_SUB_BITS bits below it.
+ *
+ * Results:
+ *      Bucket index.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+unsigned
+LatencyHistogram::Bucket(uint64 nsec)   // IN
+{
+   unsigned msb;
+
+   if (nsec < LAT_SUB_BUCKETS) {
+      return (unsigned)nsec;
+   }
+#ifdef __GNUC__
+   msb = 63 - __builtin_clzll(nsec);
+#else
+   for (msb = 63; !(nsec >> msb); msb--) {
+   }
+#endif
+   return (msb - LAT_SUB_BITS + 1) * LAT_SUB_BUCKETS +
+          (unsigned)((nsec >> (msb - LAT_SUB_BITS)) & (LAT_SUB_BUCKETS - 1));
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LatencyHistogram::BucketValue --
+ *
+ *      Inverse of Bucket().
+ *
+ * Results:
+ *      Midpoint of the latency range covered by the bucket.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+uint64
+LatencyHistogram::BucketValue(unsigned bucket)   // IN
+{
+   unsigned shift;
+
+   if (bucket < LAT_SUB_BUCKETS) {
+      return bucket;
+   }
+   shift = bucket / LAT_SUB_BUCKETS - 1;
+   return ((uint64)(LAT_SUB_BUCKETS + bucket % LAT_SUB_BUCKETS) << shift) +
+          ((1ULL << shift) >> 1);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LatencyHistogram::Merge --
+ *
+ *      Adds the samples of another histogram to this one.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+LatencyHistogram::Merge(const LatencyHistogram &other)   // IN
+{
+   unsigned i;
+
+   for (i = 0; i < LAT_NUM_BUCKETS; i++) {
+      _counts[i] += other._counts[i];
+   }
+   _count += other._count;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LatencyHistogram::Percentile --
+ *
+ *      Finds the latency below which pct percent of the samples fall.
+ *
+ * Results:
+ *      Latency in nanoseconds, 0 if the histogram is empty.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+uint64
+LatencyHistogram::Percentile(double pct) const   // IN
+{
+   uint64 rank = (uint64)(pct / 100.0 * _count + 0.5);
+   uint64 seen = 0;
+   unsigned i;
+
+   if (_count == 0) {
+      return 0;
+   }
+   if (rank < 1) {
+      rank = 1;
+   }
+   for (i = 0; i < LAT_NUM_BUCKETS; i++) {
+      seen += _counts[i];
+      if (seen >= rank) {
+         return BucketValue(i);
+      }
+   }
+   return BucketValue(LAT_NUM_BUCKETS - 1);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * NextRandom --
+ *
+ *      xorshift64* pseudo-random generator; cheap enough to pick
+ *      benchmark offsets without showing up in the latencies.
+ *
+ * Results:
+ *      Next pseudo-random number.
+ *
+ * Side effects:
+ *      Advances state, which must not be 0.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static uint64
+NextRandom(uint64 &state)   // IN/OUT
+{
+   state ^= state >> 12;
+   state ^= state << 25;
+   state ^= state >> 27;
+   return state * 2685821657736338717ULL;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * BenchThread --
+ *
+ *      Benchmark worker: issues one I/O at a time until the job has
+ *      done maxOps operations, timing each of them.
+ *
+ * Results:
+ *      TASK_OK if succeeded, TASK_FAIL if not.
+ *
+ * Side effects:
+ *      Sets job->failed on error, which stops the other workers.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static THREAD_RESULT
+BenchThread(void *arg)
+{
+   BenchWorker *worker = (BenchWorker *)arg;
+   BenchJob *job = worker->job;
+   size_t bufSize = job->bufSize * VIXDISKLIB_SECTOR_SIZE;
+   uint8 *buf = AllocAligned(bufSize);
+
+   while (!job->failed) {
+      uint64 op = job->nextOp++;
+      VixDiskLibSectorType sector;
+      bool read = job->read;
+      VixError vixError;
+
+      if (op >= job->maxOps) {
+         break;
+      }
+      if (job->pattern == PATTERN_SEQ) {
+         sector = op * job->bufSize;
+      } else {
+         sector = NextRandom(worker->seed) % job->maxOps * job->bufSize;
+         if (job->pattern == PATTERN_MIXED) {
+            read = NextRandom(worker->seed) % 100 < job->readPct;
+         }
+      }
+
+      // Time spent waiting for the limits is not I/O latency.
+      rateLimiter.Acquire(job->bufSize * VIXDISKLIB_SECTOR_SIZE, 1);
+
+      uint64 t0 = NowNsec();
+
+      if (job->handleLock != NULL) {
+         job->handleLock->lock();
+      }
+      if (read) {
+         vixError = VixDiskLib_Read(worker->handle, sector, job->bufSize, buf);
+      } else {
+         vixError = VixDiskLib_Write(worker->handle, sector, job->bufSize,
+                                     job->writeBuf);
+      }
+      if (job->handleLock != NULL) {
+         job->handleLock->unlock();
+      }
+      uint64 nsec = NowNsec() - t0;
+
+      if (VIX_FAILED(vixError)) {
+         job->error = vixError;
+         job->failed = true;
+         LiveError(liveStats);
+         break;
+      }
+      if (liveStats != NULL) {
+         LiveAdd(read ? liveStats->bytesRead : liveStats->bytesWritten,
+                 job->bufSize * VIXDISKLIB_SECTOR_SIZE);
+         LiveAdd(read ? liveStats->readOps : liveStats->writeOps, 1);
+      }
+      if (read) {
+         worker->readLatency.Add(nsec);
+         worker->reads++;
+         if (IsZeroBuffer(buf, bufSize)) {
+            job->zeroBytes.fetch_add(bufSize, std::memory_order_relaxed);
+         }
+         if (job->manifest != NULL) {
+            job->manifest->HashRange(buf, sector, job->bufSize, NULL);
+         }
+      } else {
+         worker->writeLatency.Add(nsec);
+         worker->writes++;
+      }
+      job->sectorsDone.fetch_add(job->bufSize, std::memory_order_relaxed);
+   }
+   FreeAligned(buf);
+   job->running--;
+   return job->failed ? TASK_FAIL : TASK_OK;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * DoRWBench --
+ *
+ *      Perform read/write benchmarks according to settings in
+ *      appGlobals: sequential, random or mixed I/O of bufSize sectors,
+ *      with queueDepth operations outstanding. Note that a write
+ *      benchmark will destroy the data in the target disk.
+ *
+ *      Each outstanding read gets its own read-only handle. A disk
+ *      opened for writing can only have one handle, so write and mixed
+ *      benchmarks with -qd share it and serialize the calls on it.
+ *
+ * Results:
+ *      None
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+DoRWBench(bool read) // IN
+{
+   VixDisk disk = OpenDisk(appGlobals.connection, appGlobals.diskPath,
+                           appGlobals.openFlags);
+   static const char *patternNames[] = { "seq", "rand", "mixed" };
+   const char *op = appGlobals.pattern == PATTERN_MIXED ? "Transferred" :
+                    read ? "Read" : "Wrote";
+   size_t bufSize;
+   uint8 *writeBuf;
+   VixDiskLibInfo *info;
+   VixError err = VIX_OK;
+   BenchJob job;
+   std::mutex handleLock;
+   vector<BenchWorker> workers(appGlobals.queueDepth);
+   vector<ThreadHandle> threads(appGlobals.queueDepth);
+   LatencyHistogram readLatency, writeLatency;
+   uint64 numOps = 0, lastDone = 0;
+   uint64 start = 0, end = 0, total = 0;
+   unsigned i;
+
+   if (appGlobals.bufSize == 0) {
+      appGlobals.bufSize = DEFAULT_BUFSIZE;
+   }
+   bufSize = appGlobals.bufSize * VIXDISKLIB_SECTOR_SIZE;
+
+   err = VixDiskLib_GetInfo(disk.Handle(), &info);
+   CHECK_AND_THROW(err);
+   appGlobals.statsTransport = VixDiskLib_GetTransportMode(disk.Handle());
+
+   Manifest manifest(DiskUuid(disk.Handle(), info), info->capacity,
+                     appGlobals.hashChunk);
+
+   job.manifest = appGlobals.manifestPath != NULL ? &manifest : NULL;
+   job.pattern = appGlobals.pattern;
+   job.read = read;
+   job.readPct = appGlobals.readPct;
+   job.bufSize = appGlobals.bufSize;
+   job.maxOps = info->capacity / appGlobals.bufSize;
+   if (liveStats != NULL) {
+      liveStats->totalBytes = job.maxOps * job.bufSize *
+                              VIXDISKLIB_SECTOR_SIZE;
+   }
+   job.handleLock = NULL;
+   job.nextOp = 0;
+   job.sectorsDone = 0;
+   job.zeroBytes = 0;
+   job.running = 0;
+   job.failed = false;
+   job.error = VIX_OK;
+   VixDiskLib_FreeInfo(info);
+
+   for (i = 0; i < workers.size(); i++) {
+      workers[i].job = &job;
+      workers[i].handle = disk.Handle();
+      workers[i].seed = ((uint64)time(NULL) << 16) ^
+                        (0x9e3779b97f4a7c15ULL * (i + 1));
+      workers[i].reads = 0;
+      workers[i].writes = 0;
+   }
+   if (workers.size() > 1) {
+      if (appGlobals.openFlags & VIXDISKLIB_FLAG_OPEN_READ_ONLY) {
+         for (i = 1; i < workers.size(); i++) {
+            err = VixDiskLib_Open(appGlobals.connection, appGlobals.diskPath,
+                                  appGlobals.openFlags, &workers[i].handle);
+            if (VIX_FAILED(err)) {
+               workers[i].handle = NULL;
+               break;
+            }
+         }
+      } else {
+         job.handleLock = &handleLock;
+      }
+   }
+
+   writeBuf = AllocAligned(bufSize);
+   job.writeBuf = writeBuf;
+   if (!read || appGlobals.pattern == PATTERN_MIXED) {
+      InitBuffer((uint32*)writeBuf, bufSize / sizeof(uint32));
+   }
+
+   if (!VIX_FAILED(err)) {
+      printf("Processing %" FMT64 "u buffers of %u bytes (pattern %s, "
+             "queue depth %u).\n", job.maxOps, (uint32)bufSize,
+             patternNames[appGlobals.pattern], appGlobals.queueDepth);
+
+      total = NowNsec();
+      start = total;
+      job.running = workers.size();
+      for (i = 0; i < workers.size(); i++) {
+         threads[i] = StartThread(&BenchThread, (void*)&workers[i]);
+      }
+      while (job.running > 0) {
+         uint64 done;
+
+         std::this_thread::sleep_for(std::chrono::milliseconds(10));
+         done = job.sectorsDone.load(std::memory_order_relaxed);
+         if (done - lastDone >= BUFS_PER_STAT) {
+            end = NowNsec();
+            PrintStat(op, start, end, done - lastDone);
+            start = end;
+            lastDone = done;
+         }
+      }
+      for (i = 0; i < workers.size(); i++) {
+         JoinThread(threads[i]);
+         readLatency.Merge(workers[i].readLatency);
+         writeLatency.Merge(workers[i].writeLatency);
+         numOps += workers[i].reads + workers[i].writes;
+      }
+      end = NowNsec();
+      err = job.error;
+   }
+
+   for (i = 1; i < workers.size(); i++) {
+      if (workers[i].handle != NULL && workers[i].handle != disk.Handle()) {
+         VixDiskLib_Close(workers[i].handle);
+      }
+   }
+   FreeAligned(writeBuf);
+   CHECK_AND_THROW(err);
+
+   PrintTotalStat(op, total, end, job.sectorsDone, numOps, &readLatency,
+                  &writeLatency);
+   if (read || appGlobals.pattern == PATTERN_MIXED) {
+      printf("%" FMT64 "u bytes were zero (skipped by a sparse copy).\n",
+             (uint64)job.zeroBytes);
+   }
+   if (job.manifest != NULL) {
+      SaveManifest(manifest);
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ParallelCopyThread --
+ *
+ *      Worker of a parallel copy: claims chunks from the shared job
+ *      until none are left and copies each with its own source handle.
+ *
+ * Results:
+ *      TASK_OK if succeeded, TASK_FAIL if not.
+ *
+ * Side effects:
+ *      Sets job->failed on error, which stops the other workers.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static THREAD_RESULT
+ParallelCopyThread(void *arg)
+{
+   ParallelCopyWorker *worker = (ParallelCopyWorker *)arg;
+   ParallelCopyJob *job = worker->job;
+   CopyContext context = CommandCopyContext(true, false);
+
+   context.chunkSize = job->chunkSize;
+   CopyEngine engine(context);
+
+   if (worker->sharedDst) {
+      engine.SetWriteLock(&job->writeLock);
+   }
+   // The workers already run in parallel, so each hashes its own chunks.
+   engine.SetManifest(job->manifest, NULL);
+   engine.SetJournal(job->journal);
+   try {
+      while (!job->failed) {
+         VixDiskLibSectorType start = job->nextChunk++ * job->chunkSize;
+         VixDiskLibSectorType count;
+
+         if (start >= job->numSectors) {
+            break;
+         }
+         count = job->numSectors - start;
+         if (count > job->chunkSize) {
+            count = job->chunkSize;
+         }
+         engine.Copy(VixDiskView(worker->srcHandle),
+                     VixDiskView(worker->dstHandle), start, count);
+         worker->chunksTaken++;
+      }
+   } catch (const VixDiskError& e) {
+      cout << "ParallelCopyThread Error: " << e.ErrorCode() << " "
+           << e.Description() << "\n";
+      job->failed = true;
+   }
+   worker->sectorsCopied = engine.SectorsCopied();
+   worker->sectorsSkipped = engine.SectorsSkipped();
+   return job->failed ? TASK_FAIL : TASK_OK;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ParallelCopy --
+ *
+ *      Copies numSectors sectors of srcPath to dstHandle with
+ *      appGlobals.numThreads workers. Each worker opens its own
+ *      read-only handle on the source; the destination is a local disk,
+ *      which VixDiskLib only lets one handle open for writing, so the
+ *      workers share dstHandle and serialize their writes on it.
+ *
+ * Results:
+ *      None. Throws VixDiskError on failure.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+ParallelCopy(const char *srcPath,                // IN
+             VixDiskLibHandle dstHandle,         // IN
+             VixDiskLibSectorType numSectors,    // IN
+             Manifest *manifest,                 // IN
+             CopyJournal *journal)               // IN
+{
+   ParallelCopyJob job;
+   vector<ParallelCopyWorker> workers(appGlobals.numThreads);
+   vector<ThreadHandle> threads(appGlobals.numThreads);
+   VixDiskLibSectorType copied = 0, skipped = 0;
+   VixError vixError = VIX_OK;
+   uint64 start, end;
+   unsigned i;
+
+   job.numSectors = numSectors;
+   job.chunkSize = appGlobals.chunkSize;
+   job.nextChunk = 0;
+   job.failed = false;
+   job.manifest = manifest;
+   job.journal = journal;
+
+   // Handles are opened and closed from this thread only.
+   for (i = 0; i < workers.size(); i++) {
+      workers[i].job = &job;
+      workers[i].srcHandle = NULL;
+      workers[i].dstHandle = dstHandle;
+      workers[i].sharedDst = true;
+      workers[i].chunksTaken = 0;
+      workers[i].sectorsCopied = 0;
+      workers[i].sectorsSkipped = 0;
+      vixError = VixDiskLib_Open(appGlobals.connection, srcPath,
+                                 appGlobals.openFlags, &workers[i].srcHandle);
+      if (VIX_FAILED(vixError)) {
+         break;
+      }
+   }
+
+   if (!VIX_FAILED(vixError)) {
+      printf("Copying %" FMT64 "u sectors with %u workers in chunks of %"
+             FMT64 "u sectors.\n", numSectors, appGlobals.numThreads,
+             appGlobals.chunkSize);
+      start = NowNsec();
+      for (i = 0; i < workers.size(); i++) {
+         threads[i] = StartThread(&ParallelCopyThread, (void*)&workers[i]);
+      }
+      for (i = 0; i < workers.size(); i++) {
+         JoinThread(threads[i]);
+      }
+      end = NowNsec();
+
+      for (i = 0; i < workers.size(); i++) {
+         printf("Worker %u: %" FMT64 "u chunks, %" FMT64 "u bytes skipped.\n",
+                i, workers[i].chunksTaken,
+                workers[i].sectorsSkipped * VIXDISKLIB_SECTOR_SIZE);
+         copied += workers[i].sectorsCopied;
+         skipped += workers[i].sectorsSkipped;
+      }
+      PrintTotalStat("Copied", start, end, copied, 0, NULL, NULL);
+      printf("Skipped %" FMT64 "u bytes of zero data.\n",
+             skipped * VIXDISKLIB_SECTOR_SIZE);
+   }
+
+   for (i = 0; i < workers.size(); i++) {
+      if (workers[i].srcHandle != NULL) {
+         VixDiskLib_Close(workers[i].srcHandle);
+      }
+   }
+   CHECK_AND_THROW(vixError);
+   if (job.failed) {
+      THROW_ERROR(VIX_E_FAIL);
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * FillSectors --
+ *
+ *      Generates the -fillpattern contents of numSectors sectors
+ *      starting at startSector. Every sector depends only on its own
+ *      number, so any chunk can be regenerated for verification.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+FillSectors(uint8 *buf,                         // OUT
+            VixDiskLibSectorType startSector,   // IN
+            VixDiskLibSectorType numSectors)    // IN
+{
+   const size_t wordsPerSector = VIXDISKLIB_SECTOR_SIZE / sizeof(uint64);
+   uint64 *words = (uint64 *)buf;
+   VixDiskLibSectorType sector;
+   size_t k;
+
+   switch (appGlobals.fillPattern) {
+   case FILL_BYTE:
+      memset(buf, appGlobals.filler, numSectors * VIXDISKLIB_SECTOR_SIZE);
+      break;
+   case FILL_SECTOR:
+      for (sector = startSector; sector < startSector + numSectors; sector++) {
+         for (k = 0; k < wordsPerSector; k++) {
+            *words++ = sector;
+         }
+      }
+      break;
+   case FILL_RANDOM:
+      for (sector = startSector; sector < startSector + numSectors; sector++) {
+         // splitmix64 of seed and sector, so neighbouring sectors do not
+         // start from related xorshift states
+         uint64 state = appGlobals.fillSeed + sector * 0x9e3779b97f4a7c15ULL;
+
+         state = (state ^ (state >> 30)) * 0xbf58476d1ce4e5b9ULL;
+         state = (state ^ (state >> 27)) * 0x94d049bb133111ebULL;
+         state ^= state >> 31;
+         if (state == 0) {
+            state = 1;
+         }
+         for (k = 0; k < wordsPerSector; k++) {
+            *words++ = NextRandom(state);
+         }
+      }
+      break;
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * FillThread --
+ *
+ *      Worker of a fill: claims chunks from the shared job until none
+ *      are left. A fill writes the pattern (serialized on the shared
+ *      handle); a verify reads the chunk with the worker's own handle
+ *      and compares it with the regenerated pattern.
+ *
+ * Results:
+ *      TASK_OK if succeeded, TASK_FAIL if not.
+ *
+ * Side effects:
+ *      Sets job->failed on error, which stops the other workers.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static THREAD_RESULT
+FillThread(void *arg)
+{
+   FillWorker *worker = (FillWorker *)arg;
+   FillJob *job = worker->job;
+   size_t bufSize = job->chunkSize * VIXDISKLIB_SECTOR_SIZE;
+   uint8 *pattern = NULL;
+   uint8 *readBuf = NULL;
+
+   try {
+      pattern = AllocAligned(bufSize);
+      if (job->verify) {
+         readBuf = AllocAligned(bufSize);
+      }
+      // A constant byte chunk only needs to be generated once.
+      if (appGlobals.fillPattern == FILL_BYTE) {
+         FillSectors(pattern, 0, job->chunkSize);
+      }
+      while (!job->failed) {
+         VixDiskLibSectorType pos = job->nextChunk++ * job->chunkSize;
+         VixDiskLibSectorType start = job->startSector + pos;
+         VixDiskLibSectorType count;
+         VixDiskLibSectorType i;
+
+         if (pos >= job->numSectors) {
+            break;
+         }
+         count = job->numSectors - pos;
+         if (count > job->chunkSize) {
+            count = job->chunkSize;
+         }
+         if (appGlobals.fillPattern != FILL_BYTE) {
+            FillSectors(pattern, start, count);
+         }
+         if (!job->verify) {
+            LockedWrite(VixDiskView(worker->handle), start, count, pattern,
+                        worker->sharedHandle ? &job->writeLock : NULL);
+         } else {
+            VixError vixError = VixDiskLib_Read(worker->handle, start, count,
+                                                readBuf);
+            CHECK_AND_THROW(vixError);
+            if (!IsEqualBuffer(pattern, readBuf,
+                               count * VIXDISKLIB_SECTOR_SIZE)) {
+               for (i = 0; i < count; i++) {
+                  size_t offset = i * VIXDISKLIB_SECTOR_SIZE;
+
+                  if (memcmp(pattern + offset, readBuf + offset,
+                             VIXDISKLIB_SECTOR_SIZE) != 0) {
+                     uint64 first = job->firstMismatch;
+
+                     while (start + i < first &&
+                            !job->firstMismatch.compare_exchange_weak(
+                               first, start + i)) {
+                     }
+                     job->mismatches++;
+                  }
+               }
+            }
+         }
+         worker->sectorsDone += count;
+      }
+   } catch (const VixDiskError& e) {
+      cout << "FillThread Error: " << e.ErrorCode() << " "
+           << e.Description() << "\n";
+      LiveError(liveStats);
+      job->failed = true;
+   } catch (const std::bad_alloc&) {
+      cout << "FillThread Error: out of memory\n";
+      LiveError(liveStats);
+      job->failed = true;
+   }
+   if (pattern != NULL) {
+      FreeAligned(pattern);
+   }
+   if (readBuf != NULL) {
+      FreeAligned(readBuf);
+   }
+   return job->failed ? TASK_FAIL : TASK_OK;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RunFillJob --
+ *
+ *      Fills or verifies the -start/-count range with one worker per
+ *      handle. For a fill all handles are the same writable handle.
+ *
+ * Results:
+ *      None. Throws VixDiskError on failure or mismatch.
+ *
+ * Side effects:
+ *      Prints statistics and, for a verify, the mismatch count.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+RunFillJob(const vector<VixDiskLibHandle> &handles,   // IN
+           bool verify)                               // IN
+{
+   FillJob job;
+   vector<FillWorker> workers(handles.size());
+   vector<ThreadHandle> threads(handles.size());
+   VixDiskLibSectorType done = 0;
+   uint64 start;
+   unsigned i;
+
+   job.startSector = appGlobals.startSector;
+   job.numSectors = appGlobals.numSectors;
+   job.chunkSize = appGlobals.chunkSize;
+   job.verify = verify;
+   job.nextChunk = 0;
+   job.failed = false;
+   job.mismatches = 0;
+   job.firstMismatch = ~(uint64)0;
+
+   start = NowNsec();
+   for (i = 0; i < workers.size(); i++) {
+      workers[i].job = &job;
+      workers[i].handle = handles[i];
+      workers[i].sharedHandle = !verify && workers.size() > 1;
+      workers[i].sectorsDone = 0;
+      threads[i] = StartThread(&FillThread, (void*)&workers[i]);
+   }
+   for (i = 0; i < workers.size(); i++) {
+      JoinThread(threads[i]);
+      done += workers[i].sectorsDone;
+   }
+   PrintTotalStat(verify ? "Verified" : "Filled", start, NowNsec(), done, 0,
+                  NULL, NULL);
+
+   if (job.failed) {
+      THROW_ERROR(VIX_E_FAIL);
+   }
+   if (job.mismatches != 0) {
+      printf("%" FMT64 "u sectors differ from the pattern, the first is "
+             "sector %" FMT64 "u.\n", (uint64)job.mismatches,
+             (uint64)job.firstMismatch);
+      throw VixDiskError("Verification failed", __FILE__, __LINE__);
+   }
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * DoFill --
+ *
+ *      Writes the -fillpattern to a range of a virtual disk in chunks of
+ *      -chunk sectors, with -threads workers generating the data. The
+ *      disk can only be open once for writing, so the workers share one
+ *      handle. With -verify the range is then re-read through one
+ *      read-only handle per worker and compared with the pattern.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+static void
+DoFill(void)
+{
+    {
+       VixDisk disk = OpenDisk(appGlobals.connection, appGlobals.diskPath,
+                               appGlobals.openFlags);
+       vector<VixDiskLibHandle> handles(appGlobals.numThreads, disk.Handle());
+
+       appGlobals.statsTransport = VixDiskLib_GetTransportMode(disk.Handle());
+       RunFillJob(handles, false);
+    }
+
+    if (appGlobals.verify) {
+       vector<VixDiskLibHandle> handles;
+       VixError vixError = VIX_OK;
+       unsigned i;
+
+       // Handles are opened and closed from this thread only.
+       for (i = 0; i < appGlobals.numThreads; i++) {
+          VixDiskLibHandle handle;
+
+          vixError = VixDiskLib_Open(appGlobals.connection, appGlobals.diskPath,
+                                     appGlobals.openFlags |
+                                     VIXDISKLIB_FLAG_OPEN_READ_ONLY, &handle);
+          if (VIX_FAILED(vixError)) {
+             break;
+          }
+          handles.push_back(handle);
+       }
+       try {
+          CHECK_AND_THROW(vixError);
+          RunFillJob(handles, true);
+       } catch (...) {
+          for (i = 0; i < handles.size(); i++) {
+             VixDiskLib_Close(handles[i]);
+          }
+          throw;
+       }
+       for (i = 0; i < handles.size(); i++) {
+          VixDiskLib_Close(handles[i]);
+       }
+    }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * FinishVerify --
+ *
+ *      Reports the result of a -verify copy and, with -verify-record,
+ *      writes it to a small text file that can be kept with the backup:
+ *      the chunk counts, the first chunk that differs and the SHA-1 of
+ *      all the source chunk hashes, which changes with any source data.
+ *
+ * Results:
+ *      None. Throws VixDiskError if a chunk differs or the
+ *      record cannot be written.
+ *
+ * Side effects:
+ *      Creates or replaces the -verify-record file.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+FinishVerify(const VerifyStage &verify,   // IN
+             const Manifest &manifest)    // IN
+{
+   bool ok = verify.ChunksMismatched() == 0;
+   uint8 digest[SHA1_HASH_SIZE];
+   vector<uint8> hashes;
+   char hex[2 * SHA1_HASH_SIZE + 1];
+   string tmpPath;
+   char stamp[32];
+   time_t now = time(NULL);
+   struct tm tm;
+   FILE *file;
+   bool written;
+   uint64 chunk;
+   size_t i;
+
+   printf("Verified %" FMT64 "u chunks (%" FMT64 "u bytes re-read), %"
+          FMT64 "u differ, %" FMT64 "u not written.\n",
+          verify.ChunksVerified(),
+          (uint64)verify.SectorsReread() * VIXDISKLIB_SECTOR_SIZE,
+          verify.ChunksMismatched(), verify.ChunksUnwritten());
+
+   if (appGlobals.verifyRecord != NULL) {
+      for (chunk = 0; chunk < manifest.NumChunks(); chunk++) {
+         const uint8 *hash = manifest.ChunkHash(chunk);
+
+         if (hash != NULL) {
+            hashes.insert(hashes.end(), hash, hash + SHA1_HASH_SIZE);
+         }
+      }
+      Sha1(hashes.empty() ? NULL : &hashes[0], hashes.size(), digest);
+      for (i = 0; i < SHA1_HASH_SIZE; i++) {
+         snprintf(hex + 2 * i, 3, "%02x", digest[i]);
+      }
+#ifdef _WIN32
+      gmtime_s(&tm, &now);
+#else
+      gmtime_r(&now, &tm);
+#endif
+      strftime(stamp, sizeof stamp, "%Y-%m-%dT%H:%M:%SZ", &tm);
+
+      // Written aside and renamed, like a manifest.
+      tmpPath = string(appGlobals.verifyRecord) + ".tmp";
+      file = fopen(tmpPath.c_str(), "w");
+      if (file == NULL) {
+         throw VixDiskError(strerror(errno), __FILE__, __LINE__);
+      }
+      fprintf(file, "source: %s\n", appGlobals.srcPath);
+      fprintf(file, "target: %s\n", appGlobals.diskPath);
+      fprintf(file, "uuid: %s\n", manifest.Uuid().c_str());
+      fprintf(file, "time: %s\n", stamp);
+      fprintf(file, "chunk_sectors: %" FMT64 "u\n",
+              (uint64)manifest.ChunkSectors());
+      fprintf(file, "chunks: %" FMT64 "u\n", manifest.NumChunks());
+      fprintf(file, "chunks_verified: %" FMT64 "u\n",
+              verify.ChunksVerified());
+      fprintf(file, "chunks_unwritten: %" FMT64 "u\n",
+              verify.ChunksUnwritten());
+      fprintf(file, "chunks_mismatched: %" FMT64 "u\n",
+              verify.ChunksMismatched());
+      if (!ok) {
+         fprintf(file, "first_mismatch_sector: %" FMT64 "u\n",
+                 (uint64)verify.FirstMismatch());
+      }
+      fprintf(file, "source_sha1: %s\n", hex);
+      fprintf(file, "result: %s\n", ok ? "ok" : "mismatch");
+      written = !ferror(file);
+      if (fclose(file) != 0) {
+         written = false;
+      }
+#ifdef _WIN32
+      if (written) {
+         remove(appGlobals.verifyRecord);
+      }
+#endif
+      if (!written || rename(tmpPath.c_str(), appGlobals.verifyRecord) != 0) {
+         remove(tmpPath.c_str());
+         throw VixDiskError("Cannot write the verify record",
+                            __FILE__, __LINE__);
+      }
+      printf("Wrote the verify record to %s.\n", appGlobals.verifyRecord);
+   }
+   if (!ok) {
+      throw VixDiskError("The copy differs from the source",
+                         __FILE__, __LINE__);
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * IncrementalCopy --
+ *
+ *      Brings the existing target 'diskPath' up to date with the source:
+ *      every chunk is read and hashed, and only those whose hash differs
+ *      from the -incremental record of the previous run are written.
+ *      Without a usable record every chunk is written. With -ddfs the
+ *      chunks that are written are also looked up in the ddumbfs index;
+ *      with -verify they are read back and checked.
+ *
+ * Results:
+ *      false if diskPath does not exist yet, so a full copy is needed;
+ *      true once the target is updated. Throws VixDiskError on
+ *      failure.
+ *
+ * Side effects:
+ *      Fills current with the hashes of the source.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static bool
+IncrementalCopy(VixDiskLibHandle srcHandle,                  // IN
+                VixDiskLibConnection dstConnection,          // IN
+                const VixDiskLibCreateParams &createParams,  // IN
+                Manifest &record,                            // IN/OUT
+                Manifest &current,                           // OUT
+                HashPool &hashPool,                          // IN
+                DedupCheckStage *dedup,                      // IN/OUT
+                VerifyStage *verify)                         // IN/OUT
+{
+   struct stat st;
+   VixDiskLibInfo *info;
+   VixError vixError;
+   bool haveRecord;
+
+   if (stat(appGlobals.diskPath, &st) != 0) {
+      printf("%s does not exist yet, copying all of the source.\n",
+             appGlobals.diskPath);
+      return false;
+   }
+
+   VixDisk dstDisk = OpenDisk(dstConnection, appGlobals.diskPath,
+                              verify != NULL ?
+                              VIXDISKLIB_FLAG_OPEN_UNBUFFERED : 0);
+
+   vixError = VixDiskLib_GetInfo(dstDisk.Handle(), &info);
+   CHECK_AND_THROW(vixError);
+   if (info->capacity != createParams.capacity) {
+      VixDiskLib_FreeInfo(info);
+      throw VixDiskError("Target capacity differs from the source",
+                         __FILE__, __LINE__);
+   }
+   VixDiskLib_FreeInfo(info);
+
+   haveRecord = record.Load(appGlobals.recordPath);
+
+   CopyPipeline pipeline(CommandCopyContext(false, true),
+                         appGlobals.numBuffers > 0 ? appGlobals.numBuffers : 4);
+   DeltaStage delta(haveRecord ? &record : NULL, &current, &hashPool);
+
+   pipeline.AddStage(&delta);
+   if (dedup != NULL) {
+      pipeline.AddStage(dedup);
+   }
+   pipeline.SetVerifyStage(verify);
+   printf("Updating %" FMT64 "u sectors in chunks of %" FMT64 "u sectors%s.\n",
+          createParams.capacity, appGlobals.chunkSize,
+          haveRecord ? "" : ", without a record");
+   pipeline.Copy(VixDiskView(srcHandle), dstDisk.View(), 0,
+                 createParams.capacity);
+   printf("%" FMT64 "u of %" FMT64 "u chunks changed, %" FMT64 "u bytes "
+          "written.\n", delta.ChunksChanged(),
+          delta.ChunksChanged() + delta.ChunksUnchanged(),
+          (uint64)pipeline.SectorsWritten() * VIXDISKLIB_SECTOR_SIZE);
+   if (dedup != NULL) {
+      PrintDedupCheck(*dedup, false);
+   }
+   return true;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * DoCopy --
+ *
+ *      Copies the source disk (opened through the main connection) into
+ *      a new local disk 'diskPath' with the chunked copy engine, using
+ *      several workers if -threads was given.
+ *
+ * Results:
+ *      None
+ *
+ * Side effects:
+ *      Creates diskPath.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+DoCopy(void)
+{
+   VixDisk srcDisk = OpenDisk(appGlobals.connection, appGlobals.srcPath,
+                              appGlobals.openFlags);
+   VixDiskLibConnectParams cnxParams = { 0 };
+   VixDiskLibConnection dstConnection;
+   VixDiskLibCreateParams createParams;
+   VixDiskLibInfo *info = NULL;
+   VixError vixError;
+
+   appGlobals.statsTransport = VixDiskLib_GetTransportMode(srcDisk.Handle());
+   vixError = VixDiskLib_GetInfo(srcDisk.Handle(), &info);
+   CHECK_AND_THROW(vixError);
+   createParams.adapterType = info->adapterType;
+   createParams.capacity = info->capacity;
+   createParams.diskType = VIXDISKLIB_DISK_MONOLITHIC_SPARSE;
+   createParams.hwVersion = VIXDISKLIB_HWVERSION_WORKSTATION_5;
+   if (liveStats != NULL) {
+      liveStats->totalBytes = (uint64)info->capacity * VIXDISKLIB_SECTOR_SIZE;
+   }
+
+   Manifest manifest(DiskUuid(srcDisk.Handle(), info), info->capacity,
+                     appGlobals.hashChunk);
+   Manifest *manifestPtr = appGlobals.manifestPath != NULL ||
+                           appGlobals.recordPath != NULL ||
+                           appGlobals.verify ? &manifest : NULL;
+   HashPool hashPool(manifestPtr != NULL ? appGlobals.hashThreads : 0);
+   Manifest record(DiskUuid(srcDisk.Handle(), info), info->capacity,
+                   appGlobals.hashChunk);
+   DdfsIndex ddfsIndex;
+
+   VixDiskLib_FreeInfo(info);
+   if (appGlobals.ddfsDir != NULL) {
+      OpenDdfsIndex(ddfsIndex);
+   }
+
+   HashPool dedupPool(appGlobals.ddfsDir != NULL ? appGlobals.hashThreads : 0);
+   DedupCheckStage dedup(&ddfsIndex, &dedupPool);
+   DedupCheckStage *dedupPtr = appGlobals.ddfsDir != NULL ? &dedup : NULL;
+   VerifyStage verify(&manifest, &hashPool);
+   VerifyStage *verifyPtr = appGlobals.verify ? &verify : NULL;
+
+   vixError = VixDiskLib_Connect(&cnxParams, &dstConnection);
+   CHECK_AND_THROW(vixError);
+
+   try {
+      if (appGlobals.recordPath != NULL &&
+          IncrementalCopy(srcDisk.Handle(), dstConnection, createParams,
+                          record, manifest, hashPool, dedupPtr,
+                          verifyPtr)) {
+         VixDiskLib_Disconnect(dstConnection);
+         // A target that fails the check must not become the base of
+         // the next delta, which would then never rewrite its chunks.
+         if (verifyPtr != NULL) {
+            FinishVerify(*verifyPtr, manifest);
+         }
+         manifest.Save(appGlobals.recordPath);
+         if (appGlobals.manifestPath != NULL) {
+            SaveManifest(manifest);
+         }
+         return;
+      }
+
+      CopyJournal journal(string(appGlobals.diskPath) + ".journal");
+      struct stat st;
+      bool resuming = appGlobals.resume &&
+                      stat(appGlobals.diskPath, &st) == 0;
+      VixDiskLibSectorType dstCapacity;
+      string dstUuid;
+
+      if (!resuming) {
+         if (appGlobals.resume) {
+            printf("%s does not exist yet, copying all of the source.\n",
+                   appGlobals.diskPath);
+         }
+         vixError = VixDiskLib_Create(dstConnection, appGlobals.diskPath,
+                                      &createParams, NULL, NULL);
+         CHECK_AND_THROW(vixError);
+      } else {
+         // A copy that died left the sparse target marked unclean.
+         vixError = VixDiskLib_CheckRepair(dstConnection, appGlobals.diskPath,
+                                           TRUE);
+         CHECK_AND_THROW(vixError);
+      }
+
+      // Unbuffered, so -verify reads back what reached the disk.
+      VixDisk dstDisk = OpenDisk(dstConnection, appGlobals.diskPath,
+                                 verifyPtr != NULL ?
+                                 VIXDISKLIB_FLAG_OPEN_UNBUFFERED : 0);
+
+      vixError = VixDiskLib_GetInfo(dstDisk.Handle(), &info);
+      CHECK_AND_THROW(vixError);
+      dstCapacity = info->capacity;
+      dstUuid = DiskUuid(dstDisk.Handle(), info);
+      VixDiskLib_FreeInfo(info);
+      if (resuming) {
+         if (dstCapacity != createParams.capacity) {
+            throw VixDiskError("Target capacity differs from the "
+                               "source", __FILE__, __LINE__);
+         }
+         if (!journal.Open(appGlobals.diskPath, manifest.Uuid(), dstUuid,
+                           dstCapacity, appGlobals.chunkSize)) {
+            throw VixDiskError("Cannot resume the copy", __FILE__,
+                               __LINE__);
+         }
+         printf("Resuming: %" FMT64 "u of %" FMT64 "u chunks done, first "
+                "incomplete chunk at sector %" FMT64 "u.\n",
+                journal.ChunksDone(), journal.NumChunks(),
+                (uint64)journal.FirstIncomplete());
+      } else {
+         journal.Create(appGlobals.diskPath, manifest.Uuid(), dstUuid,
+                        dstCapacity, appGlobals.chunkSize);
+      }
+
+      if (appGlobals.numThreads > 1) {
+         ParallelCopy(appGlobals.srcPath, dstDisk.Handle(),
+                      createParams.capacity, manifestPtr, &journal);
+      } else if (appGlobals.numBuffers > 0 || dedupPtr != NULL ||
+                 verifyPtr != NULL) {
+         // The ddumbfs lookup and the verify are pipeline stages only.
+         unsigned numBuffers = appGlobals.numBuffers > 0 ?
+                               appGlobals.numBuffers : 4;
+         CopyPipeline pipeline(CommandCopyContext(false, true), numBuffers);
+         ZeroCheckStage zeroCheck;
+         HashStage hashStage(manifestPtr, &hashPool);
+
+         pipeline.AddStage(&zeroCheck);
+         if (manifestPtr != NULL) {
+            pipeline.AddStage(&hashStage);
+         }
+         if (dedupPtr != NULL) {
+            pipeline.AddStage(dedupPtr);
+         }
+         pipeline.SetVerifyStage(verifyPtr);
+         pipeline.SetJournal(&journal);
+         printf("Copying %" FMT64 "u sectors in chunks of %" FMT64 "u "
+                "sectors with %u buffers in flight.\n", createParams.capacity,
+                appGlobals.chunkSize, numBuffers);
+         pipeline.Copy(srcDisk.View(), dstDisk.View(), 0,
+                       createParams.capacity);
+         printf("Skipped %" FMT64 "u bytes of zero data.\n",
+                zeroCheck.SectorsSkipped() * VIXDISKLIB_SECTOR_SIZE);
+         if (dedupPtr != NULL) {
+            PrintDedupCheck(*dedupPtr, false);
+         }
+      } else {
+         CopyEngine engine(CommandCopyContext(true, true));
+
+         engine.SetManifest(manifestPtr, &hashPool);
+         engine.SetJournal(&journal);
+         printf("Copying %" FMT64 "u sectors in chunks of %" FMT64 "u "
+                "sectors.\n", createParams.capacity, appGlobals.chunkSize);
+         engine.Copy(srcDisk.View(), dstDisk.View(), 0,
+                     createParams.capacity);
+         printf("Skipped %" FMT64 "u bytes of zero data.\n",
+                engine.SectorsSkipped() * VIXDISKLIB_SECTOR_SIZE);
+      }
+      // A failed copy keeps its journal for -resume.
+      journal.Remove();
+   } catch (...) {
+      VixDiskLib_Disconnect(dstConnection);
+      throw;
+   }
+   VixDiskLib_Disconnect(dstConnection);
+   // FinishVerify throws on a mismatch, so neither file is written.
+   if (verifyPtr != NULL) {
+      FinishVerify(*verifyPtr, manifest);
+   }
+   if (appGlobals.recordPath != NULL) {
+      // First run: the full copy becomes the base of the next delta.
+      manifest.Save(appGlobals.recordPath);
+   }
+   if (appGlobals.manifestPath != NULL) {
+      SaveManifest(manifest);
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VerifyRawImage --
+ *
+ *      -verify of a -to-raw copy: reads the image back through a
+ *      RawImage source, numBuffers chunks in flight, and compares the
+ *      hash of every chunk with the one taken of the source.
+ *
+ * Results:
+ *      None. Throws VixDiskError if a chunk differs or a read fails.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+VerifyRawImage(const Manifest &source,             // IN
+               HashPool *hashPool,                 // IN
+               VixDiskLibSectorType numSectors,    // IN
+               unsigned numBuffers)                // IN
+{
+   Manifest readBack(source.Uuid(), numSectors, source.ChunkSectors());
+   size_t bufSize = appGlobals.chunkSize * VIXDISKLIB_SECTOR_SIZE;
+   vector<uint8 *> bufs(numBuffers, (uint8 *)NULL);
+   vector<VixDiskLibSectorType> bufSector(numBuffers);
+   vector<unsigned> freeBufs;
+   VixDiskLibSectorType next = 0;
+   uint64 chunk, mismatched = 0;
+   RawImage raw;
+   unsigned i;
+   void *tag;
+
+   try {
+      for (i = 0; i < numBuffers; i++) {
+         bufs[i] = AllocAligned(bufSize);
+         freeBufs.push_back(i);
+      }
+      raw.OpenSource(appGlobals.diskPath, numBuffers);
+      raw.RegisterBuffers(&bufs[0], numBuffers, bufSize);
+
+      for (;;) {
+         while (next < numSectors && !freeBufs.empty()) {
+            VixDiskLibSectorType count = numSectors - next;
+
+            if (count > appGlobals.chunkSize) {
+               count = appGlobals.chunkSize;
+            }
+            i = freeBufs.back();
+            freeBufs.pop_back();
+            bufSector[i] = next;
+            raw.QueueRead(bufs[i], count * VIXDISKLIB_SECTOR_SIZE,
+                          next * VIXDISKLIB_SECTOR_SIZE,
+                          (void *)(uintptr_t)(i + 1));
+            next += count;
+         }
+         raw.Submit();
+         tag = raw.Complete();
+         if (tag == NULL) {
+            break;
+         }
+         i = (unsigned)(uintptr_t)tag - 1;
+         readBack.HashRange(bufs[i], bufSector[i],
+                            numSectors - bufSector[i] < appGlobals.chunkSize ?
+                            numSectors - bufSector[i] : appGlobals.chunkSize,
+                            hashPool);
+         freeBufs.push_back(i);
+      }
+      raw.Close();
+   } catch (...) {
+      raw.Close();
+      for (i = 0; i < numBuffers; i++) {
+         FreeAligned(bufs[i]);
+      }
+      throw;
+   }
+   for (i = 0; i < numBuffers; i++) {
+      FreeAligned(bufs[i]);
+   }
+
+   for (chunk = 0; chunk < source.NumChunks(); chunk++) {
+      if (!source.SameChunk(readBack, chunk) && mismatched++ == 0) {
+         printf("Chunk at sector %" FMT64 "u differs from the source.\n",
+                (uint64)(chunk * source.ChunkSectors()));
+      }
+   }
+   printf("Verified %" FMT64 "u chunks (%" FMT64 "u bytes re-read), %"
+          FMT64 "u differ.\n", source.NumChunks(),
+          (uint64)numSectors * VIXDISKLIB_SECTOR_SIZE, mismatched);
+   if (mismatched != 0) {
+      throw VixDiskError("The raw image differs from the source", __FILE__,
+                         __LINE__);
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * DoCopyToRaw --
+ *
+ *      copy -to-raw: copies the source disk into diskPath as a raw
+ *      image file or onto a block device. Chunks are read one at a time
+ *      while the writes of earlier chunks are in flight, up to -qd
+ *      requests on -pipeline buffers (as many as -qd by default). Runs
+ *      of zero grains are not written but punched out of the target.
+ *      With -ddfs, also counts the written blocks the ddumbfs already
+ *      stores, exactly since image and disk offsets are the same.
+ *
+ * Results:
+ *      None. Throws VixDiskError on failure.
+ *
+ * Side effects:
+ *      Creates or overwrites diskPath.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+DoCopyToRaw(void)
+{
+   VixDisk srcDisk = OpenDisk(appGlobals.connection, appGlobals.srcPath,
+                              appGlobals.openFlags);
+   VixDiskInfo info = srcDisk.Info();
+   VixDiskLibSectorType capacity = info->capacity;
+   unsigned numBuffers = appGlobals.numBuffers > 0 ? appGlobals.numBuffers :
+                                                     appGlobals.queueDepth;
+   size_t bufSize = appGlobals.chunkSize * VIXDISKLIB_SECTOR_SIZE;
+   Manifest manifest(DiskUuid(srcDisk.Handle(), info.Get()), capacity,
+                     appGlobals.hashChunk);
+   Manifest *manifestPtr = appGlobals.manifestPath != NULL ||
+                           appGlobals.verify ? &manifest : NULL;
+   HashPool hashPool(manifestPtr != NULL ? appGlobals.hashThreads : 0);
+   DdfsIndex ddfsIndex;
+   HashPool dedupPool(appGlobals.ddfsDir != NULL ? appGlobals.hashThreads : 0);
+   PipelineBuffer dedupBuf;
+   vector<uint8 *> bufs(numBuffers, (uint8 *)NULL);
+   vector<unsigned> pending(numBuffers, 0);
+   vector<unsigned> freeBufs;
+   vector<uint8> zeroGrains;
+   VixDiskLibSectorType done = 0, bufUpdate = 0, skipped = 0;
+   uint64 zeroStart = 0, zeroLen = 0;
+   uint64 start, end, total;
+   RawImage raw;
+   unsigned i;
+
+   appGlobals.statsTransport = srcDisk.TransportMode();
+   if (liveStats != NULL) {
+      liveStats->totalBytes = (uint64)capacity * VIXDISKLIB_SECTOR_SIZE;
+   }
+   if (appGlobals.ddfsDir != NULL) {
+      OpenDdfsIndex(ddfsIndex);
+   }
+   DedupCheckStage dedup(&ddfsIndex, &dedupPool);
+
+   try {
+      for (i = 0; i < numBuffers; i++) {
+         bufs[i] = AllocAligned(bufSize);
+         freeBufs.push_back(i);
+      }
+      raw.OpenSink(appGlobals.diskPath,
+                   (uint64)capacity * VIXDISKLIB_SECTOR_SIZE,
+                   appGlobals.preallocate, appGlobals.queueDepth);
+      raw.RegisterBuffers(&bufs[0], numBuffers, bufSize);
+      printf("Copying %" FMT64 "u sectors to %s %s with %s%s, %u requests "
+             "in flight%s.\n", capacity,
+             raw.IsDevice() ? "device" : "raw image", appGlobals.diskPath,
+             raw.Backend(), raw.IsDirect() ? " and O_DIRECT" : "",
+             appGlobals.queueDepth,
+             raw.IsPreallocated() ? ", preallocated" : "");
+
+      total = NowNsec();
+      start = total;
+      while (done < capacity) {
+         VixDiskLibSectorType count = capacity - done;
+         VixDiskLibSectorType pos = 0;
+         uint8 *buf;
+         size_t grain;
+         VixError vixError;
+
+         while (freeBufs.empty()) {
+            i = (unsigned)(uintptr_t)raw.Complete() - 1;
+            if (--pending[i] == 0) {
+               freeBufs.push_back(i);
+            }
+         }
+         i = freeBufs.back();
+         freeBufs.pop_back();
+         buf = bufs[i];
+         if (count > appGlobals.chunkSize) {
+            count = appGlobals.chunkSize;
+         }
+
+         rateLimiter.Acquire(count * VIXDISKLIB_SECTOR_SIZE, 1);
+         vixError = VixDiskLib_Read(srcDisk.Handle(), done, count, buf);
+         CHECK_AND_THROW(vixError);
+         if (liveStats != NULL) {
+            LiveAdd(liveStats->bytesRead, count * VIXDISKLIB_SECTOR_SIZE);
+            LiveAdd(liveStats->readOps, 1);
+         }
+         if (manifestPtr != NULL) {
+            manifestPtr->HashRange(buf, done, count, &hashPool);
+         }
+         skipped += MarkZeroGrains(buf, done, count, zeroGrains);
+         if (appGlobals.ddfsDir != NULL) {
+            // The zero grains become holes, which ddumbfs never sees.
+            dedupBuf.data = buf;
+            dedupBuf.startSector = done;
+            dedupBuf.numSectors = count;
+            dedupBuf.grainsMarked = true;
+            dedupBuf.skipGrains.swap(zeroGrains);
+            dedup.Process(&dedupBuf);
+            dedupBuf.skipGrains.swap(zeroGrains);
+         }
+
+         // One write per run of non-zero grains; the zero runs between
+         // them are merged across chunks and punched at once.
+         for (grain = 0; pos < count; grain++) {
+            VixDiskLibSectorType runStart = pos;
+            bool zero = zeroGrains[grain] != 0;
+            uint64 offset = (done + pos) * VIXDISKLIB_SECTOR_SIZE;
+            uint64 len;
+
+            pos += GrainSectors(done, count, pos);
+            while (pos < count && (zeroGrains[grain + 1] != 0) == zero) {
+               grain++;
+               pos += GrainSectors(done, count, pos);
+            }
+            len = (pos - runStart) * VIXDISKLIB_SECTOR_SIZE;
+            if (zero) {
+               if (zeroStart + zeroLen != offset) {
+                  raw.Zero(zeroStart, zeroLen);
+                  zeroStart = offset;
+                  zeroLen = 0;
+               }
+               zeroLen += len;
+               continue;
+            }
+            while (raw.Full()) {
+               unsigned other = (unsigned)(uintptr_t)raw.Complete() - 1;
+
+               if (--pending[other] == 0 && other != i) {
+                  freeBufs.push_back(other);
+               }
+            }
+            raw.QueueWrite(buf + runStart * VIXDISKLIB_SECTOR_SIZE, len,
+                           offset, (void *)(uintptr_t)(i + 1));
+            pending[i]++;
+            if (liveStats != NULL) {
+               LiveAdd(liveStats->bytesWritten, len);
+               LiveAdd(liveStats->writeOps, 1);
+            }
+         }
+         raw.Submit();
+         if (pending[i] == 0) {
+            freeBufs.push_back(i);
+         }
+
+         done += count;
+         bufUpdate += count;
+         if (bufUpdate >= BUFS_PER_STAT) {
+            end = NowNsec();
+            PrintStat("Copied", start, end, bufUpdate);
+            start = end;
+            bufUpdate = 0;
+         }
+      }
+      raw.Zero(zeroStart, zeroLen);
+      while (raw.Complete() != NULL) {
+      }
+      raw.Sync();
+      PrintTotalStat("Copied", total, NowNsec(), capacity, 0, NULL, NULL);
+      printf("Skipped %" FMT64 "u bytes of zero data.\n",
+             (uint64)skipped * VIXDISKLIB_SECTOR_SIZE);
+      if (appGlobals.ddfsDir != NULL) {
+         PrintDedupCheck(dedup, true);
+      }
+      raw.Close();
+   } catch (...) {
+      LiveError(liveStats);
+      raw.Close();
+      for (i = 0; i < numBuffers; i++) {
+         FreeAligned(bufs[i]);
+      }
+      throw;
+   }
+   for (i = 0; i < numBuffers; i++) {
+      FreeAligned(bufs[i]);
+   }
+
+   if (appGlobals.manifestPath != NULL) {
+      SaveManifest(manifest);
+   }
+   if (appGlobals.verify) {
+      VerifyRawImage(manifest, &hashPool, capacity, numBuffers);
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ImportThread --
+ *
+ *      -import worker: claims chunks of the image's allocated ranges
+ *      and writes their non-zero grains to the target. Each worker
+ *      reads through its own RawImage with two buffers, so the read of
+ *      its next chunk is in flight while it writes the current one.
+ *
+ * Results:
+ *      TASK_OK, or TASK_FAIL after an error.
+ *
+ * Side effects:
+ *      Sets job->failed on error, which stops the other workers.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static THREAD_RESULT
+ImportThread(void *arg)
+{
+   ImportWorker *worker = (ImportWorker *)arg;
+   ImportJob *job = worker->job;
+   size_t bufSize = job->chunkSize * VIXDISKLIB_SECTOR_SIZE;
+   uint8 *bufs[2] = { NULL, NULL };
+   bool readDone[2] = { false, false };
+   uint64 chunk[2];
+   vector<uint8> zeroGrains;
+   RawImage raw;
+   unsigned cur = 0;
+
+   try {
+      bufs[0] = AllocAligned(bufSize);
+      bufs[1] = AllocAligned(bufSize);
+      raw.OpenSource(job->rawPath, 2);
+      raw.RegisterBuffers(bufs, 2, bufSize);
+
+      chunk[cur] = job->nextChunk++;
+      if (chunk[cur] < job->chunks.size()) {
+         const ImportChunk &c = job->chunks[chunk[cur]];
+
+         rateLimiter.Acquire(c.len, 1);
+         raw.QueueRead(bufs[cur], c.len, c.startSector *
+                       VIXDISKLIB_SECTOR_SIZE, (void *)(uintptr_t)1);
+         raw.Submit();
+      }
+      while (!job->failed && chunk[cur] < job->chunks.size()) {
+         const ImportChunk &c = job->chunks[chunk[cur]];
+         unsigned other = 1 - cur;
+         VixDiskLibSectorType skipped, written;
+
+         chunk[other] = job->nextChunk++;
+         if (chunk[other] < job->chunks.size()) {
+            const ImportChunk &n = job->chunks[chunk[other]];
+
+            readDone[other] = false;
+            rateLimiter.Acquire(n.len, 1);
+            raw.QueueRead(bufs[other], n.len, n.startSector *
+                          VIXDISKLIB_SECTOR_SIZE,
+                          (void *)(uintptr_t)(other + 1));
+            raw.Submit();
+         }
+         while (!readDone[cur]) {
+            readDone[(uintptr_t)raw.Complete() - 1] = true;
+         }
+         readDone[cur] = false;
+         if (liveStats != NULL) {
+            LiveAdd(liveStats->bytesRead, c.len);
+            LiveAdd(liveStats->readOps, 1);
+         }
+
+         // The end of an image that is not whole sectors reads as zeros.
+         memset(bufs[cur] + c.len, 0,
+                c.numSectors * VIXDISKLIB_SECTOR_SIZE - c.len);
+         skipped = MarkZeroGrains(bufs[cur], c.startSector, c.numSectors,
+                                  zeroGrains);
+         written = WriteGrains(VixDiskView(job->dstHandle), c.startSector,
+                               c.numSectors, bufs[cur], &zeroGrains[0],
+                               &job->writeLock);
+         if (liveStats != NULL) {
+            LiveAdd(liveStats->bytesWritten,
+                    written * VIXDISKLIB_SECTOR_SIZE);
+            LiveAdd(liveStats->bytesSkipped,
+                    skipped * VIXDISKLIB_SECTOR_SIZE);
+            LiveAdd(liveStats->writeOps, 1);
+         }
+         worker->chunksTaken++;
+         worker->sectorsRead += c.numSectors;
+         worker->sectorsWritten += written;
+         cur = other;
+      }
+      raw.Close();
+   } catch (const VixDiskError &e) {
+      cout << "ImportThread Error: " << e.ErrorCode() << " "
+           << e.Description() << "\n";
+      LiveError(liveStats);
+      job->failed = true;
+   } catch (const std::bad_alloc&) {
+      cout << "ImportThread Error: out of memory\n";
+      LiveError(liveStats);
+      job->failed = true;
+   }
+   raw.Close();
+   FreeAligned(bufs[0]);
+   FreeAligned(bufs[1]);
+   return job->failed ? TASK_FAIL : TASK_OK;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * DoImport --
+ *
+ *      Creates diskPath, of -disktype, as large as the raw image or
+ *      block device srcPath, rounded up to whole sectors. The image's
+ *      allocated ranges, as found with SEEK_DATA and SEEK_HOLE, are cut
+ *      into chunks that appGlobals.numThreads workers read and write;
+ *      its holes are not read at all. The target handle is shared and
+ *      its writes serialized, like a parallel copy.
+ *
+ * Results:
+ *      None. Throws VixDiskError on failure.
+ *
+ * Side effects:
+ *      Creates diskPath.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+DoImport(void)
+{
+   VixDiskLibCreateParams createParams;
+   ImportJob job;
+   vector<ImportWorker> workers(appGlobals.numThreads);
+   vector<ThreadHandle> threads(appGlobals.numThreads);
+   VixDiskLibSectorType read = 0, written = 0;
+   uint64 imageSize, dataBytes = 0, numExtents = 0;
+   uint64 offset = 0, extStart, extEnd;
+   uint64 start, end;
+   VixError vixError;
+   RawImage raw;
+   unsigned i;
+
+   // The extents are found up front, so the workers split them evenly.
+   raw.OpenSource(appGlobals.srcPath, 1);
+   imageSize = raw.Size();
+   while (raw.NextData(offset, &extStart, &extEnd)) {
+      VixDiskLibSectorType sector = extStart / VIXDISKLIB_SECTOR_SIZE;
+      VixDiskLibSectorType last = (extEnd + VIXDISKLIB_SECTOR_SIZE - 1) /
+                                  VIXDISKLIB_SECTOR_SIZE;
+
+      // Sectors already taken by the previous extent's last chunk.
+      if (!job.chunks.empty()) {
+         const ImportChunk &prev = job.chunks.back();
+
+         if (sector < prev.startSector + prev.numSectors) {
+            sector = prev.startSector + prev.numSectors;
+         }
+      }
+      while (sector < last) {
+         ImportChunk c;
+         uint64 chunkEnd;
+
+         c.startSector = sector;
+         c.numSectors = last - sector;
+         if (c.numSectors > appGlobals.chunkSize) {
+            c.numSectors = appGlobals.chunkSize;
+         }
+         chunkEnd = (uint64)(sector + c.numSectors) * VIXDISKLIB_SECTOR_SIZE;
+         c.len = (chunkEnd < imageSize ? chunkEnd : imageSize) -
+                 (uint64)sector * VIXDISKLIB_SECTOR_SIZE;
+         job.chunks.push_back(c);
+         dataBytes += c.len;
+         sector += c.numSectors;
+      }
+      numExtents++;
+      offset = extEnd;
+   }
+   raw.Close();
+
+   createParams.adapterType = appGlobals.adapterType;
+   createParams.capacity = (imageSize + VIXDISKLIB_SECTOR_SIZE - 1) /
+                           VIXDISKLIB_SECTOR_SIZE;
+   createParams.diskType = appGlobals.diskType;
+   createParams.hwVersion = VIXDISKLIB_HWVERSION_WORKSTATION_5;
+   vixError = VixDiskLib_Create(appGlobals.connection, appGlobals.diskPath,
+                                &createParams, NULL, NULL);
+   CHECK_AND_THROW(vixError);
+
+   VixDisk dstDisk = OpenDisk(appGlobals.connection, appGlobals.diskPath, 0);
+
+   appGlobals.statsTransport = dstDisk.TransportMode();
+   if (liveStats != NULL) {
+      liveStats->totalBytes = dataBytes;
+   }
+   job.rawPath = appGlobals.srcPath;
+   job.dstHandle = dstDisk.Handle();
+   job.chunkSize = appGlobals.chunkSize;
+   job.nextChunk = 0;
+   job.failed = false;
+   for (i = 0; i < workers.size(); i++) {
+      workers[i].job = &job;
+      workers[i].chunksTaken = 0;
+      workers[i].sectorsRead = 0;
+      workers[i].sectorsWritten = 0;
+   }
+
+   printf("Importing %" FMT64 "u bytes in %" FMT64 "u allocated ranges of "
+          "a %" FMT64 "u byte image with %u workers in chunks of %" FMT64
+          "u sectors.\n", dataBytes, numExtents, imageSize,
+          appGlobals.numThreads, appGlobals.chunkSize);
+   start = NowNsec();
+   for (i = 0; i < workers.size(); i++) {
+      threads[i] = StartThread(&ImportThread, (void*)&workers[i]);
+   }
+   for (i = 0; i < workers.size(); i++) {
+      JoinThread(threads[i]);
+   }
+   end = NowNsec();
+   if (job.failed) {
+      THROW_ERROR(VIX_E_FAIL);
+   }
+
+   for (i = 0; i < workers.size(); i++) {
+      printf("Worker %u: %" FMT64 "u chunks, %" FMT64 "u bytes written.\n",
+             i, workers[i].chunksTaken,
+             (uint64)workers[i].sectorsWritten * VIXDISKLIB_SECTOR_SIZE);
+      read += workers[i].sectorsRead;
+      written += workers[i].sectorsWritten;
+   }
+   PrintTotalStat("Imported", start, end, read, 0, NULL, NULL);
+   printf("Read %" FMT64 "u of %" FMT64 "u bytes (%.1f%%), wrote %" FMT64
+          "u bytes, skipped %" FMT64 "u bytes of zero data.\n", dataBytes,
+          imageSize, imageSize ? 100.0 * dataBytes / imageSize : 0.0,
+          (uint64)written * VIXDISKLIB_SECTOR_SIZE,
+          (uint64)(read - written) * VIXDISKLIB_SECTOR_SIZE);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * EstimateThread --
+ *
+ *      -estimate-dedup worker: claims chunks of any disk, reads each in
+ *      one call and adds it to the job's estimator.
+ *
+ * Results:
+ *      TASK_OK, or TASK_FAIL after a read error.
+ *
+ * Side effects:
+ *      Sets job->failed on error, which stops the other workers.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static THREAD_RESULT
+EstimateThread(void *arg)
+{
+   EstimateWorker *worker = (EstimateWorker *)arg;
+   EstimateJob *job = worker->job;
+
+   try {
+      while (!job->failed) {
+         uint64 chunk = job->nextChunk++;
+         size_t disk;
+         VixDiskLibSectorType start, count;
+         VixError vixError;
+
+         if (chunk >= job->numChunks) {
+            break;
+         }
+         disk = std::upper_bound(job->firstChunk.begin(),
+                                 job->firstChunk.end(), chunk) -
+                job->firstChunk.begin() - 1;
+         start = (chunk - job->firstChunk[disk]) * job->chunkSize;
+         count = job->capacities[disk] - start;
+         if (count > job->chunkSize) {
+            count = job->chunkSize;
+         }
+         vixError = VixDiskLib_Read(worker->handles[disk], start, count,
+                                    worker->buf);
+         CHECK_AND_THROW(vixError);
+         job->estimator->Add(worker->buf, count * VIXDISKLIB_SECTOR_SIZE,
+                             job->hashPool);
+         job->sectorsRead += count;
+      }
+   } catch (const VixDiskError& e) {
+      cout << "EstimateThread Error: " << e.ErrorCode() << " "
+           << e.Description() << "\n";
+      LiveError(liveStats);
+      job->failed = true;
+   }
+   job->workersDone++;
+   return job->failed ? TASK_FAIL : TASK_OK;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ReadDiskList --
+ *
+ *      Appends the paths listed in the -disklist file, one per line, to
+ *      paths. Empty lines and lines starting with '#' are skipped.
+ *
+ * Results:
+ *      None. Throws VixDiskError if the file cannot be read.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+ReadDiskList(vector<string> &paths)   // IN/OUT
+{
+   FILE *list = fopen(appGlobals.diskList, "r");
+   char line[1024];
+
+   if (list == NULL) {
+      perror(appGlobals.diskList);
+      throw VixDiskError("Cannot read the -disklist file", __FILE__,
+                         __LINE__);
+   }
+   while (fgets(line, sizeof line, list) != NULL) {
+      size_t len = strlen(line);
+
+      while (len > 0 && strchr(" \t\r\n", line[len - 1]) != NULL) {
+         line[--len] = '\0';
+      }
+      if (len > 0 && line[0] != '#') {
+         paths.push_back(line);
+      }
+   }
+   fclose(list);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * DoEstimateDedup --
+ *
+ *      Reads diskPath and the -disklist disks once, in chunks of -chunk
+ *      sectors claimed by -threads workers with their own read-only
+ *      handles, and estimates the ddumbfs dedup ratio of the data for
+ *      every -blocksizes size.
+ *
+ * Results:
+ *      None. Throws VixDiskError on failure.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+DoEstimateDedup(void)
+{
+   vector<string> paths(1, appGlobals.diskPath);
+   DedupEstimator estimator(appGlobals.estimateSizes, appGlobals.sampleRate);
+   HashPool hashPool(appGlobals.hashThreads);
+   vector<EstimateWorker> workers(appGlobals.numThreads);
+   vector<ThreadHandle> threads(appGlobals.numThreads);
+   EstimateJob job;
+   VixError vixError = VIX_OK;
+   VixDiskLibSectorType reported = 0;
+   uint64 start, last, end;
+   size_t i, d;
+
+   if (appGlobals.diskList != NULL) {
+      ReadDiskList(paths);
+   }
+   job.numChunks = 0;
+   job.chunkSize = appGlobals.chunkSize;
+   job.nextChunk = 0;
+   job.failed = false;
+   job.sectorsRead = 0;
+   job.workersDone = 0;
+   job.estimator = &estimator;
+   job.hashPool = &hashPool;
+
+   // Handles are opened and closed from this thread only.
+   for (i = 0; i < workers.size(); i++) {
+      workers[i].job = &job;
+      workers[i].buf = NULL;
+   }
+   try {
+      for (i = 0; i < workers.size() && !VIX_FAILED(vixError); i++) {
+         workers[i].buf = AllocAligned(job.chunkSize *
+                                       VIXDISKLIB_SECTOR_SIZE);
+         for (d = 0; d < paths.size(); d++) {
+            VixDiskLibHandle handle;
+
+            vixError = VixDiskLib_Open(appGlobals.connection,
+                                       paths[d].c_str(),
+                                       appGlobals.openFlags, &handle);
+            if (VIX_FAILED(vixError)) {
+               printf("Cannot open \"%s\".\n", paths[d].c_str());
+               break;
+            }
+            workers[i].handles.push_back(handle);
+         }
+      }
+      for (d = 0; d < paths.size() && !VIX_FAILED(vixError); d++) {
+         VixDiskLibInfo *info = NULL;
+
+         vixError = VixDiskLib_GetInfo(workers[0].handles[d], &info);
+         if (!VIX_FAILED(vixError)) {
+            job.capacities.push_back(info->capacity);
+            job.firstChunk.push_back(job.numChunks);
+            job.numChunks += (info->capacity + job.chunkSize - 1) /
+                             job.chunkSize;
+            VixDiskLib_FreeInfo(info);
+         }
+      }
+      CHECK_AND_THROW(vixError);
+      appGlobals.statsTransport =
+         VixDiskLib_GetTransportMode(workers[0].handles[0]);
+
+      printf("Reading %u disks with %u workers in chunks of %" FMT64 "u "
+             "sectors.\n", (unsigned)paths.size(), appGlobals.numThreads,
+             appGlobals.chunkSize);
+      start = NowNsec();
+      last = start;
+      for (i = 0; i < workers.size(); i++) {
+         threads[i] = StartThread(&EstimateThread, (void*)&workers[i]);
+      }
+      while (job.workersDone < workers.size()) {
+         std::this_thread::sleep_for(std::chrono::milliseconds(100));
+         if (job.sectorsRead - reported >= BUFS_PER_STAT) {
+            uint64 now = NowNsec();
+
+            PrintStat("Read", last, now, job.sectorsRead - reported);
+            reported = job.sectorsRead;
+            last = now;
+         }
+      }
+      for (i = 0; i < workers.size(); i++) {
+         JoinThread(threads[i]);
+      }
+      if (job.failed) {
+         THROW_ERROR(VIX_E_FAIL);
+      }
+      end = NowNsec();
+      PrintTotalStat("Read", start, end, job.sectorsRead, 0, NULL, NULL);
+      estimator.Print(appGlobals.statsOut, paths.size(), end - start);
+   } catch (...) {
+      for (i = 0; i < workers.size(); i++) {
+         for (d = 0; d < workers[i].handles.size(); d++) {
+            VixDiskLib_Close(workers[i].handles[d]);
+         }
+         FreeAligned(workers[i].buf);
+      }
+      throw;
+   }
+   for (i = 0; i < workers.size(); i++) {
+      for (d = 0; d < workers[i].handles.size(); d++) {
+         VixDiskLib_Close(workers[i].handles[d]);
+      }
+      FreeAligned(workers[i].buf);
+   }
+}
+
+
+// A -daemon job: the file name.job in the spool directory holds the lines
+//    copy
+//    source: sourcePath
+//    target: targetPath
+// each path taking the rest of its line, spaces included. Submitters
+// write the file under another name (e.g. name.tmp) and rename it to
+// name.job once complete; a .job file changed in the last
+// DAEMON_SETTLE_SEC seconds is left for a later poll all the same. The
+// source is read through the main connection, the target is a new local
+// disk. While the job runs its file is renamed to name.running, then to
+// name.done or name.failed with a result line added. The scheduler
+// thread opens and closes all handles; each running job copies on a
+// thread of its own.
+
+#define DAEMON_POLL_MSEC      1000
+#define DAEMON_SETTLE_SEC     2
+#define DAEMON_SLICE_SECTORS  (128 * 1024)   // progress granularity
+#define DAEMON_KEEP_FINISHED  20             // shown in the status file
+
+struct DaemonJob {
+   string name;
+   string srcPath;
+   string dstPath;
+   VixDiskLibSectorType capacity;
+   VixPooledDisk src;   // open while the job runs
+   VixPooledDisk dst;
+   bool created;        // the target exists
+   ThreadHandle thread;
+   LiveJobStats *stats;   // NULL if there is no free slot
+   std::atomic<VixDiskLibSectorType> sectorsDone;
+   std::atomic<bool> finished;
+   bool failed;
+   string error;
+   uint64 startTime;
+   uint64 endTime;
+};
+
+static volatile sig_atomic_t daemonStop;
+
+
+static void
+StopDaemon(UNUSED_PARAM(int sig))   // IN
+{
+   daemonStop = 1;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * DaemonJobThread --
+ *
+ *      Copies a job's source to its target with a pipeline, a slice at
+ *      a time so the scheduler can report progress.
+ *
+ * Results:
+ *      TASK_OK, or TASK_FAIL with job->error set.
+ *
+ * Side effects:
+ *      Sets job->finished last.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static THREAD_RESULT
+DaemonJobThread(void *arg)
+{
+   DaemonJob *job = (DaemonJob *)arg;
+
+   try {
+      CopyContext context = CommandCopyContext(false, false);
+
+      // All jobs share the -max-mbps budget; each counts in its own slot.
+      context.stats = job->stats;
+      CopyPipeline pipeline(context, appGlobals.numBuffers > 0 ?
+                                     appGlobals.numBuffers : 4);
+      ZeroCheckStage zeroCheck;
+      VixDiskLibSectorType start;
+
+      pipeline.AddStage(&zeroCheck);
+      for (start = 0; start < job->capacity; start += DAEMON_SLICE_SECTORS) {
+         VixDiskLibSectorType count = job->capacity - start;
+
+         if (count > DAEMON_SLICE_SECTORS) {
+            count = DAEMON_SLICE_SECTORS;
+         }
+         pipeline.Copy(job->src.View(), job->dst.View(), start, count);
+         job->sectorsDone += count;
+      }
+   } catch (const VixDiskError& e) {
+      job->error = e.Description();
+      job->failed = true;
+   } catch (const std::bad_alloc&) {
+      job->error = "Out of memory";
+      LiveError(job->stats);
+      job->failed = true;
+   }
+   job->endTime = NowNsec();
+   job->finished = true;
+   return job->failed ? TASK_FAIL : TASK_OK;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ListJobFiles --
+ *
+ *      Finds the *.job files in dir, leaving out those modified in the
+ *      last DAEMON_SETTLE_SEC seconds, which may still be written.
+ *
+ * Results:
+ *      The job names (file names without ".job"), sorted.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static vector<string>
+ListJobFiles(const char *dir)   // IN
+{
+   vector<string> names, settled;
+   time_t now = time(NULL);
+   struct stat st;
+   string file;
+   size_t i;
+
+#ifdef _WIN32
+   WIN32_FIND_DATAA data;
+   HANDLE find = FindFirstFileA((string(dir) + "\\*.job").c_str(), &data);
+
+   if (find != INVALID_HANDLE_VALUE) {
+      do {
+         file = data.cFileName;
+         names.push_back(file.substr(0, file.size() - 4));
+      } while (FindNextFileA(find, &data));
+      FindClose(find);
+   }
+#else
+   DIR *d = opendir(dir);
+   struct dirent *entry;
+
+   if (d != NULL) {
+      while ((entry = readdir(d)) != NULL) {
+         file = entry->d_name;
+         if (file.size() > 4 && file.compare(file.size() - 4, 4, ".job") == 0) {
+            names.push_back(file.substr(0, file.size() - 4));
+         }
+      }
+      closedir(d);
+   }
+#endif
+   for (i = 0; i < names.size(); i++) {
+      file = string(dir) + "/" + names[i] + ".job";
+      if (stat(file.c_str(), &st) == 0 &&
+          now - st.st_mtime >= DAEMON_SETTLE_SEC) {
+         settled.push_back(names[i]);
+      }
+   }
+   std::sort(settled.begin(), settled.end());
+   return settled;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * FinishJobFile --
+ *
+ *      Renames a job's file from name.from to name.to and appends a
+ *      result line to it, unless result is empty.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+FinishJobFile(const DaemonJob *job,    // IN
+              const char *from,        // IN
+              const char *to,          // IN
+              const string &result)    // IN
+{
+   string base = string(appGlobals.diskPath) + "/" + job->name;
+   string path = base + to;
+   FILE *file;
+
+#ifdef _WIN32
+   remove(path.c_str());
+#endif
+   if (rename((base + from).c_str(), path.c_str()) != 0) {
+      return;
+   }
+   if (result.empty()) {
+      return;
+   }
+   file = fopen(path.c_str(), "a");
+   if (file != NULL) {
+      fprintf(file, "result: %s\n", result.c_str());
+      fclose(file);
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LoadDaemonJob --
+ *
+ *      Reads spoolDir/name.job and sizes its source disk. Lines are read
+ *      whole, so paths may contain spaces.
+ *
+ * Results:
+ *      The new job, or NULL if the file is not a valid job; it has then
+ *      been renamed to name.failed.
+ *
+ * Side effects:
+ *      Opens and closes the source disk.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static DaemonJob *
+LoadDaemonJob(const string &name)   // IN
+{
+   string path = string(appGlobals.diskPath) + "/" + name + ".job";
+   DaemonJob *job = new DaemonJob;
+   char line[2048];
+   bool isCopy = false;
+   FILE *file;
+
+   job->name = name;
+   job->capacity = 0;
+   job->created = false;
+   job->stats = NULL;
+   job->sectorsDone = 0;
+   job->finished = false;
+   job->failed = false;
+   job->startTime = 0;
+   job->endTime = 0;
+
+   file = fopen(path.c_str(), "r");
+   if (file == NULL) {
+      delete job;
+      return NULL;
+   }
+   while (fgets(line, sizeof line, file) != NULL) {
+      size_t len = strcspn(line, "\r\n");
+
+      line[len] = '\0';
+      if (strcmp(line, "copy") == 0) {
+         isCopy = true;
+      } else if (strncmp(line, "source: ", 8) == 0) {
+         job->srcPath = line + 8;
+      } else if (strncmp(line, "target: ", 8) == 0) {
+         job->dstPath = line + 8;
+      }
+   }
+   fclose(file);
+   if (!isCopy || job->srcPath.empty() || job->dstPath.empty()) {
+      FinishJobFile(job, ".job", ".failed", "expected the lines \"copy\", "
+                    "\"source: sourcePath\" and \"target: targetPath\"");
+      delete job;
+      return NULL;
+   }
+
+   try {
+      // Returned to the pool for StartDaemonJob to reuse.
+      VixPooledDisk disk = diskPool.Open(appConnection, job->srcPath.c_str(),
+                                         appGlobals.openFlags, false);
+      VixDiskLibInfo *info;
+      VixError vixError;
+
+      if (!disk.IsOpen()) {
+         delete job;   // loaded again once -pool-max allows
+         return NULL;
+      }
+      vixError = VixDiskLib_GetInfo(disk.Handle(), &info);
+      CHECK_AND_THROW(vixError);
+      job->capacity = info->capacity;
+      VixDiskLib_FreeInfo(info);
+   } catch (const VixDiskError& e) {
+      FinishJobFile(job, ".job", ".failed", e.Description());
+      delete job;
+      return NULL;
+   }
+   return job;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * StartDaemonJob --
+ *
+ *      Opens the source, creates and opens the target and starts the
+ *      copy thread of a job. The handles come from the pool, without
+ *      waiting for -pool-max: the running jobs return theirs when they
+ *      are done, if there are any (othersRunning).
+ *
+ * Results:
+ *      true if the job is running, false if it failed to start (its
+ *      file has then been renamed to name.failed) or, without
+ *      job->failed set, if it has to wait for handles.
+ *
+ * Side effects:
+ *      Creates the target disk.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static bool
+StartDaemonJob(DaemonJob *job,                              // IN/OUT
+               const VixPooledConnection &dstConnection,    // IN
+               bool othersRunning)                          // IN
+{
+   VixDiskLibCreateParams createParams;
+   VixError vixError;
+
+   try {
+      VixPooledDisk src = diskPool.Open(appConnection, job->srcPath.c_str(),
+                                        appGlobals.openFlags, false);
+      VixPooledDisk dst;
+
+      if (src.IsOpen() && !job->created) {
+         VixDiskLibInfo *info;
+
+         vixError = VixDiskLib_GetInfo(src.Handle(), &info);
+         CHECK_AND_THROW(vixError);
+         createParams.adapterType = info->adapterType;
+         createParams.capacity = info->capacity;
+         createParams.diskType = VIXDISKLIB_DISK_MONOLITHIC_SPARSE;
+         createParams.hwVersion = VIXDISKLIB_HWVERSION_WORKSTATION_5;
+         job->capacity = info->capacity;
+         VixDiskLib_FreeInfo(info);
+         vixError = VixDiskLib_Create(dstConnection.Get(),
+                                      job->dstPath.c_str(),
+                                      &createParams, NULL, NULL);
+         CHECK_AND_THROW(vixError);
+         job->created = true;
+      }
+      if (src.IsOpen()) {
+         dst = diskPool.Open(dstConnection, job->dstPath.c_str(), 0, false);
+      }
+      if (!dst.IsOpen()) {
+         if (othersRunning) {
+            return false;
+         }
+         throw VixDiskError("-pool-max leaves no handle for the target",
+                            __FILE__, __LINE__);
+      }
+      job->src = std::move(src);
+      job->dst = std::move(dst);
+   } catch (const VixDiskError& e) {
+      job->failed = true;
+      job->error = e.Description();
+      FinishJobFile(job, ".job", ".failed", job->error);
+      return false;
+   }
+
+   FinishJobFile(job, ".job", ".running", "");
+   job->stats = ClaimLiveSlot(job->name.c_str(), job->srcPath.c_str(),
+                              job->dstPath.c_str());
+   if (job->stats != NULL) {
+      job->stats->totalBytes = (uint64)job->capacity * VIXDISKLIB_SECTOR_SIZE;
+   }
+   job->startTime = NowNsec();
+   job->thread = StartThread(&DaemonJobThread, (void*)job);
+   printf("Started %s: %s -> %s, %" FMT64 "u MBytes.\n", job->name.c_str(),
+          job->srcPath.c_str(), job->dstPath.c_str(),
+          (uint64)job->capacity / 2048);
+   return true;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * WriteDaemonStatus --
+ *
+ *      Writes the queue to spoolDir/status: running jobs with their
+ *      progress, pending jobs in the order they will start and the
+ *      most recently finished jobs.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Replaces the status file.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+WriteDaemonStatus(const vector<DaemonJob *> &running,    // IN
+                  const vector<DaemonJob *> &pending,    // IN
+                  const std::deque<DaemonJob *> &done,   // IN
+                  bool stopping)                         // IN
+{
+   string path = string(appGlobals.diskPath) + "/status";
+   string tmpPath = path + ".tmp";
+   uint64 now = NowNsec();
+   FILE *file;
+   size_t i;
+
+   file = fopen(tmpPath.c_str(), "w");
+   if (file == NULL) {
+      return;
+   }
+   fprintf(file, "state: %s\n", stopping ? "stopping" : "running");
+   fprintf(file, "jobs: %u running of %u, %u pending\n",
+           (unsigned)running.size(), appGlobals.maxJobs,
+           (unsigned)pending.size());
+   for (i = 0; i < running.size(); i++) {
+      const DaemonJob *job = running[i];
+      VixDiskLibSectorType done = job->sectorsDone;
+      uint64 msec = (now - job->startTime) / 1000000 + 1;
+
+      fprintf(file, "running %s %" FMT64 "u MB %u%% %.1f MB/s %s -> %s\n",
+              job->name.c_str(), (uint64)job->capacity / 2048,
+              (unsigned)(job->capacity ? done * 100 / job->capacity : 100),
+              done * 1000.0 / 2048 / msec,
+              job->srcPath.c_str(), job->dstPath.c_str());
+   }
+   for (i = 0; i < pending.size(); i++) {
+      fprintf(file, "pending %s %" FMT64 "u MB %s -> %s\n",
+              pending[i]->name.c_str(), (uint64)pending[i]->capacity / 2048,
+              pending[i]->srcPath.c_str(), pending[i]->dstPath.c_str());
+   }
+   for (i = 0; i < done.size(); i++) {
+      const DaemonJob *job = done[i];
+      uint64 msec = (job->endTime - job->startTime) / 1000000 + 1;
+
+      fprintf(file, "%s %s %" FMT64 "u MB %.1f s %.1f MB/s%s%s\n",
+              job->failed ? "failed" : "done", job->name.c_str(),
+              (uint64)job->capacity / 2048, msec / 1000.0,
+              job->sectorsDone * 1000.0 / 2048 / msec,
+              job->failed ? " " : "", job->error.c_str());
+   }
+   fclose(file);
+#ifdef _WIN32
+   remove(path.c_str());
+#endif
+   rename(tmpPath.c_str(), path.c_str());
+}
+
+
+static bool
+LargerJob(const DaemonJob *a,   // IN
+          const DaemonJob *b)   // IN
+{
+   return a->capacity != b->capacity ? a->capacity > b->capacity :
+                                       a->name < b->name;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * DoDaemon --
+ *
+ *      Runs until stopped, taking the copy jobs queued in the spool
+ *      directory diskPath. Up to -jobs jobs run at once and share the
+ *      -max-mbps/-max-iops budget. Pending jobs start largest disk
+ *      first, which keeps the time until the last job is done short.
+ *      The library stays initialized and connected for all jobs.
+ *      SIGTERM, SIGINT or a file named "stop" in the spool directory
+ *      stop taking jobs; the daemon exits once the running ones are done.
+ *
+ * Results:
+ *      None. Throws VixDiskError if the local connection fails.
+ *
+ * Side effects:
+ *      Creates the target disks, renames the job files, writes the
+ *      status file.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+DoDaemon(void)
+{
+   string stopPath = string(appGlobals.diskPath) + "/stop";
+   VixDiskLibConnectParams cnxParams = { 0 };
+   VixPooledConnection dstConnection = diskPool.Connect(cnxParams);
+   vector<DaemonJob *> pending, running;
+   std::deque<DaemonJob *> done;
+   std::unordered_set<string> known;   // names of pending/running jobs
+   struct stat st;
+   size_t i;
+
+   signal(SIGTERM, StopDaemon);
+   signal(SIGINT, StopDaemon);
+   printf("Taking jobs from %s, %u at a time.\n", appGlobals.diskPath,
+          appGlobals.maxJobs);
+
+   for (;;) {
+      bool stopping = daemonStop || stat(stopPath.c_str(), &st) == 0;
+      bool changed = false;
+
+      if (!stopping) {
+         vector<string> names = ListJobFiles(appGlobals.diskPath);
+
+         for (i = 0; i < names.size(); i++) {
+            DaemonJob *job;
+
+            if (known.count(names[i]) != 0) {
+               continue;
+            }
+            job = LoadDaemonJob(names[i]);
+            if (job != NULL) {
+               known.insert(job->name);
+               pending.push_back(job);
+               changed = true;
+            }
+         }
       }
+
+      for (i = 0; i < running.size(); ) {
+         DaemonJob *job = running[i];
+         char result[128];
+
+         if (!job->finished) {
+            i++;
+            continue;
+         }
+         JoinThread(job->thread);
+         ReleaseLiveSlot(job->stats);
+         // The source may be copied again; a finished target is closed
+         // so that it can be used.
+         job->dst.Discard();
+         job->src.Reset();
+         snprintf(result, sizeof result, "ok, %" FMT64 "u MBytes in %.1f s",
+                  (uint64)job->capacity / 2048,
+                  (job->endTime - job->startTime) / 1e9);
+         FinishJobFile(job, ".running", job->failed ? ".failed" : ".done",
+                       job->failed ? job->error : string(result));
+         printf("%s %s: %s\n", job->failed ? "Failed" : "Finished",
+                job->name.c_str(), job->failed ? job->error.c_str() : result);
+         known.erase(job->name);
+         done.push_front(job);
+         running.erase(running.begin() + i);
+         changed = true;
+      }
+
+      std::sort(pending.begin(), pending.end(), LargerJob);
+      while (!stopping && !pending.empty() &&
+             running.size() < appGlobals.maxJobs) {
+         DaemonJob *job = pending.front();
+
+         if (!StartDaemonJob(job, dstConnection, !running.empty()) &&
+             !job->failed) {
+            break;
+         }
+         pending.erase(pending.begin());
+         if (!job->failed) {
+            running.push_back(job);
+         } else {
+            printf("Failed %s: %s\n", job->name.c_str(), job->error.c_str());
+            known.erase(job->name);
+            done.push_front(job);
+         }
+         changed = true;
+      }
+
+      while (done.size() > DAEMON_KEEP_FINISHED) {
+         delete done.back();
+         done.pop_back();
+      }
+      diskPool.Expire();
+      WriteDaemonStatus(running, pending, done, stopping);
+      if (stopping && running.empty()) {
+         break;
+      }
+      if (!changed) {
+         std::this_thread::sleep_for(
+            std::chrono::milliseconds(DAEMON_POLL_MSEC));
+      }
+   }
+
+   printf("Stopped, %u jobs not started.\n", (unsigned)pending.size());
+   for (i = 0; i < pending.size(); i++) {
+      delete pending[i];
+   }
+   for (i = 0; i < done.size(); i++) {
+      delete done[i];
    }
-   gettimeofday(&end, NULL);
-   PrintStat(read, total, end, appGlobals.bufSize * maxOps);
-   delete [] buf;
 }